@@ -7,6 +7,8 @@
 #include "cpu.h"
 #include "video/console.h"
 #include "util/util.h"
+#include "paging.h"
+#include "pit.h"
 
 
 static volatile uint32_t* apic_base = 0;
@@ -14,14 +16,21 @@ static volatile uint32_t* apic_base = 0;
 
 // Some APIC registers
 enum {
+    APIC_ID = 0x08,
     APIC_TASKPRIORITY = 0x20,
+    APIC_EOI = 0x2C,
     APIC_SPURIOUSINTERRUPT = 0x3C,
     APIC_TIMER = 0xC8,
     APIC_THERMALSENSOR = 0xCC,
     APIC_PERFORMANCECOUNTER = 0xD0,
     APIC_LINT0 = 0xD4,
     APIC_LINT1 = 0xD8,
-    APIC_ERROR = 0xDC
+    APIC_ICR_LOW = 0xC0,
+    APIC_ICR_HIGH = 0xC4,
+    APIC_ERROR = 0xDC,
+    APIC_TIMER_INITIALCOUNT = 0xE0,
+    APIC_TIMER_CURRENTCOUNT = 0xE4,
+    APIC_TIMER_DIVIDE = 0xF8
 };
 
 
@@ -47,6 +56,86 @@ bool apic_install(void)
     return(true); // Successful
 }
 
+void apic_installAP(void)
+{
+    apic_base[APIC_SPURIOUSINTERRUPT] = 0x10F; // Enable APIC. Spurious Vector is 15
+    apic_base[APIC_TASKPRIORITY] = 0x20; // Inhibit software interrupt delivery
+    apic_base[APIC_TIMER] = 0x10000; // Disable timer interrupts
+    apic_base[APIC_THERMALSENSOR] = 0x10000; // Disable thermal sensor interrupts
+    apic_base[APIC_PERFORMANCECOUNTER] = 0x10000; // Disable performance counter interrupts
+    apic_base[APIC_LINT0] = 0x10000; // External interrupts are handled by the BSP only
+    apic_base[APIC_LINT1] = 0x400; // Enable NMI Processing
+    apic_base[APIC_ERROR] = 0x10000; // Disable Error Interrupts
+}
+
+bool apic_map(void)
+{
+    static bool mapped = false;
+    if (mapped)
+        return(true);
+    if (apic_base == 0)
+        return(false);
+
+    // apic_install has been called before paging was enabled. Now the registers have to be mapped.
+    apic_base = paging_acquirePciMemory((uintptr_t)apic_base, 1);
+    mapped = apic_base != 0;
+    return(mapped);
+}
+
+uint8_t apic_id(void)
+{
+    return(apic_base[APIC_ID] >> 24);
+}
+
+void apic_sendIPI(uint8_t apicId, uint32_t command)
+{
+    apic_base[APIC_ICR_HIGH] = (uint32_t)apicId << 24;
+    apic_base[APIC_ICR_LOW] = command; // Writing the low dword sends the IPI
+    while (apic_base[APIC_ICR_LOW] & BIT(12)) {} // Wait until it has been delivered
+}
+
+bool apic_timerInstall(uint8_t vector, uint32_t* frequency)
+{
+    if (!apic_map())
+        return(false);
+
+    apic_base[APIC_TIMER_DIVIDE] = 0x3; // Divide bus clock by 16
+    apic_base[APIC_TIMER] = 0x10000 | vector; // One-shot mode, masked while measuring
+
+    // Measure the timer against 10 ms of PIT counter 2 (gate on, speaker off)
+    uint8_t aux = inportb(COUNTER_2_CONTROLPORT);
+    outportb(COUNTER_2_CONTROLPORT, (aux & ~AUX_OUT_2) | AUX_GATE_2);
+    outportb(COMMANDREGISTER, COUNTER_2 | RW_HI_LO_MODE | ONESHOT);
+    outportb(COUNTER_2_DATAPORT, BYTE1(TIMECOUNTER_i8254_FREQU/100));
+    outportb(COUNTER_2_DATAPORT, BYTE2(TIMECOUNTER_i8254_FREQU/100));
+
+    apic_base[APIC_TIMER_INITIALCOUNT] = 0xFFFFFFFF;
+    while (!(inportb(COUNTER_2_CONTROLPORT) & AUX_OUT_2_STATE)) {}
+    uint32_t counted = 0xFFFFFFFF - apic_base[APIC_TIMER_CURRENTCOUNT];
+
+    apic_base[APIC_TIMER_INITIALCOUNT] = 0;
+    outportb(COUNTER_2_CONTROLPORT, aux);
+
+    *frequency = counted*100;
+    apic_base[APIC_TIMER] = vector; // Unmask
+    return(true);
+}
+
+void apic_timerStart(uint32_t count)
+{
+    apic_base[APIC_TIMER_INITIALCOUNT] = count;
+}
+
+uint32_t apic_timerCount(void)
+{
+    return(apic_base[APIC_TIMER_CURRENTCOUNT]);
+}
+
+void apic_eoi(void)
+{
+    apic_base[APIC_EOI] = 0;
+}
+
 
 /*
 * Copyright (c) 2012-2013 The PrettyOS Project. All rights reserved.
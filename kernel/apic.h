@@ -4,8 +4,24 @@
 #include "os.h"
 
 
-bool apic_available(void);
-bool apic_install(void);
+// Interrupt command register
+#define APIC_IPI_FIXED   0x0000 // Delivers the vector in the lowest byte
+#define APIC_IPI_INIT    0x0500
+#define APIC_IPI_STARTUP 0x0600 // Starts an application processor at the page given in the lowest byte
+#define APIC_IPI_ASSERT  0x4000
+#define APIC_IPI_LEVEL   0x8000
+
+
+bool     apic_available(void);
+bool     apic_install(void);
+void     apic_installAP(void);                                   // Enables the local APIC of an application processor
+bool     apic_map(void);                                         // Maps the registers. Needs paging.
+uint8_t  apic_id(void);                                          // ID of the local APIC of the executing CPU
+void     apic_sendIPI(uint8_t apicId, uint32_t command);         // command: vector and APIC_IPI_... flags
+bool     apic_timerInstall(uint8_t vector, uint32_t* frequency); // Maps the APIC and measures the frequency of its timer. Needs paging.
+void     apic_timerStart(uint32_t count);                        // Starts the timer in one-shot mode
+uint32_t apic_timerCount(void);                                  // Current value of the timer counter
+void     apic_eoi(void);
 
 
 #endif
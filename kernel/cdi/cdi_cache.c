@@ -4,19 +4,119 @@
 */
 
 #include "cdi/cache.h"
+#include "storage/blockcache.h"
+#include "kheap.h"
+#include "util/util.h"
 
+// The blocks of all CDI caches are held in the block cache of the kernel. The CDI block handle is stored in the private
+// area of the cached block, followed by the private data of the driver.
 
-struct cdi_cache* cdi_cache_create(size_t block_size, size_t blkpriv_len, cdi_cache_read_block_t* read_block, cdi_cache_write_block_t* write_block, void* prv_data);
+typedef struct
+{
+    struct cdi_cache         cdi;
+    blockDevice_t            device;
+    cdi_cache_read_block_t*  read_block;
+    cdi_cache_write_block_t* write_block;
+    void*                    prv_data;
+} cache_t;
 
-void cdi_cache_destroy(struct cdi_cache* cache);
+typedef struct
+{
+    struct cdi_cache_block cdi;
+    cacheBlock_t*          block;
+} block_t;
 
-int cdi_cache_sync(struct cdi_cache* cache);
 
-struct cdi_cache_block* cdi_cache_block_get(struct cdi_cache* cache, uint64_t blocknum, int noread);
+static FS_ERROR readBlocks(blockDevice_t* device, uint64_t first, size_t count, void* const* destinations)
+{
+    cache_t* cache = device->data;
+    void* destination = destinations[0];
+    if (count > 1) // Read adjacent blocks at once and scatter them afterwards
+        destination = malloc(count*cache->cdi.block_size, 0, "cdi_cache read");
 
-void cdi_cache_block_release(struct cdi_cache* cache, struct cdi_cache_block* block);
+    int read = cache->read_block(&cache->cdi, first, count, destination, cache->prv_data);
+    if (count > 1)
+    {
+        if (read)
+        {
+            for (size_t i = 0; i < count; i++)
+                memcpy(destinations[i], (uint8_t*)destination + i*cache->cdi.block_size, cache->cdi.block_size);
+        }
+        free(destination);
+    }
+    return (read == 0 ? CE_BAD_SECTOR_READ : CE_GOOD);
+}
 
-void cdi_cache_block_dirty(struct cdi_cache* cache, struct cdi_cache_block* block);
+static FS_ERROR writeBlocks(blockDevice_t* device, uint64_t first, size_t count, const void* const* sources)
+{
+    cache_t* cache = device->data;
+    const void* source = sources[0];
+    if (count > 1) // Gather adjacent blocks, so that the driver can write them at once
+    {
+        uint8_t* buffer = malloc(count*cache->cdi.block_size, 0, "cdi_cache write");
+        for (size_t i = 0; i < count; i++)
+            memcpy(buffer + i*cache->cdi.block_size, sources[i], cache->cdi.block_size);
+        source = buffer;
+    }
+
+    int written = cache->write_block(&cache->cdi, first, count, source, cache->prv_data);
+    if (count > 1)
+        free((void*)source);
+    return (written == 0 ? CE_WRITE_ERROR : CE_GOOD);
+}
+
+struct cdi_cache* cdi_cache_create(size_t block_size, size_t blkpriv_len, cdi_cache_read_block_t* read_block, cdi_cache_write_block_t* write_block, void* prv_data)
+{
+    cache_t* cache = malloc(sizeof(cache_t), 0, "cdi_cache");
+    cache->cdi.block_size     = block_size;
+    cache->device.blockSize   = block_size;
+    cache->device.privateSize = sizeof(block_t) + blkpriv_len;
+    cache->device.read        = &readBlocks;
+    cache->device.write       = &writeBlocks;
+    cache->device.data        = cache;
+    cache->read_block         = read_block;
+    cache->write_block        = write_block;
+    cache->prv_data           = prv_data;
+    blockCache_addDevice(&cache->device);
+    return (&cache->cdi);
+}
+
+void cdi_cache_destroy(struct cdi_cache* cache)
+{
+    cache_t* c = (cache_t*)cache;
+    blockCache_sync(&c->device);
+    blockCache_removeDevice(&c->device);
+    free(c);
+}
+
+int cdi_cache_sync(struct cdi_cache* cache)
+{
+    return (blockCache_sync(&((cache_t*)cache)->device) == CE_GOOD);
+}
+
+struct cdi_cache_block* cdi_cache_block_get(struct cdi_cache* cache, uint64_t blocknum, int noread)
+{
+    cacheBlock_t* block = blockCache_get(&((cache_t*)cache)->device, blocknum, !noread);
+    if (block == 0)
+        return (0);
+
+    block_t* handle     = block->private;
+    handle->cdi.number  = block->number;
+    handle->cdi.data    = block->data;
+    handle->cdi.private = handle + 1;
+    handle->block       = block;
+    return (&handle->cdi);
+}
+
+void cdi_cache_block_release(struct cdi_cache* cache, struct cdi_cache_block* block)
+{
+    blockCache_release(((block_t*)block)->block);
+}
+
+void cdi_cache_block_dirty(struct cdi_cache* cache, struct cdi_cache_block* block)
+{
+    blockCache_dirty(((block_t*)block)->block);
+}
 
 /*
 * Copyright (c) 2009 The PrettyOS Project. All rights reserved.
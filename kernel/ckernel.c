@@ -5,10 +5,14 @@
 
 // Utilities
 #include "util/util.h"          // sti, memset, strcmp, strlen, rdtsc, ...
-#include "util/todo_list.h"     // todoList_execute
+#include "util/list.h"          // list_install
+#include "util/ring.h"          // ring_install
+#include "util/todo_list.h"     // todoList_install
+#include "events.h"             // event_install
 
 // Internal devices
 #include "cpu.h"                // cpu_analyze
+#include "fpu.h"                // fpu_install, fpu_test, fpu_log
 #include "cmos.h"               // cmos_read
 #include "timer.h"              // timer_install, timer_getSeconds, sleepMilliSeconds
 #include "time.h"               // getCurrentDateAndTime
@@ -16,10 +20,14 @@
 #include "irq.h"                // isr_install
 #include "power_management.h"   // powmgmt_install, powmgmt_log
 #include "apic.h"               // apic_install, apic_available
+#include "smp.h"                // smp_install
 
 // Base system
 #include "kheap.h"              // heap_install, malloc, free, logHeapRegions
+#include "objcache.h"           // objCache_log
 #include "tasking/task.h"       // tasking_install & others
+#include "tasking/synchronisation.h" // lock_log
+#include "tasking/workqueue.h"  // workqueue_install, workqueue_log
 #include "syscall.h"            // syscall_install
 #include "ipc.h"                // ipc_print
 
@@ -32,12 +40,13 @@
 #include "video/textgui.h"      // TextGUI_ShowMSG, TextGUI_AskYN
 #include "filesystem/initrd.h"  // initrd_install, ramdisk_install, readdir_fs, read_fs, finddir_fs
 #include "storage/flpydsk.h"    // flpydsk_install
+#include "storage/blockcache.h" // blockCache_log
 #ifdef _ENABLE_HDD_
 #include "storage/hdd.h"        // hdd_install
 #endif
 
 // Network
-#include "netprotocol/tcp.h"    // tcp_showConnections, network_displayArpTables
+#include "netprotocol/tcp.h"    // tcp_install, tcp_showConnections, network_displayArpTables
 
 
 const char* const version = "0.0.4.24 - Rev: 1410";
@@ -46,8 +55,6 @@ const char* const version = "0.0.4.24 - Rev: 1410";
 extern uintptr_t _bss_start; // Linker script
 extern uintptr_t _bss_end;   // Linker script
 
-todoList_t* kernel_idleTasks; // List of functions that are executed in kernel idle loop
-
 static void logText(const char* str)
 {
     textColor(LIGHT_GRAY);
@@ -113,6 +120,12 @@ static void init(multiboot_t* mb_struct)
     // Set .bss to zero
     memset(&_bss_start, 0, (uintptr_t)&_bss_end - (uintptr_t)&_bss_start);
 
+    // Object caches of basic structures. Lists are used from the beginning, before the heap is installed.
+    list_install();
+    ring_install();
+    event_install();
+    todoList_install();
+
     // Video
     kernel_console_init();
     vga_clearScreen();
@@ -142,12 +155,15 @@ static void init(multiboot_t* mb_struct)
     ipc_setInt("PrettyOS/RAM (Bytes)", &memsize);
     log("Paging", memsize != 0);
     simpleLog("Heap", heap_install());
+    if (apic_available())
+        log("APIC timer", timer_installLocalAPIC());
 
     // Video
     log("Video", vga_install());
 
     // Tasks
     simpleLog("Multitasking", tasking_install());
+    simpleLog("Work queues", workqueue_install());
 
   #ifdef _BOOTSCREEN_
     scheduler_insertTask(create_cthread(&bootscreen, "Booting ..."));
@@ -166,7 +182,8 @@ static void init(multiboot_t* mb_struct)
     // Mass storage devices
     simpleLog("Devicemanager", deviceManager_install(0));
 
-    kernel_idleTasks = todolist_create();
+    // Network protocols. Their object caches are created before network adapters can deliver packets.
+    tcp_install();
 
     puts("\n\n");
     sti();
@@ -196,6 +213,7 @@ void main(multiboot_t* mb_struct)
 
     cpu_analyze();
     fpu_test();
+    smp_install(); // Start the other CPUs
 
     powmgmt_log();
 
@@ -324,7 +342,7 @@ void main(multiboot_t* mb_struct)
                                 break;
                             case 'h': // Taking a screenshot (HDD)
                                 printf("Save screenshot to HDD.");
-                                saveScreenshot(&HDDPIODISK);
+                                saveScreenshot(&HDDDISK);
                                 break;
                         }
                     }
@@ -332,12 +350,30 @@ void main(multiboot_t* mb_struct)
                     {
                         switch (*(char*)buffer)
                         {
+                            case 'c':
+                                blockCache_log();
+                                break;
+                            case 'f':
+                                fpu_log();
+                                break;
                             case 'h':
                                 heap_logRegions();
                                 break;
+                            case 'l':
+                                lock_log();
+                                break;
+                            case 'm':
+                                mem_benchmark();
+                                break;
+                            case 'o':
+                                objCache_log();
+                                break;
                             case 'p':
                                 paging_analyzeBitTable();
                                 break;
+                            case 'w':
+                                workqueue_log();
+                                break;
                         }
                     }
                     else if (CTRL)
@@ -438,7 +474,6 @@ void main(multiboot_t* mb_struct)
             } while (serial_received(1) != 0);
         }
 
-        todoList_execute(kernel_idleTasks);
         switch_context(); // Kernel idle loop has finished so far. Provide time to next waiting task
     }
 }
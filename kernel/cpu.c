@@ -5,7 +5,6 @@
 
 #include "cpu.h"
 #include "video/console.h"
-#include "cmos.h"
 #include "ipc.h"
 
 
@@ -39,10 +38,16 @@ void cpu_install(void)
         __asm__("mov %cr4, %eax;"
                 "or $0x00000080, %eax;" // Activate PGE
                 "mov %eax, %cr4");
+    if(cpu_supports(CF_PAGES4MB))
+        __asm__("mov %cr4, %eax;"
+                "or $0x00000010, %eax;" // Activate PSE
+                "mov %eax, %cr4");
     if(cpu_supports(CF_FXSR)) // We take this to indicate availability of CR4 register
         __asm__("mov %cr4, %eax;"
                 "or $0x00000200, %eax;" // Activate OSFXSR
                 "mov %eax, %cr4");
+
+    mem_install(); // Select memcpy/memset methods for this CPU
 }
 
 static void printSupport(bool b)
@@ -70,6 +75,8 @@ void cpu_analyze(void)
     printSupport(cpu_supports(CF_PGE));
     printf("; FXSR:");
     printSupport(cpu_supports(CF_FXSR));
+    printf("; XSAVE:");
+    printSupport(cpu_supports(CF_XSAVE));
 
     // Read out VendorID
     char cpu_vendor[13];
@@ -106,6 +113,16 @@ bool cpu_supports(CPU_FEATURE feature)
     if (!cpuid_available) return (false);
 
     CPU_REGISTER r = feature&~31;
+    if (r & CR_LEAF7)
+    {
+        if (cpu_idGetRegister(0, CR_EAX) < 7)
+            return (false);
+
+        uint32_t regs[4] = {7, 0, 0, 0}; // Function 7, subfunction 0 (ecx)
+        __asm__ volatile("cpuid" : "+a"(regs[0]), "=b"(regs[1]), "+c"(regs[2]), "=d"(regs[3]));
+        r &= ~CR_LEAF7;
+        return (regs[r == CR_EAX ? 0 : r == CR_EBX ? 1 : r == CR_ECX ? 2 : 3] & BIT(feature&31));
+    }
     return (cpu_idGetRegister(0x00000001, r) & (BIT(feature-r)));
 }
 
@@ -162,64 +179,6 @@ void cpu_MSRwrite(uint32_t msr, uint64_t value)
 }
 
 
-// FPU
-
-task_t* volatile FPUTask = 0;
-
-bool fpu_install(void)
-{
-    if (!(cmos_read(CMOS_DEVICES) & BIT(1)) || (cpu_supports(CF_CPUID) && !cpu_supports(CF_FPU)))
-        return (false);
-
-    __asm__ volatile ("finit");
-
-    uint16_t ctrlword = 0x37F;
-    __asm__ volatile("fldcw %0"::"m"(ctrlword)); // Set the FPU Control Word. FLDCW = Load FPU Control Word
-
-    // set TS in cr0
-    uint32_t cr0;
-    __asm__ volatile("mov %%cr0, %0": "=r"(cr0)); // Read cr0
-    cr0 |= BIT(3); // Set the TS bit (no. 3) in CR0 to enable #NM (exception no. 7)
-    __asm__ volatile("mov %0, %%cr0":: "r"(cr0)); // Write cr0
-
-    return (true);
-}
-
-void fpu_test(void)
-{
-    textColor(LIGHT_GRAY);
-    printf("   => FPU test: ");
-
-    if (!(cmos_read(CMOS_DEVICES) & BIT(1)) || (cpu_supports(CF_CPUID) && !cpu_supports(CF_FPU)))
-    {
-        textColor(ERROR);
-        printf("FPU not available\n");
-        textColor(TEXT);
-        return;
-    }
-
-    double squareroot = sqrt(2.0);
-    squareroot = fabs(squareroot);
-    squareroot /= sqrt(2.0);
-
-    putch('[');
-
-    if (fabs(squareroot - 1.0) < 0.000001)
-    {
-        textColor(SUCCESS);
-        printf("PASSED");
-    }
-    else
-    {
-        textColor(ERROR);
-        printf("FAILED");
-    }
-
-    textColor(LIGHT_GRAY);
-    printf("]\n");
-    textColor(TEXT);
-}
-
 
 /*
 * Copyright (c) 2010-2013 The PrettyOS Project. All rights reserved.
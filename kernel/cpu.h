@@ -9,7 +9,8 @@ typedef enum
     CR_EAX = BIT(5),
     CR_EBX = BIT(6),
     CR_ECX = BIT(7),
-    CR_EDX = BIT(8)
+    CR_EDX = BIT(8),
+    CR_LEAF7 = BIT(9) // Flag: Register of CPUID function 7 (structured extended features) instead of function 1
 } CPU_REGISTER;
 
 typedef enum
@@ -46,7 +47,11 @@ typedef enum
     CF_SSSE3        = CR_ECX|9,
     CF_CMPXCHG16B   = CR_ECX|13,
     CF_SSE41        = CR_ECX|19,
-    CF_POPCNT       = CR_ECX|23
+    CF_POPCNT       = CR_ECX|23,
+    CF_XSAVE        = CR_ECX|26,
+    CF_AVX          = CR_ECX|28,
+
+    CF_ERMS         = CR_LEAF7|CR_EBX|9
 } CPU_FEATURE;
 
 
@@ -61,8 +66,5 @@ uint32_t cpu_idGetRegister(uint32_t function, CPU_REGISTER reg);
 uint64_t cpu_MSRread(uint32_t msr);
 void     cpu_MSRwrite(uint32_t msr, uint64_t value);
 
-bool fpu_install(void);
-void fpu_test(void);
-
 
 #endif
@@ -6,13 +6,15 @@
 #include "util/util.h"
 #include "descriptor_tables.h"
 #include "video/console.h"
+#include "smp.h"
 
 
 // GDT
-#define NUMBER_GDT_GATES 6 // 0-5: Null, Kernel Code, Kernel Data, User Code, User Data, TSS
+#define NUMBER_GDT_GATES (GDT_TSS_FIRST+MAX_CPUS) // 0-4: Null, Kernel Code, Kernel Data, User Code, User Data. Then one TSS per CPU
 
 // Our GDT
 static GDTentry_t gdt[NUMBER_GDT_GATES];
+static GDTptr_t   gdt_register;
 
 // Setup a descriptor in the Global Descriptor Table
 void gdt_setGate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
@@ -33,8 +35,6 @@ void gdt_setGate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uin
 
 void gdt_install(void)
 {
-    GDTptr_t gdt_register;
-
     // Setup the GDT pointer and limit
     gdt_register.limit = (sizeof(GDTentry_t) * NUMBER_GDT_GATES)-1;
     gdt_register.base  = (uint32_t)&gdt;
@@ -48,15 +48,20 @@ void gdt_install(void)
     gdt_setGate(3,  0,   0xFFFFF, VALID | RING_3 | CODE_DATA_STACK | CODE_EXEC_READ,  _4KB_ | USE32);
     gdt_setGate(4,  0,   0xFFFFF, VALID | RING_3 | CODE_DATA_STACK | DATA_READ_WRITE, _4KB_ | USE32);
 
-    tss_write(5, 0x10, 0x0); // num, ss0, esp0
+    tss_write(GDT_TSS_FIRST, 0x10, 0x0); // num, ss0, esp0
     gdt_flush(&gdt_register);
     tss_flush();
 }
 
+const GDTptr_t* gdt_getRegister(void)
+{
+    return (&gdt_register);
+}
+
 
 /// TSS
 
-static TSSentry_t tss;
+static TSSentry_t tss[MAX_CPUS] __attribute__((aligned(4))); // Each CPU needs an own TSS, because it contains the kernel stack of the task running on it
 
 #ifdef _DIAGNOSIS_
 static void tss_log(TSSentry_t* tssEntry)
@@ -84,34 +89,48 @@ static void tss_log(TSSentry_t* tssEntry)
 }
 #endif
 
-// Initialise our task state segment structure.
+// Initialise the task state segment structure of a CPU. num is its GDT entry (GDT_TSS_FIRST + index of the CPU).
 void tss_write(int32_t num, uint16_t ss0, uint32_t esp0)
 {
+    TSSentry_t* entry = &tss[num - GDT_TSS_FIRST];
+
     // Firstly, let's compute the base and limit of our entry into the GDT.
-    uint32_t base = (uint32_t)&tss;
-    uint32_t limit = sizeof(tss); //http://forum.osdev.org/viewtopic.php?f=1&t=19819&p=155587&hilit=tss_entry#p155587
+    uint32_t base = (uint32_t)entry;
+    uint32_t limit = sizeof(*entry); //http://forum.osdev.org/viewtopic.php?f=1&t=19819&p=155587&hilit=tss_entry#p155587
 
     // Now, add our TSS descriptor's address to the GDT.
     gdt_setGate(num, base, limit, 0xE9, 0x00);
 
     // Ensure the descriptor is initially zero.
-    memset(&tss, 0, sizeof(tss));
+    memset(entry, 0, sizeof(*entry));
 
-    tss.ss0  = ss0;  // Set the kernel stack segment.
-    tss.esp0 = esp0; // Set the kernel stack pointer.
+    entry->ss0  = ss0;  // Set the kernel stack segment.
+    entry->esp0 = esp0; // Set the kernel stack pointer.
 
-    tss.cs   = 0x08;
-    tss.ss = tss.ds = tss.es = tss.fs = tss.gs = 0x10;
+    entry->cs   = 0x08;
+    entry->ss = entry->ds = entry->es = entry->fs = entry->gs = 0x10;
   #ifdef _DIAGNOSIS_
-    tss_log(&tss);
+    tss_log(entry);
   #endif
 }
 
+void tss_load(int32_t num) // Used by the application processors instead of tss_flush
+{
+    __asm__ volatile("ltr %0" : : "r"((uint16_t)((num << 3) | 3)));
+}
+
 void tss_switch(uint32_t esp0, uint32_t esp, uint32_t ss)
 {
-    tss.esp0 = esp0;
-    tss.esp = esp;
-    tss.ss = ss;
+    TSSentry_t* entry = &tss[smp_cpuIndex()];
+    entry->esp0 = esp0;
+    entry->esp = esp;
+    entry->ss = ss;
+}
+
+uint32_t* tss_kernelStack(uint32_t cpu)
+{
+    STATIC_ASSERT(sizeof(TSSentry_t) % 4 == 0); // Keeps esp0 aligned in each entry
+    return ((uint32_t*)((uintptr_t)&tss[cpu] + offsetof(TSSentry_t, esp0)));
 }
 
 /*
@@ -99,12 +99,16 @@ typedef struct
 
 
 void idt_install(void); // c.f. interrupts.asm
+void idt_load(void);    // c.f. interrupts.asm. Loads the IDT on an application processor
 void gdt_install(void);
 void gdt_setGate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
 void gdt_flush(GDTptr_t*); // c.f. flush.asm
+const GDTptr_t* gdt_getRegister(void);
 void tss_write(int32_t num, uint16_t ss0, uint32_t esp0);
 void tss_flush(void); // c.f. flush.asm
+void tss_load(int32_t num);
 void tss_switch(uint32_t esp0, uint32_t esp, uint32_t ss); // Used by task_switch
+uint32_t* tss_kernelStack(uint32_t cpu); // Location of esp0 in the TSS of the CPU. Used by the sysenter handler
 
 
 #endif
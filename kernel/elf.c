@@ -6,6 +6,7 @@
 #include "elf.h"
 #include "util/util.h"
 #include "tasking/task.h"
+#include "userimage.h"
 
 
 enum elf_headerType
@@ -139,6 +140,11 @@ void* elf_prepareExecution(const void* file, size_t size, pageDirectory_t* pd)
     // Read the header
     const elf_header_t* header = (elf_header_t*)file;
 
+    // The contents of the file are kept as an image, shared by all processes started from it. It is released with the page directory.
+    // A new image is only cached when the file has been prepared successfully, so a failure cannot leave an incomplete image behind.
+    pd->image = userImage_get(file, size);
+    bool newImage = !pd->image->cached;
+
     // Read all program headers
     const elf_programHeader_t* ph = file + header->phoff;
     for (uint32_t i = 0; i < header->phnum; i++)
@@ -159,6 +165,17 @@ void* elf_prepareExecution(const void* file, size_t size, pageDirectory_t* pd)
         textColor(TEXT);
         #endif
 
+        if (ph[i].type != PT_LOAD)
+        {
+            continue;
+        }
+
+        // Check whether the segment's data exceeds the file
+        if (ph[i].offset + ph[i].filesz > size || ph[i].filesz > ph[i].memsz)
+        {
+            return (0);
+        }
+
         // Read flags from header
         MEMFLAGS_t memFlags = MEM_USER;
 
@@ -167,23 +184,20 @@ void* elf_prepareExecution(const void* file, size_t size, pageDirectory_t* pd)
             memFlags |= MEM_WRITE;
         }
 
-        // Allocate code area for the user program
-        if (!paging_alloc(pd, (void*)(ph[i].vaddr), alignUp(ph[i].memsz, PAGESIZE), memFlags))
+        if (newImage)
         {
-            return (0);
+            userImage_addSegment(pd->image, ph[i].vaddr, ph[i].offset, ph[i].filesz, ph[i].memsz);
         }
 
-        /// TODO: check all sections, not only code
-
-        // Copy the code, using the new page directory
-        cli();
-        paging_switch(pd); // Switch to PD we want to write to
-        memcpy((void*)ph[i].vaddr, file + ph[i].offset, ph[i].filesz);
-        memset((void*)ph[i].vaddr + ph[i].filesz, 0, ph[i].memsz - ph[i].filesz); // to set the bss (Block Started by Symbol) to zero
-        paging_switch(currentTask->pageDirectory); // Switch back to continue normal execution
-        sti();
+        // Reserve the area for the user program. The pages are loaded from the image when they are touched (cf. paging_handlePageFault)
+        uintptr_t begin = alignDown(ph[i].vaddr, PAGESIZE);
+        if (!paging_reserve(pd, (void*)begin, alignUp(ph[i].vaddr + ph[i].memsz, PAGESIZE) - begin, memFlags))
+        {
+            return (0);
+        }
     }
 
+    userImage_cache(pd->image);
     return ((void*)header->entry);
 }
 
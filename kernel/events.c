@@ -6,30 +6,48 @@
 #include "events.h"
 #include "util/util.h"
 #include "kheap.h"
+#include "objcache.h"
 #include "tasking/task.h"
 
 
-event_queue_t* event_createQueue(void)
+static objCache_t* eventCache; // Events are completely written when they are issued, so they need no constructor
+static objCache_t* queueCache; // Empty queues that keep their list and mutex
+
+static void event_constructQueue(void* object)
 {
-    event_queue_t* queue = malloc(sizeof(event_queue_t), 0, "event_queue");
+    event_queue_t* queue = object;
     queue->num = 0;
-    queue->mutex = mutex_create();
+    queue->mutex = mutex_create("event queue");
     queue->list = list_create();
-    return (queue);
+}
+
+void event_install(void)
+{
+    eventCache = objCache_create("event", sizeof(event_t), 0);
+    queueCache = objCache_create("event_queue", sizeof(event_queue_t), &event_constructQueue);
+}
+
+static event_t* event_alloc(void)
+{
+    return (objCache_alloc(eventCache));
+}
+
+event_queue_t* event_createQueue(void)
+{
+    return (objCache_alloc(queueCache));
 }
 
 void event_deleteQueue(event_queue_t* queue)
 {
-    for (dlelement_t* e = queue->list->head; e != 0; e = e->next)
+    for (dlelement_t* e = queue->list->head; e != 0; e = list_delete(queue->list, e))
     {
         event_t* event = e->data;
         if(event->length > sizeof(event->data))
             free(event->data);
-        free(event);
+        objCache_free(eventCache, event);
     }
-    list_free(queue->list);
-    mutex_delete(queue->mutex);
-    free(queue);
+    queue->num = 0;
+    objCache_free(queueCache, queue); // List and mutex are kept for the next queue
 }
 
 uint8_t event_issue(event_queue_t* destination, EVENT_t type, void* data, size_t length)
@@ -42,7 +60,7 @@ uint8_t event_issue(event_queue_t* destination, EVENT_t type, void* data, size_t
     if (destination->num == MAX_EVENTS)
     {
         // Overflow
-        event_t* ev = malloc(sizeof(event_t), 0, "event (overflow)");
+        event_t* ev = event_alloc();
         ev->data = 0;
         ev->length = 0;
         ev->type = EVENT_OVERFLOW;
@@ -50,6 +68,7 @@ uint8_t event_issue(event_queue_t* destination, EVENT_t type, void* data, size_t
         list_append(destination->list, ev);
         destination->num++;
         mutex_unlock(destination->mutex);
+        scheduler_unblockEvent(BL_EVENT, destination);
 
         return (2);
     }
@@ -61,7 +80,7 @@ uint8_t event_issue(event_queue_t* destination, EVENT_t type, void* data, size_t
     else
     {
         // Add event
-        event_t* ev = malloc(sizeof(event_t), 0, "event");
+        event_t* ev = event_alloc();
         if (length > sizeof(ev->data)) // data does not fit in pointer
         {
             ev->data = malloc(length, 0, "event->data");
@@ -77,6 +96,7 @@ uint8_t event_issue(event_queue_t* destination, EVENT_t type, void* data, size_t
         list_append(destination->list, ev);
         destination->num++;
         mutex_unlock(destination->mutex);
+        scheduler_unblockEvent(BL_EVENT, destination);
 
         return (0);
     }
@@ -155,7 +175,7 @@ EVENT_t event_poll(void* destination, size_t maxLength, EVENT_t filter)
     task->eventQueue->num--;
     list_delete(task->eventQueue->list, list_find(task->eventQueue->list, ev));
     mutex_unlock(task->eventQueue->mutex);
-    free(ev);
+    objCache_free(eventCache, ev);
 
     return (type);
 }
@@ -33,6 +33,7 @@ typedef struct
 } event_queue_t;
 
 
+void           event_install(void); // Creates the caches for events and event queues
 event_queue_t* event_createQueue(void);
 void           event_deleteQueue(event_queue_t* queue);
 void           event_enable(bool b); // Enables/Disables event handling for the current task
@@ -538,64 +538,94 @@ FS_ERROR FAT_fread(file_t* file, void* dest, size_t count)
     serial_log(SER_LOG_FAT, "\r\n>>>>> fread <<<<<");
   #endif
     FAT_file_t* fatfile = file->data;
-    FS_ERROR error      = CE_GOOD;
     partition_t* volume = fatfile->volume->part;
-    uint32_t temp       = count;
-    uint32_t pos        = fatfile->pos;
-    uint32_t seek       = file->seek;
-    uint32_t size       = file->size;
-    uint32_t sector     = cluster2sector(volume->data, fatfile->currCluster) + fatfile->sec;
-    uint32_t sectors    = (size%512 == 0) ? size/512 : size/512+1; // Number of sectors to be read
-    volume->disk->accessRemaining += sectors;
+    uint32_t sectorSize = volume->disk->sectorSize;
+    uint32_t secPerClus = fatfile->volume->SecPerClus;
+    uint8_t* buffer     = dest;
+    FS_ERROR error      = CE_GOOD;
+    bool eof            = false;
 
-    sectors--;
-    if (sectorRead(sector, volume->buffer, volume->disk) != CE_GOOD)
+    if (count > file->size - file->seek)
     {
-        error = CE_BAD_SECTOR_READ;
+        count = file->size - file->seek;
+        eof = true;
     }
-    while (error == CE_GOOD && temp>0)
+
+    // fatfile->pos == sectorSize: The current sector has been read completely
+    uint32_t sectors = (fatfile->pos%sectorSize + count + sectorSize-1) / sectorSize; // Number of sectors to be read
+    volume->disk->accessRemaining += sectors;
+
+    while (error == CE_GOOD && count > 0)
     {
-        if (seek == size)
+        if (fatfile->pos == sectorSize)
         {
-            error = CE_EOF;
+            fatfile->pos = 0;
+            fatfile->sec++;
+            if (fatfile->sec == secPerClus)
+            {
+                fatfile->sec = 0;
+                error = fileGetNextCluster(fatfile, 1);
+                if (error != CE_GOOD)
+                    break;
+            }
         }
-        else
+        uint32_t sector = cluster2sector(fatfile->volume, fatfile->currCluster) + fatfile->sec;
+
+        if (fatfile->pos == 0 && count >= sectorSize)
         {
-            if (pos == volume->disk->sectorSize)
+            // Whole sectors are read directly into the destination. The run is continued into following clusters as long as they are adjacent on the disk.
+            uint32_t wanted = count/sectorSize;
+            uint32_t n = 0;
+            for (;;)
             {
-                pos = 0;
-                fatfile->sec++;
-                if (fatfile->sec == fatfile->volume->SecPerClus)
-                {
-                    fatfile->sec = 0;
-                    error = fileGetNextCluster(fatfile, 1);
-                }
-                if (error == CE_GOOD)
+                uint32_t k = min(wanted - n, secPerClus - fatfile->sec);
+                n += k;
+                fatfile->sec += k;
+                if (n == wanted || fatfile->sec < secPerClus)
+                    break;
+
+                uint32_t cluster = fatfile->currCluster;
+                if (fileGetNextCluster(fatfile, 1) != CE_GOOD || fatfile->currCluster != cluster+1)
                 {
-                    sector = cluster2sector(volume->data, fatfile->currCluster);
-                    sector += fatfile->sec;
-                    sectors--;
-                    if (sectorRead(sector, volume->buffer, volume->disk) != CE_GOOD)
-                    {
-                        error = CE_BAD_SECTOR_READ;
-                    }
+                    fatfile->currCluster = cluster; // The next iteration follows the chain again (and reports errors)
+                    break;
                 }
-            } // END: load new sector
+                fatfile->sec = 0;
+            }
+            fatfile->sec--;
+            fatfile->pos = sectorSize;
 
-            if (error == CE_GOOD)
+            sectors -= n;
+            if (sectorsRead(sector, n, buffer, volume->disk) != CE_GOOD)
             {
-                *(uint8_t*)dest = MemoryReadByte(volume->buffer, pos++);
-                dest++;
-                seek++;
-                temp--;
+                error = CE_BAD_SECTOR_READ;
+                break;
             }
-        } // END: if not EOF
-    } // while no error and more bytes to copy
+            buffer     += n*sectorSize;
+            count      -= n*sectorSize;
+            file->seek += n*sectorSize;
+        }
+        else
+        {
+            sectors--;
+            if (sectorRead(sector, volume->buffer, volume->disk) != CE_GOOD)
+            {
+                error = CE_BAD_SECTOR_READ;
+                break;
+            }
+            uint32_t chunk = min(count, sectorSize - fatfile->pos);
+            memcpy(buffer, volume->buffer + fatfile->pos, chunk);
+            fatfile->pos += chunk;
+            buffer       += chunk;
+            count        -= chunk;
+            file->seek   += chunk;
+        }
+    }
 
     volume->disk->accessRemaining -= sectors; // Subtract sectors which has not been read
 
-    fatfile->pos = pos;
-    file->seek   = seek;
+    if (error == CE_GOOD && eof)
+        error = CE_EOF;
     return error;
 }
 
@@ -783,93 +813,82 @@ FS_ERROR FAT_fwrite(file_t* file, const void* ptr, size_t size)
 
     FAT_file_t* fatfile = file->data;
     partition_t* volume = file->volume;
-    uint16_t pos        = fatfile->pos;
-    uint32_t seek       = file->seek;
-    uint32_t sector     = cluster2sector(volume->data, fatfile->currCluster) + fatfile->sec;
-    uint32_t sectors    = (size%512 == 0) ? size/512 : size/512+1; // Number of sectors to be written
-
-    if (singleSectorRead(sector, volume->buffer, volume->disk) != CE_GOOD)
-    {
-        return(CE_BAD_SECTOR_READ);
-    }
+    uint32_t sectorSize = volume->disk->sectorSize;
+    uint32_t secPerClus = fatfile->volume->SecPerClus;
+    const uint8_t* src  = ptr;
+    FS_ERROR error      = CE_GOOD;
+    bool fresh          = false; // The current cluster has been allocated by this call, its old content does not matter
 
+    uint32_t sectors = (fatfile->pos%sectorSize + size + sectorSize-1) / sectorSize; // Number of sectors to be written
     volume->disk->accessRemaining += sectors;
-    uint32_t filesize   = file->size;
-    uint8_t* src        = (uint8_t*)ptr;
-    uint16_t writeCount = 0;
-    FS_ERROR error      = CE_GOOD;
 
-    while (error==CE_GOOD && size>0)
+    while (error == CE_GOOD && size > 0)
     {
-        if (seek==filesize)
+        if (file->seek >= file->size)
         {
             file->EOF = true;
         }
 
-        if (pos == volume->disk->sectorSize)
+        if (fatfile->pos == sectorSize)
         {
-            bool needRead = true;
-
-            pos = 0;
+            fatfile->pos = 0;
             fatfile->sec++;
-            if (fatfile->sec == fatfile->volume->SecPerClus)
+            if (fatfile->sec == secPerClus)
             {
                 fatfile->sec = 0;
 
                 if (file->EOF)
                 {
                     error = fileAllocateNewCluster(fatfile, 0);
-                    needRead = false;
+                    fresh = true;
                 }
                 else
                 {
                     error = fileGetNextCluster(fatfile, 1);
                 }
+                if (error != CE_GOOD)
+                    break;
             }
+        }
+        uint32_t sector = cluster2sector(fatfile->volume, fatfile->currCluster) + fatfile->sec;
+        uint32_t chunk;
 
-            if (error == CE_DISK_FULL)
-            {
-                volume->disk->accessRemaining -= sectors; // Subtract sectors that have not been written
-                return (0);
-            }
-
-            if (error == CE_GOOD)
+        if (fatfile->pos == 0 && size >= sectorSize)
+        {
+            // Whole sectors up to the end of the cluster replace the old content without reading it
+            uint32_t n = min(size/sectorSize, secPerClus - fatfile->sec);
+            sectors -= n;
+            error = sectorsWrite(sector, n, src, volume->disk);
+            fatfile->sec += n-1;
+            fatfile->pos = sectorSize;
+            chunk = n*sectorSize;
+        }
+        else
+        {
+            // Read-modify-write, unless the sector contains no data of the file yet
+            if (fresh || (fatfile->pos == 0 && file->seek >= file->size))
             {
-                sector = cluster2sector(volume->data, fatfile->currCluster);
-                sector += fatfile->sec;
-
-                if (needRead)
-                {
-                    if (singleSectorRead(sector, volume->buffer, volume->disk) != CE_GOOD)
-                    {
-                        volume->disk->accessRemaining -= sectors; // Subtract sectors which has not been written
-                        return (CE_BAD_SECTOR_READ);
-                    }
-                }
+                memset(volume->buffer, 0, sectorSize);
             }
-        } //  load new sector
-
-        if (error == CE_GOOD)
-        {
-            // Write one byte at a time
-            MemoryWriteByte(volume->buffer, pos++, *(uint8_t*)src);
-            src++;
-            seek++;
-            size--;
-            writeCount++;
-            if (file->EOF)
+            else if (singleSectorRead(sector, volume->buffer, volume->disk) != CE_GOOD)
             {
-                filesize++;
+                error = CE_BAD_SECTOR_READ;
+                break;
             }
-            sectorWrite(sector, volume->buffer, volume->disk);
+            chunk = min(size, sectorSize - fatfile->pos);
+            memcpy(volume->buffer + fatfile->pos, src, chunk);
+            sectors--;
+            error = sectorWrite(sector, volume->buffer, volume->disk);
+            fatfile->pos += chunk;
         }
-    } // while count
 
-    volume->disk->accessRemaining -= sectors; // Subtract sectors that have not been written
+        src        += chunk;
+        size       -= chunk;
+        file->seek += chunk;
+        file->size  = max(file->size, file->seek);
+    }
 
-    fatfile->pos = pos;      // save positon
-    file->seek   = seek;     // save seek
-    file->size   = filesize; // new filesize
+    volume->disk->accessRemaining -= sectors; // Subtract sectors that have not been written
 
     return (error);
 }
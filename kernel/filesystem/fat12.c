@@ -15,10 +15,7 @@ int32_t flpydsk_read_directory(void)
     // Read track
     static uint8_t track[9216]; // Cache for one track
     floppyDrive[0]->drive.insertedDisk->accessRemaining += 18;
-    for (int i = 0; i < 18; i++) // Read one track
-    {
-        flpydsk_readSector(19+i, track+i*0x200, floppyDrive[0]->drive.insertedDisk); // start at 0x2600: root directory (14 sectors)
-    }
+    flpydsk_readSectors(19, 18, track, floppyDrive[0]->drive.insertedDisk); // Read one track. start at 0x2600: root directory (14 sectors)
 
     textColor(HEADLINE);
     puts("\n<Floppy Disk - Root Directory>");
@@ -103,6 +103,7 @@ file_t* fopen(const char* path, const char* mode)
     file->size   = 0; // Init with 0 but set in FS-specific fopen
     file->EOF    = false;
     file->error  = CE_GOOD;
+    file->users  = 0;
     file->name   = malloc(strlen(getFilename(path))+1, 0, "fsmgr-filename");
     strcpy(file->name, getFilename(path));
 
@@ -165,8 +166,11 @@ file_t* fopen(const char* path, const char* mode)
 
 void fclose(file_t* file)
 {
+    while (file->users > 0) // An io ring of the task is reading or writing the file
+        scheduler_blockCurrentTask(BL_SYNC, file, 0);
+
     file->volume->type->fclose(file);
-    devicemanager_flushCaches(0);
+    devicemanager_flushCaches(file->volume->disk);
     free(file->name);
     free(file);
     list_delete(currentTask->files, list_find(currentTask->files, file));
@@ -249,7 +253,12 @@ size_t fwrite(const void* src, size_t size, size_t count, file_t* file)
 
 FS_ERROR fflush(file_t* file)
 {
-    return (file->volume->type->fflush(file));
+    FS_ERROR error = CE_GOOD;
+    if (file->volume->type->fflush) // FAT has no buffers of its own
+        error = file->volume->type->fflush(file);
+    if (error == CE_GOOD)
+        error = devicemanager_flushCaches(file->volume->disk);
+    return (error);
 }
 
 
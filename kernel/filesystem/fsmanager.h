@@ -157,6 +157,7 @@ typedef struct file
     bool         write;  // file is opened for writing
     bool         read;   // file is opened for reading
     bool         EOF;    // process has reached end of file
+    uint32_t     users;  // Submissions of io rings using the file (ioring.c). fclose waits for them.
 } file_t;
 
 
@@ -0,0 +1,329 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "fpu.h"
+#include "cpu.h"
+#include "cmos.h"
+#include "smp.h"
+#include "objcache.h"
+#include "tasking/task.h"
+#include "video/console.h"
+
+/*
+The FPU/SSE/AVX state of a task is saved in a save area taken from an object cache. The areas are aligned to 64 bytes as
+required by XSAVE, their size depends on the instructions available:
+- XSAVE/XSAVEOPT: x87, SSE and AVX state are enabled in XCR0. The size of the area is reported by CPUID function 0Dh.
+  XSAVEOPT skips components that have not been modified since they were restored.
+- FXSAVE: 512 bytes (x87 and SSE)
+- FSAVE: 108 bytes (x87 only)
+A new area contains the initial state of the FPU (control word 37Fh, MXCSR 1F80h, empty registers), so a task never sees
+the registers of another task.
+
+Each CPU holds the state of at most one task (cpu_t::fpuTask). The state of a task is only saved when another task needs
+the FPU of that CPU. Switching is lazy by default: TS in CR0 is set when a task gets the CPU whose state is not loaded, so its
+first FPU instruction raises #NM (fpu_acquire). Tasks that used the FPU in more than FPU_EAGER consecutive time slices have
+their state restored eagerly in fpu_switch, which avoids the exception. The counter wraps after 256 slices, so eager tasks
+are checked lazily again from time to time; it is reset when a task has not touched the FPU during a slice.
+*/
+
+#define FPU_EAGER      5       // Consecutive time slices using the FPU after which the state is restored eagerly
+#define FPU_ALIGNMENT  64      // Alignment of the save areas required by XSAVE
+#define CR0_TS         BIT(3)
+#define CR4_OSXSAVE    BIT(18)
+#define XCR0_ENABLED   (BIT(0)|BIT(1)|BIT(2)) // x87, SSE, AVX
+
+typedef enum
+{
+    FPU_FSAVE, FPU_FXSAVE, FPU_XSAVE, FPU_XSAVEOPT
+} FPU_METHOD;
+
+static const char* const methodNames[] = {"FSAVE", "FXSAVE", "XSAVE", "XSAVEOPT"};
+
+static FPU_METHOD  method   = FPU_FSAVE;
+static size_t      areaSize = 108;     // 80 Bytes (r0..r7) + 28 Bytes (environment image). C.f. Intel Manual vol. 2A
+static uint32_t    xcr0     = 0;       // Components enabled for XSAVE
+static objCache_t* areaCache = 0;
+
+// Statistics
+static uint32_t lazyRestores  = 0;
+static uint32_t eagerRestores = 0;
+static uint32_t saves         = 0;
+static uint32_t kernelUses    = 0;
+
+
+static void cpuid(uint32_t function, uint32_t subfunction, uint32_t regs[4])
+{
+    __asm__ volatile("cpuid" : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3]) : "a"(function), "c"(subfunction));
+}
+
+static inline void setTS(void)
+{
+    uint32_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    if (!(cr0 & CR0_TS))
+        __asm__ volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_TS)); // Enables #NM (exception no. 7)
+}
+
+static void enableXSAVE(void) // Has to be done on each CPU
+{
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_OSXSAVE));
+    __asm__ volatile("xsetbv" : : "c"(0), "a"(xcr0), "d"(0));
+}
+
+bool fpu_install(void)
+{
+    if (!(cmos_read(CMOS_DEVICES) & BIT(1)) || (cpu_supports(CF_CPUID) && !cpu_supports(CF_FPU)))
+        return (false);
+
+    if (cpu_supports(CF_XSAVE) && cpu_idGetRegister(0, CR_EAX) >= 0xD)
+    {
+        uint32_t regs[4];
+        cpuid(0xD, 0, regs);
+        xcr0 = regs[0] & XCR0_ENABLED; // Supported components
+        enableXSAVE();
+
+        cpuid(0xD, 0, regs);
+        areaSize = regs[1]; // Size required by the components enabled in XCR0
+        cpuid(0xD, 1, regs);
+        method = (regs[0] & BIT(0)) ? FPU_XSAVEOPT : FPU_XSAVE;
+    }
+    else if (cpu_supports(CF_FXSR)) // cpu_install enables OSFXSR
+    {
+        method = FPU_FXSAVE;
+        areaSize = 512; // C.f. Intel Manual vol. 2A
+    }
+
+    __asm__ volatile ("finit");
+
+    uint16_t ctrlword = 0x37F;
+    __asm__ volatile("fldcw %0"::"m"(ctrlword)); // Set the FPU Control Word. FLDCW = Load FPU Control Word
+
+    setTS();
+
+    return (true);
+}
+
+void fpu_installAP(void)
+{
+    // CR4 (OSFXSR, OSXSAVE) has been copied from the BSP, XCR0 not. CR0 has been copied as well, so TS might be set.
+    if (method >= FPU_XSAVE)
+        enableXSAVE();
+
+    uint16_t ctrlword = 0x37F;
+    __asm__ volatile("clts; finit; fldcw %0" : : "m"(ctrlword));
+    setTS();
+}
+
+void fpu_test(void)
+{
+    textColor(LIGHT_GRAY);
+    printf("   => FPU test: ");
+
+    if (!(cmos_read(CMOS_DEVICES) & BIT(1)) || (cpu_supports(CF_CPUID) && !cpu_supports(CF_FPU)))
+    {
+        textColor(ERROR);
+        printf("FPU not available\n");
+        textColor(TEXT);
+        return;
+    }
+
+    double squareroot = sqrt(2.0);
+    squareroot = fabs(squareroot);
+    squareroot /= sqrt(2.0);
+
+    putch('[');
+
+    if (fabs(squareroot - 1.0) < 0.000001)
+    {
+        textColor(SUCCESS);
+        printf("PASSED");
+    }
+    else
+    {
+        textColor(ERROR);
+        printf("FAILED");
+    }
+
+    textColor(LIGHT_GRAY);
+    printf("] %s, %u bytes per task\n", methodNames[method], areaSize);
+    textColor(TEXT);
+}
+
+
+/// Save areas
+static void initArea(void* area) // Constructor: Initial state of the FPU
+{
+    memset(area, 0, areaSize);
+    *(uint16_t*)area = 0x37F; // Control word
+    if (method == FPU_FSAVE)
+        *(uint16_t*)(area + 8) = 0xFFFF; // Tag word: All registers empty
+    else
+        *(uint32_t*)(area + 24) = 0x1F80; // MXCSR: All SSE exceptions masked. Abridged tag word (0) and XSAVE header (0): Initial state
+}
+
+static void save(void* area)
+{
+    switch (method)
+    {
+        case FPU_XSAVEOPT:
+            __asm__ volatile("xsaveopt (%0)" : : "r"(area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+            break;
+        case FPU_XSAVE:
+            __asm__ volatile("xsave (%0)" : : "r"(area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+            break;
+        case FPU_FXSAVE:
+            __asm__ volatile("fxsave (%0)" : : "r"(area) : "memory");
+            break;
+        case FPU_FSAVE:
+            __asm__ volatile("fsave (%0)" : : "r"(area) : "memory");
+            break;
+    }
+    saves++;
+}
+
+static void restore(const void* area)
+{
+    switch (method)
+    {
+        case FPU_XSAVEOPT:
+        case FPU_XSAVE:
+            __asm__ volatile("xrstor (%0)" : : "r"(area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+            break;
+        case FPU_FXSAVE:
+            __asm__ volatile("fxrstor (%0)" : : "r"(area) : "memory");
+            break;
+        case FPU_FSAVE:
+            __asm__ volatile("frstor (%0)" : : "r"(area) : "memory");
+            break;
+    }
+}
+
+static void load(cpu_t* cpu, task_t* task) // Saves the state of the current owner and restores the one of task. TS has to be clear.
+{
+    if (cpu->fpuTask)
+        save(cpu->fpuTask->FPUptr);
+
+    if (task->FPUptr == 0)
+    {
+        if (areaCache == 0)
+            areaCache = objCache_createAligned("FPU state", areaSize, FPU_ALIGNMENT, &initArea);
+        task->FPUptr = objCache_alloc(areaCache);
+    }
+    restore(task->FPUptr);
+    cpu->fpuTask = task;
+}
+
+void fpu_acquire(task_t* task)
+{
+    __asm__ volatile ("clts"); // CLearTS: reset the TS bit (no. 3) in CR0 to disable #NM
+
+    cpu_t* cpu = smp_currentCPU();
+    if (cpu->fpuTask != task)
+    {
+        load(cpu, task);
+        lazyRestores++;
+    }
+    task->fpuCounter++;
+}
+
+void fpu_switch(task_t* oldTask, task_t* newTask)
+{
+    cpu_t* cpu = smp_currentCPU();
+
+    uint32_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    if (oldTask != newTask && (cpu->fpuTask != oldTask || (cr0 & CR0_TS))) // oldTask has not used the FPU during its time slice
+        oldTask->fpuCounter = 0;
+
+    if (newTask == cpu->fpuTask)
+    {
+        __asm__ volatile("clts");
+    }
+    else if (newTask->fpuCounter > FPU_EAGER)
+    {
+        __asm__ volatile("clts");
+        load(cpu, newTask);
+        newTask->fpuCounter++; // Wraps to 0 after a while, the task is switched lazily then until it proves its usage again
+        eagerRestores++;
+    }
+    else
+    {
+        setTS();
+    }
+}
+
+void fpu_releaseTask(task_t* task)
+{
+    smp_releaseFPU(task);
+    if (task->FPUptr)
+    {
+        initArea(task->FPUptr); // Objects have to be returned in constructed state
+        objCache_free(areaCache, task->FPUptr);
+        task->FPUptr = 0;
+    }
+}
+
+void fpu_log(void)
+{
+    textColor(HEADLINE);
+    printf("\nFPU context switching:");
+    textColor(TEXT);
+    printf("\nmethod: %s, save area: %u bytes, XCR0: %Xh", methodNames[method], areaSize, xcr0);
+    printf("\nlazy restores: %u, eager restores: %u, saves: %u, kernel sections: %u\n", lazyRestores, eagerRestores, saves, kernelUses);
+}
+
+
+/// Usage by the kernel
+bool kernel_fpu_begin(void)
+{
+    bool ints = interrupts_disable();
+    __asm__ volatile("clts");
+
+    // The registers are going to be overwritten. The owner restores its state lazily when it uses the FPU again.
+    cpu_t* cpu = smp_currentCPU();
+    if (cpu->fpuTask)
+    {
+        save(cpu->fpuTask->FPUptr);
+        cpu->fpuTask = 0;
+    }
+    kernelUses++;
+    return (ints);
+}
+
+void kernel_fpu_end(bool ints)
+{
+    setTS(); // No task owns the FPU now
+    interrupts_restore(ints);
+}
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
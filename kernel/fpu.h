@@ -0,0 +1,24 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "os.h"
+
+
+struct task;
+
+bool fpu_install(void);
+void fpu_installAP(void); // Initializes the FPU of an application processor like fpu_install did on the BSP
+void fpu_test(void);
+
+void fpu_acquire(struct task* task);                           // Loads the FPU state of the task into the FPU of this CPU (#NM)
+void fpu_switch(struct task* oldTask, struct task* newTask);   // Called by task_switch. Decides between eager and lazy switching.
+void fpu_releaseTask(struct task* task);                       // Returns the save area of a terminated task to the pool
+void fpu_log(void);
+
+// Allows the kernel to use FPU/SSE/AVX registers, e.g. for SIMD copies. Interrupts are disabled in between, so the section
+// has to be short. Sections must not be nested.
+bool kernel_fpu_begin(void);         // Returns whether interrupts were enabled before
+void kernel_fpu_end(bool ints);      // ints: Return value of kernel_fpu_begin
+
+
+#endif
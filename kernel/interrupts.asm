@@ -31,7 +31,9 @@
 ;      * Perform the actual "load" operation.
 
 global idt_install
+global idt_load
 extern irq_handler
+extern smp_leaveKernel
 
 %define CONTEXT_SWITCH_CALL 126
 %define SYSCALL_NUMBER 127
@@ -53,9 +55,9 @@ section .text
     %endif
 %endmacro
 
-; Create the 48 interrupt-routines
+; Create the 48 interrupt-routines for exceptions and PIC IRQs, one for the local APIC timer and two for IPIs (cf. smp.c)
 %assign routine_nr 0
-%rep 48
+%rep 51
     IR_ROUTINE routine_nr
     %assign routine_nr routine_nr+1
 %endrep
@@ -90,6 +92,12 @@ ir_common_stub:
     call irq_handler
     mov esp, eax      ; return value: changed or unchanged esp
 
+    ; Release the kernel lock, if we return to user code. This has to happen on the stack of the new task,
+    ; because another CPU might continue the old task as soon as the lock is free.
+    push esp
+    call smp_leaveKernel
+    add esp, 4
+
     pop gs
     pop fs
     pop es
@@ -120,7 +128,7 @@ idt_install:
 
     ; Execute the macro to fill the interrupt table, unfilled entries remain zero.
     %assign COUNTER 0
-    %rep 48
+    %rep 51
         DO_IDT_ENTRY COUNTER, 0x0008, 0x8E00
         %assign COUNTER COUNTER+1
     %endrep
@@ -151,6 +159,11 @@ idt_install:
     lidt [idt_descriptor]
     ret
 
+; Load the IDT on an application processor. It has been set up by idt_install before.
+idt_load:
+    lidt [idt_descriptor]
+    ret
+
 
 section .data
 
@@ -0,0 +1,319 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "ioring.h"
+#include "kheap.h"
+#include "memory.h"
+#include "paging.h"
+#include "tasking/task.h"
+#include "tasking/workqueue.h"
+#include "util/list.h"
+#include "util/util.h"
+#include "filesystem/fsmanager.h"
+#include "netprotocol/tcp.h"
+#include "netprotocol/udp.h"
+
+/*
+Asynchronous I/O for user programs. A ring consists of a header (ioRing_t), a submission queue, a completion queue and a buffer
+area for the data of the operations. It is allocated on the kernel heap and its pages are additionally mapped into the address
+space of the program (USER_SHARED_START to USER_SHARED_END), so both sides access it without copying.
+
+The program writes submissions and advances sqTail, then calls ioring_enter, which schedules the work of the ring on WQ_IO. The
+worker executes the submissions in order and writes a completion for each of them. File handles are checked against the open
+files of the owner, and the file is kept in use until the completion is posted, so fclose waits for it. It only takes a submission if the completion
+queue has room, so completions never get lost. Each side only writes its own indices (program: sqTail, cqHead; kernel: sqHead,
+cqTail), so no lock is needed. The kernel copies each submission before using it and checks it against its own copy of the
+layout, because the program can change the ring at any time.
+
+ioring_enter can wait (BL_IORING) until a number of completions are ready. The worker wakes it when cqTail reaches the target. Completions can be reaped without a syscall.
+
+A ring is only destroyed by its work function, after the owner has closed it. ioring_cleanup waits for that, so files and
+connections used by a submission in progress are released only afterwards.
+*/
+
+#define IORING_SLOTS ((USER_SHARED_END - USER_SHARED_START) / IORING_MAX_SIZE) // Rings per program
+STATIC_ASSERT(USER_SHARED_END > USER_SHARED_START);
+
+
+typedef struct
+{
+    work_t           work;       // Processes the submissions on WQ_IO
+    ioRing_t*        shared;     // Kernel address of the ring
+    uint8_t*         user;       // Address of the ring in the address space of the program
+    size_t           size;
+    uint32_t         mask;       // entries - 1
+    ioSubmission_t*  sq;
+    ioCompletion_t*  cq;
+    uint8_t*         buffer;
+    size_t           bufferSize;
+    pageDirectory_t* pd;
+    const task_t*    owner;
+    uint32_t         cqTarget;   // Value of cqTail ioring_enter waits for
+    bool             running;    // Work function is executing
+    bool             closed;     // Owner has exited. The work function destroys the ring.
+} ring_t;
+
+
+static list_t* rings = 0;
+
+
+static ring_t* findRing(const pageDirectory_t* pd, const void* user)
+{
+    for (dlelement_t* e = rings->head; e != 0; e = e->next)
+    {
+        ring_t* ring = e->data;
+        if (ring->pd == pd && ring->user == user)
+            return (ring);
+    }
+    return (0);
+}
+
+static file_t* acquireFile(const ring_t* ring, const ioSubmission_t* sub) // Returns the file of a READ/WRITE submission, if the owner has opened it
+{
+    if (sub->opcode != IORING_OP_READ && sub->opcode != IORING_OP_WRITE)
+        return (0);
+
+    file_t* file = (file_t*)sub->handle;
+    if (ring->owner->files == 0 || list_find(ring->owner->files, file) == 0)
+        return (0);
+    file->users++;
+    return (file);
+}
+
+static void releaseFile(file_t* file)
+{
+    file->users--;
+    if (file->users == 0)
+        scheduler_unblockEvent(BL_SYNC, file); // fclose might wait
+}
+
+static int32_t execute(ring_t* ring, const ioSubmission_t* sub, file_t* file)
+{
+    if (sub->offset > ring->bufferSize || sub->length > ring->bufferSize - sub->offset)
+        return (IORING_EINVAL);
+    uint8_t* data = ring->buffer + sub->offset;
+
+    switch (sub->opcode)
+    {
+        case IORING_OP_NOP:
+            return (0);
+        case IORING_OP_READ:
+        case IORING_OP_WRITE:
+        {
+            if (file == 0)
+                return (IORING_EINVAL);
+            if (sub->position != IORING_CURRENT && fseek(file, sub->position, SEEK_SET) != CE_GOOD)
+                return (IORING_EFAILED);
+            if (sub->opcode == IORING_OP_READ)
+                return (fread(data, 1, sub->length, file));
+            return (fwrite(data, 1, sub->length, file));
+        }
+        case IORING_OP_TCP_SEND:
+            return (tcp_usend(sub->handle, data, sub->length) ? (int32_t)sub->length : IORING_EFAILED);
+        case IORING_OP_UDP_SEND:
+        {
+            IP_t destIP = {.iIP = sub->handle};
+            return (udp_usend(data, sub->length, destIP, sub->srcPort, sub->destPort) ? (int32_t)sub->length : IORING_EFAILED);
+        }
+        default:
+            return (IORING_EINVAL);
+    }
+}
+
+static void destroy(ring_t* ring)
+{
+    list_delete(rings, list_find(rings, ring));
+    free(ring->shared);
+    free(ring);
+    scheduler_unblockEvent(BL_IORING, ring); // ioring_unlockTask sees that the ring is gone
+}
+
+static ring_t* findClosedRing(const task_t* owner)
+{
+    for (dlelement_t* e = rings->head; e != 0; e = e->next)
+    {
+        ring_t* ring = e->data;
+        if (ring->owner == owner && ring->closed)
+            return (ring);
+    }
+    return (0);
+}
+
+static void processSubmissions(work_t* work)
+{
+    ring_t* ring = (ring_t*)work;
+    ioRing_t* shared = ring->shared;
+    ring->running = true;
+
+    while (!ring->closed && shared->sqHead != shared->sqTail && shared->cqTail - shared->cqHead <= ring->mask)
+    {
+        ioSubmission_t sub = ring->sq[shared->sqHead & ring->mask];
+        shared->sqHead++;
+
+        file_t* file = acquireFile(ring, &sub);
+        int32_t result = execute(ring, &sub, file); // Might block, e.g. while the disk is read
+
+        ioCompletion_t* completion = &ring->cq[shared->cqTail & ring->mask];
+        completion->userData = sub.userData;
+        completion->result   = result;
+        __asm__ volatile("" : : : "memory"); // The completion is written before it is published
+        shared->cqTail++;
+
+        if (file)
+            releaseFile(file);
+        if ((int32_t)(shared->cqTail - ring->cqTarget) >= 0)
+            scheduler_unblockEvent(BL_IORING, ring);
+    }
+
+    ring->running = false;
+    if (ring->closed && !ring->work.pending) // If the work has been scheduled again, the last execution destroys the ring
+        destroy(ring);
+}
+
+void* ioring_setup(uint32_t entries, size_t bufferSize)
+{
+    if (entries == 0 || entries > IORING_MAX_ENTRIES || (entries & (entries - 1)) || currentTask->pageDirectory == kernelPageDirectory)
+        return (0);
+
+    size_t sqOffset     = alignUp(sizeof(ioRing_t), 16);
+    size_t cqOffset     = sqOffset + entries*sizeof(ioSubmission_t);
+    size_t bufferOffset = alignUp(cqOffset + entries*sizeof(ioCompletion_t), PAGESIZE);
+    size_t size         = alignUp(bufferOffset + bufferSize, PAGESIZE);
+    if (bufferSize > IORING_MAX_SIZE || size > IORING_MAX_SIZE)
+        return (0);
+
+    if (rings == 0)
+        rings = list_create();
+
+    // Find a free slot in the shared area of the program
+    uint8_t* user = 0;
+    for (uint32_t i = 0; i < IORING_SLOTS && user == 0; i++)
+    {
+        if (findRing(currentTask->pageDirectory, USER_SHARED_START + i*IORING_MAX_SIZE) == 0)
+            user = USER_SHARED_START + i*IORING_MAX_SIZE;
+    }
+    if (user == 0)
+        return (0);
+
+    ioRing_t* shared = malloc(size, PAGESIZE, "ioring");
+    if (shared == 0)
+        return (0);
+    memset(shared, 0, size);
+    shared->entries      = entries;
+    shared->sqOffset     = sqOffset;
+    shared->cqOffset     = cqOffset;
+    shared->bufferOffset = bufferOffset;
+    shared->bufferSize   = size - bufferOffset;
+
+    // The frames stay owned by the kernel heap (MEM_SHARED), the program only gets a second mapping in its own page tables
+    for (size_t offset = 0; offset < size; offset += PAGESIZE)
+    {
+        if (!paging_mapPhysical(currentTask->pageDirectory, user + offset, paging_getPhysAddr((uint8_t*)shared + offset), PAGESIZE,
+                                MEM_USER | MEM_WRITE | MEM_SHARED))
+        {
+            paging_free(currentTask->pageDirectory, user, offset);
+            free(shared);
+            return (0);
+        }
+    }
+
+    ring_t* ring = malloc(sizeof(ring_t), 0, "ioring-ring_t");
+    ring->work       = (work_t)WORK_INIT(&processSubmissions);
+    ring->shared     = shared;
+    ring->user       = user;
+    ring->size       = size;
+    ring->mask       = entries - 1;
+    ring->sq         = (void*)shared + sqOffset;
+    ring->cq         = (void*)shared + cqOffset;
+    ring->buffer     = (uint8_t*)shared + bufferOffset;
+    ring->bufferSize = size - bufferOffset;
+    ring->pd         = currentTask->pageDirectory;
+    ring->owner      = currentTask;
+    ring->cqTarget   = 0;
+    ring->running    = false;
+    ring->closed     = false;
+    list_append(rings, ring);
+
+    return (user);
+}
+
+uint32_t ioring_enter(void* user, uint32_t minComplete)
+{
+    ring_t* ring = rings ? findRing(currentTask->pageDirectory, user) : 0;
+    if (ring == 0)
+        return (0);
+
+    if (ring->shared->sqHead != ring->shared->sqTail)
+        workqueue_schedule(WQ_IO, &ring->work);
+
+    minComplete = min(minComplete, ring->mask + 1);
+    ring->cqTarget = ring->shared->cqHead + minComplete;
+    while (ring->shared->cqTail - ring->shared->cqHead < minComplete)
+    {
+        scheduler_blockCurrentTask(BL_IORING, ring, 0);
+        if (list_find(rings, ring) == 0) // Destroyed, because the owner has exited
+            return (0);
+    }
+
+    return (ring->shared->cqTail - ring->shared->cqHead);
+}
+
+bool ioring_unlockTask(void* data)
+{
+    if (list_find(rings, data) == 0)
+        return (true); // Destroyed
+    const ring_t* ring = data;
+    return (!ring->closed && (int32_t)(ring->shared->cqTail - ring->cqTarget) >= 0);
+}
+
+void ioring_cleanup(const task_t* task)
+{
+    if (rings == 0)
+        return;
+
+    for (dlelement_t* e = rings->head; e != 0;)
+    {
+        ring_t* ring = e->data;
+        e = e->next;
+        if (ring->owner != task)
+            continue;
+
+        paging_free(ring->pd, ring->user, ring->size); // Removes the mapping only (MEM_SHARED)
+        ring->closed = true;
+        workqueue_schedule(WQ_IO, &ring->work); // Stops processing and destroys the ring
+    }
+
+    // Wait until no submission of the task is executed anymore
+    for (ring_t* ring; (ring = findClosedRing(task)) != 0;)
+        scheduler_blockCurrentTask(BL_IORING, ring, 0);
+}
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
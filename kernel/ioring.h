@@ -0,0 +1,66 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include "os.h"
+
+
+#define IORING_MAX_ENTRIES 256      // Maximum number of slots of each queue
+#define IORING_MAX_SIZE    0x100000 // Maximum size of a ring including its buffer area
+
+typedef enum
+{
+    IORING_OP_NOP, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_TCP_SEND, IORING_OP_UDP_SEND
+} IORING_OP;
+
+typedef enum
+{
+    IORING_EINVAL = -1, // Submission refers to data outside of the buffer area, to a file not opened by the program or has an unknown opcode
+    IORING_EFAILED = -2 // The operation failed
+} IORING_ERROR;
+
+// Operation posted by the program. Its data is located in the buffer area of the ring.
+typedef struct
+{
+    uint32_t opcode;   // IORING_OP
+    uint32_t handle;   // READ/WRITE: file_t*, TCP_SEND: connection ID, UDP_SEND: destination IP
+    uint32_t offset;   // Offset of the data in the buffer area
+    uint32_t length;
+    uint32_t position; // READ/WRITE: File position, IORING_CURRENT for the current one
+    uint16_t srcPort;  // UDP_SEND
+    uint16_t destPort; // UDP_SEND
+    uint32_t userData; // Copied to the completion
+    uint32_t reserved;
+} ioSubmission_t;
+
+#define IORING_CURRENT 0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t userData;
+    int32_t  result;   // Number of bytes transferred or IORING_ERROR
+} ioCompletion_t;
+
+// Header of a ring. The ring is mapped into the address space of the program and shared with the kernel.
+typedef struct
+{
+    volatile uint32_t sqHead;       // Next submission taken by the kernel
+    volatile uint32_t sqTail;       // Next submission written by the program
+    volatile uint32_t cqHead;       // Next completion taken by the program
+    volatile uint32_t cqTail;       // Next completion written by the kernel
+    uint32_t          entries;      // Slots of each queue (power of two)
+    uint32_t          sqOffset;     // Offsets from the beginning of the ring
+    uint32_t          cqOffset;
+    uint32_t          bufferOffset;
+    uint32_t          bufferSize;
+} ioRing_t;
+
+
+struct task;
+
+void*    ioring_setup(uint32_t entries, size_t bufferSize);  // Syscall. Returns the address of the ring in the address space of the program.
+uint32_t ioring_enter(void* ring, uint32_t minComplete);     // Syscall. Starts processing the submissions, waits for minComplete completions. Returns the number of completions ready.
+bool     ioring_unlockTask(void* ring);                      // Used for scheduler
+void     ioring_cleanup(const struct task* task);            // Destroys the rings created by the task. Waits until none of their submissions is executed anymore.
+
+
+#endif
@@ -7,22 +7,53 @@
 #include "tasking/task.h"
 #include "util/util.h"
 #include "kheap.h"
+#include "tasking/synchronisation.h"
 
 
 static ipc_node_t root =
 {
     .name    = 0,        .type        = IPC_FOLDER, .data.folder = 0, .owner = 0,
-    .general = IPC_READ, .accessTable = 0,          .parent      = 0
+    .general = IPC_READ, .accessTable = 0,          .parent      = 0,
+    .refresh = 0
 };
 static uint16_t printLineCounter = 0;
+static bool     refreshing       = false; // Nodes changed by a refresh function must not trigger further refreshes
+static rwlock_t treeLock         = RWLOCK_INIT("IPC tree"); // Readers look up nodes and read values, writers create nodes and change values
 
 
 // private interface
 
+static void refreshNode(ipc_node_t* node)
+{
+    if(node->refresh && !refreshing)
+    {
+        // Refresh functions change the tree, so a reader temporarily becomes a writer. Nodes are never freed, so the
+        // nodes the reader looks at stay valid while it does not hold the lock.
+        bool reader = !rwlock_isWriter(&treeLock);
+        if(reader)
+        {
+            rwlock_readUnlock(&treeLock);
+            rwlock_writeLock(&treeLock);
+        }
+
+        refreshing = true;
+        node->refresh(node);
+        refreshing = false;
+
+        if(reader)
+        {
+            rwlock_writeUnlock(&treeLock);
+            rwlock_readLock(&treeLock);
+        }
+    }
+}
+
 static ipc_node_t* getNode(const char* remainingPath, ipc_node_t* node)
 {
     const char* end = strpbrk(remainingPath, "/|\\");
 
+    refreshNode(node);
+
     if(node->type == IPC_FOLDER && node->data.folder)
     {
         if(end == 0) // Final element
@@ -74,11 +105,13 @@ static bool accessAllowed(ipc_node_t* node, IPC_RIGHTS needed)
     return ((node->general & needed) == needed); // Use general access rights as fallback
 }
 
+static IPC_ERROR createPath(const char* path, ipc_node_t** node, IPC_TYPE type);
+
 static IPC_ERROR prepareNodeToWrite(ipc_node_t** node, const char* path, IPC_TYPE type)
 {
     if(*node == 0)
     {
-        IPC_ERROR err = ipc_createNode(path, node, type);
+        IPC_ERROR err = createPath(path, node, type);
         if(err != IPC_SUCCESSFUL)
             return (err);
     }
@@ -124,6 +157,8 @@ static IPC_ERROR createNode(ipc_node_t* parent, ipc_node_t** node, const char* n
     (*node)->general     = IPC_READ; // TODO: Use parents rights?
     (*node)->accessTable = 0;
     (*node)->data.folder = 0;
+    (*node)->parent      = parent;
+    (*node)->refresh     = 0;
 
     if(parent->data.folder == 0)
         parent->data.folder = list_create();
@@ -177,14 +212,7 @@ static void ipc_printNode(ipc_node_t* node, int indent)
 }
 
 
-// Public interface (kernel)
-
-ipc_node_t* ipc_getNode(const char* path)
-{
-    return (getNode(path, &root));
-}
-
-IPC_ERROR ipc_createNode(const char* path, ipc_node_t** node, IPC_TYPE type)
+static IPC_ERROR createPath(const char* path, ipc_node_t** node, IPC_TYPE type)
 {
     char npath[strlen(path)+1];
     strcpy(npath, path);
@@ -208,27 +236,9 @@ IPC_ERROR ipc_createNode(const char* path, ipc_node_t** node, IPC_TYPE type)
     return (createNode(parent, node, nodename, type));
 }
 
-void ipc_print(void)
+static IPC_ERROR getFolder(const char* path, char* destination, size_t length) // TODO: Its possible to solve this more efficient. For example we currently require one byte too much as string length
 {
-    textColor(HEADLINE);
-    puts("\nIPC:");
-    textColor(TEXT);
-    printLineCounter = 0;
-    ipc_printNode(&root, -1);
-    putch('\n');
-}
-
-
-// Public interface (syscalls)
-
-file_t* ipc_fopen(const char* path, const char* mode)
-{
-    return (0); // TODO
-}
-
-IPC_ERROR ipc_getFolder(const char* path, char* destination, size_t length) // TODO: Its possible to solve this more efficient. For example we currently require one byte too much as string length
-{
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
     if(node == 0)
         return (IPC_NOTFOUND);
     if(node->type != IPC_FOLDER)
@@ -236,6 +246,8 @@ IPC_ERROR ipc_getFolder(const char* path, char* destination, size_t length) // T
     if(!accessAllowed(node, IPC_READ))
         return (IPC_ACCESSDENIED);
 
+    refreshNode(node);
+
     // Collect length to check if destination is large enough
     size_t neededLength = 2;
     for(dlelement_t* e = node->data.folder->head; e != 0; e = e->next)
@@ -260,9 +272,9 @@ IPC_ERROR ipc_getFolder(const char* path, char* destination, size_t length) // T
     return (IPC_SUCCESSFUL);
 }
 
-IPC_ERROR ipc_getString(const char* path, char* destination, size_t length)
+static IPC_ERROR getString(const char* path, char* destination, size_t length)
 {
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
     if(node == 0)
         return (IPC_NOTFOUND);
     if(node->type != IPC_STRING)
@@ -281,9 +293,9 @@ IPC_ERROR ipc_getString(const char* path, char* destination, size_t length)
     return (IPC_SUCCESSFUL);
 }
 
-IPC_ERROR ipc_getInt(const char* path, int64_t* destination)
+static IPC_ERROR getInt(const char* path, int64_t* destination)
 {
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
     if(node == 0)
         return (IPC_NOTFOUND);
     if(node->type != IPC_INTEGER)
@@ -296,9 +308,9 @@ IPC_ERROR ipc_getInt(const char* path, int64_t* destination)
     return (IPC_SUCCESSFUL);
 }
 
-IPC_ERROR ipc_getDouble(const char* path, double* destination)
+static IPC_ERROR getDouble(const char* path, double* destination)
 {
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
     if(node == 0)
         return (IPC_NOTFOUND);
     if(node->type != IPC_FLOAT)
@@ -311,9 +323,9 @@ IPC_ERROR ipc_getDouble(const char* path, double* destination)
     return (IPC_SUCCESSFUL);
 }
 
-IPC_ERROR ipc_setString(const char* path, const char* source)
+static IPC_ERROR setString(const char* path, const char* source)
 {
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
 
     IPC_ERROR err = prepareNodeToWrite(&node, path, IPC_STRING);
     if(err != IPC_SUCCESSFUL)
@@ -327,9 +339,9 @@ IPC_ERROR ipc_setString(const char* path, const char* source)
     return (IPC_SUCCESSFUL);
 }
 
-IPC_ERROR ipc_setInt(const char* path, int64_t* source)
+static IPC_ERROR setInt(const char* path, int64_t* source)
 {
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
 
     IPC_ERROR err = prepareNodeToWrite(&node, path, IPC_INTEGER);
     if(err != IPC_SUCCESSFUL)
@@ -340,9 +352,9 @@ IPC_ERROR ipc_setInt(const char* path, int64_t* source)
     return (IPC_SUCCESSFUL);
 }
 
-IPC_ERROR ipc_setDouble(const char* path, double* source)
+static IPC_ERROR setDouble(const char* path, double* source)
 {
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
 
     IPC_ERROR err = prepareNodeToWrite(&node, path, IPC_FLOAT);
     if(err != IPC_SUCCESSFUL)
@@ -353,9 +365,9 @@ IPC_ERROR ipc_setDouble(const char* path, double* source)
     return (IPC_SUCCESSFUL);
 }
 
-IPC_ERROR ipc_deleteKey(const char* path)
+static IPC_ERROR deleteKey(const char* path)
 {
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
     if(node == 0)
         return (IPC_NOTFOUND);
     if(!node->parent || !accessAllowed(node->parent, IPC_WRITE)) // Deleting requires write access to nodes parent
@@ -364,9 +376,9 @@ IPC_ERROR ipc_deleteKey(const char* path)
     return (deleteNode(node));
 }
 
-IPC_ERROR ipc_setAccess(const char* path, IPC_RIGHTS permissions, uint32_t task)
+static IPC_ERROR setAccess(const char* path, IPC_RIGHTS permissions, uint32_t task)
 {
-    ipc_node_t* node = ipc_getNode(path);
+    ipc_node_t* node = getNode(path, &root);
     if(node == 0)
         return (IPC_NOTFOUND);
     if(!accessAllowed(node, IPC_DELEGATERIGHTS))
@@ -396,6 +408,116 @@ IPC_ERROR ipc_setAccess(const char* path, IPC_RIGHTS permissions, uint32_t task)
     return (IPC_SUCCESSFUL);
 }
 
+// Public interface (kernel)
+
+ipc_node_t* ipc_getNode(const char* path)
+{
+    rwlock_readLock(&treeLock);
+    ipc_node_t* node = getNode(path, &root);
+    rwlock_readUnlock(&treeLock);
+    return (node);
+}
+
+IPC_ERROR ipc_createNode(const char* path, ipc_node_t** node, IPC_TYPE type)
+{
+    rwlock_writeLock(&treeLock);
+    IPC_ERROR err = createPath(path, node, type);
+    rwlock_writeUnlock(&treeLock);
+    return (err);
+}
+
+void ipc_print(void)
+{
+    textColor(HEADLINE);
+    puts("\nIPC:");
+    textColor(TEXT);
+    printLineCounter = 0;
+    rwlock_readLock(&treeLock);
+    ipc_printNode(&root, -1);
+    rwlock_readUnlock(&treeLock);
+    putch('\n');
+}
+
+
+// Public interface (syscalls)
+
+file_t* ipc_fopen(const char* path, const char* mode)
+{
+    return (0); // TODO
+}
+
+IPC_ERROR ipc_getFolder(const char* path, char* destination, size_t length)
+{
+    rwlock_readLock(&treeLock);
+    IPC_ERROR err = getFolder(path, destination, length);
+    rwlock_readUnlock(&treeLock);
+    return (err);
+}
+
+IPC_ERROR ipc_getString(const char* path, char* destination, size_t length)
+{
+    rwlock_readLock(&treeLock);
+    IPC_ERROR err = getString(path, destination, length);
+    rwlock_readUnlock(&treeLock);
+    return (err);
+}
+
+IPC_ERROR ipc_getInt(const char* path, int64_t* destination)
+{
+    rwlock_readLock(&treeLock);
+    IPC_ERROR err = getInt(path, destination);
+    rwlock_readUnlock(&treeLock);
+    return (err);
+}
+
+IPC_ERROR ipc_getDouble(const char* path, double* destination)
+{
+    rwlock_readLock(&treeLock);
+    IPC_ERROR err = getDouble(path, destination);
+    rwlock_readUnlock(&treeLock);
+    return (err);
+}
+
+IPC_ERROR ipc_setString(const char* path, const char* source)
+{
+    rwlock_writeLock(&treeLock);
+    IPC_ERROR err = setString(path, source);
+    rwlock_writeUnlock(&treeLock);
+    return (err);
+}
+
+IPC_ERROR ipc_setInt(const char* path, int64_t* source)
+{
+    rwlock_writeLock(&treeLock);
+    IPC_ERROR err = setInt(path, source);
+    rwlock_writeUnlock(&treeLock);
+    return (err);
+}
+
+IPC_ERROR ipc_setDouble(const char* path, double* source)
+{
+    rwlock_writeLock(&treeLock);
+    IPC_ERROR err = setDouble(path, source);
+    rwlock_writeUnlock(&treeLock);
+    return (err);
+}
+
+IPC_ERROR ipc_deleteKey(const char* path)
+{
+    rwlock_writeLock(&treeLock);
+    IPC_ERROR err = deleteKey(path);
+    rwlock_writeUnlock(&treeLock);
+    return (err);
+}
+
+IPC_ERROR ipc_setAccess(const char* path, IPC_RIGHTS permissions, uint32_t task)
+{
+    rwlock_writeLock(&treeLock);
+    IPC_ERROR err = setAccess(path, permissions, task);
+    rwlock_writeUnlock(&treeLock);
+    return (err);
+}
+
 
 /*
 * Copyright (c) 2011-2013 The PrettyOS Project. All rights reserved.
@@ -44,6 +44,7 @@ typedef struct ipc_node
     IPC_RIGHTS       general;     // General access rights
     list_t*          accessTable; // list of ipc_certificate_t*. Content overrides general ipc certificate
     struct ipc_node* parent;      // Points to the parent item in the tree
+    void (*refresh)(struct ipc_node* node); // Optional. Called before the subnodes of a folder are looked up, so their values can be updated on demand
 } ipc_node_t;
 
 
@@ -8,9 +8,12 @@
 #include "tasking/task.h"
 #include "tasking/vm86.h"
 #include "cpu.h"
+#include "fpu.h"
 #include "kheap.h"
 #include "timer.h"
 #include "keyboard.h"
+#include "apic.h"
+#include "smp.h"
 
 
 typedef enum
@@ -37,6 +40,7 @@ typedef struct
 static struct irq
 {
     size_t calls;             // Counts all interrupts of this number
+    uint32_t waiters;         // Tasks in waitForIRQ. Only then irq_handler has to signal the scheduler.
     size_t handlerCount;      // Counts the number of handlers assigned to this IRQ. Used to determine, which of the members of following union is valid
     union
     {
@@ -129,13 +133,15 @@ void irq_resetCounter(IRQ_NUM_t number)
 
 bool waitForIRQ(IRQ_NUM_t number, uint32_t timeout)
 {
+    // An interrupt arriving between registration and blocking is not missed, because it is counted in calls
+    __sync_fetch_and_add(&interrupts[number+32].waiters, 1);
+    bool result = true;
     if (timeout > 0)
-        return (scheduler_blockCurrentTask(BL_INTERRUPT, (void*)(number+32), max(1, timeout)));
+        result = scheduler_blockCurrentTask(BL_INTERRUPT, (void*)(number+32), max(1, timeout));
     else
-    {
         scheduler_blockCurrentTask(BL_INTERRUPT, (void*)(number+32), 0);
-        return (true);
-    }
+    __sync_fetch_and_sub(&interrupts[number+32].waiters, 1);
+    return (result);
 }
 
 bool irq_unlockTask(void* data)
@@ -230,42 +236,11 @@ static void invalidOpcode(registers_t* r)
     quitTask();
 }
 
-static void NM_fxsr(registers_t* r) // -> FPU (with support for SSE)
-{
-    kdebug(3, "#NM (fxsr): FPU is used. currentTask: %Xh\n", currentTask);
-
-    __asm__ volatile ("clts"); // CLearTS: reset the TS bit (no. 3) in CR0 to disable #NM
-
-    // save FPU data ...
-    if (FPUTask) // fxsave to FPUTask->FPUptr
-        __asm__ volatile("fxsave (%0)" : : "r" (FPUTask->FPUptr));
-
-    FPUTask = currentTask; // store the last task using FPU
-
-    // restore FPU data ...
-    if (currentTask->FPUptr) // fxrstor from currentTask->FPUptr
-        __asm__ volatile("fxrstor (%0)" : : "r" (currentTask->FPUptr));
-    else // allocate memory to save the content of the FPU registers
-        currentTask->FPUptr = malloc(512, 4, "FPUptr"); // C.f. Intel Manual vol. 2A
-}
-
 static void NM(registers_t* r) // -> FPU
 {
     kdebug(3, "#NM: FPU is used. currentTask: %Xh\n", currentTask);
 
-    __asm__ volatile ("clts"); // CLearTS: reset the TS bit (no. 3) in CR0 to disable #NM
-
-    // save FPU data ...
-    if (FPUTask) // fsave or fnsave to FPUTask->FPUptr
-        __asm__ volatile("fsave (%0)" : : "r" (FPUTask->FPUptr));
-
-    FPUTask = currentTask; // store the last task using FPU
-
-    // restore FPU data ...
-    if (currentTask->FPUptr) // frstor from currentTask->FPUptr
-        __asm__ volatile("frstor (%0)" : : "r" (currentTask->FPUptr));
-    else // allocate memory to save the content of the FPU registers
-        currentTask->FPUptr = malloc(108, 4, "FPUptr"); // 80 Bytes (r0..r7) + 28 Bytes (environment image). C.f. Intel Manual vol. 2A
+    fpu_acquire(currentTask); // Saves the state of the previous owner and loads the one of currentTask
 }
 
 static void GPF(registers_t* r) // VM86
@@ -290,6 +265,10 @@ static void PF(registers_t* r)
     uint32_t faulting_address;
     __asm__ volatile("mov %%cr2, %0" : "=r" (faulting_address)); // faulting address <== CR2 register
 
+    // Demand paging and copy-on-write
+    if (paging_handlePageFault(faulting_address, r->err_code & BIT(1)))
+        return;
+
     // The error code gives us details of what happened.
     bool pres  = !(r->err_code & BIT(0)); // Page not present
     bool rw    =   r->err_code & BIT(1);  // Write operation?
@@ -330,27 +309,26 @@ void isr_install(void)
 
     // Installing ISR-Routines
     interrupts[ISR_invalidOpcode].handler.handler.func.def = &invalidOpcode;
-    if(cpu_supports(CF_FXSR))
-        interrupts[ISR_NM].handler.handler.func.def = &NM_fxsr;
-    else
-        interrupts[ISR_NM].handler.handler.func.def = &NM;
+    interrupts[ISR_NM].handler.handler.func.def = &NM;
     interrupts[ISR_GPF].handler.handler.func.def = &GPF;
     interrupts[ISR_PF].handler.handler.func.def = &PF;
 }
 
 uint32_t irq_handler(uintptr_t esp)
 {
-    task_t* oldTask = currentTask; // Save old task to be able to restore attr in case of task_switch
-    uint8_t attr    = currentTask->attrib;  // Save the attrib so that we do not get color changes after the interrupt, if it has changed the attrib
-    console_current = kernelTask.console;   // The output is expected to appear in the kernel's console. Exception: Syscalls (cf. syscall.c)
-
     registers_t* r = (registers_t*)esp;
 
-    if (r->int_no == 0x20 || r->int_no == 0x7E) // timer interrupt or function switch_context
+    if (r->int_no == 32+IRQ_IPI_TLB) // Handled without the kernel lock, because its owner waits for the flush
     {
-        if (task_switching)
-            esp = scheduler_taskSwitch(esp); // get new task's esp from scheduler
+        smp_handleTLBFlush();
+        apic_eoi();
+        return (esp);
     }
+    smp_lockKernel(); // Released in smp_leaveKernel, if the CPU returns to user code
+
+    task_t* oldTask = currentTask; // Save old task to be able to restore attr in case of task_switch
+    uint8_t attr    = currentTask->attrib;  // Save the attrib so that we do not get color changes after the interrupt, if it has changed the attrib
+    console_current = kernelTask.console;   // The output is expected to appear in the kernel's console. Exception: Syscalls (cf. syscall.c)
 
     interrupts[r->int_no].calls++;
     if (interrupts[r->int_no].handlerCount == 1) // One handler registered for this interrupt
@@ -397,9 +375,26 @@ uint32_t irq_handler(uintptr_t esp)
     }
 
 HANDLED:
-    if(r->int_no >= (32+8))               // IRQs from slave PIC have to be quit by EOI to both PICs
-        outportb(PIC_SLAVE_CMD, PIC_EOI); // Issue EOI on slave PIC
-    outportb(PIC_MASTER_CMD, PIC_EOI);    // Issue EOI on master PIC
+    if (interrupts[r->int_no].waiters) // Timer, IPIs and syscalls are never waited for, so they skip the wait queues
+        scheduler_unblockEvent(BL_INTERRUPT, (void*)r->int_no); // Wake up tasks waiting for this IRQ (waitForIRQ)
+
+    // Timer interrupt, reschedule IPI or function switch_context. The timer handler runs before, so that tasks woken up by timers are considered.
+    if (r->int_no == 32+IRQ_TIMER || r->int_no == 32+IRQ_APIC_TIMER || r->int_no == 32+IRQ_IPI_SCHEDULE || r->int_no == 0x7E)
+    {
+        if (task_switching)
+            esp = scheduler_taskSwitch(esp, r->int_no != 0x7E); // get new task's esp from scheduler
+    }
+
+    if (r->int_no == 32+IRQ_IPI_SCHEDULE)
+    {
+        apic_eoi();
+    }
+    else if (r->int_no != 32+IRQ_APIC_TIMER) // The local APIC is acknowledged by timer_handler
+    {
+        if(r->int_no >= (32+8))               // IRQs from slave PIC have to be quit by EOI to both PICs
+            outportb(PIC_SLAVE_CMD, PIC_EOI); // Issue EOI on slave PIC
+        outportb(PIC_MASTER_CMD, PIC_EOI);    // Issue EOI on master PIC
+    }
 
     console_current = currentTask->console;
     if (r->int_no != 0x7F) // Syscalls (especially textColor) should be able to change color. HACK: Can this be solved nicer?
@@ -26,10 +26,15 @@ typedef enum
 {
     IRQ_TIMER         = 0,
     IRQ_KEYBOARD      = 1,
+    IRQ_COM2          = 3,  // Also COM4
+    IRQ_COM1          = 4,  // Also COM3
     IRQ_FLOPPY        = 6,
     IRQ_MOUSE         = 12,
     IRQ_ATA_PRIMARY   = 14,
     IRQ_ATA_SECONDARY = 15,
+    IRQ_APIC_TIMER    = 16, // Local APIC timer. Vector 48, above the IRQs of the PICs // cf. interrupts.asm
+    IRQ_IPI_SCHEDULE  = 17, // Inter-processor interrupt: Reschedule. Vector 49 // cf. smp.c
+    IRQ_IPI_TLB       = 18, // Inter-processor interrupt: TLB shootdown. Vector 50
     IRQ_SYSCALL       = 95 // PrettyOS SYSCALL_NUMBER 127 minus 32 // cf. interrupts.asm
 } IRQ_NUM_t;
 
@@ -7,6 +7,7 @@
 #include "util/util.h"
 #include "tasking/task.h"
 #include "irq.h"
+#include "util/fifo.h"
 
 #if KEYMAP == GER
   #include "keyboard_GER.h"
@@ -59,13 +60,21 @@ static const KEY_t scancodeToKey_E0[] =      // cf. http://www.win.tue.nl/~aeb/l
     0,          0,          0,          0,          0,          0,           0,            0,
 };
 
+#define KEYBOARD_SLOTS 64 // Scancodes that can wait for the keyboard thread
+
+
 static bool pressedKeys[__KEY_LAST] = {false}; // for monitoring pressed keys
 static void keyboard_handler(registers_t* r);
+static void keyboard_thread(void);
 static bool capsLock = false;
+static fifo_t* scancodes = 0; // Filled by the IRQ handler, emptied by the keyboard thread
 
 
 void keyboard_install(void)
 {
+    scancodes = fifo_create(KEYBOARD_SLOTS, sizeof(uint8_t), false);
+    scheduler_insertTask(create_thread(&keyboard_thread));
+
     irq_installHandler(IRQ_KEYBOARD, keyboard_handler); // Installs 'keyboard_handler' to IRQ_KEYBOARD
 
     while (inportb(0x64) & 1) // wait until buffer is empty
@@ -215,8 +224,14 @@ static char keyToASCII(KEY_t key)
 
 static void keyboard_handler(registers_t* r)
 {
-    // Get scancode
+    // Only fetch the scancode. It is translated and distributed by the keyboard thread.
     uint8_t scancode = getScancode();
+    fifo_put(scancodes, &scancode, sizeof(scancode));
+}
+
+static void keyboard_handleScancode(void* data, size_t length, void* context)
+{
+    uint8_t scancode = *(uint8_t*)data;
     bool make = false;
 
     // Find out key. Issue events.
@@ -254,6 +269,15 @@ static void keyboard_handler(registers_t* r)
     }
 }
 
+static void keyboard_thread(void)
+{
+    while (true)
+    {
+        fifo_wait(scancodes);
+        fifo_consume(scancodes, KEYBOARD_SLOTS, &keyboard_handleScancode, 0);
+    }
+}
+
 char getch(void)
 {
     char ret = 0;
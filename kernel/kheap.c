@@ -10,6 +10,7 @@
 #include "paging.h"
 #include "serial.h"
 #include "tasking/task.h"
+#include "ipc.h"
 
 /* The heap provides the malloc/free-functionality, i.e. dynamic allocation of memory.
    It manages a certain amount of continuous virtual memory, starting at "heapStart".
@@ -17,58 +18,159 @@
    For expansion, the heap asks the paging module to map physical memory to the following virtual addresses
    and increases its "heapSize" variable (but at least by "HEAP_MIN_GROWTH") afterwards.
 
-   To manage the free and reserved (allocated) areas of the heap an array of "region" elements is kept.
-   Each region specifies its size and reservation status.
-   Free regions always get merged. Regions don't store their addresses.
-   The third region address is calculated by adding the first and second region size to "heapStart":
-   region_3_addr = heapStart + regions[0].size + regions[1].size
+   The heap is divided into pages. Each page of the heap has an entry in the "pageMap", which tells what the page is used for:
+   - Free pages are combined to free ranges. The first page of a free range holds a node of an AVL tree,
+     which is ordered by the size of the range and its address. The map entries of the first and last page of a free range
+     point to that node, so neighbouring ranges are found and merged in O(1), the best fitting range is found in O(log n).
+   - Requests larger than SLAB_MAXSIZE are served by a "run" of pages taken from a free range. The map entry of its first page
+     points to a small descriptor storing the size of the run and the diagnostic information (comment, number).
+   - Smaller requests are served from slabs. A slab is a run of pages split up into objects of one size class.
+     Each size class keeps a list of its slabs having free objects; each slab keeps a list of its free objects.
+     Allocation and release are O(1). All map entries of a slab point to its management data (slab_t) at the end of the slab.
+     Slab objects of power-of-two size classes are naturally aligned to their size.
 
    Before the heap is set up, memory is allocated on a "placement address".
    This is an identity mapped area of continuous memory,
    the allocation just moves a pointer forward by the requested size and returns its previous value.
 
-   The heap's management data is placed at this placement address, too.
-   Since this area cannot grow, the heap has a maximum amount of region objects ("regionMaxCount").*/
+   The page map is placed at this placement address, too.
 
-// TODO: Ensure the heap will not overflow (above KERNEL_heapEnd, cf. memory.h)
+   Allocations are accounted per comment. Comments are assigned to tags by a hash table of their addresses, comments with the same
+   text share a tag. Each slab stores the tag of each object, runs store it in their descriptor. The statistics are published
+   in the IPC tree (PrettyOS/Memory) and updated whenever that folder is accessed.*/
 
 
+#define SLAB_MAXSIZE  2048 // Larger requests are served by page runs
+#define SLAB_CLASSES  14
+
+// The two lowest bits of a pageMap entry tell what the pointer in it points to
+#define MAP_TAGMASK   3
+#define MAP_SLAB      1 // slab_t of the slab containing the page
+#define MAP_RUN       2 // runDescriptor_t of the run starting at this page
+#define MAP_FREE      3 // freeRange_t of the free range starting or ending at this page
+
+#define HEAP_PAGES ((KERNEL_HEAP_END - KERNEL_HEAP_START + 1) / PAGESIZE)
+
+#define HEAP_TAGS     128 // Number of comments accounted separately. Tag 0 collects all comments that do not fit.
+#define TAG_HASH_SIZE 256
+#define TAG_FREE      0xFF // Tag of free slab objects. Detects objects freed twice.
+
+
+typedef struct freeRange
+{
+    uint32_t          pages;  // Number of pages in this range
+    struct freeRange* left;   // AVL tree ordered by (pages, address)
+    struct freeRange* right;
+    uint32_t          height;
+} freeRange_t;
+
 typedef struct
 {
-    uint32_t size;
-    bool     reserved;
-    char     comment[21];
-    uint32_t number;
-} __attribute__((packed)) region_t;
+    const char* comment;
+    uint32_t    number;
+    uint32_t    pages;
+    uint8_t     tag;
+} runDescriptor_t;
+
+typedef struct
+{
+    const char* comment;
+    uint32_t    bytes;       // Bytes allocated with this comment at the moment
+    uint32_t    peakBytes;
+    uint32_t    objects;
+    uint32_t    allocations; // Number of successful calls to malloc
+} heapTag_t;
+
+#ifdef _MALLOC_FREE_LOG_
+typedef struct
+{
+    const char* comment;
+    uint32_t    number;   // 0 if the object is free
+} objectInfo_t;
+#endif
+
+typedef struct slab
+{
+    struct slab* next;       // Slabs of the same size class having free objects
+    struct slab* prev;
+    void*        freeList;   // Singly linked list of free objects
+    uint8_t*     objects;    // First object (= start of the slab)
+    uint16_t     inUse;
+    uint8_t      sizeClass;
+} __attribute__((aligned(4))) slab_t;
+
+typedef struct
+{
+    uint16_t size;       // Size of the objects
+    uint8_t  pages;      // Size of one slab
+    uint16_t capacity;   // Objects per slab
+    uint32_t emptySlabs; // Slabs without reserved objects, one of them is kept to avoid thrashing
+    slab_t*  partial;    // Slabs with free objects
+} sizeClass_t;
 
 
-static region_t*      regions         = 0;
-static uint32_t       regionCount     = 0;
-static uint32_t       regionMaxCount  = 0;
 static uint8_t* const heapStart       = (void*)KERNEL_HEAP_START;
 static uint32_t       heapSize        = 0;
 static const uint32_t HEAP_MIN_GROWTH = 0x40000;
 
+static uintptr_t*   pageMap  = 0;
+static freeRange_t* freeTree = 0;
+static bool         growing  = false;
+
+static sizeClass_t sizeClasses[SLAB_CLASSES] =
+{
+    {  16, 1}, {  32, 1}, {  48, 1}, {  64, 1}, {  96, 1}, { 128, 1}, { 192, 1},
+    { 256, 1}, { 384, 2}, { 512, 2}, { 768, 4}, {1024, 4}, {1536, 4}, {2048, 4}
+};
+static uint8_t sizeClassIndex[SLAB_MAXSIZE/16 + 1]; // Size class for each size, in steps of 16 bytes
+
 static mutex_t* mutex = 0;
 
+// Statistics
+static heapTag_t   heapTags[HEAP_TAGS] = {{.comment = "(other)"}};
+static uint32_t    tagCount = 1;
+static const char* tagKeys[TAG_HASH_SIZE];  // Comment addresses ...
+static uint8_t     tagIndex[TAG_HASH_SIZE]; // ... and their tags. 0: Empty slot
+static uint32_t    tagKeyCount = 0;
+static uint32_t    bytesInUse = 0, peakBytes = 0, allocations = 0;
+static uint32_t    freePages  = 0, slabPages = 0;
+
 #ifdef _MEMLEAK_FIND_
   static uint32_t counter = 0;
 #endif
 
 
 static void* placementMalloc(uint32_t size, uint32_t alignment);
+static void  heap_installStatistics(void);
 
 
 void heap_install(void)
 {
-    mutex = mutex_create();
+    mutex = mutex_create("heap");
 
-    // This gets us the current placement address
-    regions = placementMalloc(0, 0);
+    for (uint8_t i = 0, cls = 0; i <= SLAB_MAXSIZE/16; i++)
+    {
+        if (i*16 > sizeClasses[cls].size)
+            cls++;
+        sizeClassIndex[i] = cls;
+    }
+    for (uint8_t i = 0; i < SLAB_CLASSES; i++)
+    {
+      #ifdef _MALLOC_FREE_LOG_
+        sizeClasses[i].capacity = (sizeClasses[i].pages*PAGESIZE - sizeof(slab_t)) / (sizeClasses[i].size + sizeof(objectInfo_t) + sizeof(uint8_t));
+      #else
+        sizeClasses[i].capacity = (sizeClasses[i].pages*PAGESIZE - sizeof(slab_t)) / (sizeClasses[i].size + sizeof(uint8_t));
+      #endif
+        sizeClasses[i].emptySlabs = 0;
+        sizeClasses[i].partial = 0;
+    }
+
+    // The page map takes one entry for each page the heap can grow to
+    uintptr_t* map = placementMalloc(HEAP_PAGES*sizeof(uintptr_t), sizeof(uintptr_t));
+    memset(map, 0, HEAP_PAGES*sizeof(uintptr_t));
+    pageMap = map; // From now on, malloc uses the heap
 
-    // We take the rest of the placement area
-    regionCount = 0;
-    regionMaxCount = (PLACEMENT_END - (uintptr_t)regions) / sizeof(region_t);
+    heap_installStatistics();
 }
 
 void* heap_getCurrentEnd(void)
@@ -76,213 +178,713 @@ void* heap_getCurrentEnd(void)
     return (heapStart + heapSize);
 }
 
-static bool heap_grow(uint32_t size, uint8_t* heapEnd)
+static void* placementMalloc(uint32_t size, uint32_t alignment)
+{
+    static void* nextPlacement = (void*)PLACEMENT_BEGIN;
+
+    // Avoid odd addresses
+    size = alignUp(size, 4);
+
+    if ((uintptr_t)nextPlacement+size > PLACEMENT_END)
+        return (0);
+
+    mutex_lock(mutex);
+    // Do simple placement allocation
+    nextPlacement = (void*)alignUp((uintptr_t)nextPlacement, alignment);
+    void* currPlacement = nextPlacement;
+    nextPlacement += size;
+
+    mutex_unlock(mutex);
+    return (currPlacement);
+}
+
+
+/// AVL tree of free ranges
+
+static inline uint32_t rangeHeight(const freeRange_t* node)
+{
+    return (node ? node->height : 0);
+}
+
+static inline bool rangeLess(const freeRange_t* a, const freeRange_t* b)
+{
+    return (a->pages < b->pages || (a->pages == b->pages && a < b));
+}
+
+static inline void rangeUpdate(freeRange_t* node)
 {
-    // We will have to append another region-object to our array if we can't merge with the last region - check whether there would be enough space to insert the region-object
-    if ((regionCount > 0) && regions[regionCount-1].reserved && (regionCount >= regionMaxCount))
+    uint32_t l = rangeHeight(node->left);
+    uint32_t r = rangeHeight(node->right);
+    node->height = 1 + max(l, r);
+}
+
+static freeRange_t* rangeRotateRight(freeRange_t* node)
+{
+    freeRange_t* l = node->left;
+    node->left = l->right;
+    l->right = node;
+    rangeUpdate(node);
+    rangeUpdate(l);
+    return (l);
+}
+
+static freeRange_t* rangeRotateLeft(freeRange_t* node)
+{
+    freeRange_t* r = node->right;
+    node->right = r->left;
+    r->left = node;
+    rangeUpdate(node);
+    rangeUpdate(r);
+    return (r);
+}
+
+static freeRange_t* rangeBalance(freeRange_t* node)
+{
+    rangeUpdate(node);
+    int32_t balance = (int32_t)rangeHeight(node->left) - (int32_t)rangeHeight(node->right);
+
+    if (balance > 1)
     {
-        return (false);
+        if (rangeHeight(node->left->left) < rangeHeight(node->left->right))
+            node->left = rangeRotateLeft(node->left);
+        return (rangeRotateRight(node));
     }
+    if (balance < -1)
+    {
+        if (rangeHeight(node->right->right) < rangeHeight(node->right->left))
+            node->right = rangeRotateRight(node->right);
+        return (rangeRotateLeft(node));
+    }
+    return (node);
+}
 
-    mutex_lock(mutex);
-    // Enhance the memory
-    if (!paging_alloc(kernelPageDirectory, heapEnd, size, MEM_KERNEL|MEM_WRITE))
+static freeRange_t* rangeInsert(freeRange_t* node, freeRange_t* range)
+{
+    if (node == 0)
+        return (range);
+
+    if (rangeLess(range, node))
+        node->left = rangeInsert(node->left, range);
+    else
+        node->right = rangeInsert(node->right, range);
+    return (rangeBalance(node));
+}
+
+static freeRange_t* rangeRemoveMin(freeRange_t* node, freeRange_t** min)
+{
+    if (node->left == 0)
     {
-        mutex_unlock(mutex);
-        return (false);
+        *min = node;
+        return (node->right);
     }
+    node->left = rangeRemoveMin(node->left, min);
+    return (rangeBalance(node));
+}
+
+static freeRange_t* rangeRemove(freeRange_t* node, freeRange_t* range)
+{
+    if (node == 0)
+        return (0);
 
-    // Maybe we can merge with the last region object?
-    if ((regionCount > 0) && !regions[regionCount-1].reserved)
+    if (node == range)
     {
-        regions[regionCount-1].size += size;
+        if (node->right == 0)
+            return (node->left);
+
+        freeRange_t* successor;
+        freeRange_t* right = rangeRemoveMin(node->right, &successor);
+        successor->left  = node->left;
+        successor->right = right;
+        return (rangeBalance(successor));
     }
-    // Otherwise insert a new region object
+
+    if (rangeLess(range, node))
+        node->left = rangeRemove(node->left, range);
     else
+        node->right = rangeRemove(node->right, range);
+    return (rangeBalance(node));
+}
+
+// Returns the smallest free range with at least "pages" pages
+static freeRange_t* rangeFind(uint32_t pages)
+{
+    freeRange_t* best = 0;
+    for (freeRange_t* node = freeTree; node != 0;)
     {
-        regions[regionCount].reserved = false;
-        regions[regionCount].size = size;
-      #ifdef _MALLOC_FREE_LOG_
-        strcpy(regions[regionCount].comment, "free");
-        regions[regionCount].number=0;
-      #endif
+        if (node->pages >= pages)
+        {
+            best = node;
+            node = node->left;
+        }
+        else
+            node = node->right;
+    }
+    return (best);
+}
+
+
+/// Page ranges
+
+static inline uint32_t pageIndex(const void* addr)
+{
+    return (((uintptr_t)addr - (uintptr_t)heapStart) / PAGESIZE);
+}
+
+static void insertRange(uint8_t* addr, uint32_t pages)
+{
+    freeRange_t* range = (freeRange_t*)addr;
+    range->pages  = pages;
+    range->left   = 0;
+    range->right  = 0;
+    range->height = 1;
+
+    uint32_t first = pageIndex(addr);
+    pageMap[first] = (uintptr_t)range | MAP_FREE;
+    pageMap[first + pages - 1] = (uintptr_t)range | MAP_FREE;
+
+    freeTree = rangeInsert(freeTree, range);
+    freePages += pages;
+}
 
-        ++regionCount;
+static void removeRange(freeRange_t* range)
+{
+    freeTree = rangeRemove(freeTree, range);
+    freePages -= range->pages;
+
+    uint32_t first = pageIndex(range);
+    pageMap[first] = 0;
+    pageMap[first + range->pages - 1] = 0;
+}
+
+// Gives pages back to the free ranges, merges with neighbouring free ranges
+static void releasePages(uint8_t* addr, uint32_t pages)
+{
+    uint32_t first = pageIndex(addr);
+
+    if (first + pages < heapSize/PAGESIZE && (pageMap[first + pages] & MAP_TAGMASK) == MAP_FREE)
+    {
+        freeRange_t* next = (freeRange_t*)(pageMap[first + pages] & ~MAP_TAGMASK);
+        removeRange(next);
+        pages += next->pages;
+    }
+    if (first > 0 && (pageMap[first - 1] & MAP_TAGMASK) == MAP_FREE)
+    {
+        freeRange_t* prev = (freeRange_t*)(pageMap[first - 1] & ~MAP_TAGMASK);
+        removeRange(prev);
+        pages += prev->pages;
+        addr = (uint8_t*)prev;
     }
 
-    heapSize += size;
-    mutex_unlock(mutex);
+    insertRange(addr, pages);
+}
+
+static bool heap_grow(uint32_t pages)
+{
+    uint8_t* heapEnd = heapStart + heapSize;
+    uint32_t sizeToGrow = max(HEAP_MIN_GROWTH, alignUp(pages*PAGESIZE*3/2, PAGESIZE));
+
+    // Ensure the heap will not overflow (above KERNEL_HEAP_END, cf. memory.h)
+    if (sizeToGrow - 1 > KERNEL_HEAP_END - (uintptr_t)heapEnd)
+    {
+        sizeToGrow = pages*PAGESIZE;
+        if (sizeToGrow - 1 > KERNEL_HEAP_END - (uintptr_t)heapEnd)
+            return (false);
+    }
+
+    // Large growth ends at a 4 MiB border, so paging can map it by 4 MiB pages
+    if (sizeToGrow >= LARGE_PAGESIZE && alignUp((uintptr_t)heapEnd + sizeToGrow, LARGE_PAGESIZE) - 1 <= KERNEL_HEAP_END)
+    {
+        sizeToGrow = alignUp((uintptr_t)heapEnd + sizeToGrow, LARGE_PAGESIZE) - (uintptr_t)heapEnd;
+    }
+
+    // Enhance the memory. Page tables for the heap are allocated by paging_install, but do not recurse if that is not sufficient.
+    if (growing)
+        return (false);
+    growing = true;
+    bool success = paging_alloc(kernelPageDirectory, heapEnd, sizeToGrow, MEM_KERNEL|MEM_WRITE);
+    growing = false;
+    if (!success)
+        return (false);
+
+    heapSize += sizeToGrow;
+    releasePages(heapEnd, sizeToGrow/PAGESIZE);
+
+  #ifdef _MALLOC_FREE_LOG_
+    textColor(YELLOW);
+    task_switching = false;
+    printf("\nheap expanded: %Xh heap end: %Xh", sizeToGrow, (uintptr_t)heapStart + heapSize);
+    task_switching = true;
+    textColor(TEXT);
+  #endif
+
     return (true);
 }
 
-static void* placementMalloc(uint32_t size, uint32_t alignment)
+// Takes a run of pages out of the free ranges, expands the heap if necessary
+static uint8_t* takePages(uint32_t pages, uint32_t alignment)
 {
-    static void* nextPlacement = (void*)PLACEMENT_BEGIN;
+    alignment = max(alignment, PAGESIZE);
 
-    // Avoid odd addresses
-    size = alignUp(size, 4);
+    freeRange_t* range;
+    while (true)
+    {
+        range = rangeFind(pages);
+        if (range && alignUp((uintptr_t)range, alignment) != (uintptr_t)range)
+            range = rangeFind(pages + alignment/PAGESIZE - 1); // This one fits in every case
 
-    if ((uintptr_t)nextPlacement+size > PLACEMENT_END)
+        if (range)
+            break;
+
+        if (!heap_grow(pages + alignment/PAGESIZE - 1))
+            return (0);
+    }
+
+    removeRange(range);
+
+    uint8_t* addr       = (uint8_t*)range;
+    uint32_t rangePages = range->pages;
+    uint32_t front      = (alignUp((uintptr_t)addr, alignment) - (uintptr_t)addr)/PAGESIZE;
+
+    // Return the part before the aligned address and the leftover to the free ranges
+    if (front)
+        insertRange(addr, front);
+    if (rangePages - front > pages)
+        insertRange(addr + (front+pages)*PAGESIZE, rangePages - front - pages);
+
+    return (addr + front*PAGESIZE);
+}
+
+
+/// Slabs
+
+// Tags of the objects of a slab. They are stored behind the objects (and their diagnostic information).
+static inline uint8_t* slab_tag(const slab_t* slab, const void* object)
+{
+    const sizeClass_t* sc = sizeClasses + slab->sizeClass;
+  #ifdef _MALLOC_FREE_LOG_
+    uint8_t* tags = slab->objects + sc->capacity*(sc->size + sizeof(objectInfo_t));
+  #else
+    uint8_t* tags = slab->objects + sc->capacity*sc->size;
+  #endif
+    return (tags + ((uint8_t*)object - slab->objects)/sc->size);
+}
+
+static slab_t* slab_create(uint8_t cls)
+{
+    sizeClass_t* sc = sizeClasses + cls;
+
+    uint8_t* mem = takePages(sc->pages, PAGESIZE);
+    if (mem == 0)
         return (0);
 
-    mutex_lock(mutex);
-    // Do simple placement allocation
-    nextPlacement = (void*)alignUp((uintptr_t)nextPlacement, alignment);
-    void* currPlacement = nextPlacement;
-    nextPlacement += size;
+    slab_t* slab    = (slab_t*)(mem + sc->pages*PAGESIZE - sizeof(slab_t));
+    slab->objects   = mem;
+    slab->inUse     = 0;
+    slab->sizeClass = cls;
 
-    mutex_unlock(mutex);
-    return (currPlacement);
+    // Chain all objects to the list of free objects
+    slab->freeList = 0;
+    for (uint16_t i = sc->capacity; i > 0; i--)
+    {
+        void** object = (void**)(mem + (i-1)*sc->size);
+        *object = slab->freeList;
+        slab->freeList = object;
+    }
+
+    for (uint32_t i = 0; i < sc->pages; i++)
+        pageMap[pageIndex(mem) + i] = (uintptr_t)slab | MAP_SLAB;
+    slabPages += sc->pages;
+
+  #ifdef _MALLOC_FREE_LOG_
+    memset(mem + sc->capacity*sc->size, 0, sc->capacity*sizeof(objectInfo_t));
+  #endif
+    memset(slab_tag(slab, mem), TAG_FREE, sc->capacity);
+
+    slab->prev = 0;
+    slab->next = sc->partial;
+    if (sc->partial)
+        sc->partial->prev = slab;
+    sc->partial = slab;
+    sc->emptySlabs++;
+
+    return (slab);
 }
 
-void* malloc(uint32_t size, uint32_t alignment, char* comment)
+static void slab_unlink(slab_t* slab)
 {
-    // consecutive number for detecting the sequence of mallocs at the heap
-    static uint32_t consecutiveNumber = 0;
+    sizeClass_t* sc = sizeClasses + slab->sizeClass;
 
-    // If the heap is not set up, do placement malloc
-    if (regions == 0)
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        sc->partial = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static void slab_destroy(slab_t* slab)
+{
+    sizeClass_t* sc = sizeClasses + slab->sizeClass;
+
+    slab_unlink(slab);
+    sc->emptySlabs--;
+
+    for (uint32_t i = 0; i < sc->pages; i++)
+        pageMap[pageIndex(slab->objects) + i] = 0;
+    slabPages -= sc->pages;
+
+    releasePages(slab->objects, sc->pages);
+}
+
+#ifdef _MALLOC_FREE_LOG_
+static objectInfo_t* slab_objectInfo(const slab_t* slab, const void* object)
+{
+    const sizeClass_t* sc = sizeClasses + slab->sizeClass;
+    objectInfo_t* info = (objectInfo_t*)(slab->objects + sc->capacity*sc->size);
+    return (info + ((uint8_t*)object - slab->objects)/sc->size);
+}
+
+static void slab_setInfo(void* object, const char* comment, uint32_t number)
+{
+    objectInfo_t* info = slab_objectInfo((slab_t*)(pageMap[pageIndex(object)] & ~MAP_TAGMASK), object);
+    info->comment = comment;
+    info->number  = number;
+}
+#endif
+
+static void* slab_alloc(uint8_t cls)
+{
+    sizeClass_t* sc = sizeClasses + cls;
+
+    slab_t* slab = sc->partial;
+    if (slab == 0)
     {
-        return (placementMalloc(size, alignment));
+        slab = slab_create(cls);
+        if (slab == 0)
+            return (0);
     }
 
-    // Avoid odd addresses
-    size = alignUp(size, 4);
+    void** object = slab->freeList;
+    slab->freeList = *object;
+    *slab_tag(slab, object) = 0; // Set by malloc
 
-    mutex_lock(mutex);
-    // Walk the regions and find one being suitable
-    uint8_t* regionAddress = heapStart;
-    for (uint32_t i=0; i<regionCount; i++)
+    if (slab->inUse == 0)
+        sc->emptySlabs--;
+    slab->inUse++;
+
+    if (slab->freeList == 0) // Slab is full now
+        slab_unlink(slab);
+
+    return (object);
+}
+
+static bool slab_free(slab_t* slab, void* object)
+{
+    sizeClass_t* sc = sizeClasses + slab->sizeClass;
+
+    // Check whether the address points to the beginning of an object
+    uint32_t offset = (uint8_t*)object - slab->objects;
+    if (offset % sc->size != 0 || offset/sc->size >= sc->capacity)
+        return (false);
+
+    uint8_t* tag = slab_tag(slab, object);
+    if (*tag == TAG_FREE) // Freed before
+        return (false);
+    *tag = TAG_FREE;
+
+    if (slab->freeList == 0) // Slab was full, it has free objects again
+    {
+        slab->prev = 0;
+        slab->next = sc->partial;
+        if (sc->partial)
+            sc->partial->prev = slab;
+        sc->partial = slab;
+    }
+
+    *(void**)object = slab->freeList;
+    slab->freeList = object;
+    slab->inUse--;
+
+    if (slab->inUse == 0)
+    {
+        sc->emptySlabs++;
+        if (sc->emptySlabs > 1) // Keep one empty slab per size class
+            slab_destroy(slab);
+    }
+
+    return (true);
+}
+
+static inline uint8_t sizeClassOf(uint32_t size, uint32_t alignment)
+{
+    if (alignment > 16) // Take the power-of-two class with a size that is a multiple of the alignment
+    {
+        size = max(size, alignment);
+        uint32_t bit;
+        __asm__("bsrl %1, %0" : "=r"(bit) : "r"(size - 1));
+        size = BIT(bit + 1);
+    }
+    return (sizeClassIndex[(size + 15)/16]);
+}
+
+
+/// Statistics
+
+// Returns the tag of a comment, creates it if necessary
+static uint8_t heap_tagOf(const char* comment)
+{
+    uint32_t h = ((uintptr_t)comment * 2654435761u) >> 24; // Knuth's multiplicative hash, 8 bits
+    while (tagIndex[h])
     {
-        // Calculate aligned address and the additional size needed due to alignment
-        uint8_t* alignedAddress = (uint8_t*)alignUp((uintptr_t)regionAddress, alignment);
-        uintptr_t additionalSize = (uintptr_t)alignedAddress - (uintptr_t)regionAddress;
+        if (tagKeys[h] == comment)
+            return (tagIndex[h]);
+        h = (h + 1) % TAG_HASH_SIZE;
+    }
+
+    // New comment address. Keep enough slots free to bound the search.
+    if (tagKeyCount >= TAG_HASH_SIZE*3/4)
+        return (0);
 
-        // Check whether this region is free and big enough
-        if (!regions[i].reserved && (regions[i].size >= size + additionalSize))
+    uint8_t tag = 0;
+    for (uint32_t i = 1; i < tagCount; i++)
+    {
+        if (heapTags[i].comment == comment || (comment && heapTags[i].comment && strcmp(heapTags[i].comment, comment) == 0))
         {
-            // We will split up this region ...
-            // +--------------------------------------------------------+
-            // |                      Current Region                    |
-            // +--------------------------------------------------------+
-            //
-            // ... into three, the first and third remain free,
-            // while the second gets reserved, and its address is returned
-            //
-            // +------------------+--------------------------+----------+
-            // | Before Alignment | Aligned Destination Area | Leftover |
-            // +------------------+--------------------------+----------+
-
-            // Split the pre-alignment area
-            if (alignedAddress != regionAddress)
-            {
-                // Check whether we are able to expand
-                if (regionCount >= regionMaxCount)
-                {
-                    mutex_unlock(mutex);
-                    return (0);
-                }
+            tag = i;
+            break;
+        }
+    }
+    if (tag == 0 && tagCount < HEAP_TAGS)
+    {
+        tag = tagCount++;
+        heapTags[tag].comment = comment;
+    }
+    if (tag == 0)
+        return (0);
 
-                // Move all following regions ahead to get room for a new one
-                memmove(regions + i+1, regions + i, (regionCount-i) * sizeof(region_t));
+    tagKeys[h]  = comment;
+    tagIndex[h] = tag;
+    tagKeyCount++;
+    return (tag);
+}
 
-                ++regionCount;
+static inline void heap_accountAlloc(uint8_t tag, uint32_t bytes)
+{
+    heapTag_t* t = heapTags + tag;
+    t->bytes += bytes;
+    t->objects++;
+    t->allocations++;
+    if (t->bytes > t->peakBytes)
+        t->peakBytes = t->bytes;
+
+    bytesInUse += bytes;
+    allocations++;
+    if (bytesInUse > peakBytes)
+        peakBytes = bytesInUse;
+}
 
-                // Setup the regions
-                regions[i].size     = alignedAddress - regionAddress;
-                regions[i].reserved = false;
+static inline void heap_accountFree(uint8_t tag, uint32_t bytes)
+{
+    heapTags[tag].bytes -= bytes;
+    heapTags[tag].objects--;
+    bytesInUse -= bytes;
+}
 
-              #ifdef _MALLOC_FREE_LOG_
-                strcpy(regions[i].comment, "free");
-              #endif
+enum
+{
+    STAT_SIZE, STAT_USED, STAT_PEAK, STAT_SLABS, STAT_FREE, STAT_LARGESTFREE, STAT_FRAGMENTATION, STAT_ALLOCATIONS,
+    STAT_FRAMES, STAT_FREEFRAMES, STAT_FREEDMAFRAMES, STAT_PAGETABLES, STAT_CACHEDPAGETABLES,
+    STAT_COUNT
+};
 
-                regions[i+1].size  -= regions[i].size;
+static const char* const statPaths[STAT_COUNT] =
+{
+    "PrettyOS/Memory/Heap/Size (Bytes)",
+    "PrettyOS/Memory/Heap/Used (Bytes)",
+    "PrettyOS/Memory/Heap/Peak (Bytes)",
+    "PrettyOS/Memory/Heap/Slabs (Bytes)",
+    "PrettyOS/Memory/Heap/Free (Bytes)",
+    "PrettyOS/Memory/Heap/Largest free range (Bytes)",
+    "PrettyOS/Memory/Heap/Fragmentation (%)",
+    "PrettyOS/Memory/Heap/Allocations",
+    "PrettyOS/Memory/Physical/Frames",
+    "PrettyOS/Memory/Physical/Free frames",
+    "PrettyOS/Memory/Physical/Free DMA frames",
+    "PrettyOS/Memory/Paging/Page tables",
+    "PrettyOS/Memory/Paging/Cached page tables"
+};
+
+enum {TAGSTAT_BYTES, TAGSTAT_PEAK, TAGSTAT_OBJECTS, TAGSTAT_ALLOCATIONS, TAGSTAT_COUNT};
+static const char* const tagStatNames[TAGSTAT_COUNT] = {"Bytes", "Peak (Bytes)", "Objects", "Allocations"};
+
+static int64_t* statValues[STAT_COUNT];
+static int64_t* tagValues[HEAP_TAGS][TAGSTAT_COUNT];
+
+// Creates a read-only IPC node owned by the kernel
+static int64_t* heap_createStatNode(const char* path)
+{
+    ipc_node_t* node;
+    if (ipc_createNode(path, &node, IPC_INTEGER) != IPC_SUCCESSFUL)
+        return (0);
+    node->owner        = 0;
+    node->data.integer = 0;
+    return (&node->data.integer);
+}
 
-                // "Aligned Destination Area" becomes the "current" region
-                regionAddress += regions[i].size;
-                i++;
+// Updates the statistics in the IPC tree. Called by ipc.c before the folder is accessed.
+static void heap_refreshStatistics(ipc_node_t* node)
+{
+    pagingStatistics_t pstats;
+    paging_getStatistics(&pstats);
+
+    mutex_lock(mutex);
+
+    uint32_t largest = 0;
+    for (const freeRange_t* range = freeTree; range; range = range->right)
+        largest = range->pages;
+
+    uint32_t values[STAT_COUNT] =
+    {
+        heapSize, bytesInUse, peakBytes, slabPages*PAGESIZE, freePages*PAGESIZE, largest*PAGESIZE,
+        freePages ? 100 - largest*100/freePages : 0, allocations,
+        pstats.totalFrames, pstats.freeFrames, pstats.freeDMAFrames, pstats.pageTables, pstats.cachedPageTables
+    };
+    for (uint32_t i = 0; i < STAT_COUNT; i++)
+    {
+        if (statValues[i])
+            *statValues[i] = values[i];
+    }
+
+    // The mutex can be locked recursively, so creating nodes (malloc) is possible while the counters do not change
+    for (uint32_t i = 0; i < tagCount; i++)
+    {
+        if (tagValues[i][0] == 0)
+        {
+            // Comments are used as node names, so they must not contain path separators
+            char name[64];
+            strncpy(name, heapTags[i].comment ? heapTags[i].comment : "(none)", sizeof(name)-1);
+            name[sizeof(name)-1] = 0;
+            for (char* c = name; *c; c++)
+            {
+                if (*c == '/' || *c == '|' || *c == '\\')
+                    *c = '_';
             }
 
-            // Split the leftover
-            if (regions[i].size > size + additionalSize)
+            char path[128];
+            for (uint32_t j = 0; j < TAGSTAT_COUNT; j++)
             {
-                // Check whether we are able to expand
-                if (regionCount+1 > regionMaxCount)
-                {
-                    mutex_unlock(mutex);
-                    return (0);
-                }
+                snprintf(path, sizeof(path), "PrettyOS/Memory/Heap/Tags/%s/%s", name, tagStatNames[j]);
+                tagValues[i][j] = heap_createStatNode(path);
+            }
+        }
+
+        uint32_t tagStats[TAGSTAT_COUNT] = {heapTags[i].bytes, heapTags[i].peakBytes, heapTags[i].objects, heapTags[i].allocations};
+        for (uint32_t j = 0; j < TAGSTAT_COUNT; j++)
+        {
+            if (tagValues[i][j])
+                *tagValues[i][j] = tagStats[j];
+        }
+    }
 
-                // Move all following regions ahead to get room for a new one
-                memmove(regions + i+2, regions + i+1, (regionCount-i-1)*sizeof(region_t));
+    mutex_unlock(mutex);
+}
 
-                ++regionCount;
+static void heap_installStatistics(void)
+{
+    ipc_node_t* folder;
+    if (ipc_createNode("PrettyOS/Memory", &folder, IPC_FOLDER) != IPC_SUCCESSFUL)
+        return;
 
-                // Setup the regions
-                regions[i+1].size     = regions[i].size - size;
-                regions[i+1].reserved = false;
-              #ifdef _MALLOC_FREE_LOG_
-                strcpy(regions[i+1].comment, "free");
-                regions[i+1].number=0;
-              #endif
+    for (uint32_t i = 0; i < STAT_COUNT; i++)
+        statValues[i] = heap_createStatNode(statPaths[i]);
 
-                regions[i].size       = size;
-            }
+    folder->owner   = 0;
+    folder->refresh = &heap_refreshStatistics;
+}
 
-            // Set the region to "reserved" and return its address
-            regions[i].reserved = true;
-            strncpy(regions[i].comment, comment, 20);
-            regions[i].comment[20] = 0;
-            regions[i].number = ++consecutiveNumber;
 
-            kdebug(3, "%Xh ", regionAddress);
+/// Public interface
 
-          #ifdef _MEMLEAK_FIND_
-            counter++;
-            writeInfo(2, "Malloc - free: %u", counter);
-          #endif
-          #ifdef _MALLOC_FREE_LOG_
-            textColor(YELLOW);
-            task_switching = false;
-            printf("\nmalloc: %Xh %s", regionAddress, comment);
-            task_switching = true;
-            textColor(TEXT);
-          #endif
+void* malloc(uint32_t size, uint32_t alignment, char* comment)
+{
+    // consecutive number for detecting the sequence of mallocs at the heap
+    static uint32_t consecutiveNumber = 0;
 
-            mutex_unlock(mutex);
-            return (regionAddress);
+    // If the heap is not set up, do placement malloc
+    if (pageMap == 0)
+    {
+        return (placementMalloc(size, alignment));
+    }
 
-        } //region is free and big enough
+    // Avoid odd addresses
+    size = alignUp(size, 4);
+
+    mutex_lock(mutex);
 
-        regionAddress += regions[i].size;
+    void* address;
+    if (size <= SLAB_MAXSIZE && alignment <= SLAB_MAXSIZE)
+    {
+        uint8_t cls = sizeClassOf(size, alignment);
+        address = slab_alloc(cls);
+
+        if (address)
+        {
+            uint8_t tag = heap_tagOf(comment);
+            *slab_tag((slab_t*)(pageMap[pageIndex(address)] & ~MAP_TAGMASK), address) = tag;
+            heap_accountAlloc(tag, sizeClasses[cls].size);
+        }
+
+      #ifdef _MALLOC_FREE_LOG_
+        if (address)
+            slab_setInfo(address, comment, ++consecutiveNumber);
+      #endif
     }
+    else
+    {
+        runDescriptor_t* run = slab_alloc(sizeClassOf(sizeof(runDescriptor_t), 0));
+        address = run ? takePages(alignUp(size, PAGESIZE)/PAGESIZE, alignment) : 0;
 
-    // There is nothing free, try to expand the heap
-    uint32_t sizeToGrow = max(HEAP_MIN_GROWTH, alignUp(size*3/2,PAGESIZE));
-    bool success = heap_grow(sizeToGrow, (uint8_t*)((uintptr_t)heapStart + heapSize));
+        if (address)
+        {
+            run->comment = comment;
+            run->number  = ++consecutiveNumber;
+            run->pages   = alignUp(size, PAGESIZE)/PAGESIZE;
+            run->tag     = heap_tagOf(comment);
+            pageMap[pageIndex(address)] = (uintptr_t)run | MAP_RUN;
+            heap_accountAlloc(run->tag, run->pages*PAGESIZE);
+          #ifdef _MALLOC_FREE_LOG_
+            slab_setInfo(run, "heap-run", consecutiveNumber);
+          #endif
+        }
+        else if (run)
+        {
+            slab_free((slab_t*)(pageMap[pageIndex(run)] & ~MAP_TAGMASK), run);
+        }
+    }
 
     mutex_unlock(mutex);
 
-    if (!success)
+    if (address == 0)
     {
         textColor(RED);
         printf("\nmalloc failed, heap could not be expanded!");
         textColor(TEXT);
         return (0);
     }
-    else
-    {
-      #ifdef _MALLOC_FREE_LOG_
-        textColor(YELLOW);
-        task_switching = false;
-        printf("\nheap expanded: %Xh heap end: %Xh", sizeToGrow, (uintptr_t)heapStart + heapSize);
-        task_switching = true;
-        textColor(TEXT);
-      #endif
-    }
 
-    // Now there should be a region that is large enough
-    void* address = malloc(size, alignment, comment);
+    kdebug(3, "%Xh ", address);
+
+  #ifdef _MEMLEAK_FIND_
+    counter++;
+    writeInfo(2, "Malloc - free: %u", counter);
+  #endif
+  #ifdef _MALLOC_FREE_LOG_
+    textColor(YELLOW);
+    task_switching = false;
+    printf("\nmalloc: %Xh %s", address, comment);
+    task_switching = true;
+    textColor(TEXT);
+  #endif
 
     return (address);
 }
@@ -314,56 +916,75 @@ void free(void* addr)
 
     mutex_lock(mutex);
 
-    // Walk the regions and find the correct one
-    uint8_t* regionAddress = heapStart;
-    for (uint32_t i=0; i<regionCount; i++)
+    bool valid = false;
+    if ((uint8_t*)addr >= heapStart && (uint8_t*)addr < heapStart + heapSize)
     {
-        if (regionAddress == addr)
-        {
-          #ifdef _MALLOC_FREE_LOG_
-            textColor(LIGHT_GRAY);
-            task_switching = false;
-            printf(" %s", regions[i].comment);
-            task_switching = true;
-            textColor(TEXT);
-            strcpy(regions[i].comment, "free");
-            regions[i].number = 0;
-          #endif
-            regions[i].reserved = false; // free the region
+        uintptr_t entry = pageMap[pageIndex(addr)];
+        void* data = (void*)(entry & ~MAP_TAGMASK);
 
-            // Check for a merge with the next region
-            if ((i+1 < regionCount) && !regions[i+1].reserved)
+        switch (entry & MAP_TAGMASK)
+        {
+            case MAP_SLAB:
             {
-                // Adjust the size of the now free region
-                regions[i].size += regions[i+1].size; // merge
+              #ifdef _MALLOC_FREE_LOG_
+                objectInfo_t* info = slab_objectInfo(data, addr);
+                if (info->number == 0)
+                    break; // Object is not reserved
+              #endif
 
-                // Move all following regions back by one
-                memmove(regions + i+1, regions + i+2, (regionCount-1-i)*sizeof(region_t));
+                uint8_t tag = *slab_tag(data, addr);
+                valid = slab_free(data, addr);
+                if (valid)
+                    heap_accountFree(tag, sizeClasses[((slab_t*)data)->sizeClass].size);
 
-                --regionCount;
+              #ifdef _MALLOC_FREE_LOG_
+                if (valid)
+                {
+                    textColor(LIGHT_GRAY);
+                    task_switching = false;
+                    printf(" %s", info->comment);
+                    task_switching = true;
+                    textColor(TEXT);
+                    info->number = 0;
+                }
+              #endif
+                break;
             }
-
-            // Check for a merge with the previous region
-            if (i>0 && !regions[i-1].reserved)
+            case MAP_RUN:
             {
-                // Adjust the size of the previous region
-                regions[i-1].size += regions[i].size; // merge
+                if (alignDown((uintptr_t)addr, PAGESIZE) != (uintptr_t)addr)
+                    break;
 
-                // Move all following regions back by one
-                memmove(regions + i, regions + i+1, (regionCount-i)*sizeof(region_t));
+                runDescriptor_t* run = data;
 
-                --regionCount;
-            }
+              #ifdef _MALLOC_FREE_LOG_
+                textColor(LIGHT_GRAY);
+                task_switching = false;
+                printf(" %s", run->comment);
+                task_switching = true;
+                textColor(TEXT);
+              #endif
 
-            mutex_unlock(mutex);
-            return;
+              #ifdef _MALLOC_FREE_LOG_
+                slab_setInfo(run, 0, 0);
+              #endif
+                heap_accountFree(run->tag, run->pages*PAGESIZE);
+                pageMap[pageIndex(addr)] = 0;
+                releasePages(addr, run->pages);
+                slab_free((slab_t*)(pageMap[pageIndex(run)] & ~MAP_TAGMASK), run);
+                valid = true;
+                break;
+            }
+            default:
+                break;
         }
-
-        regionAddress += regions[i].size;
     }
 
     mutex_unlock(mutex);
 
+    if (valid)
+        return;
+
     textColor(ERROR);
   #ifdef _BROKENFREE_DIAGNOSIS_
     printf("\nBroken free (file: %s, line: %u, addr: %Xh)", file, line, addr);
@@ -376,23 +997,57 @@ void free(void* addr)
 void heap_logRegions(void)
 {
     printf("\nDebug: Heap regions sent to serial output.\n");
-    serial_log(SER_LOG_HEAP,"\r\n\r\nregionMaxCount: %u\r\n", regionMaxCount);
+    serial_log(SER_LOG_HEAP,"\r\n\r\nheap size: %Xh\r\n", heapSize);
     serial_log(SER_LOG_HEAP,"\r\n\r\n---------------- HEAP REGIONS ----------------\r\n");
     serial_log(SER_LOG_HEAP,"address\t\tsize\t\tnumber\tcomment");
 
-    uintptr_t regionAddress = (uintptr_t)heapStart;
+    mutex_lock(mutex);
 
-    for (uint32_t i=0; i<regionCount; i++)
+    for (uint32_t i = 0; i < heapSize/PAGESIZE;)
     {
-        if (regions[i].reserved)
+        uintptr_t regionAddress = (uintptr_t)heapStart + i*PAGESIZE;
+        void* data = (void*)(pageMap[i] & ~MAP_TAGMASK);
+
+        switch (pageMap[i] & MAP_TAGMASK)
         {
-            serial_log(SER_LOG_HEAP,"\r\n%Xh\t%Xh\t%u\t%s", regionAddress, regions[i].size, regions[i].number, regions[i].comment);
+            case MAP_RUN:
+            {
+                runDescriptor_t* run = data;
+                serial_log(SER_LOG_HEAP,"\r\n%Xh\t%Xh\t%u\t%s", regionAddress, run->pages*PAGESIZE, run->number, run->comment);
+                i += run->pages;
+                break;
+            }
+            case MAP_SLAB:
+            {
+                slab_t* slab = data;
+                sizeClass_t* sc = sizeClasses + slab->sizeClass;
+                serial_log(SER_LOG_HEAP,"\r\n%Xh\t%Xh\t-\tslab: %u of %u objects (%u bytes)", regionAddress, sc->pages*PAGESIZE, slab->inUse, sc->capacity, sc->size);
+              #ifdef _MALLOC_FREE_LOG_
+                for (uint16_t j = 0; j < sc->capacity; j++)
+                {
+                    objectInfo_t* info = slab_objectInfo(slab, slab->objects + j*sc->size);
+                    if (info->number)
+                        serial_log(SER_LOG_HEAP,"\r\n  %Xh\t%Xh\t%u\t%s", slab->objects + j*sc->size, sc->size, info->number, info->comment);
+                }
+              #endif
+                i += sc->pages;
+                break;
+            }
+            case MAP_FREE:
+                i += ((freeRange_t*)data)->pages;
+                break;
+            default:
+                i++;
+                break;
         }
-        regionAddress += regions[i].size;
     }
+
+    mutex_unlock(mutex);
+
     serial_log(SER_LOG_HEAP,"\r\n---------------- HEAP REGIONS ----------------\r\n\r\n");
 }
 
+
 /*
 * Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
 *
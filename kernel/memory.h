@@ -11,12 +11,19 @@
 
 // Kernel is located at 0x100000 // 1 MiB  // cf. kernel.ld
 
-#define IDMAP   3              // 0 MiB - 12 MiB (4 KiB * 1024 * 3), identity mapping
+// Startup code of the application processors (cf. smp.c). Has to be equal to TRAMPOLINE_BASE in smp.asm.
+#define TRAMPOLINE_BASE   0x7000     // 28 KiB, one page below 1 MiB as required by the startup IPI
 
-// Placement allocation
+#define IDMAP   (DMA_ZONE_END/0x400000) // 0 MiB - 16 MiB (4 MiB per page table), identity mapping of the DMA zone
+
+// Placement allocation. Frames above it are managed by the buddy allocator (DMA zone up to DMA_ZONE_END, normal zone above).
 #define PLACEMENT_BEGIN   0x600000   // 6 MiB
 #define PLACEMENT_END     0xC00000   // 12 MiB
 
+// Physical memory below this address is identity mapped and only used for allocations that need it (ISA DMA, devices with 24 bit addresses)
+#define DMA_ZONE_END      0x1000000  // 16 MiB
+#define DMA_ZONE_RESERVE  0x100000   //  1 MiB of the DMA zone can only be taken by allocations that need it
+
 // memory location for MMIO of devices (networking card, EHCI, grafics card, ...)
 #define PCI_MEM_START     0xC0000000 // 3 GiB
 #define PCI_MEM_END       0xE0000000 // 3,5 GiB
@@ -42,7 +49,11 @@
 
 // User Heap management
 #define USER_HEAP_START ((uint8_t*)(USER_DATA_BUFFER  + 0x10000))   // 21 MiB plus 64 KiB
-#define USER_HEAP_END   ((uint8_t*)(KERNEL_HEAP_START - 0x1000000)) //  3 GiB minus 16 MiB
+#define USER_HEAP_END   ((uint8_t*)(PCI_MEM_START - 0x1000000))     //  3 GiB minus 16 MiB
+
+// Memory shared between user program and kernel (io rings, cf. ioring.c). Part of the user page tables of each program.
+#define USER_SHARED_START USER_HEAP_END             //  3 GiB minus 16 MiB
+#define USER_SHARED_END   ((uint8_t*)PCI_MEM_START) //  3 GiB
 
 
 #endif
@@ -15,6 +15,10 @@
 #include "video/video.h"
 #include "tasking/task.h"
 #include "events.h"
+#include "util/fifo.h"
+
+
+#define MOUSE_SLOTS 64 // Bytes that can wait for the mouse thread
 
 
 enum {NORMAL, WHEEL, WHEELS5BUTTON} mousetype = NORMAL;
@@ -30,6 +34,9 @@ static void mouse_wait(uint8_t type);
 static void mouse_write(uint8_t data);
 static uint8_t mouse_read();
 static void mouse_handler(registers_t* a_r);
+static void mouse_thread(void);
+
+static fifo_t* mouseBytes = 0; // Filled by the IRQ handler, emptied by the mouse thread
 
 
 void mouse_install(void)
@@ -72,7 +79,9 @@ void mouse_install(void)
         }
     }
 
-    // Setup the mouse handler
+    // Setup the mouse handler. Packets are decoded by the mouse thread.
+    mouseBytes = fifo_create(MOUSE_SLOTS, sizeof(uint8_t), false);
+    scheduler_insertTask(create_thread(&mouse_thread));
     irq_installHandler(IRQ_MOUSE, mouse_handler);
 
     // Enable the mouse
@@ -133,11 +142,17 @@ static void mouse_moveEvent(int8_t x, int8_t y)
 }
 
 static void mouse_handler(registers_t* r)
+{
+    uint8_t byte = inportb(0x60); // Receive byte
+    fifo_put(mouseBytes, &byte, sizeof(byte));
+}
+
+static void mouse_handleByte(void* data, size_t length, void* context)
 {
     static uint8_t bytecounter = 0;
     static uint8_t bytes[4];
 
-    bytes[bytecounter] = inportb(0x60); // Receive byte
+    bytes[bytecounter] = *(uint8_t*)data;
     switch (bytecounter)
     {
         case 0: // First byte: Left Button | Right Button | Middle Button | 1 | X sign | Y sign | X overflow | Y overflow
@@ -241,6 +256,15 @@ static void mouse_handler(registers_t* r)
     }
 }
 
+static void mouse_thread(void)
+{
+    while (true)
+    {
+        fifo_wait(mouseBytes);
+        fifo_consume(mouseBytes, MOUSE_SLOTS, &mouse_handleByte, 0);
+    }
+}
+
 static void mouse_wait(uint8_t type) // Data: 0, Signal: 1
 {
     unsigned int time_out = 100000;
@@ -15,12 +15,18 @@
 
 void arp_deleteTableEntry(arpTable_t* cache, arpTableEntry_t* entry)
 {
+    rwlock_writeLock(&cache->lock);
     list_delete(cache->table, list_find(cache->table, entry));
+    rwlock_writeUnlock(&cache->lock);
 }
 
 static void arp_checkTable(arpTable_t* cache)
 {
-    if (timer_getSeconds() > (cache->lastCheck + ARP_TABLE_TIME_TO_CHECK * 60)) // Check only every ... minutes
+    if (timer_getSeconds() <= (cache->lastCheck + ARP_TABLE_TIME_TO_CHECK * 60)) // Check only every ... minutes
+        return;
+
+    rwlock_writeLock(&cache->lock);
+    if (timer_getSeconds() > (cache->lastCheck + ARP_TABLE_TIME_TO_CHECK * 60)) // Another task might have checked the table while we waited for the lock
     {
         cache->lastCheck = timer_getSeconds();
         for (dlelement_t* e = cache->table->head; e != 0;)
@@ -36,10 +42,12 @@ static void arp_checkTable(arpTable_t* cache)
                 e = e->next;
         }
     }
+    rwlock_writeUnlock(&cache->lock);
 }
 
 void arp_addTableEntry(arpTable_t* cache, uint8_t MAC[6], IP_t IP, bool dynamic)
 {
+    rwlock_writeLock(&cache->lock);
     arpTableEntry_t* entry = arp_findEntry(cache, IP); // Check if there is already an entry with the same IP.
     if (entry == 0) // No entry found. Create new one.
     {
@@ -50,22 +58,27 @@ void arp_addTableEntry(arpTable_t* cache, uint8_t MAC[6], IP_t IP, bool dynamic)
     memcpy(entry->MAC, MAC, 6);
     entry->dynamic = dynamic;
     entry->seconds = timer_getSeconds();
+    rwlock_writeUnlock(&cache->lock);
 }
 
 arpTableEntry_t* arp_findEntry(arpTable_t* cache, IP_t IP)
 {
     arp_checkTable(cache); // We check the arp cache for obsolete entries.
 
+    rwlock_readLock(&cache->lock);
+    arpTableEntry_t* found = 0;
     for (dlelement_t* e = cache->table->head; e != 0; e = e->next)
     {
         arpTableEntry_t* entry = e->data;
         if (entry->IP.iIP == IP.iIP)
         {
-            entry->seconds = timer_getSeconds(); // Update time stamp.
-            return (entry);
+            entry->seconds = timer_getSeconds(); // Update time stamp. Readers only write the same value, so the read lock is sufficient.
+            found = entry;
+            break;
         }
     }
-    return (0);
+    rwlock_readUnlock(&cache->lock);
+    return (found);
 }
 
 void arp_showTable(arpTable_t* cache)
@@ -76,6 +89,7 @@ void arp_showTable(arpTable_t* cache)
     printf("\nIP\t\t  MAC\t\t\tType\t  Time(sec)");
     printf("\n--------------------------------------------------------------------------------");
     textColor(TEXT);
+    rwlock_readLock(&cache->lock);
     for (dlelement_t* e = cache->table->head; e != 0; e = e->next)
     {
         arpTableEntry_t* entry = e->data;
@@ -83,6 +97,7 @@ void arp_showTable(arpTable_t* cache)
         if (length < 9) putch('\t');
         printf("  %M\t%s\t  %u\n", entry->MAC, entry->dynamic?"dynamic":"static", entry->seconds);
     }
+    rwlock_readUnlock(&cache->lock);
     textColor(TABLE_HEADING);
     printf("--------------------------------------------------------------------------------");
 }
@@ -91,6 +106,7 @@ void arp_initTable(arpTable_t* cache)
 {
     cache->table = list_create();
     cache->lastCheck = timer_getSeconds();
+    rwlock_init(&cache->lock, "ARP table");
 
     // Create default entries
     // We use only the first 4 bytes of the array as IP, all 6 bytes are used as MAC
@@ -102,6 +118,7 @@ void arp_initTable(arpTable_t* cache)
 void arp_deleteTable(arpTable_t* cache)
 {
     list_free(cache->table);
+    rwlock_destroy(&cache->lock);
 }
 
 void arp_received(network_adapter_t* adapter, arpPacket_t* packet)
@@ -3,6 +3,7 @@
 
 #include "util/list.h"
 #include "network/netutils.h"
+#include "tasking/synchronisation.h"
 
 #define ARP_TABLE_TIME_TO_CHECK   2    // time in minutes
 #define ARP_TABLE_TIME_TO_DELETE 10    // time in minutes
@@ -25,6 +26,7 @@ typedef struct
 {
     list_t*  table;
     uint32_t lastCheck;
+    rwlock_t lock;      // Lookups are much more frequent than changes
 } arpTable_t;
 
 typedef struct
@@ -10,8 +10,9 @@
 #include "tcp.h"
 #include "video/console.h"
 #include "kheap.h"
+#include "objcache.h"
 #include "util/util.h"
-#include "util/todo_list.h"
+#include "tasking/workqueue.h"
 #include "events.h"
 #include "timer.h"
 #include "ipv4.h"
@@ -47,6 +48,11 @@ static const char* const tcpStates[] =
 
 static list_t*  tcpConnections = 0;
 
+// Caches for the buffer descriptors. The data of the buffers is still taken from the heap.
+static objCache_t* inCache         = 0;
+static objCache_t* outCache        = 0;
+static objCache_t* sendBufferCache = 0;
+
 
 static bool     tcp_IsPacketAcceptable(tcpPacket_t* tcp, tcpConnection_t* connection, uint16_t tcpDatalength);
 static uint16_t tcp_getFreeSocket();
@@ -113,12 +119,16 @@ tcpConnection_t* tcp_findConnection(IP_t IP, uint16_t port, network_adapter_t* a
     return (0);
 }
 
+void tcp_install(void)
+{
+    tcpConnections  = list_create();
+    inCache         = objCache_create("tcp_InBuffer", sizeof(tcpIn_t), 0);
+    outCache        = objCache_create("tcp_OutBuffer", sizeof(tcpOut_t), 0);
+    sendBufferCache = objCache_create("tcpSendBufPkt", sizeof(tcpSendBufferPacket), 0);
+}
+
 tcpConnection_t* tcp_createConnection(void)
 {
-    if (tcpConnections == 0)
-    {
-        tcpConnections = list_create();
-    }
     tcpConnection_t* connection    = malloc(sizeof(tcpConnection_t), 0, "tcp connection");
     connection->inBuffer           = list_create();
     connection->OutofOrderinBuffer = list_create();
@@ -196,7 +206,7 @@ static void tcp_timeoutDeleteConnection(tcpConnection_t* connection, uint32_t ti
 {
     if (connection)
     {
-        todoList_add(kernel_idleTasks, &scheduledDeleteConnection, &connection, sizeof(connection), timeMilliseconds + timer_getMilliseconds());
+        workqueue_add(WQ_TIMER, &scheduledDeleteConnection, &connection, sizeof(connection), (uint64_t)timeMilliseconds*1000 + timer_getMicroseconds());
 
       #ifdef _TCP_DEBUG_
         textColor(LIGHT_BLUE);
@@ -507,7 +517,7 @@ void tcp_receive(network_adapter_t* adapter, tcpPacket_t* tcp, size_t length, IP
                     // Add received data to the temporary Out-of-Order In-Buffer
                     if (tcpDataLength)
                     {
-                        tcpIn_t* In    = malloc(sizeof(tcpIn_t), 0, "tcp_InBuffer");
+                        tcpIn_t* In    = objCache_alloc(inCache);
                         In->ev         = malloc(sizeof(tcpReceivedEventHeader_t) + tcpDataLength, 0, "tcp_InBuf_data");
                         memcpy(In->ev+1, tcpData, tcpDataLength);
                         In->seq        = ntohl(tcp->sequenceNumber);
@@ -580,7 +590,7 @@ void tcp_receive(network_adapter_t* adapter, tcpPacket_t* tcp, size_t length, IP
 
 
                     //Fill in-buffer list
-                    tcpIn_t* In    = malloc(sizeof(tcpIn_t), 0, "tcp_InBuffer");
+                    tcpIn_t* In    = objCache_alloc(inCache);
                     In->ev         = malloc(sizeof(tcpReceivedEventHeader_t) + tcpDataLength, 0, "tcp_InBuf_data");
                     memcpy(In->ev+1, tcpData, tcpDataLength);
                     In->seq        = ntohl(tcp->sequenceNumber);
@@ -892,7 +902,7 @@ static uint32_t tcp_deleteInBuffers(tcpConnection_t* connection, list_t* list)
             count++;
             tcpIn_t* inPacket = e->data;
             free(inPacket->ev);
-            free(inPacket);
+            objCache_free(inCache, inPacket);
         }
         list_free(list);
     }
@@ -912,7 +922,7 @@ static uint32_t tcp_deleteOutBuffers(tcpConnection_t* connection)
             tcpOut_t* outPacket = e->data;
             serial_log(SER_LOG_TCP,"seq = %u  ",outPacket->segment.SEQ - connection->tcb.SND.ISS);
             free(outPacket->data);
-            free(outPacket);
+            objCache_free(outCache, outPacket);
         }
         list_free(connection->outBuffer);
         connection->outBuffer = 0;
@@ -1023,7 +1033,7 @@ static void tcp_RemoveAckedPacketsFromOutBuffer(tcpConnection_t* connection, tcp
             }
             serial_log(SER_LOG_TCP,"Acked Packet seq %u time %u ms removed.\r\n",outPacket->segment.SEQ - connection->tcb.SND.ISS, outPacket->time_ms_transmitted);
             free(outPacket->data);
-            free(outPacket);
+            objCache_free(outCache, outPacket);
             e = list_delete(connection->outBuffer, e); // Remove packet.
         }
         else
@@ -1249,7 +1259,7 @@ bool tcp_usend(uint32_t ID, void* data, size_t length) // data exchange in state
         tcp_send(connection, data, length);
 
         // send to outBuffer
-        tcpOut_t* outPacket = malloc(sizeof(tcpOut_t), 0, "tcp_OutBuffer");
+        tcpOut_t* outPacket = objCache_alloc(outCache);
         outPacket->data     = malloc(length, 0, "tcp_OutBuf_data");
         memcpy(outPacket->data, data, length);
         outPacket->segment.SEQ = connection->tcb.SND.NXT;
@@ -1279,7 +1289,7 @@ bool tcp_usend(uint32_t ID, void* data, size_t length) // data exchange in state
                 {
                     // first element in sendBuffer is too large
                     size_t sendSize = min(MSS, connection->tcb.RCV.WND);
-                    tcpSendBufferPacket* packet = malloc(sizeof(tcpSendBufferPacket),0,"tcpSendBufPkt");
+                    tcpSendBufferPacket* packet = objCache_alloc(sendBufferCache);
                     packet->data   = malloc(((tcpSendBufferPacket*)(connection->sendBuffer->head->data))->length - sendSize, 0, "tcpSendBufPkt"); // new size w/o sendSize
                     packet->length = ((tcpSendBufferPacket*)(connection->sendBuffer->head->data))->length - sendSize;
                     memcpy(packet->data, (void*)(((uintptr_t)((tcpSendBufferPacket*)(connection->sendBuffer->head->data))->data) + sendSize), ((tcpSendBufferPacket*)(connection->sendBuffer->head->data))->length - sendSize);
@@ -1289,14 +1299,14 @@ bool tcp_usend(uint32_t ID, void* data, size_t length) // data exchange in state
                     tcp_send(connection, ((tcpSendBufferPacket*)(connection->sendBuffer->head->data))->data, sendSize);
 
                     free(((tcpSendBufferPacket*)connection->sendBuffer->head->data)->data);
-                    free(connection->sendBuffer->head->data);
+                    objCache_free(sendBufferCache, connection->sendBuffer->head->data);
                     connection->sendBuffer->head->data = packet;
                 }
             }
             else // sendBuffer is empty
             {
                 size_t sendSize = min(MSS, connection->tcb.RCV.WND);
-                tcpSendBufferPacket* packet = malloc(sizeof(tcpSendBufferPacket),0,"tcpSendBufPkt");
+                tcpSendBufferPacket* packet = objCache_alloc(sendBufferCache);
                 packet->data   = malloc(length - sendSize, 0, "tcpSendBufPkt");
                 packet->length = length - sendSize;
                 memcpy(packet->data, (void*)((uintptr_t)data + sendSize), length - sendSize);
@@ -1308,7 +1318,7 @@ bool tcp_usend(uint32_t ID, void* data, size_t length) // data exchange in state
                 list_append(connection->sendBuffer, packet);
             }
             // send to outBuffer
-            tcpOut_t* outPacket = malloc(sizeof(tcpOut_t), 0, "tcp_OutBuffer");
+            tcpOut_t* outPacket = objCache_alloc(outCache);
             outPacket->data     = malloc(length, 0, "tcp_OutBuf_data");
             memcpy(outPacket->data, data, length);
             outPacket->segment.SEQ = connection->tcb.SND.NXT;
@@ -129,6 +129,7 @@ typedef struct
 } tcpSendBufferPacket;
 
 
+void tcp_install(void);
 tcpConnection_t* tcp_createConnection(void);
 void tcp_deleteConnection(tcpConnection_t* connection);
 void tcp_cleanup(task_t* task);
@@ -8,9 +8,10 @@
 #include "cdi/pci.h"
 #include "util/util.h"
 #include "util/list.h"
-#include "util/todo_list.h"
+#include "util/fifo.h"
 #include "kheap.h"
 #include "irq.h"
+#include "tasking/workqueue.h"
 #include "video/console.h"
 #include "netprotocol/ethernet.h"
 #include "rtl8139.h"
@@ -25,9 +26,30 @@ network_driver_t network_drivers[ND_COUNT] =
     {.install = &AMDPCnet_install, .interruptHandler = &PCNet_handler,   .sendPacket = &PCNet_send}
 };
 
+#define RECEIVE_SLOTS     64   // Frames that can wait for the receive thread
+#define RECEIVE_FRAMESIZE 1536 // Largest frame accepted from a driver
+
+
 Packet_t lastPacket; // save data during packet receive thru the protocols
 
 static list_t*  adapters = 0;
+static fifo_t*  received = 0; // Frames handed over by the interrupt handlers of all adapters to the network work queue. Each slot starts with the adapter.
+
+
+static void network_handleReceivedFrame(void* data, size_t length, void* context)
+{
+    network_adapter_t* adapter = *(network_adapter_t**)data;
+    ethernet_t* eth = data + sizeof(adapter);
+    ethernet_received(adapter, eth, length - sizeof(adapter));
+}
+
+static void network_processReceived(work_t* work) // Processes the received frames in bursts
+{
+    if (fifo_consume(received, RECEIVE_SLOTS, &network_handleReceivedFrame, 0) == RECEIVE_SLOTS)
+        workqueue_schedule(WQ_NETWORK, work); // There might be more. Continue after the other works of the queue.
+}
+
+static work_t receiveWork = WORK_INIT(&network_processReceived);
 
 
 bool network_installDevice(pciDev_t* device)
@@ -92,6 +114,9 @@ bool network_installDevice(pciDev_t* device)
 
 network_adapter_t* network_createDevice(pciDev_t* device)
 {
+    if (received == 0)
+        received = fifo_create(RECEIVE_SLOTS, sizeof(network_adapter_t*) + RECEIVE_FRAMESIZE, true);
+
     network_adapter_t* adapter = malloc(sizeof(network_adapter_t), 0, "network apdapter");
     adapter->driver = 0;
     adapter->PCIdev = device;
@@ -147,20 +172,17 @@ bool network_sendPacket(network_adapter_t* adapter, uint8_t* buffer, size_t leng
     return false;
 }
 
-static void network_handleReceivedBuffer(void* data, size_t length)
-{
-    network_adapter_t* adapter = *(network_adapter_t**)data;
-    ethernet_t* eth = data + sizeof(adapter);
-    ethernet_received(adapter, eth, length - sizeof(adapter));
-}
-
-void network_receivedPacket(network_adapter_t* adapter, uint8_t* data, size_t length) // Called by driver
+void network_receivedPacket(network_adapter_t* adapter, uint8_t* data, size_t length) // Called by driver, usually in its interrupt handler
 {
-    char buffer[length+sizeof(adapter)];
-    *(network_adapter_t**)buffer = adapter;
-    memcpy(buffer+sizeof(adapter), data, length);
+    // The frame is copied once into the fifo. If it is full, the frame is dropped (counted in received->dropped).
+    uint8_t* slot = fifo_reserve(received, sizeof(adapter) + length);
+    if (slot == 0)
+        return;
 
-    todoList_add(kernel_idleTasks, &network_handleReceivedBuffer, buffer, length+sizeof(adapter), 0);
+    *(network_adapter_t**)slot = adapter;
+    memcpy(slot + sizeof(adapter), data, length);
+    fifo_commit(received, slot);
+    workqueue_schedule(WQ_NETWORK, &receiveWork);
 }
 
 void network_displayArpTables(void)
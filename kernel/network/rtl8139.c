@@ -63,8 +63,15 @@ void rtl8139_install(network_adapter_t* adapter)
     rAdapter->device                   = adapter;
     adapter->data                      = rAdapter;
 
-    rAdapter->RxBuffer                 = malloc(RTL8139_RX_BUFFER_SIZE, 4, "RTL8139-RxBuf");
+    rAdapter->RxBuffer                 = (uint8_t*)paging_allocContiguous(RTL8139_RX_BUFFER_SIZE, MEM_ZONE_DMA); // Identity mapped, physically contiguous
     rAdapter->RxBufferPointer          = 0;
+    if (rAdapter->RxBuffer == 0)
+    {
+        textColor(ERROR);
+        printf("\nRTL8139: Could not allocate receive buffer.");
+        textColor(TEXT);
+        return;
+    }
     memset(rAdapter->RxBuffer, 0, RTL8139_RX_BUFFER_SIZE); // clear receiving buffer
 
     rAdapter->TxBuffer                 = malloc(RTL8139_TX_BUFFER_SIZE, 4, "RTL8139-TxBuf");
@@ -0,0 +1,171 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "objcache.h"
+#include "kheap.h"
+#include "paging.h"
+#include "util/util.h"
+#include "video/console.h"
+
+/* An object cache keeps objects of one type that are ready for use. When an object is freed, it stays in the cache,
+   so the next allocation does not have to visit the heap. The cache grows in chunks taken from the heap; the optional
+   constructor is called once for each object of a new chunk. Users have to return objects in constructed state.
+
+   Each object is followed by a dword that links it into the free list of its cache while it is not in use.
+   This way the constructed state of a free object is left untouched.
+
+   Caches are never shrunk, their chunks stay allocated. All functions can be called with interrupts enabled or disabled. */
+
+
+static objCache_t* caches = 0; // List of all caches
+
+
+static inline void** nextFree(const objCache_t* cache, void* object)
+{
+    return ((void**)((uintptr_t)object + alignUp(cache->size, sizeof(void*))));
+}
+
+objCache_t* objCache_create(const char* name, size_t size, void (*constructor)(void*))
+{
+    return (objCache_createAligned(name, size, sizeof(void*), constructor));
+}
+
+objCache_t* objCache_createAligned(const char* name, size_t size, size_t alignment, void (*constructor)(void*))
+{
+    objCache_t* cache = malloc(sizeof(objCache_t), 0, "objCache");
+    cache->name        = name;
+    cache->size        = size;
+    cache->alignment   = max(alignment, sizeof(void*));
+    cache->stride      = alignUp(alignUp(size, sizeof(void*)) + sizeof(void*), cache->alignment);
+    cache->constructor = constructor;
+    cache->freeList    = 0;
+    cache->total       = 0;
+    cache->inUse       = 0;
+    cache->peak        = 0;
+    cache->allocations = 0;
+    cache->chunks      = 0;
+    spinlock_init(&cache->lock, name);
+
+    bool enabled = interrupts_disable();
+    cache->next = caches;
+    caches = cache;
+    interrupts_restore(enabled);
+
+    return (cache);
+}
+
+static bool objCache_grow(objCache_t* cache)
+{
+    uint32_t count = max(PAGESIZE/cache->stride, 8);
+    uint8_t* chunk = malloc(count*cache->stride, cache->alignment, (char*)cache->name);
+    if (chunk == 0)
+    {
+        return (false);
+    }
+
+    // Construct the new objects and chain them
+    void* first = 0;
+    for (uint32_t i = count; i > 0; i--)
+    {
+        void* object = chunk + (i-1)*cache->stride;
+        if (cache->constructor)
+        {
+            cache->constructor(object);
+        }
+        *nextFree(cache, object) = first;
+        first = object;
+    }
+
+    bool enabled = spinlock_lockIrq(&cache->lock);
+    *nextFree(cache, chunk + (count-1)*cache->stride) = cache->freeList;
+    cache->freeList = first;
+    cache->total += count;
+    cache->chunks++;
+    spinlock_unlockIrq(&cache->lock, enabled);
+
+    return (true);
+}
+
+void* objCache_alloc(objCache_t* cache)
+{
+    bool enabled = spinlock_lockIrq(&cache->lock);
+    while (cache->freeList == 0)
+    {
+        // The heap might block, so it is called with interrupts restored and without the lock
+        spinlock_unlockIrq(&cache->lock, enabled);
+        if (!objCache_grow(cache))
+        {
+            textColor(ERROR);
+            printf("\nobjCache_alloc: Cache %s could not grow.", cache->name);
+            textColor(TEXT);
+            return (0);
+        }
+        enabled = spinlock_lockIrq(&cache->lock);
+    }
+
+    void* object = cache->freeList;
+    cache->freeList = *nextFree(cache, object);
+    cache->inUse++;
+    cache->allocations++;
+    cache->peak = max(cache->peak, cache->inUse);
+    spinlock_unlockIrq(&cache->lock, enabled);
+
+    return (object);
+}
+
+void objCache_free(objCache_t* cache, void* object)
+{
+    if (object == 0)
+    {
+        return;
+    }
+
+    bool enabled = spinlock_lockIrq(&cache->lock);
+    *nextFree(cache, object) = cache->freeList;
+    cache->freeList = object;
+    cache->inUse--;
+    spinlock_unlockIrq(&cache->lock, enabled);
+}
+
+void objCache_log(void)
+{
+    textColor(HEADLINE);
+    printf("\nObject caches:");
+    textColor(TEXT);
+    for (objCache_t* cache = caches; cache; cache = cache->next)
+    {
+        printf("\n%s:\tsize: %u, objects: %u, in use: %u (peak: %u), allocations: %u, chunks: %u", cache->name, cache->size,
+               cache->total, cache->inUse, cache->peak, cache->allocations, cache->chunks);
+    }
+    putch('\n');
+}
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
@@ -0,0 +1,34 @@
+#ifndef OBJCACHE_H
+#define OBJCACHE_H
+
+#include "tasking/synchronisation.h"
+
+
+typedef struct objCache
+{
+    const char*      name;
+    size_t           size;                   // Size of the objects
+    size_t           stride;                 // Distance between two objects. The last dword holds the link to the next free object
+    size_t           alignment;              // Alignment of the objects
+    void           (*constructor)(void*);    // Called once for each object when the cache grows (optional)
+    void*            freeList;               // Constructed objects ready to be handed out
+    struct objCache* next;                   // List of all caches
+    spinlock_t       lock;                   // Protects the free list and the statistics
+
+    // Statistics
+    uint32_t         total;                  // Number of objects owned by the cache
+    uint32_t         inUse;                  // Number of objects handed out
+    uint32_t         peak;                   // Maximum of inUse
+    uint32_t         allocations;            // Number of calls to objCache_alloc
+    uint32_t         chunks;                 // Number of memory blocks taken from the heap
+} objCache_t;
+
+
+objCache_t* objCache_create(const char* name, size_t size, void (*constructor)(void*)); // Creates a cache for objects of one type
+objCache_t* objCache_createAligned(const char* name, size_t size, size_t alignment, void (*constructor)(void*)); // alignment: Power of two
+void*       objCache_alloc(objCache_t* cache);                                         // Takes a constructed object from the cache, grows the cache if necessary
+void        objCache_free(objCache_t* cache, void* object);                            // Returns an object to its cache. It has to be in constructed state again.
+void        objCache_log(void);                                                        // Shows statistics of all caches
+
+
+#endif
@@ -13,41 +13,91 @@
 #include "kheap.h"
 #include "ipc.h"
 #include "video/console.h"
+#include "cpu.h"
+#include "util/list.h"
+#include "userimage.h"
+#include "smp.h"
 
-#define FOUR_GB 0x100000000ull // Highest address + 1
+#define FOUR_GB    0x100000000ull // Highest address + 1
+#define LARGE_PAGE BIT(7)          // Flag of a page directory entry (PS): The entry maps a 4 MiB page instead of a page table
+
+// Page table entry bits available to the OS
+#define PAGE_DEMAND BIT(9)         // Not present yet. Memory is allocated (and loaded from the user image) on first access.
+#define PAGE_SHARED MEM_SHARED     // The frame belongs to the user image or to the kernel and must not be freed with the page
+#define PAGE_COW    BIT(11)        // Shared page of a writable segment. Write access creates a private copy.
 
 
 pageDirectory_t* kernelPageDirectory;
-pageDirectory_t* currentPageDirectory = 0;
+#define currentPageDirectory (smp_currentCPU()->pageDirectory) // Page directory loaded on the executing CPU
+
+static bool     pse = false;                 // 4 MiB pages are used for kernel mappings, if the CPU supports them
+static list_t*  userPageDirectories = 0;     // Kernel page directory entries changed after creation of a user page directory are copied to it
+static uint32_t pageTableCount = 0;          // Page tables allocated by paging, including the cached ones
+static pageTable_t* heapTables = 0;          // Page tables preallocated for PCI memory and kernel heap. They cannot be freed.
+static uint32_t     heapTableCount = 0;
 
 extern char _kernel_beg, _kernel_end; // defined in linker script
 extern char _ro_start, _ro_end;       // defined in linker script
 
 static const uint32_t MAX_DWORDS = FOUR_GB / PAGESIZE / 32;
-static uint32_t*      bittable;
-static uint32_t       firstFreeDWORD = PLACEMENT_END / PAGESIZE / 32; // Exclude the first 10 MiB from being allocated (needed for DMA later on)
+static uint32_t*      bittable; // One bit per frame. Set: Frame is reserved or allocated
+
+/* Free physical memory is managed by a buddy allocator. A free block of order k consists of 2^k frames and starts at a frame
+   number that is a multiple of 2^k. For each order there is a bitmap with one bit per possible block, telling whether this
+   block is free. When a block is freed, it is merged with its buddy (the other half of the block of the next order)
+   as long as that is free as well. Blocks never cross the border between the zones, since it is aligned to the largest block size.
+   Blocks are taken from the lowest free address of a zone. Each zone remembers the first dword of each bitmap that might contain
+   a free block. */
+#define BUDDY_ORDERS 11 // Order 0 (4 KiB) to order 10 (4 MiB)
+
+typedef struct
+{
+    uint32_t begin, end;                  // Frame numbers
+    uint32_t freeBlocks[BUDDY_ORDERS];    // Number of free blocks of each order
+    uint32_t firstFreeDWORD[BUDDY_ORDERS]; // Lowest dword of buddyMap[order] that might contain a free block of this zone
+} memoryZone_t;
+
+static uint32_t*    buddyMap[BUDDY_ORDERS]; // One bit per block. Set: Block is free
+static uint32_t     frameCount;             // Number of frames managed by the allocator
+static memoryZone_t zones[MEM_ZONES] =
+{
+    {.begin = 0,                     .end = DMA_ZONE_END/PAGESIZE}, // MEM_ZONE_DMA
+    {.begin = DMA_ZONE_END/PAGESIZE, .end = DMA_ZONE_END/PAGESIZE}, // MEM_ZONE_NORMAL, end is set by physMemInit
+};
 
 
 static uint32_t physMemInit(memoryMapEntry_t* memoryMapBegin, memoryMapEntry_t* memoryMapEnd);
+static void     buddyInit(void);
 
 
 uint32_t paging_install(memoryMapEntry_t* memoryMapBegin, memoryMapEntry_t* memoryMapEnd)
 {
     uint32_t ram_available = physMemInit(memoryMapBegin, memoryMapEnd);
+    pse = cpu_supports(CF_PAGES4MB); // PSE has been enabled by cpu_install
 
     // Setup the kernel page directory
     kernelPageDirectory = malloc(sizeof(pageDirectory_t), PAGESIZE, "pag-kernelPD");
-    memset(kernelPageDirectory, 0, sizeof(pageDirectory_t) - 4);
+    memset(kernelPageDirectory, 0, sizeof(pageDirectory_t));
     kernelPageDirectory->physAddr = (uintptr_t)kernelPageDirectory;
 
     kdebug(3, "\nkernelPageDirectory (virt., phys.): %Xh, %Xh\n", kernelPageDirectory, kernelPageDirectory->physAddr);
 
-    // Setup the page tables for 0 MiB - 12 MiB, identity mapping
+    // Setup the page tables for 0 MiB - 16 MiB (DMA zone), identity mapping. Frames above the placement area are taken by the buddy allocator.
+    // The first 4 MiB (vm86) and the read-only kernel sections need page granularity, the rest is mapped by 4 MiB pages if possible.
     uintptr_t addr = 0;
-    for (uint8_t i=0; i<IDMAP; i++)
+    for (uint8_t i=0; i<DMA_ZONE_END/PAGESIZE/PAGE_COUNT; i++)
     {
+        if (pse && i > 0 && i > ((uintptr_t)&_ro_end - 1)/LARGE_PAGESIZE)
+        {
+            kernelPageDirectory->tables[i] = 0;
+            kernelPageDirectory->codes[i]  = addr | MEM_PRESENT | MEM_WRITE | MEM_NOTLBUPDATE | LARGE_PAGE;
+            addr += LARGE_PAGESIZE;
+            continue;
+        }
+
         // Page directory entry, virt=phys due to placement allocation in id-mapped area
         kernelPageDirectory->tables[i] = malloc(sizeof(pageTable_t), PAGESIZE, "pag-kernelPT");
+        pageTableCount++;
         kernelPageDirectory->codes[i]  = (uint32_t)kernelPageDirectory->tables[i] | MEM_PRESENT | MEM_WRITE;
 
         // Page table entries, identity mapping
@@ -61,6 +111,9 @@ uint32_t paging_install(memoryMapEntry_t* memoryMapBegin, memoryMapEntry_t* memo
     // Setup the page tables for PCI memory (3 - 3,5 GiB) and kernel heap (3,5 - 4 GiB), unmapped
     size_t kernelpts = PT_COUNT/8 + min(PT_COUNT/8, ram_available / PAGESIZE / PAGE_COUNT); // Number of PT's to allocate. PCI memory size + maximum kernel heap size (limited by available memory)
     pageTable_t* heap_pts = malloc(kernelpts*sizeof(pageTable_t), PAGESIZE, "pag-PTheap");
+    heapTables     = heap_pts;
+    heapTableCount = kernelpts;
+    pageTableCount += kernelpts;
     memset(heap_pts, 0, kernelpts * sizeof(pageTable_t));
     for (uint32_t i = 0; i < kernelpts; i++)
     {
@@ -172,11 +225,11 @@ static uint32_t physMemInit(memoryMapEntry_t* memoryMapBegin, memoryMapEntry_t*
         }
     }
 
-    // Check that 6 MiB-12 MiB is free for use
-    if (!isMemoryMapAvailable(memoryMapBegin, memoryMapEnd, PLACEMENT_BEGIN, IDMAP*PAGE_COUNT*PAGESIZE))
+    // Check that the placement area (6 MiB - 12 MiB) is free for use
+    if (!isMemoryMapAvailable(memoryMapBegin, memoryMapEnd, PLACEMENT_BEGIN, PLACEMENT_END))
     {
         textColor(ERROR);
-        printf("The memory between 6 MiB and 12 MiB is not free for use. OS halted!\n");
+        printf("The memory between 6 MiB and 12 MiB (placement area) is not free for use. OS halted!\n");
         cli();
         hlt();
     }
@@ -205,15 +258,22 @@ static uint32_t physMemInit(memoryMapEntry_t* memoryMapBegin, memoryMapEntry_t*
         }
     }
 
-    // Reserve first 10 MiB
+    // Reserve everything up to the end of the placement area. The rest of the DMA zone (12 MiB - 16 MiB) stays free.
     physSetBits(0x00000000, PLACEMENT_END, true);
 
+    // Reserve the page of the startup code of the application processors. A CPU that did not start in time might still execute it.
+    physSetBits(TRAMPOLINE_BASE, TRAMPOLINE_BASE + PAGESIZE, true);
+
     // Reserve the region of the kernel code
     if((uintptr_t)&_kernel_end >= PLACEMENT_END)
         physSetBits((uint32_t)&_kernel_beg, (uint32_t)&_kernel_end, true);
 
     kdebug(3, "Highest available RAM: %Xh\n", dwordCount * 32 * PAGESIZE);
 
+    frameCount = dwordCount * 32;
+    zones[MEM_ZONE_NORMAL].end = max(frameCount, DMA_ZONE_END/PAGESIZE);
+    buddyInit();
+
     // Return the amount of memory available (or rather the highest address)
     return (dwordCount * 32 * PAGESIZE);
 }
@@ -238,42 +298,488 @@ static inline void invalidateTLBEntry(uint8_t* p)
     __asm__ volatile("invlpg %0" : : "m"(*p));
 }
 
+/* Changes of present page table entries are collected in a TLB batch, which is flushed once after the whole range has been
+   changed. Small ranges are invalidated page by page, larger ones by flushing the whole TLB. Reloading CR3 does not flush global
+   pages (MEM_NOTLBUPDATE), so CR4.PGE is toggled if such pages are affected.
+   Entries that were not present before need no invalidation, because the CPU does not cache them. Other CPUs that use the page
+   directory are asked by an IPI to flush the same range (smp_flushTLB). */
+#define TLB_FLUSH_THRESHOLD 32 // Maximum number of pages invalidated one by one
+
+typedef struct
+{
+    uintptr_t begin, end; // Range of virtual addresses containing all changed pages
+    bool      global;     // A global page has been changed
+} tlbBatch_t;
+
+static void tlbBatch_add(tlbBatch_t* batch, uintptr_t addr, uint32_t size, uint32_t oldEntry)
+{
+    if (!(oldEntry & MEM_PRESENT))
+        return;
+
+    if (batch->begin == batch->end)
+    {
+        batch->begin = addr;
+        batch->end   = addr + size;
+    }
+    else
+    {
+        batch->begin = min(batch->begin, addr);
+        batch->end   = max(batch->end, addr + size);
+    }
+    batch->global |= (oldEntry & MEM_NOTLBUPDATE) != 0;
+}
+
+void paging_flushTLB(uintptr_t begin, uintptr_t end, bool global) // Flushes the TLB of the executing CPU
+{
+    if ((end - begin)/PAGESIZE <= TLB_FLUSH_THRESHOLD)
+    {
+        for (uintptr_t addr = begin; addr != end; addr += PAGESIZE)
+            invalidateTLBEntry((uint8_t*)addr);
+    }
+    else if (global && cpu_supports(CF_PGE))
+    {
+        uint32_t cr4;
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~BIT(7)) : "memory"); // Disabling PGE flushes all entries, including global ones
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+    else
+    {
+        uint32_t cr3;
+        __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+        __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+}
 
-static uint32_t physMemAlloc(void)
+static void tlbBatch_flush(tlbBatch_t* batch, pageDirectory_t* pd)
 {
-    // Search for a free uint32_t, i.e. one that not only contains ones
-    for (; firstFreeDWORD < MAX_DWORDS; firstFreeDWORD++)
+    if (batch->begin == batch->end)
+        return;
+
+    // Mappings of other page directories are not in the TLB, except of the kernel's mappings shared by all of them
+    if (pd == currentPageDirectory || pd == kernelPageDirectory)
+        paging_flushTLB(batch->begin, batch->end, batch->global);
+    smp_flushTLB(pd, batch->begin, batch->end, batch->global); // Other CPUs using the page directory
+
+    batch->begin = batch->end = 0;
+    batch->global = false;
+}
+
+// Global pages are only allowed for mappings that are the same in all address spaces
+static inline uint32_t pageFlags(const pageDirectory_t* pd, MEMFLAGS_t flags)
+{
+    return ((pd == kernelPageDirectory) ? flags : (flags & ~MEM_NOTLBUPDATE));
+}
+
+// Sets a page directory entry. Entries of the kernel page directory are copied to all user page directories.
+static void setPDE(pageDirectory_t* pd, uint32_t i, uint32_t code, pageTable_t* table)
+{
+    pd->codes[i]  = code;
+    pd->tables[i] = table;
+
+    if (pd != kernelPageDirectory)
     {
-        if (bittable[firstFreeDWORD] != 0xFFFFFFFF)
+        if (code)
+            pd->ownTables[i/32] |= BIT(i%32);
+        else
+            pd->ownTables[i/32] &= ~BIT(i%32);
+    }
+    else if (userPageDirectories)
+    {
+        for (dlelement_t* e = userPageDirectories->head; e != 0; e = e->next)
         {
-            uint32_t bitnr;
-            // Find the number of first free bit.
-            // This inline assembler instruction is smaller and faster than a C loop to identify this bit
-            __asm__("bsfl %1, %0" : "=r"(bitnr) : "r"(~bittable[firstFreeDWORD]));
+            ((pageDirectory_t*)e->data)->codes[i]  = code;
+            ((pageDirectory_t*)e->data)->tables[i] = table;
+        }
+    }
+}
 
-            // Set the page to "reserved" and return the frame's address
-            SET_BIT(bittable[firstFreeDWORD], bitnr % 32);
-            return ((firstFreeDWORD * 32 + bitnr) * PAGESIZE);
+static bool isTableEmpty(const pageTable_t* pt)
+{
+    if (pt)
+    {
+        for (uint32_t i = 0; i < PAGE_COUNT; i++)
+        {
+            if (pt->pages[i])
+                return (false);
+        }
+    }
+    return (true);
+}
+
+
+/* Page tables and user page directories are cached for reuse, so starting and ending a process needs no heap operations.
+   Page tables given back are linked via their first entry and zeroed later by the idle task (paging_refillPools). The user
+   half of a cached page directory is always zero, its kernel half is copied from the kernel's page directory on reuse. */
+#define PT_CACHE_SIZE 64 // Maximum number of cached page tables (clean and dirty)
+#define PD_CACHE_SIZE 8  // Maximum number of cached page directories
+
+// Page directory entries covering kernel memory: The identity mapped area and PCI memory plus kernel heap
+#define KERNEL_PT_LOW  (DMA_ZONE_END/LARGE_PAGESIZE)
+#define KERNEL_PT_HIGH (PCI_MEM_START/LARGE_PAGESIZE)
+
+static pageTable_t*     cleanTables = 0; // Zeroed page tables
+static pageTable_t*     dirtyTables = 0; // Page tables that have to be zeroed before reuse
+static uint32_t         cachedTables = 0;
+static pageDirectory_t* cachedDirectories = 0; // Linked via their next pointer
+static uint32_t         cachedDirectoryCount = 0;
+
+static pageTable_t* allocTable(void)
+{
+    bool ints = interrupts_disable();
+    pageTable_t* pt = cleanTables;
+    if (pt)
+    {
+        cleanTables = (pageTable_t*)pt->pages[0];
+        cachedTables--;
+    }
+    interrupts_restore(ints);
+
+    if (pt)
+    {
+        pt->pages[0] = 0;
+    }
+    else
+    {
+        pt = malloc(sizeof(pageTable_t), PAGESIZE, "pageTable");
+        if (pt)
+        {
+            memset(pt, 0, sizeof(pageTable_t));
+            pageTableCount++;
         }
     }
+    return (pt);
+}
+
+static void freeTable(pageTable_t* pt)
+{
+    bool ints = interrupts_disable();
+    if (cachedTables < PT_CACHE_SIZE || (pt >= heapTables && pt < heapTables + heapTableCount)) // Preallocated tables are always kept
+    {
+        pt->pages[0] = (uint32_t)dirtyTables;
+        dirtyTables = pt;
+        cachedTables++;
+        pt = 0;
+    }
+    interrupts_restore(ints);
 
-    // No free page found
+    if (pt)
+    {
+        free(pt);
+        pageTableCount--;
+    }
+}
+
+void paging_refillPools(void)
+{
+    while (dirtyTables)
+    {
+        bool ints = interrupts_disable();
+        pageTable_t* pt = dirtyTables;
+        if (pt)
+            dirtyTables = (pageTable_t*)pt->pages[0];
+        interrupts_restore(ints);
+
+        if (!pt)
+            break;
+        memset(pt, 0, sizeof(pageTable_t));
+
+        ints = interrupts_disable();
+        pt->pages[0] = (uint32_t)cleanTables;
+        cleanTables = pt;
+        interrupts_restore(ints);
+    }
+}
+
+// Fills the caches, so that the first processes do not need to allocate their paging structures
+static void fillPools(void)
+{
+    for (uint32_t i = 0; i < PT_CACHE_SIZE/2; i++)
+    {
+        pageTable_t* pt = malloc(sizeof(pageTable_t), PAGESIZE, "pageTable");
+        if (!pt)
+            return;
+        memset(pt, 0, sizeof(pageTable_t));
+        pt->pages[0] = (uint32_t)cleanTables;
+        cleanTables = pt;
+        cachedTables++;
+        pageTableCount++;
+    }
+    for (uint32_t i = 0; i < PD_CACHE_SIZE/2; i++)
+    {
+        pageDirectory_t* pd = malloc(sizeof(pageDirectory_t), PAGESIZE, "pag-userPD");
+        if (!pd)
+            return;
+        memset(pd, 0, sizeof(pageDirectory_t));
+        pd->physAddr = paging_getPhysAddr(pd->codes);
+        pd->next = cachedDirectories;
+        cachedDirectories = pd;
+        cachedDirectoryCount++;
+    }
+}
+
+// Maps the range of a page directory entry by a 4 MiB page. An empty page table there (e.g. preallocated for the kernel heap)
+// goes to the cache of page tables, so its memory is used again.
+static void setLargePage(pageDirectory_t* pd, uint32_t i, uint32_t code, tlbBatch_t* batch)
+{
+    pageTable_t* pt = (pd->codes[i] & LARGE_PAGE) ? 0 : pd->tables[i];
+    tlbBatch_add(batch, i*LARGE_PAGESIZE, LARGE_PAGESIZE, pd->codes[i]);
+    setPDE(pd, i, code, 0);
+    if (pt)
+        freeTable(pt);
+}
+
+// Replaces a 4 MiB page by a page table mapping the same memory
+static bool splitLargePage(pageDirectory_t* pd, uint32_t i)
+{
+    pageTable_t* pt = allocTable();
+    if (!pt)
+        return (false);
+
+    uint32_t code = pd->codes[i];
+    for (uint32_t j = 0; j < PAGE_COUNT; j++)
+    {
+        pt->pages[j] = ((code & 0xFFC00000) + j*PAGESIZE) | (code & (MEM_PRESENT|MEM_WRITE|MEM_USER|MEM_WRITETHROUGH|MEM_NOCACHE|MEM_NOTLBUPDATE|PAGE_SHARED));
+    }
+    setPDE(pd, i, paging_getPhysAddr(pt) | MEM_PRESENT | MEM_WRITE | (code & MEM_USER), pt);
+
+    // Invalidating one address removes the whole 4 MiB entry, on this CPU and on all others that might have cached it
+    tlbBatch_t batch = {0, 0, false};
+    tlbBatch_add(&batch, i*LARGE_PAGESIZE, PAGESIZE, code);
+    tlbBatch_flush(&batch, pd);
+    return (true);
+}
+
+// Returns the page table, allocates it if necessary
+static pageTable_t* getTable(pageDirectory_t* pd, uint32_t i, MEMFLAGS_t flags)
+{
+    pageTable_t* pt = pd->tables[i];
+    if (!pt)
+    {
+        pt = allocTable();
+        if (pt)
+        {
+            setPDE(pd, i, paging_getPhysAddr(pt) | MEM_PRESENT | MEM_WRITE | (flags&(~MEM_NOTLBUPDATE)), pt);
+        }
+    }
+    return (pt);
+}
+
+
+/// Buddy allocator
+
+static inline bool buddyIsFree(uint32_t frame, uint8_t order)
+{
+    uint32_t block = frame >> order;
+    return (frame < frameCount && (buddyMap[order][block/32] & BIT(block%32)));
+}
+
+static inline memoryZone_t* zoneOf(uint32_t frame)
+{
+    return (&zones[frame < DMA_ZONE_END/PAGESIZE ? MEM_ZONE_DMA : MEM_ZONE_NORMAL]);
+}
+
+static void buddyInsert(uint32_t frame, uint8_t order)
+{
+    uint32_t block = frame >> order;
+    memoryZone_t* zone = zoneOf(frame);
+    buddyMap[order][block/32] |= BIT(block%32);
+    zone->freeBlocks[order]++;
+    zone->firstFreeDWORD[order] = min(zone->firstFreeDWORD[order], block/32);
+}
+
+static void buddyRemove(uint32_t frame, uint8_t order)
+{
+    uint32_t block = frame >> order;
+    buddyMap[order][block/32] &= ~BIT(block%32);
+    zoneOf(frame)->freeBlocks[order]--;
+}
+
+// Marks the frames of a block in the bittable
+static void markFrames(uint32_t frame, uint32_t count, bool reserved)
+{
+    for (; count && frame%32; frame++, count--)
+        if (reserved) SET_BIT(bittable[frame/32], frame%32); else CLEAR_BIT(bittable[frame/32], frame%32);
+    if (count >= 32)
+    {
+        memset(bittable + frame/32, reserved ? 0xFF : 0, count/32*4);
+        frame += count & ~31;
+        count %= 32;
+    }
+    for (; count; frame++, count--)
+        if (reserved) SET_BIT(bittable[frame/32], frame%32); else CLEAR_BIT(bittable[frame/32], frame%32);
+}
+
+// Returns whether all frames of the naturally aligned block are free in the bittable
+static bool framesFree(uint32_t frame, uint8_t order)
+{
+    if (frame + BIT(order) > frameCount)
+        return (false);
+    if (order < 5)
+        return (((bittable[frame/32] >> (frame%32)) & (BIT(BIT(order))-1)) == 0);
+    for (uint32_t i = frame/32; i < (frame + BIT(order))/32; i++)
+        if (bittable[i])
+            return (false);
+    return (true);
+}
+
+static void buddyInit(void)
+{
+    for (uint8_t order = 0; order < BUDDY_ORDERS; order++)
+    {
+        size_t size = alignUp((frameCount >> order) + 1, 32) / 8;
+        buddyMap[order] = malloc(size, 0, "pag-buddyMap");
+        memset(buddyMap[order], 0, size);
+
+        for (uint8_t zone = 0; zone < MEM_ZONES; zone++)
+            zones[zone].firstFreeDWORD[order] = 0xFFFFFFFF;
+    }
+
+    // Insert all free frames as blocks as large as possible
+    for (uint32_t frame = 0; frame < frameCount;)
+    {
+        int8_t order = BUDDY_ORDERS-1;
+        while (order >= 0 && (frame % BIT(order) || !framesFree(frame, order)))
+            order--;
+
+        if (order < 0)
+        {
+            frame++;
+            continue;
+        }
+        buddyInsert(frame, order);
+        frame += BIT(order);
+    }
+}
+
+// Takes a free block of the given order from a zone, splitting larger blocks if necessary. Returns the frame number, 0 if none is available.
+static uint32_t buddyAlloc(memoryZone_t* zone, uint8_t order)
+{
+    for (uint8_t o = order; o < BUDDY_ORDERS; o++)
+    {
+        if (zone->freeBlocks[o] == 0)
+            continue;
+
+        // Find the first free block of this order that belongs to the zone
+        uint32_t last = ((zone->end >> o) + 31) / 32;
+        for (uint32_t i = max(zone->firstFreeDWORD[o], (zone->begin >> o) / 32); i < last; i++)
+        {
+            uint32_t bits = buddyMap[o][i];
+            while (bits)
+            {
+                uint32_t bitnr;
+                __asm__("bsfl %1, %0" : "=r"(bitnr) : "r"(bits));
+                uint32_t frame = (i*32 + bitnr) << o;
+                if (frame >= zone->begin && frame < zone->end)
+                {
+                    zone->firstFreeDWORD[o] = i;
+                    buddyRemove(frame, o);
+
+                    // Return the upper halves of the block as long as it is larger than requested
+                    while (o > order)
+                    {
+                        o--;
+                        buddyInsert(frame + BIT(o), o);
+                    }
+                    markFrames(frame, BIT(order), true);
+                    return (frame);
+                }
+                bits &= ~BIT(bitnr);
+            }
+        }
+        zone->firstFreeDWORD[o] = last; // There is no free block of this order below. Happens only if the counter is wrong.
+    }
     return (0);
 }
 
-static void physMemFree(uint32_t addr)
+static void buddyFree(uint32_t frame, uint8_t order)
 {
-    // Calculate the number of the bit
-    uint32_t bitnr = addr / PAGESIZE;
+    markFrames(frame, BIT(order), false);
+
+    // Merge with the buddy as long as it is free
+    while (order < BUDDY_ORDERS-1 && buddyIsFree(frame ^ BIT(order), order))
+    {
+        buddyRemove(frame ^ BIT(order), order);
+        frame &= ~BIT(order);
+        order++;
+    }
+    buddyInsert(frame, order);
+}
 
-    // Maybe the affected dword (which has a free bit now) is ahead of firstFreeDWORD?
-    if (bitnr/32 < firstFreeDWORD)
+// Frees an arbitrary range of frames, split into naturally aligned blocks
+static void buddyFreeRange(uint32_t frame, uint32_t count)
+{
+    while (count)
     {
-        firstFreeDWORD = bitnr/32;
+        uint8_t order = 0;
+        while (order < BUDDY_ORDERS-1 && frame % BIT(order+1) == 0 && BIT(order+1) <= count)
+            order++;
+        buddyFree(frame, order);
+        frame += BIT(order);
+        count -= BIT(order);
     }
+}
+
+// Takes 2^order frames from the normal zone. If it is exhausted, the DMA zone is used, but only as long as DMA_ZONE_RESERVE stays free
+// there, so heap growth and large allocations cannot take the memory ISA DMA and floppy need. Interrupts have to be disabled.
+static uint32_t allocNormal(uint8_t order)
+{
+    uint32_t frame = buddyAlloc(&zones[MEM_ZONE_NORMAL], order);
+    if (frame != 0 || order == BUDDY_ORDERS-1)
+        return (frame);
+
+    uint32_t freeDMAFrames = 0;
+    for (uint8_t o = 0; o < BUDDY_ORDERS; o++)
+        freeDMAFrames += zones[MEM_ZONE_DMA].freeBlocks[o] << o;
+    if (freeDMAFrames < DMA_ZONE_RESERVE/PAGESIZE + BIT(order))
+        return (0);
+    return (buddyAlloc(&zones[MEM_ZONE_DMA], order));
+}
+
+// Allocates 2^order contiguous frames, from the normal zone if possible. Returns the physical address, 0 if there is not enough memory.
+static uint32_t physMemAllocBlock(uint8_t order)
+{
+    bool enabled = interrupts_disable();
+    uint32_t frame = allocNormal(order);
+    interrupts_restore(enabled);
+    return (frame * PAGESIZE);
+}
+
+static void physMemFreeRange(uint32_t addr, uint32_t count)
+{
+    uint32_t frame = addr / PAGESIZE;
+    if (frame >= frameCount || frame == 0)
+        return;
 
-    // Set the page to "free"
-    CLEAR_BIT(bittable[bitnr/32], bitnr%32);
+    bool enabled = interrupts_disable();
+    buddyFreeRange(frame, count);
+    interrupts_restore(enabled);
+}
+
+uintptr_t paging_allocContiguous(uint32_t size, MEMZONE_t zone)
+{
+    uint32_t count = alignUp(size, PAGESIZE) / PAGESIZE;
+    uint8_t order = 0;
+    while (BIT(order) < count)
+        order++;
+    if (count == 0 || order >= BUDDY_ORDERS)
+        return (0);
+
+    bool enabled = interrupts_disable();
+    uint32_t frame = zone == MEM_ZONE_NORMAL ? allocNormal(order) : buddyAlloc(&zones[MEM_ZONE_DMA], order);
+
+    // Give back the frames that were not requested
+    if (frame)
+        buddyFreeRange(frame + count, BIT(order) - count);
+    interrupts_restore(enabled);
+
+    return (frame * PAGESIZE);
+}
+
+void paging_freeContiguous(uintptr_t physAddress, uint32_t size)
+{
+    ASSERT(physAddress % PAGESIZE == 0);
+    physMemFreeRange(physAddress, alignUp(size, PAGESIZE) / PAGESIZE);
 }
 
 bool paging_alloc(pageDirectory_t* pd, void* virtAddress, uint32_t size, MEMFLAGS_t flags)
@@ -282,100 +788,365 @@ bool paging_alloc(pageDirectory_t* pd, void* virtAddress, uint32_t size, MEMFLAG
     ASSERT(((uint32_t)virtAddress) % PAGESIZE == 0);
     ASSERT(size % PAGESIZE == 0);
 
-    // We repeat allocating one page at once
-    for (uint32_t done=0; done<size/PAGESIZE; done++)
+    flags = pageFlags(pd, flags);
+
+    // The pages are filled page table by page table. Only pages that were not present are set up, so no TLB entries have to be invalidated.
+    // Physical memory is taken in blocks as large as possible, to reduce the number of allocations.
+    uint32_t physAddress = 0, blockPages = 0;
+    uint32_t pagenr = (uint32_t)virtAddress/PAGESIZE;
+    uint32_t end    = pagenr + size/PAGESIZE;
+    while (pagenr < end)
     {
-        uint32_t pagenr = (uint32_t)virtAddress/PAGESIZE + done;
+        uint32_t table = pagenr/PAGE_COUNT;
+        uint32_t last  = min(end, (table+1)*PAGE_COUNT);
 
         // Maybe there is already memory allocated?
-        if (pd->tables[pagenr/PAGE_COUNT] && pd->tables[pagenr/PAGE_COUNT]->pages[pagenr%PAGE_COUNT])
+        if (pd->codes[table] & LARGE_PAGE)
         {
-            kdebug(3, "pagenumber already allocated: %u\n", pagenr);
+            kdebug(3, "pagenumbers already allocated: %u - %u\n", pagenr, last-1);
+            pagenr = last;
             continue;
         }
 
-        // Allocate physical memory
-        uint32_t physAddress = physMemAlloc();
+        // Kernel memory covering a whole page table is mapped by a 4 MiB page, if possible
+        if (pse && pd == kernelPageDirectory && !(flags & MEM_USER) && blockPages == 0 && pagenr%PAGE_COUNT == 0 &&
+            end - pagenr >= PAGE_COUNT && isTableEmpty(pd->tables[table]))
+        {
+            physAddress = physMemAllocBlock(BUDDY_ORDERS-1); // Blocks of the highest order are aligned to 4 MiB
+            if (physAddress)
+            {
+                tlbBatch_t batch = {0, 0, false};
+                setLargePage(pd, table, physAddress | flags | MEM_PRESENT | LARGE_PAGE, &batch);
+                tlbBatch_flush(&batch, pd);
+                pagenr = last;
+                continue;
+            }
+        }
 
-        if (physAddress == 0)
+        // Get the page table
+        pageTable_t* pt = getTable(pd, table, flags);
+        if (!pt)
         {
             // Undo the allocations and return an error
-            paging_free(pd, virtAddress, done*PAGESIZE);
+            physMemFreeRange(physAddress, blockPages);
+            paging_free(pd, virtAddress, (pagenr - (uint32_t)virtAddress/PAGESIZE)*PAGESIZE);
             return (false);
         }
 
-        // Get the page table
-        pageTable_t* pt = pd->tables[pagenr/PAGE_COUNT];
+        // Setup the pages of this table
+        for (; pagenr < last; pagenr++)
+        {
+            uint32_t* page = &pt->pages[pagenr%PAGE_COUNT];
+            if (*page)
+            {
+                kdebug(3, "pagenumber already allocated: %u\n", pagenr);
+                continue;
+            }
+
+            // Allocate physical memory
+            if (blockPages == 0)
+            {
+                uint8_t order = 0;
+                while (order < BUDDY_ORDERS-1 && BIT(order+1) <= end - pagenr)
+                    order++;
+                do
+                {
+                    physAddress = physMemAllocBlock(order);
+                } while (physAddress == 0 && order-- > 0);
+
+                if (physAddress == 0)
+                {
+                    // Undo the allocations and return an error
+                    paging_free(pd, virtAddress, (pagenr - (uint32_t)virtAddress/PAGESIZE)*PAGESIZE);
+                    return (false);
+                }
+                blockPages = BIT(order);
+            }
+
+            *page = physAddress | flags | MEM_PRESENT;
+
+            if (flags & MEM_USER)
+                kdebug(3, "pagenumber now allocated: %u physAddress: %Xh\n", pagenr, physAddress);
+
+            physAddress += PAGESIZE;
+            blockPages--;
+        }
+    }
+
+    // Pages of the last block that have not been used, because some pages were already allocated
+    if (blockPages)
+        physMemFreeRange(physAddress, blockPages);
+
+    return (true);
+}
+
+void paging_free(pageDirectory_t* pd, void* virtAddress, uint32_t size)
+{
+    // "virtAddress" and "size" must be page-aligned
+    ASSERT(((uint32_t)virtAddress) % PAGESIZE == 0);
+    ASSERT(size % PAGESIZE == 0);
+
+    // Go through all page tables and free their pages. Physically contiguous pages are given back at once.
+    tlbBatch_t batch = {0, 0, false};
+    uint32_t pagenr = (uint32_t)virtAddress / PAGESIZE;
+    uint32_t end    = pagenr + size/PAGESIZE;
+    uint32_t runStart = 0, runPages = 0;
 
+    while (pagenr < end)
+    {
+        uint32_t table = pagenr/PAGE_COUNT;
+        uint32_t last  = min(end, (table+1)*PAGE_COUNT);
+
+        if (pd->codes[table] & LARGE_PAGE)
+        {
+            if (pagenr%PAGE_COUNT == 0 && last - pagenr == PAGE_COUNT)
+            {
+                // Free the whole 4 MiB page. Frames owned by someone else (paging_mapPhysical with MEM_SHARED) are only unmapped.
+                tlbBatch_add(&batch, pagenr*PAGESIZE, LARGE_PAGESIZE, pd->codes[table]);
+                if ((pd->codes[table] & (PAGE_SHARED|MEM_PRESENT)) == MEM_PRESENT)
+                    physMemFreeRange(pd->codes[table] & 0xFFC00000, PAGE_COUNT);
+                setPDE(pd, table, 0, 0);
+                pagenr = last;
+                continue;
+            }
+
+            // Only a part of the 4 MiB page is freed, so it has to be split into 4 KiB pages
+            if (!splitLargePage(pd, table))
+            {
+                textColor(ERROR);
+                printf("\npaging_free: Could not split 4 MiB page at %Xh", pagenr*PAGESIZE);
+                textColor(TEXT);
+                break;
+            }
+        }
+
+        pageTable_t* pt = pd->tables[table];
         if (!pt)
         {
-            // Allocate the page table
-            pt = malloc(sizeof(pageTable_t), PAGESIZE, "pageTable");
+            pagenr = last;
+            continue;
+        }
 
-            if (!pt)
+        for (; pagenr < last; pagenr++)
+        {
+            // Get the physical address and remove the page
+            uint32_t* page = &pt->pages[pagenr%PAGE_COUNT];
+            if (*page == 0)
+                continue;
+            uint32_t physAddress = (*page & (PAGE_SHARED|MEM_PRESENT)) == MEM_PRESENT ? (*page & 0xFFFFF000) : 0;
+            tlbBatch_add(&batch, pagenr*PAGESIZE, PAGESIZE, *page);
+            *page = 0;
+
+            // Free memory
+            if (physAddress && physAddress == runStart + runPages*PAGESIZE)
             {
-                // Undo the allocations and return an error
-                physMemFree(physAddress);
-                paging_free(pd, virtAddress, done*PAGESIZE);
-                return (false);
+                runPages++;
             }
-            memset(pt, 0, sizeof(pageTable_t));
-            pd->tables[pagenr/PAGE_COUNT] = pt;
+            else if (physAddress)
+            {
+                physMemFreeRange(runStart, runPages);
+                runStart = physAddress;
+                runPages = 1;
+            }
+        }
+    }
+    tlbBatch_flush(&batch, pd);
+    physMemFreeRange(runStart, runPages);
+}
 
-            // Set physical address and flags
-            pd->codes[pagenr/PAGE_COUNT] = paging_getPhysAddr(pt) | MEM_PRESENT | MEM_WRITE | (flags&(~MEM_NOTLBUPDATE));
+bool paging_mapPhysical(pageDirectory_t* pd, void* virtAddress, uint32_t physAddress, uint32_t size, MEMFLAGS_t flags)
+{
+    // Addresses and "size" must be page-aligned
+    ASSERT(((uint32_t)virtAddress) % PAGESIZE == 0);
+    ASSERT(physAddress % PAGESIZE == 0);
+    ASSERT(size % PAGESIZE == 0);
+
+    flags = pageFlags(pd, flags);
+
+    tlbBatch_t batch = {0, 0, false};
+    uint32_t pagenr = (uint32_t)virtAddress/PAGESIZE;
+    uint32_t end    = pagenr + size/PAGESIZE;
+    while (pagenr < end)
+    {
+        uint32_t table = pagenr/PAGE_COUNT;
+        uint32_t last  = min(end, (table+1)*PAGE_COUNT);
+
+        // Kernel mappings covering a whole page table are done by 4 MiB pages, if the physical address is suitable
+        if (pse && pd == kernelPageDirectory && !(flags & MEM_USER) && pagenr%PAGE_COUNT == 0 && last - pagenr == PAGE_COUNT &&
+            physAddress % LARGE_PAGESIZE == 0 && ((pd->codes[table] & LARGE_PAGE) || isTableEmpty(pd->tables[table])))
+        {
+            setLargePage(pd, table, physAddress | flags | MEM_PRESENT | LARGE_PAGE, &batch);
+            physAddress += LARGE_PAGESIZE;
+            pagenr = last;
+            continue;
         }
 
-        // Setup the page
-        pt->pages[pagenr%PAGE_COUNT] = physAddress | flags | MEM_PRESENT;
+        if ((pd->codes[table] & LARGE_PAGE) && !splitLargePage(pd, table))
+        {
+            tlbBatch_flush(&batch, pd);
+            return (false);
+        }
 
-        if(pd == currentPageDirectory)
-            invalidateTLBEntry(virtAddress + done*PAGESIZE);
+        pageTable_t* pt = getTable(pd, table, flags);
+        if (!pt)
+        {
+            tlbBatch_flush(&batch, pd);
+            return (false);
+        }
 
-        if (flags & MEM_USER)
-            kdebug(3, "pagenumber now allocated: %u physAddress: %Xh\n", pagenr, physAddress);
+        // Fill the page table in one pass
+        for (; pagenr < last; pagenr++)
+        {
+            uint32_t* page = &pt->pages[pagenr%PAGE_COUNT];
+            tlbBatch_add(&batch, pagenr*PAGESIZE, PAGESIZE, *page);
+            *page = physAddress | flags | MEM_PRESENT;
+            physAddress += PAGESIZE;
+        }
     }
+
+    tlbBatch_flush(&batch, pd);
     return (true);
 }
 
-void paging_free(pageDirectory_t* pd, void* virtAddress, uint32_t size)
+bool paging_reserve(pageDirectory_t* pd, void* virtAddress, uint32_t size, MEMFLAGS_t flags)
 {
     // "virtAddress" and "size" must be page-aligned
     ASSERT(((uint32_t)virtAddress) % PAGESIZE == 0);
     ASSERT(size % PAGESIZE == 0);
 
-    // Go through all pages and free them
-    uint32_t pagenr = (uint32_t)virtAddress / PAGESIZE;
+    for (uint32_t pagenr = (uint32_t)virtAddress/PAGESIZE; pagenr < ((uint32_t)virtAddress + size)/PAGESIZE; pagenr++)
+    {
+        pageTable_t* pt = getTable(pd, pagenr/PAGE_COUNT, flags);
+        if (!pt)
+        {
+            return (false);
+        }
+
+        uint32_t* page = &pt->pages[pagenr%PAGE_COUNT];
+        if (*page == 0)
+        {
+            *page = PAGE_DEMAND | (flags & (MEM_USER|MEM_WRITE));
+        }
+        else if (*page & PAGE_DEMAND) // Several segments may share a page
+        {
+            *page |= flags & MEM_WRITE;
+        }
+    }
+    return (true);
+}
 
-    while (size)
+bool paging_handlePageFault(uintptr_t address, bool write)
+{
+    pageDirectory_t* pd = currentPageDirectory;
+    uint32_t pagenr = address/PAGESIZE;
+    if ((pd->codes[pagenr/PAGE_COUNT] & LARGE_PAGE) || !pd->tables[pagenr/PAGE_COUNT])
     {
-        // Get the physical address and invalidate the page
-        uint32_t* page = &pd->tables[pagenr/PAGE_COUNT]->pages[pagenr%PAGE_COUNT];
-        uint32_t physAddress = *page & 0xFFFFF000;
-        *page = 0;
-        if(pd == currentPageDirectory)
-            invalidateTLBEntry((uint8_t*)(pagenr*PAGESIZE));
+        return (false);
+    }
+
+    uint32_t* page  = &pd->tables[pagenr/PAGE_COUNT]->pages[pagenr%PAGE_COUNT];
+    uint8_t*  vaddr = (uint8_t*)(pagenr*PAGESIZE);
+    bool fromImage  = pd->image && userImage_containsData(pd->image, (uintptr_t)vaddr);
+
+    if (!(*page & MEM_PRESENT) && (*page & PAGE_DEMAND))
+    {
+        uint32_t flags = *page & (MEM_USER|MEM_WRITE);
+        if (write && !(flags & MEM_WRITE))
+            return (false);
+
+        if (fromImage && !write)
+        {
+            // Map the shared frame read-only, load it if it is the first access by any process
+            uint32_t* frame = userImage_sharedFrame(pd->image, (uintptr_t)vaddr);
+            bool load = (*frame == 0);
+            if (load)
+            {
+                *frame = physMemAllocBlock(0);
+                if (*frame == 0)
+                    return (false);
+                *page = *frame | MEM_PRESENT | MEM_WRITE; // Kernel has to write it once
+                invalidateTLBEntry(vaddr);
+                userImage_fillPage(pd->image, (uintptr_t)vaddr, vaddr);
+            }
+            *page = *frame | MEM_PRESENT | (flags & MEM_USER) | PAGE_SHARED | ((flags & MEM_WRITE) ? PAGE_COW : 0);
+            invalidateTLBEntry(vaddr);
+            return (true);
+        }
+
+        // Private page: Demand-zero memory or written page of the image
+        uint32_t physAddress = physMemAllocBlock(0);
+        if (physAddress == 0)
+            return (false);
+        *page = physAddress | MEM_PRESENT | MEM_WRITE | (flags & MEM_USER);
+        invalidateTLBEntry(vaddr);
+        if (fromImage)
+            userImage_fillPage(pd->image, (uintptr_t)vaddr, vaddr);
+        else
+            memset(vaddr, 0, PAGESIZE);
+        *page = physAddress | MEM_PRESENT | flags;
+        invalidateTLBEntry(vaddr);
+        return (true);
+    }
 
-        // Free memory and adjust variables for next loop run
-        physMemFree(physAddress);
-        size -= PAGESIZE;
-        pagenr++;
+    if ((*page & MEM_PRESENT) && (*page & PAGE_COW) && write)
+    {
+        // Copy on write: The shared frame contains the data of the file, so the private copy is built from the file as well
+        uint32_t physAddress = physMemAllocBlock(0);
+        if (physAddress == 0)
+            return (false);
+        *page = physAddress | MEM_PRESENT | MEM_WRITE | (*page & MEM_USER);
+        invalidateTLBEntry(vaddr);
+        userImage_fillPage(pd->image, (uintptr_t)vaddr, vaddr);
+        return (true);
     }
+
+    return (false);
 }
 
 pageDirectory_t* paging_createUserPageDirectory(void)
 {
-    // Allocate memory for the page directory
-    pageDirectory_t* pd = (pageDirectory_t*) malloc(sizeof(pageDirectory_t), PAGESIZE,"pag-userPD");
+    if (userPageDirectories == 0)
+    {
+        userPageDirectories = list_create();
+        fillPools();
+    }
+
+    // Take a page directory from the cache. Its user half is zero already and it has no image.
+    bool ints = interrupts_disable();
+    pageDirectory_t* pd = cachedDirectories;
+    if (pd)
+    {
+        cachedDirectories = pd->next;
+        cachedDirectoryCount--;
+    }
+    interrupts_restore(ints);
 
     if (!pd)
     {
+        // Allocate memory for the page directory
+        pd = (pageDirectory_t*) malloc(sizeof(pageDirectory_t), PAGESIZE,"pag-userPD");
+        if (!pd)
+        {
+            return (0);
+        }
+        memset(pd, 0, sizeof(pageDirectory_t));
+        pd->physAddr = paging_getPhysAddr(pd->codes);
+    }
+
+    if (!list_append(userPageDirectories, pd))
+    {
+        free(pd);
         return (0);
     }
 
-    // Each user's page directory contains the same mapping as the kernel
-    memcpy(pd, kernelPageDirectory, sizeof(pageDirectory_t));
-    pd->physAddr = paging_getPhysAddr(pd->codes);
+    // Each user's page directory contains the same mapping of kernel memory. The kernel's page tables are shared.
+    // As the page directory is in the list now, later changes of the kernel's page directory are applied by setPDE.
+    ints = interrupts_disable();
+    memcpy(pd->codes,                   kernelPageDirectory->codes,                   KERNEL_PT_LOW*sizeof(uint32_t));
+    memcpy(pd->tables,                  kernelPageDirectory->tables,                  KERNEL_PT_LOW*sizeof(pageTable_t*));
+    memcpy(pd->codes + KERNEL_PT_HIGH,  kernelPageDirectory->codes + KERNEL_PT_HIGH,  (PT_COUNT-KERNEL_PT_HIGH)*sizeof(uint32_t));
+    memcpy(pd->tables + KERNEL_PT_HIGH, kernelPageDirectory->tables + KERNEL_PT_HIGH, (PT_COUNT-KERNEL_PT_HIGH)*sizeof(pageTable_t*));
+    interrupts_restore(ints);
 
     return (pd);
 }
@@ -386,57 +1157,115 @@ void paging_destroyUserPageDirectory(pageDirectory_t* pd)
     if(pd == currentPageDirectory)
         paging_switch(kernelPageDirectory); // Leave current PD, if we attempt to delete it
 
-    // Free all memory that is not from the kernel
-    for (uint32_t i=0; i<PT_COUNT; i++)
+    list_delete(userPageDirectories, list_find(userPageDirectories, pd));
+
+    // Free all memory that is not from the kernel. Only the page tables set up for this page directory are visited.
+    for (uint32_t i = 0; i < PT_COUNT/32; i++)
     {
-        if (pd->tables[i] && (pd->tables[i] != kernelPageDirectory->tables[i]))
+        while (pd->ownTables[i])
         {
-            for (uint32_t j=0; j<PAGE_COUNT; j++)
-            {
-                uint32_t physAddress = pd->tables[i]->pages[j] & 0xFFFFF000;
+            uint32_t bitnr;
+            __asm__("bsfl %1, %0" : "=r"(bitnr) : "r"(pd->ownTables[i]));
+            pd->ownTables[i] &= ~BIT(bitnr);
 
-                if (physAddress)
+            uint32_t table = i*32 + bitnr;
+            pageTable_t* pt = pd->tables[table];
+            if (pt)
+            {
+                uint32_t runStart = 0, runPages = 0;
+                for (uint32_t j=0; j<PAGE_COUNT; j++)
                 {
-                    physMemFree(physAddress);
+                    uint32_t physAddress = pt->pages[j] & 0xFFFFF000;
+                    if (!physAddress || (pt->pages[j] & PAGE_SHARED))
+                        continue;
+
+                    // Physically contiguous frames are given back at once
+                    if (physAddress == runStart + runPages*PAGESIZE)
+                    {
+                        runPages++;
+                    }
+                    else
+                    {
+                        physMemFreeRange(runStart, runPages);
+                        runStart = physAddress;
+                        runPages = 1;
+                    }
                 }
+                physMemFreeRange(runStart, runPages);
+                freeTable(pt);
             }
-            free(pd->tables[i]);
+            pd->codes[table]  = 0;
+            pd->tables[table] = 0;
         }
     }
 
+    if (pd->image)
+    {
+        userImage_release(pd->image);
+        pd->image = 0;
+    }
+
+    // Keep the page directory for the next process. Its user half is zero again.
+    bool ints = interrupts_disable();
+    if (cachedDirectoryCount < PD_CACHE_SIZE)
+    {
+        pd->next = cachedDirectories;
+        cachedDirectories = pd;
+        cachedDirectoryCount++;
+        pd = 0;
+    }
+    interrupts_restore(ints);
+
     free(pd);
 }
 
 
-void* paging_acquirePciMemory(uint32_t physAddress, uint32_t numberOfPages)
+bool paging_isUserArea(const void* address, size_t size, bool write)
 {
-    static void* virtAddress = (void*)PCI_MEM_START;
-    void* retVal = virtAddress;
-    task_switching  = false;
-
-    for (uint32_t i=0; i<numberOfPages; i++)
+    uintptr_t begin = (uintptr_t)address;
+    if (begin < KERNEL_PT_LOW*LARGE_PAGESIZE || begin >= KERNEL_PT_HIGH*LARGE_PAGESIZE || size > KERNEL_PT_HIGH*LARGE_PAGESIZE - begin)
+        return (false);
+
+    // Every page has to be accessible by the program. Pages loaded on demand and copy-on-write pages are handled by paging_handlePageFault.
+    const pageDirectory_t* pd = currentPageDirectory;
+    uint32_t last = (begin + (size ? size-1 : 0))/PAGESIZE;
+    for (uint32_t pagenr = begin/PAGESIZE; pagenr <= last; pagenr++)
     {
-        if (virtAddress == (void*)PCI_MEM_END)
+        uint32_t code = pd->codes[pagenr/PAGE_COUNT];
+        if (!(code & LARGE_PAGE))
         {
-            textColor(ERROR);
-            printf("\nNot enough PCI-memory available");
-            textColor(TEXT);
-            task_switching = true;
-            return (0);
+            if (!(code & MEM_PRESENT) || pd->tables[pagenr/PAGE_COUNT] == 0)
+                return (false);
+            code = pd->tables[pagenr/PAGE_COUNT]->pages[pagenr%PAGE_COUNT];
         }
+        if (!(code & MEM_USER) || !(code & (MEM_PRESENT|PAGE_DEMAND)) || (write && !(code & (MEM_WRITE|PAGE_COW))))
+            return (false);
+    }
+    return (true);
+}
 
-        uint32_t pagenr = (uintptr_t)virtAddress/PAGESIZE;
-
-        // Check the page table and setup the page
-        ASSERT(kernelPageDirectory->tables[pagenr/PAGE_COUNT]);
-        kernelPageDirectory->tables[pagenr/PAGE_COUNT]->pages[pagenr%PAGE_COUNT] = physAddress | MEM_PRESENT | MEM_WRITE | MEM_KERNEL;
+void* paging_acquirePciMemory(uint32_t physAddress, uint32_t numberOfPages)
+{
+    static void* virtAddress = (void*)PCI_MEM_START;
+    task_switching  = false;
 
-        invalidateTLBEntry(virtAddress);
+    // Large areas (like the linear framebuffer) are mapped by 4 MiB pages, if possible. The virtual address has to be aligned like the physical one.
+    if (pse && numberOfPages >= PAGE_COUNT && physAddress % LARGE_PAGESIZE == 0)
+    {
+        virtAddress = (void*)alignUp((uintptr_t)virtAddress, LARGE_PAGESIZE);
+    }
+    void* retVal = virtAddress;
 
-        // next page
-        virtAddress += PAGESIZE;
-        physAddress += PAGESIZE;
+    if (numberOfPages > ((uintptr_t)PCI_MEM_END - (uintptr_t)virtAddress)/PAGESIZE ||
+        !paging_mapPhysical(kernelPageDirectory, virtAddress, physAddress, numberOfPages*PAGESIZE, MEM_PRESENT | MEM_WRITE | MEM_KERNEL))
+    {
+        textColor(ERROR);
+        printf("\nNot enough PCI-memory available");
+        textColor(TEXT);
+        task_switching = true;
+        return (0);
     }
+    virtAddress += numberOfPages*PAGESIZE;
 
     task_switching = true;
     return (retVal);
@@ -450,6 +1279,12 @@ uintptr_t paging_getPhysAddr(void* virtAddress)
     uint32_t pageNumber = (uintptr_t)virtAddress / PAGESIZE;
     pageTable_t* pt = pd->tables[pageNumber/PAGE_COUNT];
 
+    if (pd->codes[pageNumber/PAGE_COUNT] & LARGE_PAGE)
+    {
+        // 4 MiB page: The page directory entry contains the address
+        return ( (pd->codes[pageNumber/PAGE_COUNT] & 0xFFC00000) + ((uintptr_t)virtAddress & 0x003FFFFF) );
+    }
+
   #ifdef _DIAGNOSIS_
     kdebug(3, "\nvirt-->phys: pagenr: %u ", pageNumber);
     kdebug(3, "pt: %Xh\n", pt);
@@ -468,20 +1303,32 @@ uintptr_t paging_getPhysAddr(void* virtAddress)
 
 static void* lookForVirtAddr(uintptr_t physAddr, uintptr_t start, uintptr_t end)
 {
-    for (uintptr_t i = start; i < end; i+=PAGESIZE)
+    for (uintptr_t i = start; i < end && i >= start;)
     {
+        uint32_t code = kernelPageDirectory->codes[i/LARGE_PAGESIZE];
+        if (code & LARGE_PAGE) // Check the whole 4 MiB page at once
+        {
+            if ((physAddr & 0xFFC00000) == (code & 0xFFC00000) && (physAddr & 0x003FFFFF) >= (i & 0x003FFFFF))
+            {
+                return (void*)((i & 0xFFC00000) + (physAddr & 0x003FFFFF));
+            }
+            i = alignDown(i, LARGE_PAGESIZE) + LARGE_PAGESIZE;
+            continue;
+        }
+
         if (paging_getPhysAddr((void*)i) == (physAddr & 0xFFFFF000))
         {
             return (void*)(i + (physAddr & 0x00000FFF));
         }
+        i += PAGESIZE;
     }
     return (0); // Not mapped between start and end
 }
 
 void* paging_getVirtAddr(uintptr_t physAddress)
 {
-    // check idendity mapping area
-    if (physAddress < IDMAP * 1024 * PAGESIZE)
+    // check idendity mapping area (including DMA zone)
+    if (physAddress < DMA_ZONE_END)
     {
         return (void*)physAddress;
     }
@@ -492,20 +1339,36 @@ void* paging_getVirtAddr(uintptr_t physAddress)
         return (virtAddr);
 
     // check pci memory
-    lookForVirtAddr(physAddress, (uintptr_t)PCI_MEM_START, (uintptr_t)PCI_MEM_END);
+    virtAddr = lookForVirtAddr(physAddress, (uintptr_t)PCI_MEM_START, (uintptr_t)PCI_MEM_END);
     if(virtAddr)
         return (virtAddr);
 
     // check between idendity mapping area and heap start
-    lookForVirtAddr(physAddress, IDMAP * 1024 * PAGESIZE, (uintptr_t)KERNEL_HEAP_START);
+    virtAddr = lookForVirtAddr(physAddress, DMA_ZONE_END, (uintptr_t)KERNEL_HEAP_START);
     if(virtAddr)
         return (virtAddr);
 
     // check between current heap end and theoretical heap end
-    lookForVirtAddr(physAddress, (uintptr_t)heap_getCurrentEnd(), (uintptr_t)KERNEL_HEAP_END);
+    virtAddr = lookForVirtAddr(physAddress, (uintptr_t)heap_getCurrentEnd(), (uintptr_t)KERNEL_HEAP_END);
     return (virtAddr);
 }
 
+void paging_getStatistics(pagingStatistics_t* stats)
+{
+    stats->totalFrames   = frameCount;
+    stats->freeFrames    = 0;
+    stats->freeDMAFrames = 0;
+
+    bool ints = interrupts_disable();
+    for (uint8_t order = 0; order < BUDDY_ORDERS; order++)
+    {
+        stats->freeFrames    += (zones[MEM_ZONE_DMA].freeBlocks[order] + zones[MEM_ZONE_NORMAL].freeBlocks[order]) << order;
+        stats->freeDMAFrames += zones[MEM_ZONE_DMA].freeBlocks[order] << order;
+    }
+    stats->pageTables       = pageTableCount;
+    stats->cachedPageTables = cachedTables;
+    interrupts_restore(ints);
+}
 
 void paging_analyzeBitTable(void)
 {
@@ -551,6 +1414,18 @@ void paging_analyzeBitTable(void)
         }
 
     }
+
+    // Summary of the kernel's mappings. Frames of 4 MiB pages appear as used in the bittable above.
+    uint32_t largePages = 0, pageTables = 0;
+    for (uint32_t i=0; i < PT_COUNT; i++)
+    {
+        if (kernelPageDirectory->codes[i] & LARGE_PAGE)
+            largePages++;
+        else if (kernelPageDirectory->tables[i])
+            pageTables++;
+    }
+    textColor(TEXT);
+    printf("\nKernel mappings: %u 4 MiB pages, %u page tables", largePages, pageTables);
     textColor(TEXT);
 }
 
@@ -3,17 +3,26 @@
 
 #include "util/util.h"
 
-#define PAGESIZE   0x1000 // Size of one page in bytes
-#define PAGE_COUNT 1024   // Number of pages per page table
-#define PT_COUNT   1024   // Number of page tables per page directory
+#define PAGESIZE       0x1000   // Size of one page in bytes
+#define PAGE_COUNT     1024     // Number of pages per page table
+#define PT_COUNT       1024     // Number of page tables per page directory
+#define LARGE_PAGESIZE 0x400000 // Size of a 4 MiB page (PSE), i.e. the memory covered by one page table
 
 
 typedef enum
 {
     MEM_KERNEL = 0, MEM_PRESENT = 1, MEM_WRITE = 2, MEM_USER = 4,
-    MEM_WRITETHROUGH = BIT(3), MEM_NOCACHE = BIT(4), MEM_NOTLBUPDATE = BIT(8)
+    MEM_WRITETHROUGH = BIT(3), MEM_NOCACHE = BIT(4), MEM_NOTLBUPDATE = BIT(8),
+    MEM_SHARED = BIT(10) // paging_mapPhysical: The frames are owned by someone else and are not freed with the mapping
 } MEMFLAGS_t;
 
+typedef enum
+{
+    MEM_ZONE_DMA,    // Physical memory below 16 MiB (DMA_ZONE_END). Identity mapped, so the physical address can be used directly.
+    MEM_ZONE_NORMAL, // Physical memory above 16 MiB. Falls back to MEM_ZONE_DMA if there is not enough memory, except for DMA_ZONE_RESERVE.
+    MEM_ZONES
+} MEMZONE_t;
+
 
 // Memory Map
 typedef struct
@@ -24,18 +33,30 @@ typedef struct
     uint32_t type;   // Is "1" for "free"
 } __attribute__((packed)) memoryMapEntry_t;
 
-// Paging
+// Paging. The structures consist of dwords only, so they need no packing.
 typedef struct
 {
     uint32_t pages[PAGE_COUNT];
-} __attribute__((packed)) pageTable_t;
+} pageTable_t;
 
-typedef struct
+typedef struct pageDirectory
 {
     uint32_t     codes[PT_COUNT];
     pageTable_t* tables[PT_COUNT];
     uint32_t     physAddr;
-} __attribute__((packed)) pageDirectory_t;
+    struct userImage* image; // Executable whose pages are loaded on demand (cf. userimage.h)
+    uint32_t     ownTables[PT_COUNT/32]; // Bitmap of the page directory entries set up for this page directory only (user page directories)
+    struct pageDirectory* next; // Link in the cache of unused user page directories (paging.c)
+} pageDirectory_t;
+
+typedef struct
+{
+    uint32_t totalFrames;      // Frames of physical memory, including reserved ones
+    uint32_t freeFrames;
+    uint32_t freeDMAFrames;    // Free frames below DMA_ZONE_END
+    uint32_t pageTables;       // Page tables allocated by paging (including the ones of the kernel)
+    uint32_t cachedPageTables; // Page tables kept for reuse
+} pagingStatistics_t;
 
 
 extern pageDirectory_t* kernelPageDirectory;
@@ -45,15 +66,25 @@ uint32_t paging_install(memoryMapEntry_t* memoryMapBegin, memoryMapEntry_t* memo
 
 bool  paging_alloc(pageDirectory_t* pd, void* virtAddress, uint32_t size, MEMFLAGS_t flags);
 void  paging_free (pageDirectory_t* pd, void* virtAddress, uint32_t size);
+bool  paging_reserve(pageDirectory_t* pd, void* virtAddress, uint32_t size, MEMFLAGS_t flags); // Physical memory is allocated on first access
+bool  paging_mapPhysical(pageDirectory_t* pd, void* virtAddress, uint32_t physAddress, uint32_t size, MEMFLAGS_t flags); // Maps a physically contiguous range, flushes the TLB once
+bool  paging_handlePageFault(uintptr_t address, bool write); // Returns true, if the fault was resolved by loading or copying the page
+bool  paging_isUserArea(const void* address, size_t size, bool write); // Returns true, if the range is mapped (or loaded on demand) for the current user program and writable if requested
 void* paging_acquirePciMemory(uint32_t physAddress, uint32_t numberOfPages);
 
+uintptr_t paging_allocContiguous(uint32_t size, MEMZONE_t zone); // Allocates physically contiguous memory (up to 4 MiB), returns the physical address or 0
+void      paging_freeContiguous(uintptr_t physAddress, uint32_t size);
+
 pageDirectory_t* paging_createUserPageDirectory(void);
 void             paging_destroyUserPageDirectory(pageDirectory_t* pd);
 void             paging_switch(pageDirectory_t* pd);
+void             paging_flushTLB(uintptr_t begin, uintptr_t end, bool global); // Flushes the TLB of the executing CPU. global: Global pages are affected
+void             paging_refillPools(void); // Prepares cached page tables for reuse. Called by the idle task.
 
 uintptr_t paging_getPhysAddr(void*     virtAddress);
 void*     paging_getVirtAddr(uintptr_t physAddress);
 
+void      paging_getStatistics(pagingStatistics_t* stats);
 void      paging_analyzeBitTable(void);
 
 
@@ -6,6 +6,7 @@
 #include "pci.h"
 #include "util/util.h"
 #include "storage/usb_hc.h"
+#include "storage/ahci.h"
 #include "network/network.h"
 #include "audio/audio.h"
 #include "video/console.h"
@@ -221,6 +222,13 @@ void pci_scan(void)
                             usb_hc_install(PCIdev);
                         }
 
+                      #ifdef _AHCI_ENABLE_
+                        if (PCIdev->classID == 0x01 && PCIdev->subclassID == 0x06 && PCIdev->interfaceID == 0x01) // SATA Controller (AHCI)
+                        {
+                            ahci_install(PCIdev);
+                        }
+                      #endif
+
                         if (PCIdev->classID == 0x02 && PCIdev->subclassID == 0x00) // Network Adapters
                         {
                             network_installDevice(PCIdev);
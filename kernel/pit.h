@@ -19,12 +19,16 @@
 #define RW_LO_MODE              0x20               // Read/2xWrite bits 8..15 of counter value
 #define RW_HI_LO_MODE           0x30               // 2xRead/2xWrite bits 0..7 then 8..15 of counter value
 
+#define COUNTER_LATCH           0x00               // Latch the counter value for reading (instead of RW_..._MODE)
+
+#define ONESHOT                 0x00               // interrupt on terminal count
 #define RATEGENERATOR           0x04               // divide by N counter
 #define SQUAREWAVE              0x06               // square-wave mode
 
 // counter 2 control port
 #define AUX_GATE_2              0x01               // aux port, PIT gate 2 input
 #define AUX_OUT_2               0x02               // aux port, PIT clock out 2 enable
+#define AUX_OUT_2_STATE         0x20               // aux port, state of the output of counter 2 (read only)
 
 
 #endif
@@ -8,10 +8,29 @@
 #include "serial.h"
 #include "video/console.h"
 #include "util/util.h"
+#include "util/fifo.h"
+#include "irq.h"
+
+
+#define SERIAL_SLOTS 256 // Received bytes buffered per port
 
 
 static uint8_t  serialPorts;
 static uint16_t IOports[4]; // Contains the ports used to access
+static fifo_t*  received[4]; // Filled by the IRQ handler, emptied by serial_read
+
+
+static void serial_handler(registers_t* r) // COM1 and COM3 share one IRQ, COM2 and COM4 the other. Just look at all ports.
+{
+    for (uint8_t i = 0; i < serialPorts; i++)
+    {
+        while (received[i] && (inportb(IOports[i] + 5) & 1)) // Data ready
+        {
+            char c = inportb(IOports[i]);
+            fifo_put(received[i], &c, sizeof(c));
+        }
+    }
+}
 
 
 void serial_init(void)
@@ -25,6 +44,12 @@ void serial_init(void)
     IOports[2]  = *((uint16_t*)0x404);
     IOports[3]  = *((uint16_t*)0x406);
 
+    if (serialPorts > 0)
+    {
+        irq_installHandler(IRQ_COM1, serial_handler);
+        irq_installHandler(IRQ_COM2, serial_handler);
+    }
+
     for (uint8_t i = 0; i < serialPorts; i++)
     {
         outportb(IOports[i] + 1, 0x00); // Disable all interrupts
@@ -35,6 +60,8 @@ void serial_init(void)
         outportb(IOports[i] + 3, 0x03); // 8 bits, no parity, one stop bit
         outportb(IOports[i] + 2, 0xC7); // Enable FIFO, clear them, with 14-byte threshold
         outportb(IOports[i] + 4, 0x0B); // OUT2, RTS and DSR set
+        received[i] = fifo_create(SERIAL_SLOTS, sizeof(char), false);
+        outportb(IOports[i] + 1, 0x01); // Enable the "received data available" interrupt
         textColor(LIGHT_GRAY);
         printf("\n     => COM %d:", i+1);
         printf("\n       => IO-port: ");
@@ -49,17 +76,19 @@ bool serial_received(uint8_t com)
 {
     if (com <= serialPorts)
     {
-        return inportb(IOports[com-1] + 5) & 1;
+        return (!fifo_isEmpty(received[com-1]));
     }
     return false;
 }
 
 char serial_read(uint8_t com)
 {
-    if (com <= serialPorts)
+    if (com <= serialPorts) // The fifo has only one consumer, so only one task should read from a port
     {
-        while (serial_received(com) == false);
-        return inportb(IOports[com-1]);
+        char c;
+        fifo_wait(received[com-1]);
+        fifo_get(received[com-1], &c, sizeof(c));
+        return (c);
     }
     return (0);
 }
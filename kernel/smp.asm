@@ -0,0 +1,67 @@
+; smp.asm -- startup code of the application processors (cf. smp.c)
+;
+; smp_install copies the code between smp_trampoline and smp_trampolineEnd to
+; TRAMPOLINE_BASE and fills in smp_trampolineData. A startup IPI lets the
+; application processor begin at TRAMPOLINE_BASE in real mode. The code loads
+; the kernel's GDT, switches to protected mode, enables paging with the
+; kernel's page directory and calls the entry function on its own stack.
+; The code runs at another address than it has been linked to, so all
+; addresses are calculated relative to smp_trampoline.
+
+%define TRAMPOLINE_BASE 0x7000 ; Has to be equal to TRAMPOLINE_BASE in memory.h
+%define REL(label) (TRAMPOLINE_BASE + ((label) - smp_trampoline))
+
+global smp_trampoline
+global smp_trampolineData
+global smp_trampolineEnd
+
+
+section .text
+
+[BITS 16]
+smp_trampoline:
+    cli
+    xor ax, ax
+    mov ds, ax
+
+    o32 lgdt [REL(smp_trampolineData.gdtr)]
+
+    mov eax, cr0
+    or al, 1          ; PE
+    mov cr0, eax
+    jmp dword 0x08:REL(.protectedMode)
+
+[BITS 32]
+.protectedMode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, [REL(smp_trampolineData.cr4)]
+    mov cr4, eax
+    mov eax, [REL(smp_trampolineData.cr3)]
+    mov cr3, eax
+    mov eax, [REL(smp_trampolineData.cr0)] ; Enables paging
+    mov cr0, eax
+
+    mov esp, [REL(smp_trampolineData.esp)]
+    call [REL(smp_trampolineData.entry)]
+
+.halt:                ; The entry function does not return
+    cli
+    hlt
+    jmp .halt
+
+align 4
+smp_trampolineData:   ; Layout has to match trampolineData_t in smp.c
+.cr0:   dd 0
+.cr3:   dd 0
+.cr4:   dd 0
+.esp:   dd 0
+.entry: dd 0
+.gdtr:  dw 0
+        dd 0
+smp_trampolineEnd:
@@ -0,0 +1,394 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "syscall.h"
+#include "irq.h"
+#include "kheap.h"
+#include "memory.h"
+#include "timer.h"
+#include "descriptor_tables.h"
+#include "tasking/task.h"
+#include "video/console.h"
+#include "util/util.h"
+
+/*
+The application processors (APs) are found in the MP configuration table of the BIOS and started by the INIT-SIPI-SIPI sequence.
+Each CPU has an own TSS, kernel stack, run queue (scheduler.c), current task, FPU owner and loaded page directory. The index of
+the executing CPU is derived from its task register (smp_cpuIndex).
+The kernel is protected by one kernel lock: A CPU owns it while it executes kernel code. It is taken when an interrupt enters the
+kernel and released when the CPU returns to user code (smp_leaveKernel) or halts. So all kernel code written for a single CPU
+keeps working, while user code runs on all CPUs in parallel. If a CPU switches to a task that continues in kernel code (kernel
+threads, blocked syscalls), it hands the lock to waiting CPUs first, so kernel threads do not keep the other CPUs out. The remaining CPU specific state is not touched without the lock.
+Inter-processor interrupts reschedule other CPUs (woken tasks, expired slices, work to steal) and flush their TLBs. A CPU waiting
+for the kernel lock answers TLB flush requests, because the owner of the lock waits for them.
+*/
+
+#define AP_STACK_SIZE    0x1000 // Stack used by an application processor until it runs tasks
+#define NO_OWNER         0xFFFFFFFF
+#define BDA_EBDA_SEGMENT 0x40E  // Word in the BIOS data area holding the segment of the extended BIOS data area
+
+typedef struct // cf. smp.asm
+{
+    uint32_t cr0, cr3, cr4;
+    uint32_t esp;
+    void   (*entry)(void);
+    GDTptr_t gdtr;
+} __attribute__((packed)) trampolineData_t;
+STATIC_ASSERT(sizeof(trampolineData_t) == 5*4 + 6); // Five dwords and the GDT register, as laid out in smp.asm
+
+typedef struct // MP floating pointer structure. Intel MultiProcessor Specification 1.4, chapter 4.1
+{
+    char     signature[4]; // "_MP_"
+    uint32_t configTable;  // Physical address of the MP configuration table
+    uint8_t  length;       // In units of 16 bytes
+    uint8_t  revision;
+    uint8_t  checksum;
+    uint8_t  features[5];
+} __attribute__((packed)) mpFloatingPointer_t;
+
+typedef struct // MP configuration table header
+{
+    char     signature[4]; // "PCMP"
+    uint16_t length;
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem[8];
+    char     product[12];
+    uint32_t oemTable;
+    uint16_t oemTableSize;
+    uint16_t entryCount;
+    uint32_t localApic;
+    uint16_t extendedLength;
+    uint8_t  extendedChecksum;
+    uint8_t  reserved;
+} __attribute__((packed)) mpConfigTable_t;
+
+typedef struct // MP configuration table entry of type 0
+{
+    uint8_t  type;
+    uint8_t  apicId;
+    uint8_t  apicVersion;
+    uint8_t  flags;        // Bit 0: Enabled, Bit 1: Bootstrap processor
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__((packed)) mpProcessor_t;
+
+
+extern uint8_t smp_trampoline[], smp_trampolineData[], smp_trampolineEnd[]; // cf. smp.asm
+
+cpu_t    smp_cpus[MAX_CPUS] = {{.id = 0, .online = true, .runningTask = &kernelTask}};
+uint32_t smp_cpuCount       = 1;
+
+static volatile uint32_t kernelLock = NO_OWNER; // Index of the CPU owning the kernel lock
+static volatile uint32_t lockWaiters = 0;       // Number of CPUs spinning in smp_lockKernel
+static cpu_t* volatile   startingCPU = 0;       // AP started at the moment
+
+static struct // TLB flush requested by smp_flushTLB. Only written by the owner of the kernel lock.
+{
+    uintptr_t begin, end;
+    bool      global;
+} tlbRequest;
+
+
+/// Kernel lock
+void smp_lockKernel(void)
+{
+    uint32_t self = smp_cpuIndex();
+    if (kernelLock == self || __sync_bool_compare_and_swap(&kernelLock, NO_OWNER, self))
+        return;
+
+    __sync_fetch_and_add(&lockWaiters, 1);
+    while (kernelLock != self && __sync_val_compare_and_swap(&kernelLock, NO_OWNER, self) != NO_OWNER) // An interrupt might take the lock for us
+    {
+        if (smp_cpus[self].tlbFlush) // The owner of the lock might wait for us
+            smp_handleTLBFlush();
+        __asm__ volatile("pause");
+    }
+    __sync_fetch_and_sub(&lockWaiters, 1);
+}
+
+void smp_unlockKernel(void)
+{
+    if (kernelLock == smp_cpuIndex())
+    {
+        __asm__ volatile("" : : : "memory"); // All writes of the kernel are done before the lock is released
+        kernelLock = NO_OWNER;
+    }
+}
+
+void smp_yieldKernel(void)
+{
+    bool ints = interrupts_disable();
+    smp_unlockKernel();
+    for (uint32_t i = 0; i < 1000 && kernelLock == NO_OWNER; i++) // Give a waiting CPU the chance to take the lock
+        __asm__ volatile("pause");
+    smp_lockKernel();
+    interrupts_restore(ints);
+}
+
+void smp_leaveKernel(uintptr_t esp)
+{
+    cpu_t* cpu = smp_currentCPU();
+    const registers_t* r = (const registers_t*)esp;
+    if ((r->cs & 3) || (r->eflags & BIT(17))) // Return to ring 3 or VM86 mode
+        smp_unlockKernel();
+    else if (cpu->taskSwitched && lockWaiters > 0) // Switch to a task in kernel code: Waiting CPUs get the lock before it continues
+        smp_yieldKernel();
+    cpu->taskSwitched = false;
+}
+
+
+/// Inter-processor interrupts
+void smp_sendIPI(uint32_t cpu, uint8_t vector)
+{
+    apic_sendIPI(smp_cpus[cpu].apicId, APIC_IPI_FIXED | APIC_IPI_ASSERT | vector);
+}
+
+void smp_flushTLB(const pageDirectory_t* pd, uintptr_t begin, uintptr_t end, bool global)
+{
+    if (smp_cpuCount == 1)
+        return;
+
+    tlbRequest.begin  = begin;
+    tlbRequest.end    = end;
+    tlbRequest.global = global;
+
+    uint32_t self = smp_cpuIndex();
+    for (uint32_t i = 0; i < smp_cpuCount; i++)
+    {
+        // Mappings of the kernel are used by all CPUs, user mappings only by the CPUs that loaded the page directory
+        if (i != self && (pd == kernelPageDirectory || smp_cpus[i].pageDirectory == pd))
+        {
+            smp_cpus[i].tlbFlush = true;
+            smp_sendIPI(i, 32+IRQ_IPI_TLB);
+        }
+    }
+    for (uint32_t i = 0; i < smp_cpuCount; i++)
+    {
+        while (smp_cpus[i].tlbFlush)
+            __asm__ volatile("pause");
+    }
+}
+
+void smp_handleTLBFlush(void)
+{
+    cpu_t* cpu = smp_currentCPU();
+    if (cpu->tlbFlush)
+    {
+        paging_flushTLB(tlbRequest.begin, tlbRequest.end, tlbRequest.global);
+        cpu->tlbFlush = false;
+    }
+}
+
+void smp_releaseFPU(const task_t* task)
+{
+    for (uint32_t i = 0; i < smp_cpuCount; i++)
+    {
+        if (smp_cpus[i].fpuTask == task)
+            smp_cpus[i].fpuTask = 0;
+    }
+}
+
+
+/// Startup of the application processors
+static void apEntry(void) // Called by smp.asm on the stack of the AP
+{
+    cpu_t* cpu = startingCPU;
+
+    tss_load(GDT_TSS_FIRST + cpu->id); // From now on, smp_cpuIndex works on this CPU
+    idt_load();
+    apic_installAP();
+
+    fpu_installAP();
+    syscall_installAP();
+
+    cpu->online = true;
+
+    smp_lockKernel();
+    scheduler_startCPU(); // Does not return
+}
+
+static bool checksum(const void* data, size_t length)
+{
+    uint8_t sum = 0;
+    for (const uint8_t* p = data; length > 0; length--, p++)
+        sum += *p;
+    return (sum == 0);
+}
+
+static const mpFloatingPointer_t* findFloatingPointer(uintptr_t begin, uintptr_t end)
+{
+    for (uintptr_t addr = begin; addr < end; addr += 16)
+    {
+        const mpFloatingPointer_t* mp = (const mpFloatingPointer_t*)addr;
+        if (memcmp(mp->signature, "_MP_", 4) == 0 && checksum(mp, mp->length*16))
+            return (mp);
+    }
+    return (0);
+}
+
+static uint16_t readBDA(uintptr_t address)
+{
+    // gcc assumes that pointers into the first page are invalid, so the address is hidden from it
+    const volatile uint16_t* word;
+    __asm__("" : "=r"(word) : "0"(address));
+    return (*word);
+}
+
+static size_t findProcessors(uint8_t* apicIds, size_t max) // Collects the APIC IDs of all enabled APs
+{
+    // The floating pointer is in the first KiB of the EBDA, the last KiB of base memory or in the BIOS ROM
+    uintptr_t ebda = (uintptr_t)readBDA(BDA_EBDA_SEGMENT) << 4;
+    const mpFloatingPointer_t* mp = 0;
+    if (ebda)
+        mp = findFloatingPointer(ebda, ebda + 0x400);
+    if (mp == 0)
+        mp = findFloatingPointer(0x9FC00, 0xA0000);
+    if (mp == 0)
+        mp = findFloatingPointer(0xF0000, 0x100000);
+    if (mp == 0 || mp->configTable == 0 || mp->configTable >= DMA_ZONE_END) // Only the identity mapped area is accessible
+        return (0);
+
+    const mpConfigTable_t* table = (const mpConfigTable_t*)mp->configTable;
+    if (memcmp(table->signature, "PCMP", 4) != 0 || !checksum(table, table->length))
+        return (0);
+
+    size_t count = 0;
+    const uint8_t* entry = (const uint8_t*)(table + 1);
+    for (uint16_t i = 0; i < table->entryCount; i++)
+    {
+        if (*entry == 0) // Processor
+        {
+            const mpProcessor_t* processor = (const mpProcessor_t*)entry;
+            if ((processor->flags & BIT(0)) && !(processor->flags & BIT(1)) && count < max)
+                apicIds[count++] = processor->apicId;
+            entry += sizeof(mpProcessor_t);
+        }
+        else // Bus, I/O APIC and interrupt assignments
+        {
+            entry += 8;
+        }
+    }
+    return (count);
+}
+
+static void waitMicroseconds(uint32_t microseconds)
+{
+    uint64_t end = timer_getMicroseconds() + microseconds;
+    while (timer_getMicroseconds() < end)
+        __asm__ volatile("pause");
+}
+
+static bool startProcessor(cpu_t* cpu, trampolineData_t* data)
+{
+    void* stack = malloc(AP_STACK_SIZE, 16, "smp-APstack");
+    data->esp = (uintptr_t)stack + AP_STACK_SIZE;
+    tss_write(GDT_TSS_FIRST + cpu->id, 0x10, 0);
+    cpu->pageDirectory = kernelPageDirectory;
+    startingCPU = cpu;
+
+    // INIT-SIPI-SIPI sequence. Intel MultiProcessor Specification 1.4, appendix B.4
+    apic_sendIPI(cpu->apicId, APIC_IPI_INIT | APIC_IPI_ASSERT | APIC_IPI_LEVEL);
+    apic_sendIPI(cpu->apicId, APIC_IPI_INIT | APIC_IPI_LEVEL);
+    sleepMilliSeconds(10);
+    for (uint8_t i = 0; i < 2 && !cpu->online; i++)
+    {
+        apic_sendIPI(cpu->apicId, APIC_IPI_STARTUP | (TRAMPOLINE_BASE >> 12));
+        waitMicroseconds(200);
+    }
+
+    for (uint8_t i = 0; i < 100 && !cpu->online; i++) // Give the AP 100 ms to start
+        sleepMilliSeconds(1);
+
+    if (!cpu->online)
+    {
+        // Put the AP back into the wait-for-SIPI state. Its stack is not freed, since it might have started nevertheless.
+        apic_sendIPI(cpu->apicId, APIC_IPI_INIT | APIC_IPI_ASSERT | APIC_IPI_LEVEL);
+        apic_sendIPI(cpu->apicId, APIC_IPI_INIT | APIC_IPI_LEVEL);
+        return (false);
+    }
+    return (true);
+}
+
+void smp_install(void)
+{
+    if (!apic_available() || !apic_map())
+        return;
+
+    smp_cpus[0].apicId = apic_id();
+
+    uint8_t apicIds[MAX_CPUS-1];
+    size_t count = findProcessors(apicIds, MAX_CPUS-1);
+    if (count == 0)
+        return;
+
+    // The local APIC timer can only be read and programmed by its own CPU, but the clock is used by all CPUs
+    timer_useGlobalDevice();
+
+    memcpy((void*)TRAMPOLINE_BASE, smp_trampoline, smp_trampolineEnd - smp_trampoline);
+    trampolineData_t* data = (trampolineData_t*)(TRAMPOLINE_BASE + (smp_trampolineData - smp_trampoline));
+    __asm__ volatile("mov %%cr0, %0" : "=r"(data->cr0));
+    __asm__ volatile("mov %%cr4, %0" : "=r"(data->cr4));
+    data->cr3   = kernelPageDirectory->physAddr;
+    data->entry = &apEntry;
+    data->gdtr  = *gdt_getRegister();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        cpu_t* cpu = &smp_cpus[smp_cpuCount];
+        cpu->id     = smp_cpuCount;
+        cpu->apicId = apicIds[i];
+
+        if (startProcessor(cpu, data))
+        {
+            smp_cpuCount++;
+        }
+        else
+        {
+            textColor(ERROR);
+            printf("\nSMP: CPU with APIC ID %u did not start.", apicIds[i]);
+            textColor(TEXT);
+        }
+    }
+
+    textColor(LIGHT_GRAY);
+    printf("   => CPUs: ");
+    textColor(TEXT);
+    printf("%u\n", smp_cpuCount);
+}
+
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
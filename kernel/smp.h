@@ -0,0 +1,54 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "paging.h"
+
+
+#define MAX_CPUS       8 // Number of CPUs supported by PrettyOS
+#define GDT_TSS_FIRST  5 // GDT entry of the TSS of the first CPU. The TSS of CPU n is stored in entry GDT_TSS_FIRST+n
+
+
+struct task;
+
+typedef struct
+{
+    uint8_t               id;            // Index in smp_cpus
+    uint8_t               apicId;        // ID of the local APIC of the CPU
+    volatile bool         online;        // CPU has been started and takes part in scheduling
+    struct task*          runningTask;   // Task executed by this CPU (currentTask)
+    struct task*          idleTask;      // Task executed if the run queue of this CPU is empty
+    struct task*          fpuTask;       // Task whose state is loaded in the FPU of this CPU (FPUTask)
+    pageDirectory_t*      pageDirectory; // Page directory loaded into CR3
+    volatile bool         tlbFlush;      // Another CPU requested a TLB flush (smp_flushTLB)
+    bool                  taskSwitched;  // The CPU switched the task in the current interrupt (smp_leaveKernel)
+} cpu_t;
+
+
+extern cpu_t    smp_cpus[MAX_CPUS];
+extern uint32_t smp_cpuCount;
+
+
+static inline uint32_t smp_cpuIndex(void) // Index of the executing CPU. Derived from the task register, since every CPU has an own TSS.
+{
+    uint16_t tr;
+    __asm__ volatile("str %0" : "=r"(tr));
+    return (tr < (GDT_TSS_FIRST<<3) ? 0 : (tr>>3) - GDT_TSS_FIRST);
+}
+
+static inline cpu_t* smp_currentCPU(void)
+{
+    return (&smp_cpus[smp_cpuIndex()]);
+}
+
+void smp_install(void);
+void smp_lockKernel(void);   // Takes the kernel lock for this CPU. Does nothing if the CPU owns it already.
+void smp_unlockKernel(void); // Releases the kernel lock, if this CPU owns it
+void smp_yieldKernel(void);  // Lets other CPUs waiting for the kernel lock enter the kernel once
+void smp_leaveKernel(uintptr_t esp); // Called after an interrupt: Releases the kernel lock, if the CPU returns to user code. cf. interrupts.asm
+void smp_sendIPI(uint32_t cpu, uint8_t vector);
+void smp_flushTLB(const pageDirectory_t* pd, uintptr_t begin, uintptr_t end, bool global); // Flushes the TLBs of all other CPUs using pd
+void smp_handleTLBFlush(void); // Executes a TLB flush requested by another CPU
+void smp_releaseFPU(const struct task* task); // No FPU holds the state of the task any longer
+
+
+#endif
@@ -0,0 +1,631 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "ahci.h"
+#include "ata.h"
+#include "util/util.h"
+#include "kheap.h"
+#include "paging.h"
+#include "irq.h"
+#include "serial.h"
+#include "timer.h"
+#include "tasking/task.h"
+
+/*
+SATA controllers in AHCI mode. Every port with a connected drive gets a command list, a FIS receive area and one command table
+per used slot. Drives supporting NCQ get READ/WRITE FPDMA QUEUED commands, so up to 32 commands can be outstanding per port:
+Each transfer takes as many free slots as it needs (at least one, further ones only if they are free), issues all of its
+commands and then waits for them. Concurrent tasks (readers, the flusher of the block cache) fill the remaining slots.
+A task waits for a free slot in BL_AHCISLOT and for its command in BL_AHCI. The IRQ handler completes the issued slots that the
+port no longer reports as active in PxSACT/PxCI. A command that is still active after AHCI_TIMEOUT fails when the port has been
+stopped, so the HBA does not access its buffer anymore. On an error the port stops processing commands: The IRQ handler only
+marks the port and wakes up the waiting tasks. The first of them stops the port (restartPort), then all outstanding commands
+fail and the port is started again. Queued writes use FUA, so they need no cache flush that would drain the queue. Drives without NCQ
+use one slot with READ/WRITE DMA (EXT) followed by a cache flush after writes, like hdd.c.
+*/
+
+static uint8_t numAHCI = 0;
+
+
+static void ahci_handler(registers_t* r, pciDev_t* device);
+
+
+/// Helpers
+
+// The register structures are packed, so a register is addressed by its offset instead of a pointer to the member
+static inline uint32_t readRegister(const volatile void* regs, size_t offset)
+{
+    return (*(const volatile uint32_t*)((uintptr_t)regs + offset));
+}
+
+// Waits until (register & mask) == value. Returns false after timeout milliseconds.
+static bool waitRegister(const volatile void* regs, size_t offset, uint32_t mask, uint32_t value, uint32_t timeout)
+{
+    for (uint32_t i = 0; i < timeout; i++)
+    {
+        if ((readRegister(regs, offset) & mask) == value)
+            return (true);
+        sleepMilliSeconds(1);
+    }
+    return ((readRegister(regs, offset) & mask) == value);
+}
+
+static inline uint32_t lowestBit(uint32_t bits)
+{
+    uint32_t index;
+    __asm__("bsf %1, %0" : "=r"(index) : "rm"(bits));
+    return (index);
+}
+
+// Takes a free command slot. wait == false: Returns AHCI_SLOTS if all slots are in use.
+static uint32_t takeSlot(ahci_port_t* p, bool wait)
+{
+    bool ints = interrupts_disable();
+    while (p->freeSlots == 0 && wait)
+        scheduler_blockCurrentTask(BL_AHCISLOT, p, 0); // The scheduler checks freeSlots again before the task sleeps (ahci_unlockSlot)
+    uint32_t slot = AHCI_SLOTS;
+    if (p->freeSlots)
+    {
+        slot = lowestBit(p->freeSlots);
+        p->freeSlots &= ~BIT(slot);
+    }
+    interrupts_restore(ints);
+    return (slot);
+}
+
+static void releaseSlot(ahci_port_t* p, uint32_t slot)
+{
+    bool ints = interrupts_disable();
+    p->freeSlots |= BIT(slot);
+    scheduler_unblockEvent(BL_AHCISLOT, p);
+    interrupts_restore(ints);
+}
+
+// Marks the given slots as completed and wakes up their tasks. Caller has to hold issueLock.
+static void completeSlots(ahci_port_t* p, uint32_t slots, bool failed)
+{
+    p->issued &= ~slots;
+    while (slots)
+    {
+        uint32_t slot = lowestBit(slots);
+        slots &= ~BIT(slot);
+        p->slots[slot].failed = failed;
+        p->slots[slot].done   = true;
+        scheduler_unblockEvent(BL_AHCI, &p->slots[slot]);
+    }
+}
+
+
+/// Port control
+
+static bool stopPort(ahci_port_t* p)
+{
+    p->regs->CMD &= ~AHCI_PCMD_ST;
+    return (waitRegister(p->regs, offsetof(ahci_portRegs_t, CMD), AHCI_PCMD_CR, 0, 500));
+}
+
+static bool startPort(ahci_port_t* p)
+{
+    if (!waitRegister(p->regs, offsetof(ahci_portRegs_t, TFD), AHCI_TFD_BSY | AHCI_TFD_DRQ, 0, 1000))
+    {
+        // The drive hangs: COMRESET
+        p->regs->SCTL = (p->regs->SCTL & ~0x0F) | 1;
+        sleepMilliSeconds(2);
+        p->regs->SCTL &= ~0x0F;
+        sleepMilliSeconds(AHCI_LINK_DELAY); // DET is only valid when the PHY has finished the reset
+        if (!waitRegister(p->regs, offsetof(ahci_portRegs_t, SSTS), AHCI_SSTS_DET, AHCI_DET_PRESENT, 1000) ||
+            !waitRegister(p->regs, offsetof(ahci_portRegs_t, TFD), AHCI_TFD_BSY | AHCI_TFD_DRQ, 0, AHCI_TIMEOUT))
+        {
+            serial_log(SER_LOG_HRDDSK, "[AHCI] Port %u does not respond. TFD: %X\r\n", p->num, p->regs->TFD);
+            return (false);
+        }
+    }
+    p->regs->SERR = 0xFFFFFFFF;
+    p->regs->IS   = 0xFFFFFFFF;
+    p->regs->CMD |= AHCI_PCMD_ST;
+    return (true);
+}
+
+// Called with p->lock held, after an error or a lost command
+static void restartPort(ahci_port_t* p)
+{
+    serial_log(SER_LOG_HRDDSK, "[AHCI] Restarting port %u. IS: %X, TFD: %X, SERR: %X\r\n", p->num, p->regs->IS, p->regs->TFD, p->regs->SERR);
+
+    if (!stopPort(p)) // Clears PxCI and PxSACT, all outstanding commands are aborted
+    {
+        // The HBA might still transfer data of the outstanding commands, so their slots and buffers stay taken until the port stops
+        serial_log(SER_LOG_HRDDSK, "[AHCI] Port %u could not be stopped\r\n", p->num);
+        p->restart = true;
+        return;
+    }
+
+    bool ints = spinlock_lockIrq(&p->issueLock);
+    completeSlots(p, p->issued, true);
+    spinlock_unlockIrq(&p->issueLock, ints);
+
+    p->restart = !startPort(p);
+}
+
+
+/// Commands
+
+// Describes up to max sectors of the list in the PRDT of the table, starting at sector *offset of list[*element]. Returns the
+// number of sectors described, less than max if the PRDT is full. Physically contiguous parts share an entry.
+static uint32_t buildPRDT(ahci_cmdTable_t* table, uint16_t* entries, const sgElement_t* list, size_t* element, uint32_t* offset, uint32_t max)
+{
+    uint32_t sectors = 0;
+    uint32_t size    = 0; // Of the last entry
+    *entries = 0;
+
+    while (sectors < max && *entries <= AHCI_PRDT_ENTRIES-2) // A sector needs at most two new entries
+    {
+        while (*offset == list[*element].count)
+        {
+            (*element)++;
+            *offset = 0;
+        }
+        uint8_t* buffer = (uint8_t*)list[*element].buffer + 512*(*offset);
+        if ((uintptr_t)buffer & 1) // The HBA transfers words
+            break;
+
+        for (size_t length = 512; length > 0;)
+        {
+            size_t piece = min(length, PAGESIZE - ((uintptr_t)buffer & (PAGESIZE-1)));
+            uint32_t phys = paging_getPhysAddr(buffer);
+
+            if (*entries > 0 && table->PRDT[*entries-1].DBA + size == phys && size + piece <= AHCI_PRD_MAXBYTES)
+            {
+                size += piece;
+            }
+            else
+            {
+                if (*entries > 0)
+                    table->PRDT[*entries-1].DBC = size - 1;
+                table->PRDT[*entries].DBA  = phys;
+                table->PRDT[*entries].DBAU = 0;
+                (*entries)++;
+                size = piece;
+            }
+            buffer += piece;
+            length -= piece;
+        }
+
+        (*offset)++;
+        sectors++;
+    }
+
+    if (*entries > 0)
+        table->PRDT[*entries-1].DBC = size - 1;
+    return (sectors);
+}
+
+static void setupCommand(ahci_port_t* p, uint32_t slot, uint8_t command, uint32_t sector, uint32_t count, uint16_t entries, bool write)
+{
+    ahci_fisH2D_t* fis = (ahci_fisH2D_t*)p->tables[slot]->CFIS;
+    memset(fis, 0, sizeof(ahci_fisH2D_t));
+    fis->type    = 0x27;
+    fis->flags   = BIT(7);
+    fis->command = command;
+    fis->device  = BIT(6); // LBA
+    fis->lba0    = sector & 0xFF;
+    fis->lba1    = (sector >> 8) & 0xFF;
+    fis->lba2    = (sector >> 16) & 0xFF;
+    fis->lba3    = (sector >> 24) & 0xFF; // Bits 32-47 are always 0, because sector numbers have 32 bit
+
+    p->slots[slot].queued = (command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA);
+    if (p->slots[slot].queued)
+    {
+        fis->featureLow  = count & 0xFF; // Queued commands take the sector count in the feature register and the tag in the count register
+        fis->featureHigh = (count >> 8) & 0xFF;
+        fis->countLow    = slot << 3;
+        if (write)
+            fis->device |= BIT(7); // FUA: Completed when the data is on the medium
+    }
+    else
+    {
+        fis->countLow  = count & 0xFF;
+        fis->countHigh = (count >> 8) & 0xFF;
+        if (command == ATA_CMD_READ_DMA || command == ATA_CMD_WRITE_DMA)
+            fis->device |= (sector >> 24) & 0x0F; // LBA28
+    }
+
+    ahci_cmdHeader_t* header = &p->commandList[slot];
+    header->flags = sizeof(ahci_fisH2D_t)/4 | (write ? BIT(6) : 0);
+    header->PRDTL = entries;
+    header->PRDBC = 0;
+}
+
+static void issue(ahci_port_t* p, uint32_t slot)
+{
+    mutex_lock(p->lock);
+    if (p->restart)
+        restartPort(p);
+
+    p->slots[slot].done    = false;
+    p->slots[slot].failed  = false;
+    p->slots[slot].stopped = false;
+
+    bool ints = spinlock_lockIrq(&p->issueLock);
+    p->issued |= BIT(slot);
+    if (p->slots[slot].queued)
+        p->regs->SACT = BIT(slot);
+    p->regs->CI = BIT(slot);
+    spinlock_unlockIrq(&p->issueLock, ints);
+
+    mutex_unlock(p->lock);
+}
+
+// Waits for the command in the slot. The slot stays taken.
+static bool waitForSlot(ahci_port_t* p, uint32_t slot)
+{
+    ahci_slot_t* s = &p->slots[slot];
+    while (!s->done)
+    {
+        bool woken = scheduler_blockCurrentTask(BL_AHCI, s, AHCI_TIMEOUT);
+        if (s->done)
+            break;
+
+        mutex_lock(p->lock);
+        if (p->restart) // An error stopped the port. If no other task has done it, the outstanding commands fail now.
+        {
+            s->stopped = false; // If the port cannot be stopped, it is tried again after the timeout
+            if (!s->done)
+                restartPort(p);
+        }
+        else if (!woken)
+        {
+            bool ints = spinlock_lockIrq(&p->issueLock);
+            bool lost = !s->done && ((p->regs->SACT | p->regs->CI) & BIT(slot));
+            if (!s->done && !lost) // Finished, but the IRQ did not arrive
+                completeSlots(p, BIT(slot), p->regs->TFD & AHCI_TFD_ERR);
+            spinlock_unlockIrq(&p->issueLock, ints);
+
+            if (lost) // The command fails only when the port has stopped, until then the HBA might access its buffers
+                restartPort(p);
+        }
+        mutex_unlock(p->lock);
+    }
+
+    if (s->failed)
+        serial_log(SER_LOG_HRDDSK, "[AHCI] Command in slot %u of port %u failed. TFD: %X\r\n", slot, p->num, p->regs->TFD);
+    return (!s->failed);
+}
+
+// Executes a command without data, or with one buffer of up to one page
+static bool execute(ahci_port_t* p, uint8_t command, void* buffer, uint32_t sectors)
+{
+    uint32_t slot = takeSlot(p, true);
+    sgElement_t element = {.buffer = buffer, .count = sectors};
+    size_t index = 0;
+    uint32_t offset = 0;
+    uint16_t entries = 0;
+    if (sectors)
+        buildPRDT(p->tables[slot], &entries, &element, &index, &offset, sectors);
+    setupCommand(p, slot, command, 0, 0, entries, false);
+    issue(p, slot);
+    bool success = waitForSlot(p, slot);
+    releaseSlot(p, slot);
+    return (success);
+}
+
+// Splits the transfer into commands of up to AHCI_MAXSECTORS sectors, which are issued together as far as slots are free
+static FS_ERROR transfer(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device, bool write)
+{
+    ahci_port_t* p = device->data;
+
+    uint32_t count = 0;
+    for (size_t i = 0; i < elements; i++)
+        count += list[i].count;
+
+    if (count == 0 || (uint64_t)sector + count > device->size / 512)
+        return (CE_INVALID_ARGUMENT);
+
+    uint8_t command;
+    if (p->ncq)
+        command = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+    else if (p->lba48)
+        command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    else
+        command = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    uint32_t maxSectors = (p->ncq || p->lba48) ? AHCI_MAXSECTORS : 256;
+
+    FS_ERROR error = CE_GOOD;
+    size_t element = 0;
+    uint32_t offset = 0;
+    while (count > 0 && error == CE_GOOD)
+    {
+        uint32_t slots[AHCI_SLOTS];
+        size_t issued = 0;
+        for (uint32_t slot = takeSlot(p, true); slot < AHCI_SLOTS; slot = count > 0 ? takeSlot(p, false) : AHCI_SLOTS)
+        {
+            uint16_t entries;
+            uint32_t n = buildPRDT(p->tables[slot], &entries, list, &element, &offset, min(count, maxSectors));
+            if (n == 0)
+            {
+                serial_log(SER_LOG_HRDDSK, "[AHCI] Buffer not suitable for DMA\r\n");
+                releaseSlot(p, slot);
+                error = CE_INVALID_ARGUMENT;
+                break;
+            }
+            setupCommand(p, slot, command, sector, n, entries, write);
+            issue(p, slot);
+            slots[issued++] = slot;
+            sector += n;
+            count  -= n;
+        }
+
+        for (size_t i = 0; i < issued; i++)
+        {
+            if (!waitForSlot(p, slots[i]))
+                error = write ? CE_WRITE_ERROR : CE_BAD_SECTOR_READ;
+            releaseSlot(p, slots[i]);
+        }
+    }
+
+    if (error == CE_GOOD && write && !p->ncq && !execute(p, p->lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH, 0, 0))
+        error = CE_WRITE_ERROR;
+
+    return (error);
+}
+
+
+/// Installation
+
+static ahci_cmdTable_t* allocTable(ahci_port_t* p, uint32_t slot)
+{
+    ahci_cmdTable_t* table = p->tables[slot] = malloc(sizeof(ahci_cmdTable_t), PAGESIZE, "ahci-cmdTable");
+    memset(table, 0, sizeof(ahci_cmdTable_t));
+    p->commandList[slot].CTBA  = paging_getPhysAddr(table);
+    p->commandList[slot].CTBAU = 0;
+    return (table);
+}
+
+static void setupPort(ahci_t* a, uint8_t num)
+{
+    ahci_port_t* p = malloc(sizeof(ahci_port_t), 0, "ahci_port_t");
+    memset(p, 0, sizeof(ahci_port_t));
+    p->ahci      = a;
+    p->num       = num;
+    p->regs      = &a->regs->ports[num];
+    p->lock      = mutex_create("AHCI port");
+    p->freeSlots = BIT(0); // Only one command until the drive has been identified
+    spinlock_init(&p->issueLock, "AHCI issue");
+
+    p->regs->CMD &= ~AHCI_PCMD_FRE;
+    if (!stopPort(p) || !waitRegister(p->regs, offsetof(ahci_portRegs_t, CMD), AHCI_PCMD_FR, 0, 500))
+    {
+        serial_log(SER_LOG_HRDDSK, "[AHCI] Port %u could not be stopped\r\n", num);
+        free(p);
+        return;
+    }
+
+    p->commandList = malloc(AHCI_SLOTS*sizeof(ahci_cmdHeader_t), 1024, "ahci-cmdList");
+    memset(p->commandList, 0, AHCI_SLOTS*sizeof(ahci_cmdHeader_t));
+    p->fisArea = malloc(256, 256, "ahci-FIS");
+    memset(p->fisArea, 0, 256);
+    allocTable(p, 0);
+
+    p->regs->CLB  = paging_getPhysAddr(p->commandList);
+    p->regs->CLBU = 0;
+    p->regs->FB   = paging_getPhysAddr(p->fisArea);
+    p->regs->FBU  = 0;
+    p->regs->SERR = 0xFFFFFFFF;
+    p->regs->IS   = 0xFFFFFFFF;
+    p->regs->IE   = AHCI_PIS_DHRS | AHCI_PIS_PSS | AHCI_PIS_DSS | AHCI_PIS_SDBS | AHCI_PIS_ERRORS;
+    p->regs->CMD |= AHCI_PCMD_FRE | AHCI_PCMD_POD | AHCI_PCMD_SUD;
+    a->ports[num] = p; // The IRQ handler needs it
+
+    uint16_t* identify = malloc(512, 512, "ahci-identify");
+    if (!startPort(p) || !execute(p, ATA_CMD_IDENTIFY, identify, 1))
+    {
+        serial_log(SER_LOG_HRDDSK, "[AHCI] IDENTIFY failed on port %u\r\n", num);
+        stopPort(p);
+        p->regs->IE = 0;
+        a->ports[num] = 0;
+        free(identify);
+        return; // The structures stay allocated, the HBA might still access them
+    }
+
+    // Word 106, bit 12: Logical sectors are longer than 256 words (words 117/118)
+    if ((identify[106] & 0xC000) == 0x4000 && (identify[106] & BIT(12)) && *(uint32_t*)&identify[117] != 256)
+    {
+        serial_log(SER_LOG_HRDDSK, "[AHCI] Port %u: Sector size of %u words not supported\r\n", num, *(uint32_t*)&identify[117]);
+        free(identify);
+        return; // Idle port, no commands are issued to it
+    }
+
+    p->lba48 = identify[83] & BIT(10);
+    p->ncq   = a->ncq && (identify[76] & BIT(8));
+    p->depth = p->ncq ? min(a->slots, (identify[75] & 0x1F) + 1) : 1;
+    for (uint32_t i = 1; i < p->depth; i++)
+        allocTable(p, i);
+    p->freeSlots = (p->depth == 32) ? 0xFFFFFFFF : BIT(p->depth) - 1;
+
+    disk_t* disk = malloc(sizeof(disk_t), 0, "ahci-Disk");
+    memset(disk, 0, sizeof(disk_t));
+    disk->type       = &AHCIDISK;
+    disk->data       = p;
+    disk->port       = &p->port;
+    disk->sectorSize = 512;
+    // Words 100-103: lba48 sectors, words 60/61: lba28 sectors. Sector numbers have 32 bit, so at most 2 TiB are used.
+    if (p->lba48 && (identify[102] || identify[103]))
+        disk->size = ((uint64_t)0xFFFFFFFF)*512;
+    else if (p->lba48)
+        disk->size = ((uint64_t)(*(uint32_t*)&identify[100]))*512;
+    else
+        disk->size = ((uint64_t)(*(uint32_t*)&identify[60]))*512;
+    free(identify);
+
+    p->port.type         = &AHCI;
+    p->port.data         = p;
+    p->port.insertedDisk = disk;
+    snprintf(p->port.name, 15, "SATA %u.%u", a->num+1, num);
+
+    serial_log(SER_LOG_HRDDSK, "[AHCI] Disk at port %u: %S, LBA48: %u, NCQ: %u, queue depth: %u\r\n", num, disk->size, p->lba48, p->ncq, p->depth);
+
+    attachDisk(disk);
+    attachPort(&p->port);
+    analyzeDisk(disk);
+}
+
+void ahci_install(pciDev_t* PCIdev)
+{
+    pciBar_t* bar = &PCIdev->bar[5]; // ABAR
+    if (bar->memoryType != PCI_MMIO)
+        return;
+
+    ahci_t* a = malloc(sizeof(ahci_t), 0, "ahci");
+    memset(a, 0, sizeof(ahci_t));
+    a->PCIdevice = PCIdev;
+    a->num       = numAHCI++;
+    PCIdev->data = a;
+
+    uint16_t offset = bar->baseAddress % PAGESIZE;
+    void* virt = paging_acquirePciMemory(bar->baseAddress - offset, alignUp(offset + max(bar->memorySize, sizeof(ahci_hbaRegs_t)), PAGESIZE)/PAGESIZE);
+    a->regs = (ahci_hbaRegs_t*)(virt + offset);
+
+    uint16_t pciCommandRegister = pci_config_read(PCIdev->bus, PCIdev->device, PCIdev->func, PCI_COMMAND, 2);
+    pci_config_write_word(PCIdev->bus, PCIdev->device, PCIdev->func, PCI_COMMAND, pciCommandRegister | PCI_CMD_MMIO | PCI_CMD_BUSMASTER);
+
+    // Take the HBA over from the BIOS
+    if (a->regs->CAP2 & AHCI_CAP2_BOH)
+    {
+        a->regs->BOHC |= AHCI_BOHC_OOS;
+        waitRegister(a->regs, offsetof(ahci_hbaRegs_t, BOHC), AHCI_BOHC_BOS, 0, 2000);
+    }
+
+    a->regs->GHC |= AHCI_GHC_AE;
+    a->regs->GHC |= AHCI_GHC_HR;
+    if (!waitRegister(a->regs, offsetof(ahci_hbaRegs_t, GHC), AHCI_GHC_HR, 0, 1000))
+    {
+        serial_log(SER_LOG_HRDDSK, "[AHCI] HBA reset failed\r\n");
+        return;
+    }
+    a->regs->GHC |= AHCI_GHC_AE;
+    sleepMilliSeconds(AHCI_LINK_DELAY); // The reset also resets the links of the ports. DET is valid afterwards.
+
+    a->ncq   = a->regs->CAP & AHCI_CAP_SNCQ;
+    a->slots = ((a->regs->CAP & AHCI_CAP_NCS) >> 8) + 1;
+    serial_log(SER_LOG_HRDDSK, "[AHCI] Version %X, ports implemented: %X, slots: %u, NCQ: %u\r\n", a->regs->VS, a->regs->PI, a->slots, a->ncq);
+
+    irq_installPCIHandler(PCIdev->irq, ahci_handler, PCIdev);
+    a->regs->IS   = 0xFFFFFFFF;
+    a->regs->GHC |= AHCI_GHC_IE;
+
+    uint32_t implemented = a->regs->PI;
+    for (uint8_t i = 0; i < AHCI_PORTS; i++)
+    {
+        if (!(implemented & BIT(i)))
+            continue;
+
+        ahci_portRegs_t* regs = &a->regs->ports[i];
+        if ((regs->SSTS & AHCI_SSTS_DET) == AHCI_DET_DETECTED) // Device found, but the link is still being established
+            waitRegister(regs, offsetof(ahci_portRegs_t, SSTS), AHCI_SSTS_DET, AHCI_DET_PRESENT, 1000);
+        if ((regs->SSTS & AHCI_SSTS_DET) == AHCI_DET_PRESENT && regs->SIG == AHCI_SIG_ATA) // ATAPI and port multipliers are not supported
+            setupPort(a, i);
+    }
+}
+
+static void ahci_handler(registers_t* r, pciDev_t* device)
+{
+    ahci_t* a = device->data;
+    uint32_t is = a->regs->IS;
+    if (is == 0) // Shared IRQ
+        return;
+
+    for (uint32_t i = 0; i < AHCI_PORTS; i++)
+    {
+        if (!(is & BIT(i)) || a->ports[i] == 0)
+            continue;
+
+        ahci_port_t* p = a->ports[i];
+        uint32_t pis = p->regs->IS;
+        p->regs->IS = pis;
+
+        spinlock_lock(&p->issueLock);
+        if (pis & AHCI_PIS_ERRORS) // The port stopped processing commands. The waiting tasks stop it and fail the commands (restartPort).
+        {
+            p->restart = true;
+            for (uint32_t slots = p->issued; slots; slots &= slots-1)
+            {
+                p->slots[lowestBit(slots)].stopped = true;
+                scheduler_unblockEvent(BL_AHCI, &p->slots[lowestBit(slots)]);
+            }
+        }
+        if (!p->restart) // After an error, PxCI and PxSACT do not tell which commands succeeded
+        {
+            uint32_t active = p->regs->SACT | p->regs->CI;
+            completeSlots(p, p->issued & ~active, false);
+        }
+        spinlock_unlock(&p->issueLock);
+    }
+
+    a->regs->IS = is;
+}
+
+bool ahci_unlockTask(void* data)
+{
+    const ahci_slot_t* s = data;
+    return (s->done || s->stopped);
+}
+
+bool ahci_unlockSlot(void* data)
+{
+    return (((ahci_port_t*)data)->freeSlots != 0);
+}
+
+
+/// Interface of the device manager
+
+FS_ERROR ahci_readSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* device)
+{
+    sgElement_t element = {.buffer = buffer, .count = count};
+    return (transfer(sector, &element, 1, device, false));
+}
+
+FS_ERROR ahci_writeSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* device)
+{
+    sgElement_t element = {.buffer = buffer, .count = count};
+    return (transfer(sector, &element, 1, device, true));
+}
+
+FS_ERROR ahci_readSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device)
+{
+    return (transfer(sector, list, elements, device, false));
+}
+
+FS_ERROR ahci_writeSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device)
+{
+    return (transfer(sector, list, elements, device, true));
+}
+
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
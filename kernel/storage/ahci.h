@@ -0,0 +1,223 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "os.h"
+#include "pci.h"
+#include "devicemanager.h"
+#include "tasking/synchronisation.h"
+
+#define AHCI_PORTS        32
+#define AHCI_SLOTS        32
+#define AHCI_PRDT_ENTRIES 248    // The command table of a slot fills one page
+#define AHCI_PRD_MAXBYTES 0x400000
+#define AHCI_MAXSECTORS   2048   // Per command
+#define AHCI_TIMEOUT      30000  // Milliseconds until a command is regarded as lost
+#define AHCI_LINK_DELAY   10     // Milliseconds after an HBA reset or COMRESET until PxSSTS.DET shows the link state
+
+
+/* *** */
+/* CAP */
+/* *** */
+
+#define AHCI_CAP_NCS      0x00001F00 // Number of command slots - 1
+#define AHCI_CAP_SNCQ     BIT(30)    // Supports native command queuing
+
+
+/* *** */
+/* GHC */
+/* *** */
+
+#define AHCI_GHC_HR       BIT(0)     // HBA reset
+#define AHCI_GHC_IE       BIT(1)     // Interrupt enable
+#define AHCI_GHC_AE       BIT(31)    // AHCI enable
+
+
+/* **** */
+/* BOHC */
+/* **** */
+
+#define AHCI_CAP2_BOH     BIT(0)     // BIOS/OS handoff supported
+#define AHCI_BOHC_BOS     BIT(0)     // BIOS owned semaphore
+#define AHCI_BOHC_OOS     BIT(1)     // OS owned semaphore
+
+
+/* ***** */
+/* PxCMD */
+/* ***** */
+
+#define AHCI_PCMD_ST      BIT(0)     // Start processing the command list
+#define AHCI_PCMD_SUD     BIT(1)     // Spin-up device
+#define AHCI_PCMD_POD     BIT(2)     // Power on device
+#define AHCI_PCMD_FRE     BIT(4)     // FIS receive enable
+#define AHCI_PCMD_FR      BIT(14)    // FIS receive running
+#define AHCI_PCMD_CR      BIT(15)    // Command list running
+
+
+/* ********* */
+/* PxIS PxIE */
+/* ********* */
+
+#define AHCI_PIS_DHRS     BIT(0)     // Device to host register FIS
+#define AHCI_PIS_PSS      BIT(1)     // PIO setup FIS
+#define AHCI_PIS_DSS      BIT(2)     // DMA setup FIS
+#define AHCI_PIS_SDBS     BIT(3)     // Set device bits FIS (completion of queued commands)
+#define AHCI_PIS_ERRORS   (BIT(30) | BIT(29) | BIT(28) | BIT(27) | BIT(26) | BIT(24) | BIT(23)) // TFES, HBFS, HBDS, IFS, INFS, OFS, IPMS
+
+
+/* ***************** */
+/* PxTFD PxSSTS PxSIG */
+/* ***************** */
+
+#define AHCI_TFD_ERR      BIT(0)
+#define AHCI_TFD_DRQ      BIT(3)
+#define AHCI_TFD_BSY      BIT(7)
+
+#define AHCI_SSTS_DET     0x0F
+#define AHCI_DET_DETECTED 1          // Device present, communication not established yet
+#define AHCI_DET_PRESENT  3          // Device present and communication established
+
+#define AHCI_SIG_ATA      0x00000101
+
+
+typedef struct
+{
+    volatile uint32_t CLB;              // Command list base address, 1 KiB aligned  // +00h
+    volatile uint32_t CLBU;                                                          // +04h
+    volatile uint32_t FB;               // FIS base address, 256 byte aligned        // +08h
+    volatile uint32_t FBU;                                                           // +0Ch
+    volatile uint32_t IS;               // Interrupt status (rwc)                    // +10h
+    volatile uint32_t IE;               // Interrupt enable                          // +14h
+    volatile uint32_t CMD;              // Command and status                        // +18h
+    volatile uint32_t reserved0;                                                     // +1Ch
+    volatile uint32_t TFD;              // Task file data                            // +20h
+    volatile uint32_t SIG;              // Signature of the device                   // +24h
+    volatile uint32_t SSTS;             // SATA status                               // +28h
+    volatile uint32_t SCTL;             // SATA control                              // +2Ch
+    volatile uint32_t SERR;             // SATA error (rwc)                          // +30h
+    volatile uint32_t SACT;             // Queued commands not completed yet         // +34h
+    volatile uint32_t CI;               // Commands issued                           // +38h
+    volatile uint32_t SNTF;                                                          // +3Ch
+    volatile uint32_t FBS;                                                           // +40h
+    volatile uint32_t reserved1[11];                                                 // +44h
+    volatile uint32_t vendor[4];                                                     // +70h
+} __attribute__((packed)) ahci_portRegs_t;
+
+typedef struct
+{
+    volatile uint32_t CAP;              // Host capabilities                         // +00h
+    volatile uint32_t GHC;              // Global host control                       // +04h
+    volatile uint32_t IS;               // Interrupt status, one bit per port (rwc)  // +08h
+    volatile uint32_t PI;               // Ports implemented                         // +0Ch
+    volatile uint32_t VS;               // Version                                   // +10h
+    volatile uint32_t CCC_CTL;                                                       // +14h
+    volatile uint32_t CCC_PORTS;                                                     // +18h
+    volatile uint32_t EM_LOC;                                                        // +1Ch
+    volatile uint32_t EM_CTL;                                                        // +20h
+    volatile uint32_t CAP2;                                                          // +24h
+    volatile uint32_t BOHC;             // BIOS/OS handoff control                   // +28h
+    volatile uint8_t  reserved[0xD4];                                                // +2Ch
+    ahci_portRegs_t   ports[AHCI_PORTS];                                             // +100h
+} __attribute__((packed)) ahci_hbaRegs_t;
+
+// Entry of the command list of a port
+typedef struct
+{
+    uint16_t          flags;            // Bits 0-4: Length of the command FIS in dwords, bit 6: write
+    uint16_t          PRDTL;            // Number of PRDT entries
+    volatile uint32_t PRDBC;            // Bytes transferred
+    uint32_t          CTBA;             // Command table, 128 byte aligned
+    uint32_t          CTBAU;
+    uint32_t          reserved[4];
+} __attribute__((packed)) ahci_cmdHeader_t;
+
+typedef struct
+{
+    uint32_t DBA;                       // Data base address, word aligned
+    uint32_t DBAU;
+    uint32_t reserved;
+    uint32_t DBC;                       // Bits 0-21: Byte count - 1, bit 31: interrupt on completion
+} __attribute__((packed)) ahci_prd_t;
+
+typedef struct
+{
+    uint8_t    CFIS[64];                // Command FIS
+    uint8_t    ACMD[16];                // ATAPI command
+    uint8_t    reserved[48];
+    ahci_prd_t PRDT[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) ahci_cmdTable_t;
+
+// Register FIS host to device
+typedef struct
+{
+    uint8_t type;                       // 0x27
+    uint8_t flags;                      // Bit 7: Command
+    uint8_t command;
+    uint8_t featureLow;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t featureHigh;
+    uint8_t countLow;
+    uint8_t countHigh;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+} __attribute__((packed)) ahci_fisH2D_t;
+
+
+typedef struct
+{
+    volatile bool done;
+    volatile bool failed;
+    volatile bool stopped;              // An error stopped the port while the command was outstanding (ahci_handler)
+    bool          queued;               // NCQ command, tracked by PxSACT
+} ahci_slot_t;
+
+struct ahci;
+
+typedef struct
+{
+    port_t            port;
+    struct ahci*      ahci;
+    ahci_portRegs_t*  regs;
+    uint8_t           num;
+    ahci_cmdHeader_t* commandList;
+    void*             fisArea;
+    ahci_cmdTable_t*  tables[AHCI_SLOTS];
+    ahci_slot_t       slots[AHCI_SLOTS];
+    uint32_t          freeSlots;        // Bitmask, only the first depth slots are used
+    uint32_t          issued;           // Slots with an outstanding command, protected by issueLock
+    spinlock_t        issueLock;
+    mutex_t*          lock;             // Serializes issuing with port restarts
+    bool              restart;          // The port stopped after an error and has to be restarted before the next command
+    bool              ncq;
+    bool              lba48;
+    uint8_t           depth;            // Number of commands that can be outstanding
+} ahci_port_t;
+
+typedef struct ahci
+{
+    pciDev_t*        PCIdevice;
+    ahci_hbaRegs_t*  regs;
+    uint8_t          num;
+    bool             ncq;               // HBA supports NCQ
+    uint8_t          slots;             // Command slots per port
+    ahci_port_t*     ports[AHCI_PORTS]; // 0 if there is no drive at the port
+} ahci_t;
+
+
+void     ahci_install(pciDev_t* PCIdev);
+bool     ahci_unlockTask(void* data); // Used for scheduler
+bool     ahci_unlockSlot(void* data); // Used for scheduler
+
+FS_ERROR ahci_readSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* device);
+FS_ERROR ahci_writeSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* device);
+FS_ERROR ahci_readSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device);
+FS_ERROR ahci_writeSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device);
+
+
+#endif
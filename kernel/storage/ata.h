@@ -24,6 +24,34 @@
 #define ATA_STATUS_RDY 0x40
 #define ATA_STATUS_BSY 0x80
 
+#define ATA_CMD_READ_PIO      0x20
+#define ATA_CMD_READ_PIO_EXT  0x24
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_WRITE_PIO     0x30
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA    0x60 // NCQ
+#define ATA_CMD_WRITE_FPDMA   0x61
+#define ATA_CMD_READ_DMA      0xC8
+#define ATA_CMD_WRITE_DMA     0xCA
+#define ATA_CMD_FLUSH         0xE7
+#define ATA_CMD_FLUSH_EXT     0xEA
+#define ATA_CMD_IDENTIFY      0xEC
+
+// Bus master IDE registers (BAR4 of the IDE controller). The registers of the secondary channel follow at offset 8.
+#define ATA_BM_CMD    0
+#define ATA_BM_STATUS 2
+#define ATA_BM_PRDT   4
+
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ  0x08 // Controller writes to memory
+
+#define ATA_BM_STATUS_ACTIVE 0x01
+#define ATA_BM_STATUS_ERR    0x02
+#define ATA_BM_STATUS_IRQ    0x04
+#define ATA_BM_STATUS_DMA0   0x20 // Set by the BIOS if the master drive can do DMA
+#define ATA_BM_STATUS_DMA1   0x40 // Set by the BIOS if the slave drive can do DMA
+
 
 typedef enum
 {
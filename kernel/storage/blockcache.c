@@ -0,0 +1,638 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "blockcache.h"
+#include "paging.h"
+#include "kheap.h"
+#include "timer.h"
+#include "util/util.h"
+#include "video/console.h"
+#include "tasking/task.h"
+#include "tasking/synchronisation.h"
+
+/*
+Write-back cache for the blocks of disks and CDI caches. Blocks are found with a hash table keyed by (device, block number).
+All cached blocks are kept in one LRU list, the least recently used unreferenced clean block is evicted when the capacity
+would be exceeded. Blocks of different sizes share the capacity; an evicted block is reused directly if it has the size
+needed. If all blocks are referenced, the capacity is exceeded temporarily instead of failing.
+
+Dirty blocks are kept in a list per device sorted by block number. They are written back by the flusher thread when they
+are older than DIRTY_EXPIRE or when more than DIRTY_BACKGROUND percent of the cache are dirty. Adjacent dirty blocks are
+written with a single call of the device (up to BLOCKCACHE_MAXRUN blocks). Tasks dirtying blocks beyond DIRTY_LIMIT percent
+write back blocks themselves, so the flusher cannot fall behind arbitrarily. Eviction never writes: If none of the oldest
+blocks is clean, the flusher is woken up and the capacity is exceeded until it has written them back. Dirty blocks of a
+removed device are written back before they are dropped; the reboot and shutdown paths sync the cache as well.
+
+The cache is protected by a mutex. It is released while the device reads or writes, so the I/O of one task does not stall
+the others, and devices can use the cache recursively (e.g. a CDI cache on top of a disk). A missing block is inserted as a
+placeholder marked as reading; tasks that need it meanwhile wait for the reader (BL_BLOCKREAD), so a block is never read
+twice. If reading fails, the block stays invalid and is read again by the next task that needs it. Write-backs of the
+flusher and of blockCache_sync release the lock as well; the blocks are referenced meanwhile. blockCache_sync waits for these write-backs, so the data is
+on the device when it returns (fflush, fclose).
+*/
+
+#define DIRTY_EXPIRE     3000 // Milliseconds a block may stay dirty
+#define DIRTY_BACKGROUND 10   // Percentage of the capacity that wakes up the flusher
+#define DIRTY_LIMIT      40   // Percentage of the capacity beyond which writers have to write back blocks themselves
+#define FLUSH_INTERVAL   1000 // Milliseconds between two runs of the flusher
+#define VICTIM_SCAN      32   // Number of unreferenced blocks that are checked for a clean one on eviction
+
+
+static mutex_t*       lock       = 0;
+static cacheBlock_t** buckets    = 0;
+static uint32_t       bucketBits = 0;
+static cacheBlock_t*  newest     = 0;
+static cacheBlock_t*  oldest     = 0;
+static blockDevice_t* devices    = 0;
+static size_t         capacity   = 0;  // Bytes
+static size_t         used       = 0;  // Bytes of block data allocated
+static size_t         dirtyBytes = 0;
+static uint32_t       dirtyGeneration = 0;
+static uint32_t       writing    = 0;  // Write-backs running without the lock
+static bool           flushWanted = false; // Eviction found only dirty blocks. The flusher writes back the oldest ones.
+
+// Statistics
+static uint32_t blocks        = 0;
+static uint32_t dirtyBlocks   = 0;
+static uint32_t hits          = 0;
+static uint32_t misses        = 0;
+static uint32_t evictions     = 0;
+static uint32_t writeBacks    = 0; // Blocks
+static uint32_t writeCommands = 0; // Calls of the write functions of the devices
+static uint32_t throttled     = 0; // Writers that had to write back blocks themselves
+
+
+static void flusher(void);
+
+void blockCache_install(void)
+{
+    pagingStatistics_t stats;
+    paging_getStatistics(&stats);
+    capacity = max(stats.totalFrames / BLOCKCACHE_FRACTION * PAGESIZE, BLOCKCACHE_MINSIZE);
+
+    uint32_t maxBlocks = capacity / 512;
+    bucketBits = 6; // At least 64 buckets
+    while ((1u << bucketBits) < maxBlocks/2) // Load factor of about 2 when the cache is full of 512 byte blocks
+        bucketBits++;
+    buckets = malloc(sizeof(cacheBlock_t*) << bucketBits, 0, "block cache buckets");
+    memset(buckets, 0, sizeof(cacheBlock_t*) << bucketBits);
+
+    lock = mutex_create("block cache");
+
+    task_t* task = create_thread(&flusher);
+    task->priority = PRIORITY_NORMAL;
+    scheduler_insertTask(task);
+}
+
+static inline cacheBlock_t** bucket(const blockDevice_t* device, uint64_t number)
+{
+    uint32_t key = (uint32_t)number ^ (uint32_t)(number >> 32) ^ ((uintptr_t)device >> 3);
+    return (buckets + ((key * 2654435761u) >> (32 - bucketBits))); // Fibonacci hashing
+}
+
+
+/// LRU list
+
+static void unlink(cacheBlock_t* block)
+{
+    if (block->newer)
+        block->newer->older = block->older;
+    else
+        newest = block->older;
+    if (block->older)
+        block->older->newer = block->newer;
+    else
+        oldest = block->newer;
+}
+
+static void insertNewest(cacheBlock_t* block)
+{
+    block->older = newest;
+    block->newer = 0;
+    if (newest)
+        newest->newer = block;
+    else
+        oldest = block;
+    newest = block;
+}
+
+
+/// Dirty blocks
+
+static void markDirty(cacheBlock_t* block)
+{
+    blockDevice_t* device = block->device;
+    block->dirty           = true;
+    block->dirtySince      = timer_getMilliseconds();
+    block->dirtyGeneration = ++dirtyGeneration;
+
+    // Sorted insertion. Searched from the end, because blocks are usually written in ascending order.
+    cacheBlock_t* prev = device->dirtyLast;
+    while (prev && prev->number > block->number)
+        prev = prev->dirtyPrev;
+    block->dirtyPrev = prev;
+    block->dirtyNext = prev ? prev->dirtyNext : device->dirtyFirst;
+    if (block->dirtyNext)
+        block->dirtyNext->dirtyPrev = block;
+    else
+        device->dirtyLast = block;
+    if (prev)
+        prev->dirtyNext = block;
+    else
+        device->dirtyFirst = block;
+
+    dirtyBlocks++;
+    dirtyBytes += device->blockSize;
+}
+
+static void markClean(cacheBlock_t* block)
+{
+    blockDevice_t* device = block->device;
+    if (block->dirtyPrev)
+        block->dirtyPrev->dirtyNext = block->dirtyNext;
+    else
+        device->dirtyFirst = block->dirtyNext;
+    if (block->dirtyNext)
+        block->dirtyNext->dirtyPrev = block->dirtyPrev;
+    else
+        device->dirtyLast = block->dirtyPrev;
+
+    block->dirty = false;
+    dirtyBlocks--;
+    dirtyBytes -= device->blockSize;
+}
+
+// Writes the block and the adjacent dirty blocks with one call. The lock is released while the device writes.
+static FS_ERROR writeRun(cacheBlock_t* block)
+{
+    blockDevice_t* device = block->device;
+    cacheBlock_t* first = block;
+    size_t count = 1;
+    while (first->dirtyPrev && first->dirtyPrev->number == first->number-1 && count < BLOCKCACHE_MAXRUN/2)
+    {
+        first = first->dirtyPrev;
+        count++;
+    }
+
+    cacheBlock_t* run[BLOCKCACHE_MAXRUN];
+    const void* sources[BLOCKCACHE_MAXRUN];
+    count = 0;
+    for (cacheBlock_t* b = first; b && count < BLOCKCACHE_MAXRUN && b->number == first->number+count; b = b->dirtyNext)
+        run[count++] = b;
+
+    for (size_t i = 0; i < count; i++) // Data written to the blocks meanwhile makes them dirty again
+    {
+        run[i]->refs++;
+        markClean(run[i]);
+        sources[i] = run[i]->data;
+    }
+
+    writing++;
+    mutex_unlock(lock);
+    FS_ERROR error = device->write(device, first->number, count, sources);
+    mutex_lock(lock);
+    writing--;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        run[i]->refs--;
+        if (error != CE_GOOD && !run[i]->dirty)
+            markDirty(run[i]);
+    }
+    if (writing == 0)
+        scheduler_unblockEvent(BL_WRITEBACK, &writing);
+
+    if (error != CE_GOOD)
+    {
+        textColor(ERROR);
+        printf("\nBlock cache: Writing blocks %u-%u failed (error %u).", (uint32_t)first->number, (uint32_t)first->number+count-1, error);
+        textColor(TEXT);
+        return (error);
+    }
+    writeBacks += count;
+    writeCommands++;
+    return (CE_GOOD);
+}
+
+static bool selectAll(const cacheBlock_t* block, uint32_t arg)
+{
+    return (true);
+}
+
+static bool selectExpired(const cacheBlock_t* block, uint32_t now)
+{
+    return (now - block->dirtySince >= DIRTY_EXPIRE);
+}
+
+static bool selectAboveLimit(const cacheBlock_t* block, uint32_t limit)
+{
+    return (dirtyBytes > limit);
+}
+
+// Writes back the selected dirty blocks of a device (0: all devices). The lock is dropped while writing, so the lists are
+// searched again after each run. Blocks dirtied after the start, e.g. again after a failed write, are left alone.
+static FS_ERROR writeDirty(blockDevice_t* only, bool (*selected)(const cacheBlock_t*, uint32_t), uint32_t arg)
+{
+    FS_ERROR error = CE_GOOD;
+    uint32_t generation = dirtyGeneration;
+    while (true)
+    {
+        cacheBlock_t* found = 0;
+        for (blockDevice_t* device = devices; device && !found; device = device->next)
+        {
+            if (only != 0 && device != only)
+                continue;
+            for (cacheBlock_t* block = device->dirtyFirst; block && !found; block = block->dirtyNext)
+            {
+                if ((int32_t)(generation - block->dirtyGeneration) >= 0 && selected(block, arg))
+                    found = block;
+            }
+        }
+        if (found == 0)
+            return (error);
+
+        FS_ERROR result = writeRun(found);
+        if (result != CE_GOOD)
+            error = result;
+    }
+}
+
+static void writeOldest(void) // Writes back the oldest unreferenced dirty block and its neighbours, so that eviction finds clean blocks again
+{
+    uint32_t scanned = 0;
+    for (cacheBlock_t* block = oldest; block && scanned < VICTIM_SCAN; block = block->newer)
+    {
+        if (block->refs)
+            continue;
+        if (block->dirty)
+        {
+            writeRun(block);
+            return; // The lock was dropped, so the list may have changed. Further blocks are written on the next request.
+        }
+        scanned++;
+    }
+}
+
+static void waitForWriteBacks(void)
+{
+    while (writing > 0)
+    {
+        // writeRun wakes us when the count drops to 0. The unlock function checks it when blocking, so the wakeup is not missed.
+        mutex_unlock(lock);
+        scheduler_blockCurrentTask(BL_WRITEBACK, &writing, 0);
+        mutex_lock(lock);
+    }
+}
+
+static void flusher(void)
+{
+    while (true)
+    {
+        scheduler_blockCurrentTask(BL_WRITEBACK, &dirtyBytes, FLUSH_INTERVAL);
+
+        mutex_lock(lock);
+        writeDirty(0, &selectExpired, timer_getMilliseconds());
+        writeDirty(0, &selectAboveLimit, capacity/100*DIRTY_BACKGROUND);
+        if (flushWanted)
+        {
+            flushWanted = false;
+            writeOldest();
+        }
+        mutex_unlock(lock);
+    }
+}
+
+bool blockCache_unlockTask(void* data)
+{
+    if (data == &writing)
+        return (writing == 0);
+    if (data == &dirtyBytes)
+        return (false); // The flusher is only woken up by blockCache_dirty, otherwise it could spin on failing writes
+    return (!((const cacheBlock_t*)data)->reading); // BL_BLOCKREAD
+}
+
+
+/// Allocation and eviction
+
+static void removeBlock(cacheBlock_t* block)
+{
+    cacheBlock_t** prev = bucket(block->device, block->number);
+    while (*prev != block)
+        prev = &(*prev)->hashNext;
+    *prev = block->hashNext;
+
+    unlink(block);
+    if (block->dirty)
+        markClean(block);
+    block->device->blocks--;
+    blocks--;
+}
+
+static void freeBlock(cacheBlock_t* block)
+{
+    used -= block->device->blockSize;
+    free(block->data);
+    free(block);
+}
+
+static cacheBlock_t* findVictim(void)
+{
+    cacheBlock_t* dirty = 0;
+    uint32_t scanned = 0;
+    for (cacheBlock_t* block = oldest; block && scanned < VICTIM_SCAN; block = block->newer)
+    {
+        if (block->refs)
+            continue;
+        if (!block->dirty)
+            return (block);
+        if (dirty == 0)
+            dirty = block;
+        scanned++;
+    }
+
+    // The flusher is behind. Writing here would hold the lock during the I/O, so the flusher is woken up instead.
+    if (dirty)
+    {
+        flushWanted = true;
+        scheduler_unblockEvent(BL_WRITEBACK, &dirtyBytes);
+    }
+    return (0);
+}
+
+static cacheBlock_t* allocBlock(blockDevice_t* device)
+{
+    while (used + device->blockSize > capacity)
+    {
+        cacheBlock_t* victim = findVictim();
+        if (victim == 0)
+            break; // All blocks are in use: Exceed the capacity
+
+        removeBlock(victim);
+        evictions++;
+
+        if (victim->device->blockSize == device->blockSize && victim->device->privateSize == device->privateSize)
+        {
+            victim->device = device;
+            return (victim);
+        }
+        freeBlock(victim);
+    }
+
+    cacheBlock_t* block = malloc(sizeof(cacheBlock_t) + device->privateSize, 0, "block cache header");
+    // Blocks of a power of two size do not cross page boundaries, which allows drivers to use them for DMA
+    size_t size = device->blockSize;
+    block->data = malloc(size, (size & (size-1)) ? 0 : min(size, PAGESIZE), "block cache data");
+    block->private = block + 1;
+    block->device = device;
+    used += size;
+    return (block);
+}
+
+
+/// Interface
+
+void blockCache_addDevice(blockDevice_t* device)
+{
+    device->blocks     = 0;
+    device->dirtyFirst = 0;
+    device->dirtyLast  = 0;
+
+    mutex_lock(lock);
+    device->next = devices;
+    devices = device;
+    mutex_unlock(lock);
+}
+
+void blockCache_removeDevice(blockDevice_t* device)
+{
+    mutex_lock(lock);
+    writeDirty(device, &selectAll, 0);
+    waitForWriteBacks();
+
+    uint32_t lost = 0;
+    for (cacheBlock_t* block = device->dirtyFirst; block; block = block->dirtyNext)
+        lost++;
+    if (lost > 0)
+    {
+        textColor(ERROR);
+        printf("\nBlock cache: %u dirty blocks of a removed device could not be written back.", lost);
+        textColor(TEXT);
+    }
+
+    cacheBlock_t* next;
+    for (cacheBlock_t* block = oldest; block && device->blocks > 0; block = next)
+    {
+        next = block->newer;
+        if (block->device == device)
+        {
+            removeBlock(block);
+            freeBlock(block);
+        }
+    }
+
+    for (blockDevice_t** prev = &devices; *prev; prev = &(*prev)->next)
+    {
+        if (*prev == device)
+        {
+            *prev = device->next;
+            break;
+        }
+    }
+    mutex_unlock(lock);
+}
+
+FS_ERROR blockCache_getRange(blockDevice_t* device, uint64_t first, size_t count, cacheBlock_t** result, bool read)
+{
+    bool own[BLOCKCACHE_MAXRUN]; // Placeholders read by this call
+
+    mutex_lock(lock);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        cacheBlock_t* block = *bucket(device, first+i);
+        while (block && (block->device != device || block->number != first+i))
+            block = block->hashNext;
+
+        if (block)
+        {
+            hits++;
+            block->refs++;
+            unlink(block);
+            insertNewest(block);
+        }
+        else
+        {
+            misses++;
+            block = allocBlock(device);
+            block->number  = first+i;
+            block->refs    = 1;
+            block->valid   = false;
+            block->reading = false;
+            block->dirty   = false;
+            memset(block->private, 0, device->privateSize);
+
+            cacheBlock_t** head = bucket(device, block->number);
+            block->hashNext = *head;
+            *head = block;
+            insertNewest(block);
+            device->blocks++;
+            blocks++;
+        }
+
+        own[i] = read && !block->valid && !block->reading;
+        if (own[i])
+            block->reading = true;
+        else if (!read && !block->reading)
+            block->valid = true; // Content is overwritten by the caller
+        result[i] = block;
+    }
+
+    mutex_unlock(lock);
+
+    // Each run of placeholders is read by one call
+    FS_ERROR error = CE_GOOD;
+    for (size_t i = 0; i < count && error == CE_GOOD;)
+    {
+        if (!own[i])
+        {
+            i++;
+            continue;
+        }
+
+        void* destinations[BLOCKCACHE_MAXRUN];
+        size_t n = 0;
+        for (; i+n < count && own[i+n]; n++)
+            destinations[n] = result[i+n]->data;
+        error = device->read(device, first+i, n, destinations);
+        i += n;
+    }
+
+    mutex_lock(lock);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        cacheBlock_t* block = result[i];
+        if (own[i])
+        {
+            block->valid   = error == CE_GOOD;
+            block->reading = false;
+            if (block->refs > 1) // Other tasks wait for it
+                scheduler_unblockEvent(BL_BLOCKREAD, block);
+        }
+    }
+
+    // Blocks read by other tasks
+    for (size_t i = 0; i < count; i++)
+    {
+        cacheBlock_t* block = result[i];
+        while (block->reading)
+        {
+            mutex_unlock(lock);
+            scheduler_blockCurrentTask(BL_BLOCKREAD, block, 0);
+            mutex_lock(lock);
+        }
+        if (!read && !block->valid)
+            block->valid = true;
+        else if (!block->valid && error == CE_GOOD)
+            error = CE_BAD_SECTOR_READ;
+    }
+
+    if (error != CE_GOOD)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            result[i]->refs--;
+            result[i] = 0;
+        }
+    }
+
+    mutex_unlock(lock);
+    return (error);
+}
+
+cacheBlock_t* blockCache_get(blockDevice_t* device, uint64_t number, bool read)
+{
+    cacheBlock_t* block;
+    blockCache_getRange(device, number, 1, &block, read);
+    return (block);
+}
+
+void blockCache_release(cacheBlock_t* block)
+{
+    mutex_lock(lock);
+    block->refs--;
+    mutex_unlock(lock);
+}
+
+void blockCache_dirty(cacheBlock_t* block)
+{
+    mutex_lock(lock);
+    if (!block->dirty)
+    {
+        markDirty(block);
+
+        if (dirtyBytes > capacity/100*DIRTY_LIMIT)
+        {
+            throttled++;
+            writeDirty(0, &selectAboveLimit, capacity/100*DIRTY_LIMIT);
+        }
+        else if (dirtyBytes > capacity/100*DIRTY_BACKGROUND)
+        {
+            scheduler_unblockEvent(BL_WRITEBACK, &dirtyBytes);
+        }
+    }
+    mutex_unlock(lock);
+}
+
+FS_ERROR blockCache_sync(blockDevice_t* device)
+{
+    mutex_lock(lock);
+    FS_ERROR error = writeDirty(device, &selectAll, 0);
+    waitForWriteBacks(); // Blocks written by the flusher or by other tasks are on the device only when these write-backs are done
+    mutex_unlock(lock);
+    return (error);
+}
+
+void blockCache_log(void)
+{
+    textColor(HEADLINE);
+    printf("\nBlock cache:");
+    textColor(TEXT);
+    printf("\ncapacity: %u KiB, used: %u KiB, blocks: %u (dirty: %u), hash buckets: %u", capacity/1024, used/1024, blocks, dirtyBlocks, 1u << bucketBits);
+    uint32_t lookups = hits + misses;
+    printf("\nhits: %u, misses: %u (hit rate: %u%%), evictions: %u", hits, misses,
+           lookups == 0 ? 0 : lookups < 0x1000000 ? hits*100/lookups : hits/(lookups/100), evictions);
+    printf("\nwritten back: %u blocks in %u writes, throttled writers: %u", writeBacks, writeCommands, throttled);
+    putch('\n');
+}
+
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
@@ -0,0 +1,62 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "os.h"
+#include "filesystem/fsmanager.h"
+
+#define BLOCKCACHE_FRACTION 32      // The cache may use 1/BLOCKCACHE_FRACTION of the physical memory
+#define BLOCKCACHE_MINSIZE  0x10000 // Lower limit of the capacity in bytes
+#define BLOCKCACHE_MAXRUN   64      // Maximum number of adjacent blocks read or written back by one call
+
+
+struct cacheBlock;
+
+// Anything that consists of blocks of equal size: Disks (devicemanager.c) and CDI caches (cdi_cache.c)
+typedef struct blockDevice
+{
+    size_t   blockSize;
+    size_t   privateSize;                                                                                 // Bytes allocated behind each cached block for the owner of the device
+    FS_ERROR (*read) (struct blockDevice* device, uint64_t first, size_t count, void* const* destinations);   // Reads count consecutive blocks
+    FS_ERROR (*write)(struct blockDevice* device, uint64_t first, size_t count, const void* const* sources); // Writes count consecutive blocks
+    void*    data;                                                                                        // Owner of the device, e.g. the disk
+
+    // Managed by the cache
+    uint32_t            blocks;      // Number of cached blocks of this device
+    struct cacheBlock*  dirtyFirst;  // Dirty blocks sorted by block number
+    struct cacheBlock*  dirtyLast;
+    struct blockDevice* next;
+} blockDevice_t;
+
+typedef struct cacheBlock
+{
+    blockDevice_t*     device;
+    uint64_t           number;
+    uint8_t*           data;
+    void*              private;         // privateSize bytes, zeroed when the block enters the cache
+    uint32_t           refs;            // Blocks are only evicted when they are not referenced
+    bool               valid;           // Content has been read from the device (or is overwritten by the task that got it)
+    bool               reading;         // A task reads the content without the lock, others wait for it (BL_BLOCKREAD)
+    bool               dirty;           // Contains data that has not been written to the device yet
+    uint32_t           dirtySince;      // Milliseconds since boot
+    uint32_t           dirtyGeneration; // Value of a counter incremented whenever a block becomes dirty
+    struct cacheBlock* dirtyNext;
+    struct cacheBlock* dirtyPrev;
+    struct cacheBlock* hashNext;
+    struct cacheBlock* newer;           // LRU list
+    struct cacheBlock* older;
+} cacheBlock_t;
+
+
+void          blockCache_install(void);
+void          blockCache_addDevice(blockDevice_t* device);    // The callbacks and sizes have to be set before
+void          blockCache_removeDevice(blockDevice_t* device); // Writes back the dirty blocks of the device and drops all its blocks. They must not be referenced.
+cacheBlock_t* blockCache_get(blockDevice_t* device, uint64_t number, bool read); // Returns the referenced block, 0 if it could not be read. read == false: Content is undefined if the block was not cached.
+FS_ERROR      blockCache_getRange(blockDevice_t* device, uint64_t first, size_t count, cacheBlock_t** blocks, bool read); // Like blockCache_get for count <= BLOCKCACHE_MAXRUN consecutive blocks. Uncached runs are read by one call each.
+void          blockCache_release(cacheBlock_t* block);
+void          blockCache_dirty(cacheBlock_t* block);
+FS_ERROR      blockCache_sync(blockDevice_t* device);         // Writes the dirty blocks of the device to it (0: all devices) and waits for running write-backs
+bool          blockCache_unlockTask(void* data);              // Used for scheduler
+void          blockCache_log(void);
+
+
+#endif
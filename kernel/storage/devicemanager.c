@@ -12,9 +12,7 @@
 #include "filesystem/fat.h"
 #include "uhci.h"
 #include "hdd.h"
-#ifdef _CACHE_DIAGNOSIS_
-  #include "timer.h"
-#endif
+#include "ahci.h"
 
 
 disk_t* disks[DISKARRAYSIZE] = {0};
@@ -26,36 +24,85 @@ portType_t FDD      = {.motorOff = &flpydsk_motorOff, .pollDisk = 0},
            USB_OHCI = {.motorOff = 0,                 .pollDisk = 0},
            USB_EHCI = {.motorOff = 0,                 .pollDisk = 0},
            RAM      = {.motorOff = 0,                 .pollDisk = 0},
-           HDD      = {.motorOff = 0,                 .pollDisk = 0};
+           HDD      = {.motorOff = 0,                 .pollDisk = 0},
+           AHCI     = {.motorOff = 0,                 .pollDisk = 0};
 
-diskType_t FLOPPYDISK = {.readSector = &flpydsk_readSector, .writeSector = &flpydsk_writeSector},
-           USB_MSD    = {.readSector = &usb_read,           .writeSector = &usb_write},
-           RAMDISK    = {.readSector = 0,                   .writeSector = 0},
-           HDDPIODISK = {.readSector = &hdd_readSectorPIO,   .writeSector = &hdd_writeSectorPIO};
+diskType_t FLOPPYDISK = {.readSectors = &flpydsk_readSectors, .writeSectors = &flpydsk_writeSectors, .readSectorsSG = 0,                  .writeSectorsSG = 0},
+           USB_MSD    = {.readSectors = &usb_readSectors,     .writeSectors = &usb_writeSectors,     .readSectorsSG = &usb_readSectorsSG,   .writeSectorsSG = &usb_writeSectorsSG},
+           RAMDISK    = {.readSectors = 0,                    .writeSectors = 0,                     .readSectorsSG = 0,                    .writeSectorsSG = 0},
+           HDDDISK    = {.readSectors = &hdd_readSectors,     .writeSectors = &hdd_writeSectors,     .readSectorsSG = &hdd_readSectorsSG,   .writeSectorsSG = &hdd_writeSectorsSG},
+           AHCIDISK   = {.readSectors = &ahci_readSectors,    .writeSectors = &ahci_writeSectors,    .readSectorsSG = &ahci_readSectorsSG,  .writeSectorsSG = &ahci_writeSectorsSG};
 
-// Cache
-#define NUMCACHE 20
+// Transfers consecutive sectors from or to the buffers of cached blocks. Buffers following each other in memory are merged.
+static FS_ERROR transferBlocks(disk_t* disk, uint32_t sector, size_t count, void* const* buffers, bool write)
+{
+    sgElement_t list[BLOCKCACHE_MAXRUN];
+    size_t elements = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (elements > 0 && (uint8_t*)list[elements-1].buffer + list[elements-1].count*disk->cache.blockSize == buffers[i])
+        {
+            list[elements-1].count++;
+        }
+        else
+        {
+            list[elements].buffer = buffers[i];
+            list[elements].count  = 1;
+            elements++;
+        }
+    }
+
+    if (write && disk->type->writeSectorsSG)
+        return (disk->type->writeSectorsSG(sector, list, elements, disk));
+    if (!write && disk->type->readSectorsSG)
+        return (disk->type->readSectorsSG(sector, list, elements, disk));
 
-typedef struct
+    for (size_t i = 0; i < elements; i++)
+    {
+        FS_ERROR error = write ? disk->type->writeSectors(sector, list[i].count, list[i].buffer, disk) : disk->type->readSectors(sector, list[i].count, list[i].buffer, disk);
+        if (error != CE_GOOD)
+            return (error);
+        sector += list[i].count;
+    }
+    return (CE_GOOD);
+}
+
+/*
+disk_t::accessRemaining keeps the motor of a disk running (flpydsk). Callers announce one access per sector before they read or
+write (fat.c, singleSectorRead/Write). Since all sectors go through the block cache, sectorsRead and sectorsWrite count these
+accesses down when the data is copied from or into the cache, independently of whether the device is accessed. Transfers of the
+cache to the device happen at other times (reads of missing blocks, write-backs) and announce their own accesses, which the
+drivers of disks with a motor count down for each sector they transfer. Other drivers do not count at all.
+*/
+static inline void announceAccesses(disk_t* disk, size_t count)
 {
-    uint8_t buffer[512];
-    bool valid;
-    bool write; // Contains unwritten data
-    void* owner;
-    disk_t* disk;
-    uint32_t sector;
-} cache_t;
+    if (disk->port && disk->port->type->motorOff)
+        disk->accessRemaining += count;
+}
 
-static cache_t* caches = 0;
+static inline void completeAccesses(disk_t* disk, size_t count)
+{
+    disk->accessRemaining -= count;
+}
+
+static FS_ERROR readBlocks(blockDevice_t* device, uint64_t first, size_t count, void* const* destinations)
+{
+    disk_t* disk = device->data;
+    announceAccesses(disk, count);
+    return (transferBlocks(disk, first, count, destinations, false));
+}
+
+static FS_ERROR writeBlocks(blockDevice_t* device, uint64_t first, size_t count, const void* const* sources)
+{
+    disk_t* disk = device->data;
+    announceAccesses(disk, count);
+    return (transferBlocks(disk, first, count, (void* const*)sources, true));
+}
 
 
 void deviceManager_install(partition_t* systemPart)
 {
-    caches = malloc(sizeof(cache_t)*NUMCACHE, 0, "devmgr caches");
-    for (uint16_t i = 0; i < NUMCACHE; i++) // Invalidate all read caches
-    {
-        caches[i].valid = false;
-    }
+    blockCache_install();
 
     systemPartition = systemPart;
 }
@@ -90,6 +137,13 @@ void attachPort(port_t* port)
 
 void attachDisk(disk_t* disk)
 {
+    disk->cache.blockSize   = disk->sectorSize ? disk->sectorSize : 512;
+    disk->cache.privateSize = 0;
+    disk->cache.read        = &readBlocks;
+    disk->cache.write       = &writeBlocks;
+    disk->cache.data        = disk;
+    blockCache_addDevice(&disk->cache);
+
     // Later: Searching correct ID in device-File
     for (size_t i=0; i<DISKARRAYSIZE; i++)
     {
@@ -107,6 +161,7 @@ void removeDisk(disk_t* disk)
     {
         if (disks[i] == disk)
         {
+            blockCache_removeDevice(&disk->cache); // Unwritten data is lost, the disk is gone
             disks[i] = 0;
             return;
         }
@@ -137,7 +192,9 @@ void showPortList(void)
             else if (ports[i]->type == &USB_EHCI)
                 printf("\nUSB 2.0        ");
             else if (ports[i]->type == &HDD)
-                printf("\nATA (PIO)      ");
+                printf("\nATA            ");
+            else if (ports[i]->type == &AHCI)
+                printf("\nSATA (AHCI)    ");
             else
                 printf("\nUnknown        ");
 
@@ -189,7 +246,8 @@ void showDiskList(void)
             if      (disks[i]->type == &FLOPPYDISK) printf("\nFloppy");
             else if (disks[i]->type == &RAMDISK)    printf("\nRAMdisk");
             else if (disks[i]->type == &USB_MSD)    printf("\nUSB MSD");
-            else if (disks[i]->type == &HDDPIODISK) printf("\nHDD");
+            else if (disks[i]->type == &HDDDISK)    printf("\nHDD");
+            else if (disks[i]->type == &AHCIDISK)   printf("\nSATA");
             else                                    printf("\nUnknown");
 
             textColor(IMPORTANT);
@@ -383,100 +441,43 @@ FS_ERROR analyzeDisk(disk_t* disk)
 }
 
 
-#ifdef _CACHE_DIAGNOSIS_
-static void logCache(void)
-{
-    printf("\n\nCaches:\nID\tdisk\t\tsector\towner\t\tvalid\tsynced");
-    textColor(LIGHT_GRAY);
-    printf("\n--------------------------------------------------------------------------------");
-    for (uint16_t i = 0; i < NUMCACHE; i++)
-    {
-        if (caches[i].valid)
-            textColor(GREEN);
-        else
-            textColor(LIGHT_GRAY);
-        printf("\n%u:\t%Xh\t%u\t%Xh\t%s\t%s", i, caches[i].disk, caches[i].sector, caches[i].owner, caches[i].valid?"yes":"no", caches[i].write?"no":"yes");
-    }
-    textColor(LIGHT_GRAY);
-    printf("\n--------------------------------------------------------------------------------");
-    textColor(TEXT);
-    waitForKeyStroke();
-}
-#endif
+/// Cache
 
-static void flushCache(cache_t* c)
+FS_ERROR devicemanager_flushCaches(disk_t* disk)
 {
-    if(c->write && c->valid)
-    {
-        c->disk->type->writeSector(c->sector, c->buffer, c->disk);
-        c->write = false;
-    }
+    return (blockCache_sync(disk ? &disk->cache : 0));
 }
 
-void devicemanager_flushCaches(void* owner)
+FS_ERROR sectorsWrite(uint32_t sector, uint32_t count, const uint8_t* buffer, disk_t* disk)
 {
-    for (uint16_t i = 0; i < NUMCACHE; i++)
-        if(caches[i].owner == owner)
-            flushCache(caches+i);
-}
+  #ifdef _DEVMGR_DIAGNOSIS_
+    textColor(YELLOW); printf("\n>>>>> sectorsWrite: %u-%u <<<<<", sector, sector+count-1); textColor(TEXT);
+  #endif
 
-static void fillCache(uint32_t sector, disk_t* disk, uint8_t* buffer, bool write, void* owner)
-{
-    bool done = false;
-    for (uint16_t i = 0; i < NUMCACHE; i++) // Look for cache that can be updated
+    size_t blockSize = disk->cache.blockSize;
+    while (count > 0)
     {
-        if (caches[i].valid && caches[i].sector == sector && caches[i].disk == disk)
+        uint32_t n = min(count, BLOCKCACHE_MAXRUN);
+        cacheBlock_t* blocks[BLOCKCACHE_MAXRUN];
+        blockCache_getRange(&disk->cache, sector, n, blocks, false); // Written back when they are evicted or flushed
+        completeAccesses(disk, n);
+        for (uint32_t i = 0; i < n; i++)
         {
-            if(done)
-                caches[i].valid = false;
-            else
-            {
-                if(caches[i].owner != owner)
-                {
-                    flushCache(caches+i);
-                    caches[i].owner = owner;
-                }
-                if(write)
-                {
-                    caches[i].write = true;
-                }
-                memcpy(caches[i].buffer, buffer, 512);
-                done = true;
-            }
+            memcpy(blocks[i]->data, buffer + i*blockSize, blockSize);
+            blockCache_dirty(blocks[i]);
+            blockCache_release(blocks[i]);
         }
+        sector += n;
+        count  -= n;
+        buffer += n*blockSize;
     }
 
-    if(!done)
-    {
-        static uint8_t currCache = 0;
-        if(caches[currCache].valid)
-            flushCache(caches+currCache); // Write cache before its overwritten
-        // fill new cache
-        caches[currCache].sector = sector;
-        caches[currCache].disk   = disk;
-        caches[currCache].valid  = true;
-        caches[currCache].write  = write;
-        caches[currCache].owner  = owner;
-        memcpy(caches[currCache].buffer, buffer, 512);
-
-        currCache++;
-        currCache %= NUMCACHE;
-    }
-
-  #ifdef _CACHE_DIAGNOSIS_
-    logCache();
-  #endif
+    return CE_GOOD;
 }
 
 FS_ERROR sectorWrite(uint32_t sector, uint8_t* buffer, disk_t* disk)
 {
-  #ifdef _DEVMGR_DIAGNOSIS_
-    textColor(YELLOW); printf("\n>>>>> sectorWrite: %u <<<<<", sector); textColor(TEXT);
-  #endif
-
-    fillCache(sector, disk, buffer, true, 0);
-
-    return CE_GOOD;
+    return (sectorsWrite(sector, 1, buffer, disk));
 }
 
 FS_ERROR singleSectorWrite(uint32_t sector, uint8_t* buffer, disk_t* disk)
@@ -486,34 +487,40 @@ FS_ERROR singleSectorWrite(uint32_t sector, uint8_t* buffer, disk_t* disk)
 }
 
 
-FS_ERROR sectorRead(uint32_t sector, uint8_t* buffer, disk_t* disk)
+FS_ERROR sectorsRead(uint32_t sector, uint32_t count, uint8_t* buffer, disk_t* disk)
 {
   #ifdef _DEVMGR_DIAGNOSIS_
-    textColor(0x03); printf("\n>>>>> sectorRead: %u <<<<<", sector); textColor(TEXT);
+    textColor(0x03); printf("\n>>>>> sectorsRead: %u-%u <<<<<", sector, sector+count-1); textColor(TEXT);
   #endif
 
-    for (uint16_t i = 0; i < NUMCACHE; i++)
+    size_t blockSize = disk->cache.blockSize;
+    while (count > 0)
     {
-        if (caches[i].valid && caches[i].sector == sector && caches[i].disk == disk)
+        uint32_t n = min(count, BLOCKCACHE_MAXRUN);
+        cacheBlock_t* blocks[BLOCKCACHE_MAXRUN];
+        FS_ERROR error = blockCache_getRange(&disk->cache, sector, n, blocks, true);
+        completeAccesses(disk, n);
+        if (error != CE_GOOD)
         {
-          #ifdef _DEVMGR_DIAGNOSIS_
-            printf("\nsector: %u <--- read from RAM Cache", caches[i].sector);
-          #endif
-
-            memcpy(buffer, caches[i].buffer, 512); // Take data from read cache
-
-            disk->accessRemaining--;
-            return (CE_GOOD);
+            completeAccesses(disk, count-n); // Sectors that will not be read
+            return (CE_BAD_SECTOR_READ);
         }
-    }
 
-    FS_ERROR error = disk->type->readSector(sector, buffer, disk);
-    if (error == CE_GOOD)
-    {
-        fillCache(sector, disk, buffer, false, 0);
+        for (uint32_t i = 0; i < n; i++)
+        {
+            memcpy(buffer + i*blockSize, blocks[i]->data, blockSize);
+            blockCache_release(blocks[i]);
+        }
+        sector += n;
+        count  -= n;
+        buffer += n*blockSize;
     }
+    return (CE_GOOD);
+}
 
-    return error;
+FS_ERROR sectorRead(uint32_t sector, uint8_t* buffer, disk_t* disk)
+{
+    return (sectorsRead(sector, 1, buffer, disk));
 }
 
 FS_ERROR singleSectorRead(uint32_t sector, uint8_t* buffer, disk_t* disk)
@@ -3,6 +3,7 @@
 
 #include "os.h"
 #include "filesystem/fsmanager.h"
+#include "blockcache.h"
 
 #define PORTARRAYSIZE 26
 #define DISKARRAYSIZE 26
@@ -17,14 +18,23 @@ typedef struct
     void (*pollDisk)(struct port*);
 } portType_t;
 
+// Element of a scatter-gather list: count consecutive sectors are transferred from or to buffer
 typedef struct
 {
-    FS_ERROR (*readSector) (uint32_t, void*, struct disk*);
-    FS_ERROR (*writeSector)(uint32_t, void*, struct disk*);
+    void*    buffer;
+    uint32_t count;
+} sgElement_t;
+
+typedef struct
+{
+    FS_ERROR (*readSectors)   (uint32_t sector, uint32_t count, void* buffer, struct disk*);
+    FS_ERROR (*writeSectors)  (uint32_t sector, uint32_t count, void* buffer, struct disk*);
+    FS_ERROR (*readSectorsSG) (uint32_t sector, const sgElement_t* list, size_t elements, struct disk*); // Optional. Otherwise readSectors is called for each element.
+    FS_ERROR (*writeSectorsSG)(uint32_t sector, const sgElement_t* list, size_t elements, struct disk*); // Optional
 } diskType_t;
 
-extern portType_t FDD, USB_UHCI, USB_OHCI, USB_EHCI, RAM, HDD;
-extern diskType_t FLOPPYDISK, USB_MSD, RAMDISK, HDDPIODISK;
+extern portType_t FDD, USB_UHCI, USB_OHCI, USB_EHCI, RAM, HDD, AHCI;
+extern diskType_t FLOPPYDISK, USB_MSD, RAMDISK, HDDDISK, AHCIDISK;
 
 typedef struct disk
 {
@@ -35,6 +45,7 @@ typedef struct disk
     void*        data;                          // Contains additional information depending on disk-type
     uint32_t     accessRemaining;               // Used to control motor
     struct port* port;
+    blockDevice_t cache;                        // Sectors of the disk in the block cache, set up by attachDisk
 
     // Technical data of the disk
     uint32_t sectorSize;    // Bytes per sector
@@ -80,8 +91,10 @@ FS_ERROR sectorRead       (uint32_t sector, uint8_t* buffer, disk_t* disk);
 FS_ERROR singleSectorRead (uint32_t sector, uint8_t* buffer, disk_t* disk);
 FS_ERROR sectorWrite      (uint32_t sector, uint8_t* buffer, disk_t* disk);
 FS_ERROR singleSectorWrite(uint32_t sector, uint8_t* buffer, disk_t* disk);
+FS_ERROR sectorsRead      (uint32_t sector, uint32_t count, uint8_t* buffer, disk_t* disk);       // Sectors that are not cached are read with as few requests as possible
+FS_ERROR sectorsWrite     (uint32_t sector, uint32_t count, const uint8_t* buffer, disk_t* disk); // Written back by the block cache
 
-void devicemanager_flushCaches(void* owner);
+FS_ERROR devicemanager_flushCaches(disk_t* disk); // Writes cached sectors of the disk (0: all disks)
 
 
 #endif
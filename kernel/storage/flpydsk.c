@@ -129,7 +129,7 @@ static floppy_t* createFloppy(uint8_t ID)
     floppy_t* fdd        = malloc(sizeof(floppy_t), 0, "flpydsk-FDD");
     fdd->ID              = ID;
     fdd->motor           = false; // floppy motor is off
-    fdd->RW_Lock         = mutex_create();
+    fdd->RW_Lock         = mutex_create("floppy");
     fdd->accessRemaining = 0;
     fdd->lastTrack       = 0xFFFFFFFF;
     fdd->trackBuffer     = malloc(0x2400, 0, "flpydsk-TrackBuffer");
@@ -693,6 +693,30 @@ FS_ERROR flpydsk_writeSector(uint32_t sector, void* buffer, disk_t* device)
 }
 
 
+// The floppy reads whole tracks into its track buffer anyway, so the sectors are copied one by one
+FS_ERROR flpydsk_readSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* device)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        FS_ERROR error = flpydsk_readSector(sector+i, buffer + i*512, device);
+        if (error != CE_GOOD)
+            return (error);
+    }
+    return (CE_GOOD);
+}
+
+FS_ERROR flpydsk_writeSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* device)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        FS_ERROR error = flpydsk_writeSector(sector+i, buffer + i*512, device);
+        if (error != CE_GOOD)
+            return (error);
+    }
+    return (CE_GOOD);
+}
+
+
 FS_ERROR flpydsk_write_ia(int32_t i, void* a, FLOPPY_MODE option)
 {
     int32_t val=0;
@@ -37,6 +37,8 @@ void flpydsk_motorOff(port_t* port);
 void flpydsk_refreshVolumeName(disk_t* disk);
 FS_ERROR flpydsk_readSector(uint32_t sector, void* buffer, disk_t* device);
 FS_ERROR flpydsk_writeSector(uint32_t sector, void* buffer, disk_t* device);
+FS_ERROR flpydsk_readSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* device);
+FS_ERROR flpydsk_writeSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* device);
 FS_ERROR flpydsk_write_ia(int32_t i, void* a, FLOPPY_MODE option);
 
 
@@ -14,13 +14,12 @@
 #include "serial.h"
 #include "timer.h"
 #include "irq.h"
+#include "paging.h"
+#include "pci.h"
 
 
 static inline void wait400NS(uint16_t p) { inportb(p);inportb(p);inportb(p);inportb(p); }
 
-static const uint32_t hddDmaPhysAdress = 0x4000;
-static void* hddDmaAdress;
-
 static inline void repinsw(uint16_t port, uint16_t* buf, uint32_t count)
 {
     __asm__("rep insw" : : "d" (port), "D" ((uint32_t)buf), "c" (count));
@@ -34,7 +33,6 @@ static const uint32_t ataIRQRetries = 30000 / 200;
 static const uint32_t ataPollInterval = 10;
 static const uint32_t ataPollRetries = 30000 / 10;
 
-// TODO: Merge the r/w-functions and make lba48 (currently removed) part of it to avoid code duplication
 // Caller has to call irq_resetCounter before calling this function
 static inline bool ataWaitIRQ(uint16_t channel, uint8_t errMask, uint8_t* status)
 {
@@ -181,177 +179,301 @@ static inline bool ataWaitBSY(HDD_ATACHANNEL channel)
     return false;
 }
 
-static FS_ERROR readSectorPIOLBA28(uint32_t sector, void* buf, hdd_t* hd)
+// Walks through a scatter-gather list sector by sector
+typedef struct
 {
-    uint16_t port = 0;
-    bool slave = false;
+    const sgElement_t* element;
+    uint32_t           sector;  // Sector inside of the element
+} sgCursor_t;
 
-    switch(hd->channel)
+static uint16_t* nextSector(sgCursor_t* cursor)
+{
+    while (cursor->sector == cursor->element->count)
     {
-    case ATACHANNEL_FIRST_MASTER:
-        port = ATA_PRIMARY_BASEPORT;
-        break;
-    case ATACHANNEL_FIRST_SLAVE:
-        port = ATA_PRIMARY_BASEPORT;
-        slave = true;
-        break;
-    case ATACHANNEL_SECOND_MASTER:
-        port = ATA_SECONDARY_BASEPORT;
-        break;
-    case ATACHANNEL_SECOND_SLAVE:
-        port = ATA_SECONDARY_BASEPORT;
-        slave = true;
-        break;
-    default:
-        return CE_INVALID_ARGUMENT;
+        cursor->element++;
+        cursor->sector = 0;
     }
+    return ((uint16_t*)cursor->element->buffer + 256*cursor->sector++);
+}
 
-    mutex_lock(hd->rwLock);
+static inline IRQ_NUM_t ataIRQ(const hdd_t* hd)
+{
+    return (hd->port == ATA_PRIMARY_BASEPORT ? IRQ_ATA_PRIMARY : IRQ_ATA_SECONDARY);
+}
 
-    // high nibble: 0xE = master, 0xF = slave
-    // low nibble: highest 4 bit of the 28 bit lba
-    outportb(port+ATA_REG_DRIVE, (slave? 0xF0 : 0xE0) | ((sector >> 24) & 0x0F));
+// Selects the drive, waits until it is ready and writes the address registers. Caller has to hold hd->rwLock.
+// LBA48 is only used for sectors that are not addressable with 28 bit, because it needs twice as many port accesses.
+static bool ataSetupCommand(hdd_t* hd, uint32_t sector, uint32_t count, bool* ext, uint8_t* status)
+{
+    *ext = sector + count - 1 > 0x0FFFFFFF;
 
-    uint8_t stat = 0;
+    // LBA28: high nibble 0xE = master, 0xF = slave, low nibble: highest 4 bit of the 28 bit lba
+    // LBA48: 0x40 = master, 0x50 = slave
+    if (*ext)
+        outportb(hd->port+ATA_REG_DRIVE, hd->slave ? 0x50 : 0x40);
+    else
+        outportb(hd->port+ATA_REG_DRIVE, (hd->slave ? 0xF0 : 0xE0) | ((sector >> 24) & 0x0F));
 
-    if(!ataPoll(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, ATA_STATUS_RDY, &stat))
-    {
-        serial_log(SER_LOG_HRDDSK, "[ATA-PIO28-Read] Drive was not ready in 30 sec: %y\n", stat);
+    if (!ataPoll(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, ATA_STATUS_RDY, status))
+        return false;
 
-        mutex_unlock(hd->rwLock);
-        return CE_BAD_SECTOR_READ;
+    if (*ext) // High order bytes first. Bits 32-47 of the lba are always 0, because sector numbers have 32 bit.
+    {
+        outportb(hd->port+ATA_REG_SECTORCOUNT, (count >> 8) & 0xFF);
+        outportb(hd->port+ATA_REG_LBALO, (sector >> 24) & 0xFF);
+        outportb(hd->port+ATA_REG_LBAMID, 0);
+        outportb(hd->port+ATA_REG_LBAHI, 0);
     }
+    outportb(hd->port+ATA_REG_SECTORCOUNT, count & 0xFF); // LBA28: 0 means 256 sectors
+    outportb(hd->port+ATA_REG_LBALO, sector & 0xFF);
+    outportb(hd->port+ATA_REG_LBAMID, (sector >> 8) & 0xFF);
+    outportb(hd->port+ATA_REG_LBAHI, (sector >> 16) & 0xFF);
+    return true;
+}
 
-    //outportb(port+ATA_REG_FEATURE, 0x00);
+static bool ataFlushCache(hdd_t* hd, bool ext, uint8_t* status)
+{
+    outportb(hd->port+ATA_REG_STATUSCMD, ext ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH);
+    return ataPoll(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, ATA_STATUS_RDY, status);
+}
 
-    outportb(port+ATA_REG_SECTORCOUNT, 1); // read 1 sector
 
-    outportb(port+ATA_REG_LBALO, sector & 0xFF);
-    outportb(port+ATA_REG_LBAMID, (sector >> 8) & 0xFF);
-    outportb(port+ATA_REG_LBAHI, (sector >> 16) & 0xFF);
+/// PIO
 
-    // Moved from ataWaitIRQ because it caused problems on fast emulators
-    irq_resetCounter(port == ATA_PRIMARY_BASEPORT ? IRQ_ATA_PRIMARY : IRQ_ATA_SECONDARY);
+// Reads up to 256 sectors with one command. The drive raises an IRQ for each sector.
+static FS_ERROR readSectorsPIO(uint32_t sector, uint32_t count, sgCursor_t* data, hdd_t* hd)
+{
+    IRQ_NUM_t irq = ataIRQ(hd);
+    uint8_t stat = 0;
+    bool ext;
 
-    outportb(port+ATA_REG_STATUSCMD, 0x20); // Read sector(s)
+    mutex_lock(hd->rwLock);
 
-    if(!ataWaitIRQ(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, &stat))
+    if (!ataSetupCommand(hd, sector, count, &ext, &stat))
     {
-        serial_log(SER_LOG_HRDDSK, "[ATA-PIO28-Read] Failed to read: %y\r\n", stat);
-        mutex_unlock(hd->rwLock);
-
-        // TODO: Reset drive
+        serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Read] Drive was not ready in 30 sec: %y\n", stat);
 
+        mutex_unlock(hd->rwLock);
         return CE_BAD_SECTOR_READ;
     }
-    else
-    {
-        serial_log(SER_LOG_HRDDSK, "[ATA-PIO28-Read] Got IRQ, now checking the status: %y\r\n", stat);
-    }
 
-    if(!(stat & ATA_STATUS_RDY && stat & ATA_STATUS_DRQ))
+    // Moved from ataWaitIRQ because it caused problems on fast emulators
+    irq_resetCounter(irq);
+
+    outportb(hd->port+ATA_REG_STATUSCMD, ext ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
+
+    for (uint32_t i = 0; i < count; i++)
     {
-        serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Read28] IRQ generated with no error, but either RDY or DRQ is 0: %y\r\n", stat);
-        mutex_unlock(hd->rwLock);
+        if(!ataWaitIRQ(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, &stat))
+        {
+            serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Read] Failed to read: %y\r\n", stat);
+            mutex_unlock(hd->rwLock);
 
-        return CE_BAD_SECTOR_READ;
-    }
+            // TODO: Reset drive
+
+            return CE_BAD_SECTOR_READ;
+        }
 
-    repinsw(port+ATA_REG_DATA, buf, 256);
+        if(!(stat & ATA_STATUS_RDY && stat & ATA_STATUS_DRQ))
+        {
+            serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Read] IRQ generated with no error, but either RDY or DRQ is 0: %y\r\n", stat);
+            mutex_unlock(hd->rwLock);
+
+            return CE_BAD_SECTOR_READ;
+        }
+
+        irq_resetCounter(irq); // The drive continues with the next sector as soon as this one has been taken
+        repinsw(hd->port+ATA_REG_DATA, nextSector(data), 256);
+    }
 
     mutex_unlock(hd->rwLock);
 
     return CE_GOOD;
 }
 
-static FS_ERROR writeSectorPIOLBA28(uint32_t sector, void* buf, hdd_t* hd)
+// Writes up to 256 sectors with one command. The drive raises an IRQ after each sector.
+static FS_ERROR writeSectorsPIO(uint32_t sector, uint32_t count, sgCursor_t* data, hdd_t* hd)
 {
-    uint16_t port = 0;
-    bool slave = false;
-
-    switch(hd->channel)
-    {
-    case ATACHANNEL_FIRST_MASTER:
-        port = ATA_PRIMARY_BASEPORT;
-        break;
-    case ATACHANNEL_FIRST_SLAVE:
-        port = ATA_PRIMARY_BASEPORT;
-        slave = true;
-        break;
-    case ATACHANNEL_SECOND_MASTER:
-        port = ATA_SECONDARY_BASEPORT;
-        break;
-    case ATACHANNEL_SECOND_SLAVE:
-        port = ATA_SECONDARY_BASEPORT;
-        slave = true;
-        break;
-    default:
-        return CE_INVALID_ARGUMENT;
-    }
+    IRQ_NUM_t irq = ataIRQ(hd);
+    uint8_t portval;
+    bool ext;
 
     mutex_lock(hd->rwLock);
 
-    // high nibble: 0xE0 = master, 0xF0 = slave
-    // low nibble: highest 4 bit of the 28 bit lba
-    outportb(port+ATA_REG_DRIVE, (slave? 0xF0 : 0xE0) | ((sector >> 24) & 0x0F));
+    if (!ataSetupCommand(hd, sector, count, &ext, &portval))
+    {
+        serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Write] Drive was not ready in 30 sec: %y\r\n", portval);
 
-    uint8_t portval;
+        mutex_unlock(hd->rwLock);
+        return CE_WRITE_ERROR;
+    }
 
-    if(!ataPoll(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, ATA_STATUS_RDY, &portval))
+    // When writing the IRQ will fire AFTER we transmitted the data, so we'll have to poll
+    outportb(hd->port+ATA_REG_STATUSCMD, ext ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO);
+
+    if(!ataPoll(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, ATA_STATUS_RDY | ATA_STATUS_DRQ, &portval))
     {
-        serial_log(SER_LOG_HRDDSK, "[ATA-PIO28-Write] Drive was not ready in 30 sec: %y\r\n", portval);
+        serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Write] Failed to write (pre data send): %y\r\n", portval);
 
         mutex_unlock(hd->rwLock);
         return CE_WRITE_ERROR;
     }
 
-    //outportb(port+ATA_REG_FEATURE, 0x00);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        irq_resetCounter(irq);
 
-    outportb(port+ATA_REG_SECTORCOUNT, 1); // write 1 sector
+        uint16_t* bufu16 = nextSector(data);
+        for(int j = 0; j < 256; ++j)
+        {
+            __asm__ volatile("jmp .+2"); // ATA needs a 'tiny delay of jmp $+2'
 
-    outportb(port+ATA_REG_LBALO, sector & 0xFF);
-    outportb(port+ATA_REG_LBAMID, (sector >> 8) & 0xFF);
-    outportb(port+ATA_REG_LBAHI, (sector >> 16) & 0xFF);
+            outportw(hd->port+ATA_REG_DATA, bufu16[j]);
+        }
 
-    // When writing the IRQ will fire AFTER we transmitted the data, so we'll have to poll
-    outportb(port+ATA_REG_STATUSCMD, 0x30); // Write sector(s)
+        if(!ataWaitIRQ(hd->channel, ATA_STATUS_DF | ATA_STATUS_ERR, &portval))
+        {
+            serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Write] Failed to write (post data send): %y\r\n", portval);
+            mutex_unlock(hd->rwLock);
 
-    irq_resetCounter(port == ATA_PRIMARY_BASEPORT ? IRQ_ATA_PRIMARY : IRQ_ATA_SECONDARY);
+            // TODO: Reset drive
 
-    if(!ataPoll(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, ATA_STATUS_RDY | ATA_STATUS_DRQ, &portval))
+            return CE_WRITE_ERROR;
+        }
+
+        if(i+1 < count && !(portval & ATA_STATUS_DRQ))
+        {
+            serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Write] Drive does not request the next sector: %y\r\n", portval);
+
+            mutex_unlock(hd->rwLock);
+            return CE_WRITE_ERROR;
+        }
+    }
+
+    if(!ataFlushCache(hd, ext, &portval))
     {
-        serial_log(SER_LOG_HRDDSK, "[ATA-PIO28-Write] Failed to write (pre data send): %y\r\n", portval);
+        serial_log(SER_LOG_HRDDSK, "[ATA-PIO-Write] Error during cache flush: %y\r\n", portval);
 
         mutex_unlock(hd->rwLock);
         return CE_WRITE_ERROR;
     }
 
-    uint16_t* bufu16 = buf;
+    mutex_unlock(hd->rwLock);
 
-    int i;
-    for(i = 0; i < 256; ++i)
+    return CE_GOOD;
+}
+
+
+/// Bus master DMA
+
+// Describes the buffers of the next count sectors in the PRD table of the drive. Physically contiguous parts are merged,
+// but an entry must not cross a 64 KiB boundary. Returns false if the buffers cannot be used for DMA. Caller has to hold hd->rwLock.
+static bool buildPRDT(hdd_t* hd, sgCursor_t* cursor, uint32_t count)
+{
+    size_t   entries = 0;
+    uint32_t size    = 0; // Of the last entry
+
+    while (count > 0)
     {
-        __asm__ volatile("jmp .+2"); // ATA needs a 'tiny delay of jmp $+2'
+        while (cursor->sector == cursor->element->count)
+        {
+            cursor->element++;
+            cursor->sector = 0;
+        }
+        uint32_t n = min(count, cursor->element->count - cursor->sector);
+        uint8_t* buffer = (uint8_t*)cursor->element->buffer + 512*cursor->sector;
+        size_t length = n*512;
+
+        if ((uintptr_t)buffer & 1) // The controller transfers words
+            return false;
 
-        outportw(port+ATA_REG_DATA, bufu16[i]);
+        while (length > 0)
+        {
+            size_t piece = min(length, PAGESIZE - ((uintptr_t)buffer & (PAGESIZE-1)));
+            uint32_t phys = paging_getPhysAddr(buffer);
+
+            if (entries > 0 && hd->prdt[entries-1].address + size == phys && (phys & 0xFFFF) != 0)
+            {
+                size += piece;
+            }
+            else
+            {
+                if (entries == ATA_PRDT_ENTRIES)
+                    return false;
+                if (entries > 0)
+                    hd->prdt[entries-1].size = size; // 0x10000 becomes 0, which means 64 KiB
+                hd->prdt[entries].address = phys;
+                hd->prdt[entries].flags   = 0;
+                entries++;
+                size = piece;
+            }
+            buffer += piece;
+            length -= piece;
+        }
+
+        cursor->sector += n;
+        count -= n;
     }
 
-    if(!ataWaitIRQ(hd->channel, ATA_STATUS_DF | ATA_STATUS_ERR, &portval))
+    hd->prdt[entries-1].size  = size;
+    hd->prdt[entries-1].flags = ATA_PRD_LAST;
+    return true;
+}
+
+// Transfers up to 256 sectors from or to the buffers at the cursor with one command. The task sleeps until the drive raises its IRQ.
+// Returns CE_INVALID_ARGUMENT if the buffers cannot be used for DMA.
+static FS_ERROR transferDMA(uint32_t sector, uint32_t count, sgCursor_t* cursor, hdd_t* hd, bool write)
+{
+    IRQ_NUM_t irq = ataIRQ(hd);
+    uint8_t stat = 0;
+    bool ext;
+
+    mutex_lock(hd->rwLock);
+
+    if (!buildPRDT(hd, cursor, count)) // The PRD table of the drive is only used while the lock is held
     {
-        serial_log(SER_LOG_HRDDSK, "[ATA-PIO28-Write] Failed to write (post data send): %y\r\n", portval);
         mutex_unlock(hd->rwLock);
+        return CE_INVALID_ARGUMENT;
+    }
 
-        // TODO: Reset drive
+    outportl(hd->busMaster+ATA_BM_PRDT, paging_getPhysAddr(hd->prdt));
+    outportb(hd->busMaster+ATA_BM_CMD, write ? 0 : ATA_BM_CMD_READ); // Direction is seen from the controller: it writes to memory when reading from the drive
+    outportb(hd->busMaster+ATA_BM_STATUS, inportb(hd->busMaster+ATA_BM_STATUS) | ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ); // Clear by writing 1
 
-        return CE_WRITE_ERROR;
+    if (!ataSetupCommand(hd, sector, count, &ext, &stat))
+    {
+        serial_log(SER_LOG_HRDDSK, "[ATA-DMA] Drive was not ready in 30 sec: %y\r\n", stat);
+
+        mutex_unlock(hd->rwLock);
+        return (write ? CE_WRITE_ERROR : CE_BAD_SECTOR_READ);
     }
 
-    // Force cache flush
-    outportw(port+ATA_REG_STATUSCMD, 0xE7);
+    irq_resetCounter(irq);
 
-    if(!ataPoll(hd->channel, ATA_STATUS_ERR | ATA_STATUS_ERR, ATA_STATUS_RDY, &portval))
+    if (write)
+        outportb(hd->port+ATA_REG_STATUSCMD, ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA);
+    else
+        outportb(hd->port+ATA_REG_STATUSCMD, ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+    outportb(hd->busMaster+ATA_BM_CMD, inportb(hd->busMaster+ATA_BM_CMD) | ATA_BM_CMD_START);
+
+    bool irqReceived = ataWaitIRQ(hd->channel, ATA_STATUS_ERR | ATA_STATUS_DF, &stat);
+
+    outportb(hd->busMaster+ATA_BM_CMD, inportb(hd->busMaster+ATA_BM_CMD) & ~ATA_BM_CMD_START);
+    uint8_t bmStatus = inportb(hd->busMaster+ATA_BM_STATUS);
+    outportb(hd->busMaster+ATA_BM_STATUS, bmStatus | ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ);
+    stat = inportb(hd->port+ATA_REG_STATUSCMD); // Acknowledges the IRQ of the drive
+
+    if (!irqReceived || (bmStatus & ATA_BM_STATUS_ERR) || (stat & (ATA_STATUS_ERR | ATA_STATUS_DF)))
+    {
+        serial_log(SER_LOG_HRDDSK, "[ATA-DMA] Transfer failed. Status: %y, bus master status: %y\r\n", stat, bmStatus);
+
+        mutex_unlock(hd->rwLock);
+        return (write ? CE_WRITE_ERROR : CE_BAD_SECTOR_READ);
+    }
+
+    if (write && !ataFlushCache(hd, ext, &stat))
     {
-        serial_log(SER_LOG_HRDDSK, "[ATA-PIO28-Write] Error during cache flush: %y\r\n", portval);
+        serial_log(SER_LOG_HRDDSK, "[ATA-DMA] Error during cache flush: %y\r\n", stat);
 
         mutex_unlock(hd->rwLock);
         return CE_WRITE_ERROR;
@@ -362,6 +484,32 @@ static FS_ERROR writeSectorPIOLBA28(uint32_t sector, void* buf, hdd_t* hd)
     return CE_GOOD;
 }
 
+// Returns the I/O base of the bus master registers of an IDE controller that uses the legacy ports, 0 if there is none
+static uint16_t findBusMaster(void)
+{
+    for (dlelement_t* e = pci_devices->head; e; e = e->next)
+    {
+        pciDev_t* dev = e->data;
+
+        // Interface: Bit 7 = bus master capable, bits 0 and 2 = channels in native mode (not at 0x1F0/0x170)
+        if (dev->classID != 0x01 || dev->subclassID != 0x01 || !(dev->interfaceID & BIT(7)))
+            continue;
+        if (dev->interfaceID & (BIT(0)|BIT(2))) // The driver only knows the legacy ports, so the bus master would belong to other drives
+        {
+            serial_log(SER_LOG_HRDDSK, "[hdd_install] Skipping IDE controller %u:%u.%u in native mode (interface %y)\r\n",
+                       dev->bus, dev->device, dev->func, dev->interfaceID);
+            continue;
+        }
+        if (dev->bar[4].memoryType == PCI_IO)
+        {
+            uint16_t pciCommandRegister = pci_config_read(dev->bus, dev->device, dev->func, PCI_COMMAND, 2);
+            pci_config_write_word(dev->bus, dev->device, dev->func, PCI_COMMAND, pciCommandRegister | PCI_CMD_IO | PCI_CMD_BUSMASTER);
+            return (dev->bar[4].baseAddress);
+        }
+    }
+    return (0);
+}
+
 static bool hdd_ATAIdentify(HDD_ATACHANNEL channel, uint16_t *output)
 {
     uint16_t port = 0;
@@ -465,7 +613,8 @@ void hdd_install(void)
     outportb(ATA_REG_PRIMARY_DEVCONTROL, 0x00);
     outportb(ATA_REG_SECONDARY_DEVCONTROL, 0x00);
 
-    hddDmaAdress = paging_acquirePciMemory(hddDmaPhysAdress, 1); // Reserved for later use
+    uint16_t busMaster = findBusMaster();
+    serial_log(SER_LOG_HRDDSK, "[hdd_install] Bus master IDE registers at %x\r\n", busMaster);
 
     uint16_t buf[256];
 
@@ -480,14 +629,36 @@ void hdd_install(void)
             hdd_t* hd = malloc(sizeof(hdd_t), 0, "hdd-HDD");
 
             hd->channel = (HDD_ATACHANNEL)i;
-
-            hd->dma = false; // reserved
-            hd->lba48 = false; // reserved
+            hd->slave   = (i == ATACHANNEL_FIRST_SLAVE || i == ATACHANNEL_SECOND_SLAVE);
+            hd->port    = (i == ATACHANNEL_FIRST_MASTER || i == ATACHANNEL_FIRST_SLAVE) ? ATA_PRIMARY_BASEPORT : ATA_SECONDARY_BASEPORT;
+
+            hd->lba48 = buf[83] & BIT(10);
+
+            // DMA needs a bus master IDE controller and a drive supporting it (word 49, bit 8) with a multiword DMA (word 63) or
+            // Ultra DMA mode (word 88, valid if word 53 bit 2 is set) selected. The BIOS marks the drives it set up for DMA in the
+            // status register of the bus master. Otherwise PIO is used.
+            bool modeSelected = (buf[63] & 0x0700) || ((buf[53] & BIT(2)) && (buf[88] & 0x7F00));
+            uint16_t channelBusMaster = busMaster ? busMaster + (hd->port == ATA_PRIMARY_BASEPORT ? 0 : 8) : 0;
+            hd->dma = channelBusMaster && (buf[49] & BIT(8)) && modeSelected &&
+                      (inportb(channelBusMaster+ATA_BM_STATUS) & (hd->slave ? ATA_BM_STATUS_DMA1 : ATA_BM_STATUS_DMA0));
+            hd->dmaErrors = 0;
+            hd->busMaster = 0;
+            hd->prdt = 0;
+            if (hd->dma)
+            {
+                hd->busMaster = channelBusMaster;
+                hd->prdt = malloc(ATA_PRDT_ENTRIES*sizeof(ataPRD_t), PAGESIZE, "hdd-PRDT"); // Must not cross a 64 KiB boundary
+            }
+            else if (channelBusMaster)
+            {
+                serial_log(SER_LOG_HRDDSK, "[hdd_install] No DMA mode set up for channel %d (words 49/63/88: %x/%x/%x), using PIO\r\n",
+                           i, buf[49], buf[63], buf[88]);
+            }
 
             if (i == ATACHANNEL_FIRST_MASTER || i == ATACHANNEL_FIRST_SLAVE)
             {
               if (!ataPrimaryChannelLock)
-                  ataPrimaryChannelLock = mutex_create();
+                  ataPrimaryChannelLock = mutex_create("ATA primary channel");
               hd->rwLock = ataPrimaryChannelLock;
 
               outportb(ATA_REG_PRIMARY_DEVCONTROL, 0x00);
@@ -495,7 +666,7 @@ void hdd_install(void)
             else if (i == ATACHANNEL_SECOND_MASTER || i == ATACHANNEL_SECOND_SLAVE)
             {
                 if (!ataSecondaryChannelLock)
-                    ataSecondaryChannelLock = mutex_create();
+                    ataSecondaryChannelLock = mutex_create("ATA secondary channel");
                 hd->rwLock = ataSecondaryChannelLock;
 
                 outportb(ATA_REG_SECONDARY_DEVCONTROL, 0x00);
@@ -507,11 +678,17 @@ void hdd_install(void)
             hd->drive->data         = hd;
             hd->drive->insertedDisk = malloc(sizeof(disk_t), 0, "hdd-Disk");
 
-            hd->drive->insertedDisk->type            = &HDDPIODISK;
+            hd->drive->insertedDisk->type            = &HDDDISK;
             hd->drive->insertedDisk->data            = hd;
             hd->drive->insertedDisk->port            = hd->drive;
-            // buf[60] and buf[61] give the total size of the lba28 adressable sectors
-            hd->drive->insertedDisk->size            = ((uint64_t)(*(uint32_t*)&buf[60]))*512;
+            // buf[60] and buf[61] give the total size of the lba28 adressable sectors, buf[100] to buf[103] the one of lba48.
+            // Sector numbers have 32 bit, so at most 2 TiB are used.
+            if (hd->lba48 && (buf[102] || buf[103]))
+                hd->drive->insertedDisk->size        = ((uint64_t)0xFFFFFFFF)*512;
+            else if (hd->lba48)
+                hd->drive->insertedDisk->size        = ((uint64_t)(*(uint32_t*)&buf[100]))*512;
+            else
+                hd->drive->insertedDisk->size        = ((uint64_t)(*(uint32_t*)&buf[60]))*512;
             hd->drive->insertedDisk->headCount       = 0;
             hd->drive->insertedDisk->secPerTrack     = 0;
             hd->drive->insertedDisk->sectorSize      = 512;
@@ -520,7 +697,7 @@ void hdd_install(void)
             for(int j = 0; j < PARTITIONARRAYSIZE; ++j)
                 hd->drive->insertedDisk->partition[i] = 0;
 
-            serial_log(SER_LOG_HRDDSK, "[hdd_install] Size of disk at channel %d is %S\r\n", i, hd->drive->insertedDisk->size);
+            serial_log(SER_LOG_HRDDSK, "[hdd_install] Size of disk at channel %d is %S, LBA48: %u, DMA: %u\r\n", i, hd->drive->insertedDisk->size, hd->lba48, hd->dma);
 
             attachDisk(hd->drive->insertedDisk); // disk == hard disk
             attachPort(hd->drive);
@@ -529,30 +706,73 @@ void hdd_install(void)
     }
 }
 
-FS_ERROR hdd_writeSectorPIO(uint32_t sector, void* buf, disk_t* device)
+// Splits the transfer into commands of up to 256 sectors. DMA is used when possible, otherwise PIO.
+static FS_ERROR transfer(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device, bool write)
 {
-    if (sector < device->size / 512)
+    hdd_t* hd = device->data;
+
+    uint32_t count = 0;
+    for (size_t i = 0; i < elements; i++)
+        count += list[i].count;
+
+    if (count == 0 || (uint64_t)sector + count > device->size / 512 || (!hd->lba48 && sector + count - 1 > 0x0FFFFFFF))
+        return CE_INVALID_ARGUMENT;
+
+    sgCursor_t cursor = {.element = list, .sector = 0};
+    while (count > 0)
     {
-        if (sector > 0x0FFFFFFF)
-            return CE_INVALID_ARGUMENT;
+        uint32_t n = min(count, 256);
+        sgCursor_t start = cursor;
+        bool done = false;
 
-        return writeSectorPIOLBA28(sector, buf, device->data);
+        if (hd->dma)
+        {
+            FS_ERROR error = transferDMA(sector, n, &cursor, hd, write);
+            done = error == CE_GOOD;
+            if (done)
+            {
+                hd->dmaErrors = 0;
+            }
+            else if (error != CE_INVALID_ARGUMENT && ++hd->dmaErrors >= ATA_DMA_ERRORS)
+            {
+                serial_log(SER_LOG_HRDDSK, "[ATA-DMA] Falling back to PIO on channel %d\r\n", (int32_t)hd->channel);
+                hd->dma = false;
+            }
+        }
+        if (!done) // Buffers not suitable for DMA or DMA failed: This transfer is retried with PIO
+        {
+            cursor = start;
+            FS_ERROR error = write ? writeSectorsPIO(sector, n, &cursor, hd) : readSectorsPIO(sector, n, &cursor, hd);
+            if (error != CE_GOOD)
+                return error;
+        }
+        sector += n;
+        count  -= n;
     }
-    else return CE_INVALID_ARGUMENT;
+    return CE_GOOD;
 }
 
-FS_ERROR hdd_readSectorPIO(uint32_t sector, void* buf, disk_t* device)
+FS_ERROR hdd_writeSectors(uint32_t sector, uint32_t count, void* buf, disk_t* device)
 {
-    if (sector < device->size / 512)
-    {
-        if (sector > 0x0FFFFFFF)
-            return CE_INVALID_ARGUMENT;
+    sgElement_t element = {.buffer = buf, .count = count};
+    return transfer(sector, &element, 1, device, true);
+}
 
-        return readSectorPIOLBA28(sector, buf, device->data);
-    }
-    else return CE_INVALID_ARGUMENT;
+FS_ERROR hdd_readSectors(uint32_t sector, uint32_t count, void* buf, disk_t* device)
+{
+    sgElement_t element = {.buffer = buf, .count = count};
+    return transfer(sector, &element, 1, device, false);
 }
 
+FS_ERROR hdd_writeSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device)
+{
+    return transfer(sector, list, elements, device, true);
+}
+
+FS_ERROR hdd_readSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device)
+{
+    return transfer(sector, list, elements, device, false);
+}
 
 /*
 * Copyright (c) 2012-2013 The PrettyOS Project. All rights reserved.
@@ -9,22 +9,41 @@
 
 //WARNING: WIP! Do not use any of these functions on a real PC
 
+#define ATA_PRDT_ENTRIES 512    // One page
+#define ATA_PRD_LAST     0x8000
+#define ATA_DMA_ERRORS   3       // Consecutive failed DMA transfers after which the drive only uses PIO
+
+// Physical region descriptor: Memory region of a bus master DMA transfer
+typedef struct
+{
+    uint32_t address;
+    uint16_t size;  // 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed)) ataPRD_t;
+
 typedef struct
 {
     HDD_ATACHANNEL channel;
+    uint16_t port; // Base of the command block registers
+    bool slave;
     mutex_t* rwLock;
 
     port_t* drive;
 
-    bool dma; //Reserved for later use
+    bool dma;           // Cleared after ATA_DMA_ERRORS failed DMA transfers in a row, the drive uses PIO afterwards
+    uint8_t dmaErrors;  // Failed DMA transfers since the last successful one
+    uint16_t busMaster; // Bus master registers of the channel
+    ataPRD_t* prdt;
     bool lba48;
 } hdd_t;
 
 
 void hdd_install(void);
 
-FS_ERROR hdd_writeSectorPIO(uint32_t sector, void* buf, disk_t* device);
-FS_ERROR hdd_readSectorPIO(uint32_t sector, void* buf, disk_t* device);
+FS_ERROR hdd_writeSectors(uint32_t sector, uint32_t count, void* buf, disk_t* device);
+FS_ERROR hdd_readSectors(uint32_t sector, uint32_t count, void* buf, disk_t* device);
+FS_ERROR hdd_writeSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device);
+FS_ERROR hdd_readSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device);
 
 
 #endif
\ No newline at end of file
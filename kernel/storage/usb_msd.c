@@ -642,36 +642,108 @@ void testMSD(usb_device_t* device)
     analyzeDisk(device->disk);
 }
 
-FS_ERROR usb_read(uint32_t sector, void* buffer, disk_t* dev)
+// READ(10) or WRITE(10) of up to USB_MSD_MAXSECTORS sectors. Each element of the scatter-gather list becomes a data stage
+// transaction of the same bulk transfer.
+static FS_ERROR transferSectors(usb_device_t* device, uint32_t sector, uint32_t count, const sgElement_t* list, size_t elements, bool write)
+{
+    uint8_t SCSIcommand = write ? 0x2A : 0x28;
+
+    struct usb_CommandBlockWrapper cbw;
+    formatSCSICommand(SCSIcommand, &cbw, sector, count);
+
+    usb_transfer_t transfer;
+    usb_setupTransfer(device->disk->port, &transfer, USB_BULK, device->numEndpointOutMSD, 512);
+    usb_outTransaction(&transfer, false, &cbw, 31);
+    if (write)
+    {
+        for (size_t i = 0; i < elements; i++)
+            usb_outTransaction(&transfer, false, list[i].buffer, list[i].count*512);
+    }
+    usb_issueTransfer(&transfer);
+
+    char statusBuffer[13];
+    usb_setupTransfer(device->disk->port, &transfer, USB_BULK, device->numEndpointInMSD, 512);
+    if (!write)
+    {
+        for (size_t i = 0; i < elements; i++)
+            usb_inTransaction(&transfer, false, list[i].buffer, list[i].count*512);
+    }
+    usb_inTransaction(&transfer, false, statusBuffer, 13);
+    usb_issueTransfer(&transfer);
+
+    if (checkSCSICommand(statusBuffer, device, count*512, SCSIcommand) != 0)
+        return (write ? CE_WRITE_ERROR : CE_BAD_SECTOR_READ);
+    return (CE_GOOD);
+}
+
+// Splits the list into commands of up to USB_MSD_MAXSECTORS sectors
+static FS_ERROR transferSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* dev, bool write)
+{
+    usb_device_t* device = dev->data;
+    sgElement_t chunk[USB_MSD_MAXSECTORS];
+    size_t   chunkElements = 0;
+    uint32_t chunkSectors  = 0;
+
+    for (size_t i = 0; i < elements; i++)
+    {
+        uint8_t* buffer = list[i].buffer;
+        uint32_t count  = list[i].count;
+        while (count > 0)
+        {
+            uint32_t n = min(count, USB_MSD_MAXSECTORS - chunkSectors);
+            chunk[chunkElements].buffer = buffer;
+            chunk[chunkElements].count  = n;
+            chunkElements++;
+            chunkSectors += n;
+            buffer += n*512;
+            count  -= n;
+
+            if (chunkSectors == USB_MSD_MAXSECTORS || (count == 0 && i == elements-1))
+            {
+                FS_ERROR error = transferSectors(device, sector, chunkSectors, chunk, chunkElements, write);
+                if (error != CE_GOOD)
+                    return (error);
+                sector += chunkSectors;
+                chunkSectors  = 0;
+                chunkElements = 0;
+            }
+        }
+    }
+    return (CE_GOOD);
+}
+
+FS_ERROR usb_readSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* dev)
 {
   #ifdef _USB_TRANSFER_DIAGNOSIS_
     textColor(LIGHT_BLUE);
-    printf("\n\n>SCSI: read sector: %u", sector);
+    printf("\n\n>SCSI: read sectors: %u-%u", sector, sector+count-1);
     textColor(TEXT);
   #endif
 
-    usb_device_t* device = dev->data;
-
-    usb_sendSCSICommand(device, device->numInterfaceMSD, device->numEndpointOutMSD, device->numEndpointInMSD,
-                        0x28 /*SCSI opcode*/, sector /*LBA*/, 1 /*Blocks In*/, buffer, 0);
-
-    return (CE_GOOD);
+    sgElement_t element = {.buffer = buffer, .count = count};
+    return (transferSG(sector, &element, 1, dev, false));
 }
 
-FS_ERROR usb_write(uint32_t sector, void* buffer, disk_t* dev)
+FS_ERROR usb_writeSectors(uint32_t sector, uint32_t count, void* buffer, disk_t* dev)
 {
   #ifdef _USB_DIAGNOSIS_
     textColor(IMPORTANT);
-    printf("\n\n>>> SCSI: write sector: %u", sector);
+    printf("\n\n>>> SCSI: write sectors: %u-%u", sector, sector+count-1);
     textColor(TEXT);
   #endif
 
-    usb_device_t* device = dev->data;
+    sgElement_t element = {.buffer = buffer, .count = count};
+    return (transferSG(sector, &element, 1, dev, true));
+}
 
-    usb_sendSCSICommand_out(device, device->numInterfaceMSD, device->numEndpointOutMSD, device->numEndpointInMSD,
-                            0x2A /*SCSI opcode*/, sector /*LBA*/, 1 /*Blocks Out*/, buffer, 0);
+FS_ERROR usb_readSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* dev)
+{
+    return (transferSG(sector, list, elements, dev, false));
+}
 
-    return (CE_GOOD);
+FS_ERROR usb_writeSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* dev)
+{
+    return (transferSG(sector, list, elements, dev, true));
 }
 
 void usb_resetRecoveryMSD(usb_device_t* device, uint32_t Interface)
@@ -5,6 +5,8 @@
 #include "devicemanager.h"
 #include "usb.h"
 
+#define USB_MSD_MAXSECTORS 64 // Sectors transferred by one SCSI command at most
+
 
 struct usb_CommandBlockWrapper
 {
@@ -46,8 +48,10 @@ void          usb_sendSCSICommand_out(usb_device_t* device,
                                       void*         dataBuffer,
                                       void*         statusBuffer);
 
-FS_ERROR      usb_read (uint32_t sector, void* buffer, disk_t* device);
-FS_ERROR      usb_write(uint32_t sector, void* buffer, disk_t* device);
+FS_ERROR      usb_readSectors   (uint32_t sector, uint32_t count, void* buffer, disk_t* device);
+FS_ERROR      usb_writeSectors  (uint32_t sector, uint32_t count, void* buffer, disk_t* device);
+FS_ERROR      usb_readSectorsSG (uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device);
+FS_ERROR      usb_writeSectorsSG(uint32_t sector, const sgElement_t* list, size_t elements, disk_t* device);
 
 void          testMSD(usb_device_t* device);
 
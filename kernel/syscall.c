@@ -21,7 +21,28 @@
 #include "video/video.h"
 #include "network/network.h"
 #include "ipc.h"
+#include "ioring.h"
+#include "smp.h"
+#include "descriptor_tables.h"
 
+/*
+Syscall ABI: eax contains the number of the syscall, ebx, ecx, edx, esi and edi its parameters. The result is returned in eax.
+User programs enter the kernel either by int 0x7F or, if the CPU supports it, by sysenter (cf. user/user_tools/start.asm).
+For sysenter, ebp has to point to the user stack, whose top element is the address the kernel returns to by sysexit.
+
+The sysenter MSRs are set on each CPU. IA32_SYSENTER_ESP points to esp0 in the TSS of the CPU, so the handler finds the kernel
+stack of the current task with a single load. Like an interrupt, the handler takes the kernel lock, which is released again
+before returning to the user program.
+
+The multi-call syscall executes an array of syscall descriptors with one kernel entry. User programs use it to batch character
+I/O and the draining of events.
+*/
+
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+static size_t multicall(syscallDescriptor_t* calls, size_t count);
 
 // Overwiew to all syscalls in documentation/Syscalls.odt
 
@@ -32,14 +53,14 @@ static void* syscalls[] =
 /*  2  */    &exit,
 /*  3  */    &scheduler_blockCurrentTask,
 /*  4  */    &nop, // createConsoleThread
-/*  5  */    &nop,
+/*  5  */    &multicall,
 /*  6  */    &getpid,
 /*  7  */    &nop,
 /*  8  */    &nop,
 /*  9  */    &nop,
 
 /*  10 */    &task_grow_userheap,
-/*  11 */    &nop, // userheapFree
+/*  11 */    &task_shrink_userheap,
 /*  12 */    &nop,
 /*  13 */    &nop,
 /*  14 */    &nop,
@@ -52,8 +73,8 @@ static void* syscalls[] =
 /*  20 */    &nop, // fmove
 /*  21 */    &fclose,
 /*  22 */    &formatPartition,
-/*  23 */    &nop,
-/*  24 */    &nop,
+/*  23 */    &ioring_setup,
+/*  24 */    &ioring_enter,
 
 /*  25 */    &ipc_fopen,
 /*  26 */    &ipc_getFolder,
@@ -144,59 +165,121 @@ static void* syscalls[] =
     &cprintf
 };
 
+#define SYSCALL_COUNT (sizeof(syscalls)/sizeof(*syscalls))
+
+// We don't know how many parameters the function wants. Therefore, we pass all of them.
+// The function will use the number of parameters it wants.
+typedef uint32_t (*syscall_t)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
 static void syscall_handler(registers_t* r);
-void syscall_sysenterHandler();
+void syscall_sysenterHandler(void);
+uint32_t syscall_sysenter(uint32_t number, uint32_t ebx, uint32_t ecx, uint32_t edx, uint32_t esi, uint32_t edi, uintptr_t* userStack);
+
+static bool sysenter = false;
 
 void syscall_install(void)
 {
-    if(cpu_supports(CF_SYSENTEREXIT))
+    irq_installHandler(IRQ_SYSCALL, syscall_handler);
+
+    // Some Pentium Pro processors report SEP although they do not support sysenter (Intel manual 3A, 5.8.7)
+    uint32_t signature = cpu_idGetRegister(0x00000001, CR_EAX);
+    bool brokenSEP = ((signature >> 8) & 0xF) == 6 && ((signature >> 4) & 0xF) < 3 && (signature & 0xF) < 3;
+    sysenter = cpu_supports(CF_SYSENTEREXIT) && !brokenSEP;
+
+    syscall_installAP();
+}
+
+void syscall_installAP(void)
+{
+    if (sysenter)
     {
-        irq_installHandler(IRQ_SYSCALL, syscall_handler);
-        cpu_MSRwrite(0x174, 8); // CS
-        cpu_MSRwrite(0x175, 0x480000); // ESP
-        cpu_MSRwrite(0x176, (uintptr_t)&syscall_sysenterHandler); // EIP
+        cpu_MSRwrite(MSR_SYSENTER_CS, 0x08); // Kernel code segment. SYSEXIT derives the user segments from it (0x1B, 0x23)
+        cpu_MSRwrite(MSR_SYSENTER_ESP, (uintptr_t)tss_kernelStack(smp_cpuIndex()));
+        cpu_MSRwrite(MSR_SYSENTER_EIP, (uintptr_t)&syscall_sysenterHandler);
     }
-    else
-        irq_installHandler(IRQ_SYSCALL, syscall_handler);
+}
+
+bool syscall_sysenterAvailable(void)
+{
+    return (sysenter);
+}
+
+static inline uint32_t call(uint32_t number, uint32_t ebx, uint32_t ecx, uint32_t edx, uint32_t esi, uint32_t edi)
+{
+    return (((syscall_t)syscalls[number])(ebx, ecx, edx, esi, edi));
 }
 
 static void syscall_handler(registers_t* r)
 {
     // Firstly, check if the requested syscall number is valid. The syscall number is found in EAX.
-    if (r->eax >= sizeof(syscalls)/sizeof(*syscalls))
+    if (r->eax >= SYSCALL_COUNT)
         return;
 
     console_current = currentTask->console; // Syscall output should appear in the console of the task that caused the syscall
+    r->eax = call(r->eax, r->ebx, r->ecx, r->edx, r->esi, r->edi);
+    console_current = kernelTask.console;
+}
+
+uint32_t syscall_sysenter(uint32_t number, uint32_t ebx, uint32_t ecx, uint32_t edx, uint32_t esi, uint32_t edi, uintptr_t* userStack) // Called by syscall_sysenterHandler
+{
+    // userStack holds the ebp of the program. It is replaced by the return address found there, which becomes eip for sysexit.
+    // ebp is controlled by the program, so it must not point into kernel memory.
+    const uintptr_t* returnAddress = (const uintptr_t*)*userStack;
+    if (!paging_isUserArea(returnAddress, sizeof(uintptr_t), false))
+    {
+        textColor(ERROR);
+        printf("\nsysenter: Invalid user stack %Xh. Task terminated.\n", (uintptr_t)returnAddress);
+        textColor(TEXT);
+        exit();
+    }
+    *userStack = *returnAddress;
 
-    // We don't know how many parameters the function wants.
-    // Therefore, we push them all onto the stack in the correct order.
-    // The function will use the number of parameters it wants.
-    __asm__ volatile (
-     "push %1; \
-      push %2; \
-      push %3; \
-      push %4; \
-      push %5; \
-      call *%6; \
-      add $20, %%esp;"
-       : "=a" (r->eax) : "D" (r->edi), "S" (r->esi), "d" (r->edx), "c" (r->ecx), "b" (r->ebx), "a" (syscalls[r->eax]) : "esp", "memory");
+    if (number >= SYSCALL_COUNT)
+        return (0);
 
+    console_current = currentTask->console;
+    uint32_t result = call(number, ebx, ecx, edx, esi, edi);
     console_current = kernelTask.console;
+    return (result);
 }
 
-__asm__ ("syscall_sysenterHandler:"
-             "sti;"                 // IF flag is disabled by sysenter, however it should be safe to interrupt a syscall
-             "shl $2, %eax;"        // Calculate address of function: Multiply syscall number by 4
-             "add $syscalls, %eax;"
-             "push %edi;"           // Push parameters on stack
-             "push %esi;"
-             "push %edx;"
-             "push %ecx;"
-             "push %ebx;"
-             "call *(%eax);"        // Call syscall
-             "add $20, %esp;"       // Restore stack
-             "mov %ebp, %edx;"      // Move return address to edx
-             "sysexit;");           // Leave kernel
+__asm__ ("syscall_sysenterHandler:\n"
+             "mov (%esp), %esp\n"          // IA32_SYSENTER_ESP points to esp0 in the TSS: Kernel stack of the current task
+             "push %ebp\n"                 // Replaced by the return address (eip for sysexit)
+             "push %esp\n"                 // Parameters of syscall_sysenter
+             "push %edi\n"
+             "push %esi\n"
+             "push %edx\n"
+             "push %ecx\n"
+             "push %ebx\n"
+             "push %eax\n"
+             "call smp_lockKernel\n"       // Interrupts are disabled by sysenter
+             "sti\n"                       // It is safe to interrupt a syscall
+             "call syscall_sysenter\n"
+             "mov %eax, (%esp)\n"          // Keep result
+             "cli\n"
+             "call smp_unlockKernel\n"
+             "pop %eax\n"                  // Result
+             "add $24, %esp\n"
+             "pop %edx\n"                  // eip for sysexit
+             "mov %ebp, %ecx\n"            // esp for sysexit
+             "sti\n"                       // Takes effect after sysexit
+             "sysexit");
+
+static size_t multicall(syscallDescriptor_t* calls, size_t count) // Returns the number of syscalls executed
+{
+    // The results are written back to the array of the program, so it has to be writable user memory completely
+    if (count > (size_t)-1/sizeof(syscallDescriptor_t) || !paging_isUserArea(calls, count*sizeof(syscallDescriptor_t), true))
+        return (0);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (calls[i].number >= SYSCALL_COUNT || calls[i].number == SYSCALL_MULTICALL)
+            return (i);
+        calls[i].result = call(calls[i].number, calls[i].args[0], calls[i].args[1], calls[i].args[2], calls[i].args[3], calls[i].args[4]);
+    }
+    return (count);
+}
 
 /*
 * Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
@@ -3,6 +3,19 @@
 
 #include "os.h"
 
+#define SYSCALL_MULTICALL 5
+
+// Element of the array given to the multi-call syscall
+typedef struct
+{
+    uint32_t number;
+    uint32_t args[5]; // ebx, ecx, edx, esi, edi
+    uint32_t result;  // eax
+} syscallDescriptor_t;
+
+
 void syscall_install(void);
+void syscall_installAP(void);          // Sets the sysenter MSRs of an application processor
+bool syscall_sysenterAvailable(void);  // User programs (ring 3) can enter the kernel by sysenter
 
 #endif
@@ -4,129 +4,382 @@
 */
 
 #include "util/util.h"
-#include "util/ring.h"
 #include "util/todo_list.h"
+#include "workqueue.h"
+#include "ioring.h"
+#include "storage/blockcache.h"
+#include "storage/ahci.h"
 #include "timer.h"
 #include "task.h"
 #include "irq.h"
 #include "scheduler.h"
+#include "paging.h"
+#include "smp.h"
 
-static ring_t* runningTasks = 0;
-static ring_t* blockedTasks = 0;
+/*
+Runnable tasks are kept in one FIFO queue per priority level. Bit n of runQueue_t::bitmap is set while level n is not empty, so the
+next task is found in O(1) by scanning the bitmap for its highest bit. The running task stays at the head of its queue until its
+slice is used up or it yields; then it is moved to the tail. Higher levels get shorter slices, because tasks there are expected to
+react to an event and to block again soon. The timer tick (scheduler_tick) only runs while more than one task is runnable.
+Each CPU has an own set of run queues, so tasks tend to stay on the CPU whose caches hold their data. New tasks go to the CPU
+with the fewest runnable tasks, woken tasks return to the CPU they ran on last. A CPU whose queues are empty steals a waiting task
+from the busiest CPU, except of tasks whose FPU state is still loaded there. Other CPUs are informed about new work and expired
+slices by a reschedule IPI. The timer tick is only handled by the BSP (smp.c).
+Blocked tasks wait in a hash table of wait queues keyed by blocker type and data, so scheduler_unblockEvent only looks at the
+tasks waiting for that object. The unlock function of a blocker type is evaluated once when a task wants to block, it is never
+polled. Blocks with a timeout additionally arm the kernel timer of the task (timer.c).
+A task has a base level (task_t::priority) and a current level (task_t::level). Tasks woken up by an interrupt, an event or a
+network packet are raised by PRIORITY_BOOST levels above their base level. Each expired slice lowers the level by one again, so
+a boosted task that turns out to be CPU bound sinks back to its base level quickly.
+*/
+
+#define WAIT_QUEUES 64 // Number of wait queues for blocked tasks. Power of two.
+
+typedef struct
+{
+    taskQueue_t levels[PRIORITY_LEVELS];
+    uint32_t    bitmap; // Bit n set: levels[n] is not empty
+    uint32_t    count;  // Number of tasks in all levels
+} runQueue_t;
 
-static task_t* freetimeTask = 0;
+static runQueue_t  runQueues[MAX_CPUS]; // One per CPU
+static taskQueue_t waitQueues[WAIT_QUEUES];
+static uint32_t    blockedCount  = 0;  // Number of tasks in all waitQueues
+static bool        installed     = false;
 
 blockerType_t blocker[] =
 {
-    {0},                    // BL_TIME
-    {0},                    // BL_SYNC
-    {&irq_unlockTask},      // BL_INTERRUPT. Interrupts seem to be good for event based handling, but they are not, because we count interrupts occuring before the block was set.
-    {0},                    // BL_TASK
-    {&todoList_unlockTask}, // BL_TODOLIST
-    {&event_unlockTask},    // BL_EVENT
-    {0}                     // BL_NETPACKET
+    {0},                      // BL_TIME
+    {0},                      // BL_SYNC
+    {&irq_unlockTask},        // BL_INTERRUPT. Interrupts seem to be good for event based handling, but they are not, because we count interrupts occuring before the block was set.
+    {0},                      // BL_TASK
+    {&todoList_unlockTask},   // BL_TODOLIST
+    {&event_unlockTask},      // BL_EVENT
+    {0},                      // BL_NETPACKET
+    {0},                      // BL_FIFO. fifo_wait checks the fifo itself.
+    {&workqueue_unlockTask},  // BL_WORK
+    {&ioring_unlockTask},     // BL_IORING
+    {&blockCache_unlockTask}, // BL_WRITEBACK
+    {&blockCache_unlockTask}, // BL_BLOCKREAD
+    {&ahci_unlockTask},       // BL_AHCI
+    {&ahci_unlockSlot}        // BL_AHCISLOT
 };
 
 
-// Function for freetime task. Executed when the ring of running tasks is empty.
+// Function for freetime task. Executed when all run queues of the CPU are empty.
 static void doNothing(void)
 {
     while (true)
     {
+        paging_refillPools(); // Nothing else to do: Prepare paging structures for the next process
+        cli();
+        smp_unlockKernel(); // Other CPUs may use the kernel while this one sleeps
+        sti();
         hlt();
+        smp_lockKernel(); // Usually taken by the interrupt already, but not by a TLB flush IPI
+        if (runQueues[smp_cpuIndex()].bitmap != 0) // An interrupt made a task runnable. Do not wait for the next tick.
+            switch_context();
     }
 }
 
 void scheduler_install(void)
 {
-    // Init scheduler rings
-    runningTasks = ring_create();
-    blockedTasks = ring_create();
+    installed = true;
+}
+
+void scheduler_startCPU(void) // Called by an application processor after startup
+{
+    cpu_t* cpu = smp_currentCPU();
+
+    // The code running on the CPU becomes its freetime task, so the initial state of the created task is never used
+    cpu->idleTask    = create_task(PROCESS, kernelPageDirectory, &doNothing, 0, 0, 0, 0);
+    cpu->runningTask = cpu->idleTask;
+    doNothing();
+}
+
+
+/// Queue handling. Interrupts have to be disabled by the caller.
+static uint8_t sliceLength(uint8_t level) // Timer ticks a task may run on the given level before the next task of that level gets the CPU
+{
+    return (1 + (PRIORITY_LEVELS-1-level)/2);
+}
+
+static bool isRunQueue(const taskQueue_t* queue)
+{
+    return ((void*)queue >= (void*)runQueues && (void*)queue < (void*)(runQueues + MAX_CPUS));
+}
+
+static void enqueue(taskQueue_t* queue, task_t* task)
+{
+    task->queue     = queue;
+    task->queueNext = 0;
+    task->queuePrev = queue->tail;
+
+    if (queue->tail)
+        queue->tail->queueNext = task;
+    else
+        queue->head = task;
+    queue->tail = task;
+
+    if (isRunQueue(queue))
+    {
+        runQueues[task->cpu].bitmap |= BIT(task->level);
+        runQueues[task->cpu].count++;
+    }
+    else
+    {
+        blockedCount++;
+    }
 }
 
+static void dequeue(task_t* task)
+{
+    taskQueue_t* queue = task->queue;
+    if (queue == 0)
+        return; // Not in any queue
+
+    if (task->queuePrev)
+        task->queuePrev->queueNext = task->queueNext;
+    else
+        queue->head = task->queueNext;
+
+    if (task->queueNext)
+        task->queueNext->queuePrev = task->queuePrev;
+    else
+        queue->tail = task->queuePrev;
+
+    task->queue = 0;
+
+    if (isRunQueue(queue))
+    {
+        if (queue->head == 0)
+            runQueues[task->cpu].bitmap &= ~BIT(task->level);
+        runQueues[task->cpu].count--;
+    }
+    else
+    {
+        blockedCount--;
+    }
+}
+
+static void makeRunnable(task_t* task, uint8_t level) // Appends the task with a fresh slice to the run queue of its CPU on the given level
+{
+    dequeue(task);
+    task->level = level;
+    task->slice = sliceLength(level);
+    enqueue(&runQueues[task->cpu].levels[level], task);
+}
+
+static bool isRunnable(const task_t* task)
+{
+    return (isRunQueue(task->queue));
+}
+
+static bool tickNeeded(void) // The timer tick is needed while a CPU is shared by several tasks
+{
+    for (uint32_t i = 0; i < smp_cpuCount; i++)
+    {
+        if (runQueues[i].count > 1)
+            return (true);
+    }
+    return (false);
+}
+
+static uint32_t waitingTasks(uint32_t cpu) // Runnable tasks of the CPU that do not run at the moment
+{
+    return (runQueues[cpu].count - (isRunnable(smp_cpus[cpu].runningTask) && smp_cpus[cpu].runningTask->cpu == cpu));
+}
+
+static void notifyCPU(const task_t* task) // The task became runnable. Its CPU or an idle CPU might have to reschedule.
+{
+    if (task->cpu != smp_cpuIndex())
+    {
+        const cpu_t* cpu = &smp_cpus[task->cpu];
+        if (cpu->runningTask == cpu->idleTask || task->level > cpu->runningTask->level)
+        {
+            smp_sendIPI(task->cpu, 32+IRQ_IPI_SCHEDULE);
+            return;
+        }
+    }
+
+    if (waitingTasks(task->cpu) > 0) // The task has to wait: Offer it to an idle CPU
+    {
+        for (uint32_t i = 0; i < smp_cpuCount; i++)
+        {
+            if (i != smp_cpuIndex() && smp_cpus[i].runningTask == smp_cpus[i].idleTask)
+            {
+                smp_sendIPI(i, 32+IRQ_IPI_SCHEDULE);
+                return;
+            }
+        }
+    }
+}
+
+static taskQueue_t* waitQueue(const blockerType_t* type, const void* data) // Wait queue of all tasks blocked by the given object
+{
+    uint32_t key = (uintptr_t)data ^ ((type - blocker) * 0x9E3779B1);
+    key ^= (key >> 16) ^ (key >> 6);
+    return (&waitQueues[key & (WAIT_QUEUES-1)]);
+}
+
+
+/// Blocking and unblocking
 static void unblockTask(task_t* task, bool timeout)
 {
+    ktimer_stop(&task->blockTimer);
+
     // Write the reason for the unblock in the data field of the blocker (false in case of timeout)
     task->blocker.data = (void*)(!timeout);
 
-    // Move task into the scheduler ring
-    ring_move(runningTasks, blockedTasks, task);
+    // Tasks waiting for I/O get a boost, so that they can handle the data quickly.
+    uint8_t level = task->level;
+    BLOCKERTYPE reason = task->blocker.type - blocker;
+    if (!timeout && (reason == BL_INTERRUPT || reason == BL_EVENT || reason == BL_NETPACKET || reason == BL_FIFO || reason == BL_AHCI))
+        level = min(task->priority + PRIORITY_BOOST, PRIORITY_LEVELS-1);
+
+    makeRunnable(task, level);
+    if (runQueues[task->cpu].count > 1) // The CPU has to be shared (again)
+        timer_enableTick(true);
+    notifyCPU(task);
+}
+
+static void blockTimeout(void* data) // Callback of task_t::blockTimer
+{
+    task_t* task = data;
+    if (task->queue != 0 && !isRunQueue(task->queue))
+        unblockTask(task, true);
 }
 
 void scheduler_unblockEvent(BLOCKERTYPE type, void* data) // Event based blocks are handled here
 {
-    if (!blockedTasks || blockedTasks->begin == 0)
-        return; // Ring is empty
+    bool ints = interrupts_disable();
 
-    blockedTasks->current = blockedTasks->begin;
-    do
+    for (task_t* current = waitQueue(&blocker[type], data)->head; current != 0;)
     {
-        task_t* current = (task_t*)blockedTasks->current->data;
-
-        if (current->blocker.type == &blocker[type] && current->blocker.data == data) // The blocking event this ring element is waiting for appeared -> unblock
+        task_t* next = current->queueNext; // unblockTask moves current to a run queue
+        if (current->blocker.type == &blocker[type] && current->blocker.data == data) // The blocking event this task is waiting for appeared -> unblock
         {
             unblockTask(current, false);
         }
+        current = next;
+    }
 
-        blockedTasks->current = blockedTasks->current->next; // Iterate through the ring
-    } while (blockedTasks->begin != 0 && blockedTasks->current != blockedTasks->begin);
+    interrupts_restore(ints);
 }
 
-static void checkBlocked() // Not event based blocks are handled here (polling)
+bool scheduler_blockCurrentTask(BLOCKERTYPE reason, void* data, uint32_t timeout)
 {
-    if (blockedTasks->begin == 0)
-        return; // Ring is empty
+    bool ints = interrupts_disable();
+
+    blockerType_t* type = &blocker[reason];
+    if (type->unlock && type->unlock(data)) // Condition is already fulfilled. Events that happen later unblock the task via scheduler_unblockEvent.
+    {
+        interrupts_restore(ints);
+        return (true);
+    }
 
-    blockedTasks->current = blockedTasks->begin;
+    currentTask->blocker.type = type;
+    currentTask->blocker.data = data;
 
-    do
+    dequeue(currentTask);
+    enqueue(waitQueue(type, data), currentTask);
+
+    if (timeout != 0)
     {
-        task_t* current = (task_t*)blockedTasks->current->data;
+        ktimer_init(&currentTask->blockTimer, &blockTimeout, currentTask);
+        ktimer_start(&currentTask->blockTimer, (uint64_t)timeout*1000, 0);
+    }
+
+    interrupts_restore(ints);
+
+    switch_context(); // Leave task. This task will not be called again until block ended.
+
+    return ((bool)currentTask->blocker.data); // data field contains the reason for unblock after the block is released
+}
 
-        if (current->blocker.type && current->blocker.type->unlock && current->blocker.type->unlock(current->blocker.data)) // Unblock function specified and the task should not be blocked any more...
-        {
-            unblockTask(current, false);
-        }
-        else if (current->blocker.timeout != 0 && current->blocker.timeout <= timer_getTicks()) // ...or timeout reached
-        {
-            unblockTask(current, true);
-        }
 
-        blockedTasks->current = blockedTasks->current->next; // Iterate through the ring
-    } while (blockedTasks->begin != 0 && blockedTasks->current != blockedTasks->begin);
+/// Task selection
+bool scheduler_shouldSwitchTask(void) // This function increases performance if there is just one task running by avoiding task switches
+{
+    return (runQueues[smp_cpuIndex()].count != 1 || !isRunnable(currentTask));
 }
 
-bool scheduler_shouldSwitchTask() // This function increases performance if there is just one task running by avoiding task switches
+static bool stealTask(uint32_t self) // Moves a waiting task of the busiest CPU to this one
 {
-    return (runningTasks->begin == 0 || runningTasks->begin != runningTasks->begin->next); // No running tasks or only one running task
+    uint32_t victim = self;
+    uint32_t most   = 0;
+    for (uint32_t i = 0; i < smp_cpuCount; i++)
+    {
+        uint32_t waiting = waitingTasks(i);
+        if (i != self && waiting > most)
+        {
+            victim = i;
+            most   = waiting;
+        }
+    }
+    if (victim == self)
+        return (false);
+
+    // Take the task that waits longest on the highest level. Tasks whose FPU state is loaded on the victim have to stay there.
+    const cpu_t* cpu = &smp_cpus[victim];
+    for (int level = PRIORITY_LEVELS-1; level >= 0; level--)
+    {
+        for (task_t* task = runQueues[victim].levels[level].head; task; task = task->queueNext)
+        {
+            if (task != cpu->runningTask && task != cpu->fpuTask)
+            {
+                dequeue(task);
+                task->cpu = self;
+                enqueue(&runQueues[self].levels[task->level], task);
+                return (true);
+            }
+        }
+    }
+    return (false);
 }
 
 static task_t* scheduler_getNextTask(void)
 {
-    checkBlocked();
-
-    if (runningTasks->begin == 0) // Ring is empty. Freetime for the CPU.
+    uint32_t self = smp_cpuIndex();
+    if (runQueues[self].bitmap == 0 && !stealTask(self)) // All queues are empty. Freetime for the CPU.
     {
-        if (freetimeTask == 0) // The freetime task has not been needed until now. Use spare time to create it.
+        cpu_t* cpu = &smp_cpus[self];
+        if (cpu->idleTask == 0) // The freetime task has not been needed until now. Use spare time to create it.
         {
-            freetimeTask = create_task(PROCESS, kernelPageDirectory, &doNothing, 0, 0, 0, 0);
+            cpu->idleTask = create_task(PROCESS, kernelPageDirectory, &doNothing, 0, 0, 0, 0);
         }
-        return (freetimeTask);
+        return (cpu->idleTask);
     }
 
-    runningTasks->current = runningTasks->current->next; // Take next task from the ring
-    return ((task_t*)runningTasks->current->data);
+    uint32_t level;
+    __asm__("bsr %1, %0" : "=r"(level) : "rm"(runQueues[self].bitmap));
+    return (runQueues[self].levels[level].head);
 }
 
-uint32_t scheduler_taskSwitch(uint32_t esp)
+uint32_t scheduler_taskSwitch(uint32_t esp, bool timer)
 {
-    if (runningTasks == 0)
+    if (!installed)
         return (esp); // Tasking seems to be not installed -> Don't switch task.
 
     task_saveState(esp);
 
     task_t* oldTask = currentTask;
+
+    if (isRunnable(oldTask))
+    {
+        if (!timer) // Task gave up the CPU voluntarily. It loses a boost and goes to the end of its base queue.
+        {
+            makeRunnable(oldTask, oldTask->priority);
+        }
+        else if (oldTask->slice == 0) // Slice used up: Next task of this level. Lower boosted tasks by one level.
+        {
+            makeRunnable(oldTask, oldTask->level > oldTask->priority ? oldTask->level-1 : oldTask->level);
+        }
+        // Otherwise the task stays at the head of its queue and continues, unless a task with a higher level became runnable.
+    }
+
     task_t* newTask = scheduler_getNextTask();
+    timer_enableTick(tickNeeded()); // Tickless, if all CPUs run their only task or are idle
 
     if (oldTask == newTask) // No task switch needed
         return (esp);
@@ -134,41 +387,70 @@ uint32_t scheduler_taskSwitch(uint32_t esp)
     return (task_switch(newTask));
 }
 
-void scheduler_insertTask(task_t* task)
-{
-    ring_insert(runningTasks, task, true); // We only want to have a task one time in the ring, because we steer the priority (later) with multiple rings and not by inserting a task multiple times into the ring
-}
 
-void scheduler_deleteTask(task_t* task)
+void scheduler_tick(void) // Called by the timer every 1/SYSTEMFREQUENCY seconds while the tick is enabled
 {
-    // Take task out of our rings
-    ring_deleteFirst(runningTasks, task);
-    ring_deleteFirst(blockedTasks, task);
-
-    scheduler_unblockEvent(BL_TASK, (void*)task->pid); // Unblock tasks waiting for the end of the given task
+    for (uint32_t i = 0; i < smp_cpuCount; i++)
+    {
+        task_t* task = smp_cpus[i].runningTask;
+        if (task->slice && --task->slice == 0 && i != smp_cpuIndex() && runQueues[i].count > 1)
+            smp_sendIPI(i, 32+IRQ_IPI_SCHEDULE); // The executing CPU switches after the timer interrupt, the others need an IPI
+    }
 }
 
-bool scheduler_blockCurrentTask(BLOCKERTYPE reason, void* data, uint32_t timeout)
-{
-    currentTask->blocker.type = &blocker[reason];
-    currentTask->blocker.data = data;
 
-    if (timeout == 0)
+/// Task management
+void scheduler_insertTask(task_t* task)
+{
+    bool ints = interrupts_disable();
+    if (task->queue == 0) // We only want to have a task one time in the queues
     {
-        currentTask->blocker.timeout = 0;
+        if (task != &kernelTask)
+        {
+            task->cpu = smp_cpuIndex(); // New tasks go to the CPU with the fewest runnable tasks
+            for (uint32_t i = 0; i < smp_cpuCount; i++)
+            {
+                if (runQueues[i].count < runQueues[task->cpu].count)
+                    task->cpu = i;
+            }
+        }
+        makeRunnable(task, task->priority);
+        if (runQueues[task->cpu].count > 1)
+            timer_enableTick(true);
+        notifyCPU(task);
     }
-    else
+    interrupts_restore(ints);
+}
+
+void scheduler_stopTask(task_t* task) // Takes the task out of the run queues and waits until no other CPU executes it
+{
+    while (true)
     {
-        currentTask->blocker.timeout = timer_getTicks()+max(1, timer_millisecondsToTicks(timeout));
+        bool ints = interrupts_disable();
+        dequeue(task);
+        ktimer_stop(&task->blockTimer);
+
+        uint32_t cpu = task->cpu;
+        bool running = cpu != smp_cpuIndex() && smp_cpus[cpu].runningTask == task;
+        if (running)
+            smp_sendIPI(cpu, 32+IRQ_IPI_SCHEDULE);
+        interrupts_restore(ints);
+
+        if (!running)
+            return;
+        smp_yieldKernel(); // The other CPU needs the kernel lock to switch to another task
     }
+}
 
-    cli();
-    ring_move(blockedTasks, runningTasks, currentTask);
-    sti();
-
-    switch_context(); // Leave task. This task will not be called again until block ended.
+void scheduler_deleteTask(task_t* task)
+{
+    // Take task out of our queues
+    bool ints = interrupts_disable();
+    dequeue(task);
+    ktimer_stop(&task->blockTimer);
+    interrupts_restore(ints);
 
-    return ((bool)currentTask->blocker.data); // data field contains the reason for unblock after the block is released
+    scheduler_unblockEvent(BL_TASK, (void*)task->pid); // Unblock tasks waiting for the end of the given task
 }
 
 void scheduler_log(void)
@@ -183,42 +465,46 @@ void scheduler_log(void)
     printf("pid  esp\t\bpd\t k_stack   access   thread");
     printf("\n--------------------------------------------------------------------------------");
 
-    if (runningTasks->begin != 0)
+    for (uint32_t cpu = 0; cpu < smp_cpuCount; cpu++)
     {
-        textColor(HEADLINE);
-        printf("\nrunning:\n\n");
-        textColor(TEXT);
-        slelement_t* temp = runningTasks->begin;
-
-        do
+        for (int level = PRIORITY_LEVELS-1; level >= 0; level--)
         {
-            task_log((task_t*)temp->data);
-            temp = temp->next;
+            if (runQueues[cpu].levels[level].head != 0)
+            {
+                textColor(HEADLINE);
+                printf("\nrunning (CPU %u, level %u, %u ticks):\n\n", cpu, level, sliceLength(level));
+                textColor(TEXT);
+                for (task_t* temp = runQueues[cpu].levels[level].head; temp; temp = temp->queueNext)
+                {
+                    task_log(temp);
+                }
+            }
         }
-        while (temp && temp != runningTasks->begin);
     }
 
-    if (blockedTasks->begin != 0)
+    if (blockedCount != 0)
     {
         textColor(HEADLINE);
         printf("\nblocked:\n\n");
         textColor(TEXT);
-        slelement_t* temp = blockedTasks->begin;
-
-        do
+        for (size_t i = 0; i < WAIT_QUEUES; i++)
         {
-            task_log((task_t*)temp->data);
-            temp = temp->next;
+            for (task_t* temp = waitQueues[i].head; temp; temp = temp->queueNext)
+            {
+                task_log(temp);
+            }
         }
-        while (temp && temp != blockedTasks->begin);
     }
 
-    if (freetimeTask)
+    for (uint32_t cpu = 0; cpu < smp_cpuCount; cpu++)
     {
-        textColor(HEADLINE);
-        printf("\nfreetime:\n\n");
-        textColor(TEXT);
-        task_log(freetimeTask);
+        if (smp_cpus[cpu].idleTask)
+        {
+            textColor(HEADLINE);
+            printf("\nfreetime (CPU %u):\n\n", cpu);
+            textColor(TEXT);
+            task_log(smp_cpus[cpu].idleTask);
+        }
     }
     printf("\n\n");
 }
@@ -4,30 +4,43 @@
 #include "os.h"
 
 
+#define PRIORITY_LEVELS 8 // Number of run queues. Tasks on higher levels are preferred.
+#define PRIORITY_NORMAL 3 // Default base level of a task
+#define PRIORITY_BOOST  2 // Levels a task is raised when woken up by an interrupt, an event or a network packet
+
+
 typedef struct task task_t;
 
 typedef struct
 {
-    bool (*unlock)(void*); // if 0, the blocker is event based
+    task_t* head;
+    task_t* tail;
+} taskQueue_t;
+
+typedef struct
+{
+    bool (*unlock)(void*); // Checked once before a task is blocked: true if the condition is already fulfilled. Optional. Tasks are woken up by scheduler_unblockEvent
 } blockerType_t;
 
 typedef enum
 {
-    BL_TIME, BL_SYNC, BL_INTERRUPT, BL_TASK, BL_TODOLIST, BL_EVENT, BL_NETPACKET
+    BL_TIME, BL_SYNC, BL_INTERRUPT, BL_TASK, BL_TODOLIST, BL_EVENT, BL_NETPACKET, BL_FIFO, BL_WORK, BL_IORING, BL_WRITEBACK, BL_BLOCKREAD, BL_AHCI, BL_AHCISLOT
 } BLOCKERTYPE;
 
 typedef struct
 {
     blockerType_t* type;
     void*          data;    // While the task is blocked, it contains information for the unblock functions. After the block ended, it is set to 0 in case of timeout and 1 otherwise
-    uint32_t       timeout; // 0 if no timeout is defined.
 } blocker_t;
 
 
 void     scheduler_install(void);
+void     scheduler_startCPU(void); // Turns the calling application processor into its freetime task. Does not return.
 bool     scheduler_shouldSwitchTask(void);
-uint32_t scheduler_taskSwitch(uint32_t esp);
+uint32_t scheduler_taskSwitch(uint32_t esp, bool timer); // timer: called by the timer interrupt, otherwise the task gave up the CPU
+void     scheduler_tick(void);
 void     scheduler_insertTask(task_t* task);
+void     scheduler_stopTask(task_t* task); // Takes the task out of the run queues and waits until it does not run on another CPU
 void     scheduler_deleteTask(task_t* task);
 bool     scheduler_blockCurrentTask(BLOCKERTYPE, void* data, uint32_t timeout); // false in case of timeout
 void     scheduler_unblockEvent(BLOCKERTYPE type, void* data);
@@ -7,14 +7,155 @@
 #include "kheap.h"
 #include "task.h"
 #include "util/util.h"
+#include "video/console.h"
 
+/*
+All locks are taken by atomic operations (lock cmpxchg/xchg/xadd), so they work across CPUs. Spinlocks busy-wait. They are
+meant for short sections that must not block, spinlock_lockIrq additionally protects against interrupt handlers on the same CPU.
+
+Mutexes and reader-writer locks let a task sleep in the wait queue of the lock (scheduler_blockCurrentTask with BL_SYNC) if it
+cannot get the lock. A mutex first spins for a while if its owner is running on another CPU, because the owner will release
+it soon. The locks remember whether tasks sleep on them, so unlocking an uncontended lock does not involve the scheduler.
+
+Between checking the lock and blocking, interrupts are disabled. As the waiting task holds the kernel lock (smp.c), no other
+CPU can release the lock in between, so no wakeup is lost.
+
+Each lock counts acquisitions, contentions and sleeps and measures how long it is held exclusively (in TSC cycles).
+*/
+
+
+#define MUTEX_FREE      0
+#define MUTEX_LOCKED    1
+#define MUTEX_CONTENDED 2  // Locked, tasks might sleep in the wait queue
+#define MUTEX_SPINS     50 // Maximum number of times a mutex gives the kernel lock to its owner before sleeping
+
+#define RWLOCK_WRITER   (-1)
+
+
+static lockStats_t* locks = 0; // List of all locks
+
+
+/// Statistics
+static void stats_init(lockStats_t* stats, const char* name)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->name = name;
+}
+
+static void stats_list(lockStats_t* stats) // Locks are listed when they are used first, so statically initialized locks are shown as well
+{
+    bool ints = interrupts_disable();
+    if (!stats->listed)
+    {
+        stats->listed = true;
+        stats->next = locks;
+        locks = stats;
+    }
+    interrupts_restore(ints);
+}
+
+static void stats_remove(const lockStats_t* stats)
+{
+    if (!stats->listed)
+        return;
+
+    bool ints = interrupts_disable();
+    for (lockStats_t** s = &locks; *s; s = &(*s)->next)
+    {
+        if (*s == stats)
+        {
+            *s = stats->next;
+            break;
+        }
+    }
+    interrupts_restore(ints);
+}
+
+static void stats_acquired(lockStats_t* stats, bool contended) // Called while the lock is held exclusively
+{
+    if (!stats->listed)
+        stats_list(stats);
+    stats->acquisitions++;
+    if (contended)
+        stats->contentions++;
+    stats->lockedSince = rdtsc();
+}
+
+static void stats_released(lockStats_t* stats) // Called before the exclusively held lock is released
+{
+    uint64_t cycles = rdtsc() - stats->lockedSince;
+    stats->holdCycles += cycles;
+    if (cycles > stats->maxHoldCycles)
+        stats->maxHoldCycles = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+}
+
+void lock_log(void)
+{
+    textColor(HEADLINE);
+    printf("\nLocks:");
+    textColor(TEXT);
+    bool ints = interrupts_disable();
+    for (const lockStats_t* s = locks; s; s = s->next)
+    {
+        printf("\n%s:\tacquired: %u, contended: %u, slept: %u, held: %u kCycles (max. %u Cycles)", s->name ? s->name : "(unnamed)",
+               s->acquisitions, s->contentions, s->sleeps, (uint32_t)(s->holdCycles >> 10), s->maxHoldCycles);
+    }
+    interrupts_restore(ints);
+    putch('\n');
+}
 
-// Semaphore
+
+/// Spinlock
+void spinlock_init(spinlock_t* lock, const char* name)
+{
+    lock->locked = 0;
+    stats_init(&lock->stats, name);
+}
+
+void spinlock_destroy(spinlock_t* lock)
+{
+    stats_remove(&lock->stats);
+}
+
+void spinlock_lock(spinlock_t* lock)
+{
+    bool contended = false;
+    while (__sync_lock_test_and_set(&lock->locked, 1) != 0)
+    {
+        contended = true;
+        while (lock->locked) // Wait without locking the bus
+            __asm__ volatile("pause");
+    }
+    stats_acquired(&lock->stats, contended);
+}
+
+void spinlock_unlock(spinlock_t* lock)
+{
+    stats_released(&lock->stats);
+    __sync_lock_release(&lock->locked);
+}
+
+bool spinlock_lockIrq(spinlock_t* lock)
+{
+    bool ints = interrupts_disable();
+    spinlock_lock(lock);
+    return (ints);
+}
+
+void spinlock_unlockIrq(spinlock_t* lock, bool ints)
+{
+    spinlock_unlock(lock);
+    interrupts_restore(ints);
+}
+
+
+/// Semaphore
 semaphore_t* semaphore_create(uint16_t resourceCount)
 {
     semaphore_t* obj = malloc(sizeof(semaphore_t), 0, "semaphore");
     obj->resCount = resourceCount;
     obj->freeRes = obj->resCount;
+    obj->waiters = false;
     return (obj);
 }
 
@@ -22,74 +163,276 @@ void semaphore_lock(semaphore_t* obj)
 {
     if (obj == 0) return; // Invalid object
 
+    bool ints = interrupts_disable();
     while (obj->freeRes == 0) // blocked? -> wait. Do this in a loop to prevent two tasks locking a semaphore at the "same" time
+    {
+        obj->waiters = true;
         scheduler_blockCurrentTask(BL_SYNC, obj, 0);
+    }
 
     obj->freeRes--; // aquire one resource
+    interrupts_restore(ints);
 }
 
 void semaphore_unlock(semaphore_t* obj)
 {
     if (obj == 0) return; // Invalid object
 
+    bool ints = interrupts_disable();
     if (obj->resCount == 0 || obj->freeRes < obj->resCount) // Protected against increasing the number of resources by unlocking it multiple times
         obj->freeRes++; // free one resource
 
-    scheduler_unblockEvent(BL_SYNC, obj); // Inform scheduler that this semaphore has been unlocked
+    if (obj->waiters)
+    {
+        obj->waiters = false;
+        scheduler_unblockEvent(BL_SYNC, obj); // Inform scheduler that this semaphore has been unlocked
+    }
+    interrupts_restore(ints);
 }
 
 void semaphore_delete(semaphore_t* obj)
 {
-    if (obj->freeRes == 0) // There can be tasks that are blocked due to this semaphore. Unlock them to avoid deadlocks
+    if (obj->waiters) // There can be tasks that are blocked due to this semaphore. Unlock them to avoid deadlocks
         scheduler_unblockEvent(BL_SYNC, obj);
 
     free(obj);
 }
 
 
-// Mutex
-mutex_t* mutex_create(void)
+/// Mutex
+mutex_t* mutex_create(const char* name)
 {
     mutex_t* obj = malloc(sizeof(mutex_t), 0, "mutex");
-    obj->blocks = 0;
+    obj->state   = MUTEX_FREE;
+    obj->blocker = 0;
+    obj->blocks  = 0;
+    stats_init(&obj->stats, name);
     return (obj);
 }
 
+static bool ownerRunning(const mutex_t* obj) // The owner of the mutex is executed by another CPU at the moment
+{
+    const task_t* owner = obj->blocker;
+    return (owner && owner->cpu != smp_cpuIndex() && smp_cpus[owner->cpu].runningTask == owner);
+}
+
+static void mutex_acquired(mutex_t* obj, bool contended)
+{
+    obj->blocker = currentTask;
+    obj->blocks = 1;
+    stats_acquired(&obj->stats, contended);
+}
+
 void mutex_lock(mutex_t* obj)
 {
     if (!obj) return; // Invalid object.
 
-    if (obj->blocks != 0 && obj->blocker == currentTask) // Mutex has already been locked by this task. Increase blocks counter.
+    if (obj->state != MUTEX_FREE && obj->blocker == currentTask) // Mutex has already been locked by this task. Increase blocks counter.
     {
         obj->blocks++;
         return;
     }
 
-    while (obj->blocks != 0)
+    if (__sync_val_compare_and_swap(&obj->state, MUTEX_FREE, MUTEX_LOCKED) == MUTEX_FREE) // Fast path: Mutex was free
+    {
+        mutex_acquired(obj, false);
+        return;
+    }
+
+    // The owner needs the kernel lock to make progress, so it is handed over while spinning
+    for (uint32_t i = 0; i < MUTEX_SPINS && ownerRunning(obj); i++)
+    {
+        smp_yieldKernel();
+        if (obj->state == MUTEX_FREE && __sync_val_compare_and_swap(&obj->state, MUTEX_FREE, MUTEX_LOCKED) == MUTEX_FREE)
+        {
+            mutex_acquired(obj, true);
+            return;
+        }
+    }
+
+    // Sleep until the mutex is unlocked. A task that takes the mutex this way marks it as contended, because further tasks might sleep.
+    bool ints = interrupts_disable();
+    while (__sync_lock_test_and_set(&obj->state, MUTEX_CONTENDED) != MUTEX_FREE)
+    {
+        obj->stats.sleeps++;
         scheduler_blockCurrentTask(BL_SYNC, obj, 0); // Wait until the mutex is unlocked
+    }
+    mutex_acquired(obj, true);
+    interrupts_restore(ints);
+}
 
-    obj->blocks = 1;
-    obj->blocker = currentTask;
+bool mutex_tryLock(mutex_t* obj)
+{
+    if (!obj) return (false); // Invalid object.
+
+    if (obj->state != MUTEX_FREE && obj->blocker == currentTask)
+    {
+        obj->blocks++;
+        return (true);
+    }
+
+    if (__sync_val_compare_and_swap(&obj->state, MUTEX_FREE, MUTEX_LOCKED) != MUTEX_FREE)
+        return (false);
+
+    mutex_acquired(obj, false);
+    return (true);
 }
 
 void mutex_unlock(mutex_t* obj)
 {
-    if (!obj) return; // Invalid object
+    if (!obj || obj->blocks == 0) return; // Invalid object or not locked
 
     obj->blocks--; // Release one lock.
+    if (obj->blocks != 0)
+        return;
 
-    scheduler_unblockEvent(BL_SYNC, obj); // Inform scheduler that this mutex has been unlocked
+    stats_released(&obj->stats);
+    obj->blocker = 0;
+    if (__sync_lock_test_and_set(&obj->state, MUTEX_FREE) == MUTEX_CONTENDED)
+        scheduler_unblockEvent(BL_SYNC, obj); // Inform scheduler that this mutex has been unlocked
 }
 
 void mutex_delete(mutex_t* obj)
 {
-    if (obj->blocks != 0) // There can be tasks that are blocked due to this mutex. Unlock them to avoid deadlocks
+    if (obj->state == MUTEX_CONTENDED) // There can be tasks that are blocked due to this mutex. Unlock them to avoid deadlocks
         scheduler_unblockEvent(BL_SYNC, obj);
 
+    stats_remove(&obj->stats);
     free(obj);
 }
 
 
+/// Reader-writer lock
+void rwlock_init(rwlock_t* lock, const char* name)
+{
+    lock->state          = 0;
+    lock->writersWaiting = 0;
+    lock->waiters        = false;
+    lock->writer         = 0;
+    lock->writes         = 0;
+    stats_init(&lock->stats, name);
+}
+
+void rwlock_destroy(rwlock_t* lock)
+{
+    if (lock->waiters)
+        scheduler_unblockEvent(BL_SYNC, lock);
+    stats_remove(&lock->stats);
+}
+
+static bool tryRead(rwlock_t* lock)
+{
+    int32_t state = lock->state;
+    return (state != RWLOCK_WRITER && lock->writersWaiting == 0 && __sync_val_compare_and_swap(&lock->state, state, state+1) == state);
+}
+
+static bool tryWrite(rwlock_t* lock)
+{
+    return (__sync_val_compare_and_swap(&lock->state, 0, RWLOCK_WRITER) == 0);
+}
+
+static void wakeWaiters(rwlock_t* lock)
+{
+    if (lock->waiters)
+    {
+        lock->waiters = false;
+        scheduler_unblockEvent(BL_SYNC, lock); // All of them try again. Those that fail set waiters again.
+    }
+}
+
+void rwlock_readLock(rwlock_t* lock)
+{
+    if (lock->writer == currentTask) // The writer may read
+    {
+        lock->writes++;
+        return;
+    }
+
+    if (!lock->stats.listed)
+        stats_list(&lock->stats);
+
+    if (tryRead(lock))
+    {
+        __sync_fetch_and_add(&lock->stats.acquisitions, 1);
+        return;
+    }
+
+    bool ints = interrupts_disable();
+    lock->stats.contentions++;
+    while (!tryRead(lock))
+    {
+        lock->waiters = true;
+        lock->stats.sleeps++;
+        scheduler_blockCurrentTask(BL_SYNC, lock, 0);
+    }
+    lock->stats.acquisitions++;
+    interrupts_restore(ints);
+}
+
+void rwlock_readUnlock(rwlock_t* lock)
+{
+    if (lock->writer == currentTask)
+    {
+        rwlock_writeUnlock(lock);
+        return;
+    }
+
+    bool ints = interrupts_disable();
+    if (__sync_sub_and_fetch(&lock->state, 1) == 0)
+        wakeWaiters(lock);
+    interrupts_restore(ints);
+}
+
+void rwlock_writeLock(rwlock_t* lock)
+{
+    if (lock->writer == currentTask)
+    {
+        lock->writes++;
+        return;
+    }
+
+    bool contended = false;
+    bool ints = interrupts_disable();
+    if (!tryWrite(lock))
+    {
+        contended = true;
+        __sync_fetch_and_add(&lock->writersWaiting, 1); // New readers have to wait from now on
+        while (!tryWrite(lock))
+        {
+            lock->waiters = true;
+            lock->stats.sleeps++;
+            scheduler_blockCurrentTask(BL_SYNC, lock, 0);
+        }
+        __sync_fetch_and_sub(&lock->writersWaiting, 1);
+    }
+    lock->writer = currentTask;
+    lock->writes = 1;
+    stats_acquired(&lock->stats, contended);
+    interrupts_restore(ints);
+}
+
+void rwlock_writeUnlock(rwlock_t* lock)
+{
+    if (lock->writer != currentTask) return; // Not locked by this task
+
+    lock->writes--;
+    if (lock->writes != 0)
+        return;
+
+    stats_released(&lock->stats);
+    bool ints = interrupts_disable();
+    lock->writer = 0;
+    __sync_lock_test_and_set(&lock->state, 0);
+    wakeWaiters(lock);
+    interrupts_restore(ints);
+}
+
+bool rwlock_isWriter(const rwlock_t* lock)
+{
+    return (lock->writer == currentTask);
+}
+
+
 /*
 * Copyright (c) 2010-2013 The PrettyOS Project. All rights reserved.
 *
@@ -4,10 +4,45 @@
 #include "scheduler.h"
 
 
+// Statistics kept by every lock. Shown by lock_log.
+typedef struct lockStats
+{
+    const char*       name;
+    uint32_t          acquisitions;  // Number of successful lock operations (recursive ones not counted)
+    uint32_t          contentions;   // Lock operations that found the lock busy
+    uint32_t          sleeps;        // Number of times a task had to wait in the wait queue of the lock
+    uint64_t          lockedSince;   // TSC when the lock has been taken exclusively
+    uint64_t          holdCycles;    // Sum of the exclusive hold times
+    uint32_t          maxHoldCycles; // Longest exclusive hold time
+    bool              listed;        // Lock has been added to the list shown by lock_log (at first acquisition)
+    struct lockStats* next;          // List of all locks
+} lockStats_t;
+
+void lock_log(void); // Shows the statistics of all locks
+
+
+// Spinlock: Busy waiting, for short critical sections only. The holder must not block.
+typedef struct
+{
+    volatile uint32_t locked;
+    lockStats_t       stats;
+} spinlock_t;
+
+#define SPINLOCK_INIT(lockName) {.locked = 0, .stats = {.name = (lockName)}} // Static alternative to spinlock_init
+
+void spinlock_init(spinlock_t* lock, const char* name);
+void spinlock_destroy(spinlock_t* lock);
+void spinlock_lock(spinlock_t* lock);
+void spinlock_unlock(spinlock_t* lock);
+bool spinlock_lockIrq(spinlock_t* lock);               // Disables interrupts before spinning. Returns whether they were enabled before.
+void spinlock_unlockIrq(spinlock_t* lock, bool ints);  // ints: Return value of spinlock_lockIrq
+
+
 typedef struct
 {
     uint16_t resCount;  // Number of resources
     uint16_t freeRes;   // Index of the first unused resource in the array mentioned above
+    bool     waiters;   // Tasks are blocked on this semaphore
 } semaphore_t;
 
 semaphore_t* semaphore_create(uint16_t resourceCount);
@@ -16,16 +51,43 @@ void         semaphore_unlock(semaphore_t* obj);
 void         semaphore_delete(semaphore_t* obj);
 
 
+// Mutex: Spins while the owner runs on another CPU, sleeps in the wait queue of the mutex otherwise. Can be locked recursively.
 typedef struct
 {
-    task_t*  blocker; // Task that is blocking the mutex
-    uint32_t blocks;  // Indicates whether this mutex is blocked at the moment or not. -> You have to call unlock as often as lock to unblock mutex.
+    volatile uint32_t state;   // MUTEX_FREE, MUTEX_LOCKED or MUTEX_CONTENDED (tasks might wait)
+    task_t* volatile  blocker; // Task that is blocking the mutex
+    uint32_t          blocks;  // Indicates whether this mutex is blocked at the moment or not. -> You have to call unlock as often as lock to unblock mutex.
+    lockStats_t       stats;
 } mutex_t;
 
-mutex_t* mutex_create(void);
+mutex_t* mutex_create(const char* name);
 void     mutex_lock(mutex_t* obj);
+bool     mutex_tryLock(mutex_t* obj); // Locks the mutex if that is possible without waiting
 void     mutex_unlock(mutex_t* obj);
 void     mutex_delete(mutex_t* obj);
 
 
+// Reader-writer lock: Any number of readers or one writer. Waiting writers are preferred. The writer can lock recursively,
+// also for reading. Readers must not lock for writing.
+typedef struct
+{
+    volatile int32_t  state;          // Number of readers, RWLOCK_WRITER while a writer holds the lock
+    volatile uint32_t writersWaiting;
+    volatile bool     waiters;        // Tasks are blocked on this lock
+    task_t* volatile  writer;
+    uint32_t          writes;         // Recursion depth of the writer
+    lockStats_t       stats;
+} rwlock_t;
+
+#define RWLOCK_INIT(lockName) {.state = 0, .writer = 0, .stats = {.name = (lockName)}} // Static alternative to rwlock_init
+
+void rwlock_init(rwlock_t* lock, const char* name);
+void rwlock_destroy(rwlock_t* lock);
+void rwlock_readLock(rwlock_t* lock);
+void rwlock_readUnlock(rwlock_t* lock);
+void rwlock_writeLock(rwlock_t* lock);
+void rwlock_writeUnlock(rwlock_t* lock);
+bool rwlock_isWriter(const rwlock_t* lock); // The current task holds the lock for writing
+
+
 #endif
@@ -7,9 +7,13 @@
 #include "util/util.h"
 #include "memory.h"
 #include "cpu.h"
+#include "fpu.h"
 #include "descriptor_tables.h"
 #include "kheap.h"
+#include "objcache.h"
 #include "scheduler.h"
+#include "syscall.h"
+#include "ioring.h"
 #include "timer.h"
 #include "netprotocol/udp.h"
 #include "netprotocol/tcp.h"
@@ -29,19 +33,22 @@ task_t kernelTask =
     .esp           = 0,
     .privilege     = 0,
     .FPUptr        = 0,
+    .fpuCounter    = 0,
     .console       = &kernelConsole,
     .attrib        = 0x0F,
     .eventQueue    = 0,
     .type          = PROCESS,
+    .priority      = PRIORITY_NORMAL,
+    .queue         = 0,      // Inserted into the scheduler's queues by tasking_install
     .blocker.type  = 0,      // The task is not blocked (scheduler.h/c)
     .kernelStack   = 0,      // The kernel task does not need a kernel stack because it does not call his own functions by syscall
     .threads       = 0       // No threads associated with the task at the moment. List is created later if necessary
 };
 
-task_t* currentTask = &kernelTask;
 list_t* tasks; // List of all tasks. Not sorted by pid
 
 static uint32_t next_pid = 1; // The next available process ID (kernel has 0, so we start with 1 here).
+static objCache_t* taskCache; // task_t of all tasks except kernelTask
 
 
 void tasking_install(void)
@@ -53,6 +60,7 @@ void tasking_install(void)
   #endif
 
     tasks = list_create();
+    taskCache = objCache_create("task_t", sizeof(task_t), 0);
 
     kernelTask.pageDirectory = kernelPageDirectory;
     kernelTask.eventQueue = event_createQueue();
@@ -86,14 +94,18 @@ bool waitForTask(task_t* blockingTask, uint32_t timeout)
 /// Functions to create tasks
 task_t* create_task(taskType_t type, pageDirectory_t* directory, void(*entry)(void), uint8_t privilege, console_t* console, size_t argc, char* argv[])
 {
-    task_t* newTask = malloc(sizeof(task_t), 0, "task_t");
+    task_t* newTask = objCache_alloc(taskCache);
     newTask->type          = type;
     newTask->pid           = next_pid++;
     newTask->pageDirectory = directory;
     newTask->privilege     = privilege;
     newTask->FPUptr        = 0;
+    newTask->fpuCounter    = 0;
     newTask->attrib        = 0x0F;
+    newTask->priority      = PRIORITY_NORMAL;
+    newTask->queue         = 0; // Not known to the scheduler until scheduler_insertTask is called
     newTask->blocker.type  = 0;
+    ktimer_init(&newTask->blockTimer, 0, newTask);
     newTask->threads       = 0; // No threads associated with the task at the moment. created later if necessary
     newTask->eventQueue    = 0; // Event handling is disabled per default
     newTask->files         = 0;
@@ -103,7 +115,7 @@ task_t* create_task(taskType_t type, pageDirectory_t* directory, void(*entry)(vo
     if (newTask->privilege == 3 && newTask->type != VM86)
     {
         newTask->heap_top = USER_HEAP_START;
-        paging_alloc(newTask->pageDirectory, (void*)(USER_STACK - 10*PAGESIZE), 10*PAGESIZE, MEM_USER|MEM_WRITE); // Stack starts at USER_STACK-StackSize*PAGESIZE
+        paging_reserve(newTask->pageDirectory, (void*)(USER_STACK - 10*PAGESIZE), 10*PAGESIZE, MEM_USER|MEM_WRITE); // Stack starts at USER_STACK-StackSize*PAGESIZE
     }
 
     newTask->kernelStack = malloc(kernelStackSize, 4, "task-kernelstack")+kernelStackSize;
@@ -144,7 +156,7 @@ task_t* create_task(taskType_t type, pageDirectory_t* directory, void(*entry)(vo
     // General purpose registers w/o esp
     *(--kernelStack) = argc;            // eax. Used to give argc to user programs.
     *(--kernelStack) = (uintptr_t)argv; // ecx. Used to give argv to user programs.
-    *(--kernelStack) = 0;//cpu_supports(CF_SYSENTEREXIT); // edx. Used to inform the user programm about the support for the SYSENTER/SYSEXIT instruction. TODO: Enable it. At the moment, there are problems with multiple tasks
+    *(--kernelStack) = newTask->privilege == 3 && syscall_sysenterAvailable(); // edx. Used to inform the user programm about the support for the SYSENTER/SYSEXIT instruction. SYSEXIT returns to ring 3.
     *(--kernelStack) = 0;
     *(--kernelStack) = 0;
     *(--kernelStack) = 0;
@@ -269,7 +281,9 @@ uint32_t task_switch(task_t* newTask)
 {
     task_switching = false;
 
+    task_t* oldTask = currentTask;
     currentTask = newTask;
+    smp_currentCPU()->taskSwitched = oldTask != newTask;
 
     tss_switch((uintptr_t)currentTask->kernelStack, currentTask->esp, currentTask->ss); // esp0, esp, ss
 
@@ -281,18 +295,7 @@ uint32_t task_switch(task_t* newTask)
     textColor(TEXT);
     #endif
 
-    // Set TS
-    if (currentTask == FPUTask)
-    {
-        __asm__ volatile("clts"); // CLearTS: reset the TS bit (no. 3) in CR0 to disable #NM
-    }
-    else
-    {
-        uint32_t cr0;
-        __asm__ volatile("mov %%cr0, %0": "=r"(cr0)); // Read cr0
-        cr0 |= BIT(3); // Set the TS bit (no. 3) in CR0 to enable #NM (exception no. 7)
-        __asm__ volatile("mov %0, %%cr0":: "r"(cr0)); // Write cr0
-    }
+    fpu_switch(oldTask, currentTask); // Restores the FPU state eagerly or sets TS
 
     task_switching = true;
 
@@ -303,6 +306,8 @@ void switch_context() // Switch to next task (by interrupt)
 {
     if (!scheduler_shouldSwitchTask()) // If the scheduler does not want to switch the task ...
     {
+        cli();
+        smp_unlockKernel(); // Other CPUs may enter the kernel while this one is waiting. The interrupt takes the lock again.
         sti();
         hlt(); // Wait one cycle
     }
@@ -314,6 +319,8 @@ void switch_context() // Switch to next task (by interrupt)
 // Functions to kill a task
 void kill(task_t* task)
 {
+    scheduler_stopTask(task); // The task must not run on another CPU while it is destroyed
+
     task_switching = false; // There should not occur a task switch while we are exiting from a task, to avoid data corruption
 
     #ifdef _TASKING_DIAGNOSIS_
@@ -321,6 +328,7 @@ void kill(task_t* task)
     #endif
 
     // Cleanup
+    ioring_cleanup(task); // Waits for submissions in progress, which might use the files and connections of the task
     console_cleanup(task);
     udp_cleanup(task);
     tcp_cleanup(task);
@@ -370,9 +378,9 @@ void kill(task_t* task)
         systemControl(REBOOT);
     }
 
-    free(task->FPUptr);
+    fpu_releaseTask(task);
     free(task->kernelStack - kernelStackSize); // Free kernelstack
-    free(task);
+    objCache_free(taskCache, task);
 
     task_switching = true;
 
@@ -406,7 +414,7 @@ void* task_grow_userheap(uint32_t increase)
     increase = alignUp(increase, PAGESIZE);
 
     if (((uintptr_t)old_heap_top + increase > (uintptr_t)USER_HEAP_END) ||
-        !paging_alloc(currentTask->pageDirectory, old_heap_top, increase, MEM_USER | MEM_WRITE))
+        !paging_reserve(currentTask->pageDirectory, old_heap_top, increase, MEM_USER | MEM_WRITE)) // Demand-zero memory
     {
         return (0);
     }
@@ -416,6 +424,19 @@ void* task_grow_userheap(uint32_t increase)
     return old_heap_top;
 }
 
+bool task_shrink_userheap(uint32_t decrease)
+{
+    if (decrease % PAGESIZE != 0 || decrease > (uintptr_t)currentTask->heap_top - (uintptr_t)USER_HEAP_START)
+    {
+        return (false);
+    }
+
+    currentTask->heap_top -= decrease;
+    paging_free(currentTask->pageDirectory, currentTask->heap_top, decrease);
+
+    return (true);
+}
+
 void task_log(task_t* t)
 {
     textColor(IMPORTANT);
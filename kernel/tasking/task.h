@@ -5,6 +5,8 @@
 #include "paging.h"
 #include "scheduler.h"
 #include "events.h"
+#include "timer.h"
+#include "smp.h"
 
 
 typedef enum
@@ -21,15 +23,23 @@ struct task
     pageDirectory_t* pageDirectory;  // Page directory
     uint8_t*         heap_top;       // User heap top
     void*            kernelStack;    // Kernel stack location
-    void*            FPUptr;         // Pointer to FPU data
+    void*            FPUptr;         // Pointer to FPU data (save area, cf. fpu.c)
+    uint8_t          fpuCounter;     // Number of consecutive time slices in which the task used the FPU
     list_t*          threads;        // All threads owned by this tasks - deleted if this task is exited
     task_t*          parent;         // Task that created this thread (only used for threads)
     event_queue_t*   eventQueue;     // 0 if no event handling enabled. Points to queue otherwise.
     uint8_t          privilege;      // Access privilege
 
     // Information needed by scheduler
-    uint16_t         priority; // Indicates how often this task gets the CPU
-    blocker_t        blocker;  // Object indicating reason and duration of blockade
+    uint8_t          priority;  // Base level of the task (0 to PRIORITY_LEVELS-1). Indicates how often this task gets the CPU
+    uint8_t          level;     // Current level. Above priority after a wakeup by I/O
+    uint8_t          slice;     // Timer ticks left until the next task of the same level gets the CPU
+    uint8_t          cpu;       // CPU whose run queue contains the task or that executed it last
+    taskQueue_t*     queue;     // Run queue or blocked queue the task is in. 0 if it is in none
+    task_t*          queueNext; // Links inside of queue
+    task_t*          queuePrev;
+    ktimer_t         blockTimer; // Ends a block with timeout
+    blocker_t        blocker;   // Object indicating reason and duration of blockade
 
     // Task specific graphical output settings
     console_t*       console; // Console used by this task
@@ -42,10 +52,11 @@ struct task
 };
 
 
-extern task_t* volatile FPUTask; // fpu.c
-extern task_t           kernelTask;
-extern bool             task_switching;
-extern task_t*          currentTask;
+extern task_t kernelTask;
+extern bool   task_switching;
+
+#define currentTask (smp_currentCPU()->runningTask) // Task running on the executing CPU
+#define FPUTask     (smp_currentCPU()->fpuTask)     // Task whose state is loaded in the FPU of the executing CPU
 
 
 void     tasking_install(void);
@@ -64,6 +75,7 @@ void     task_kill(uint32_t pid);
 bool     waitForTask(task_t* blockingTask, uint32_t timeout); // Returns false in case of timeout. TODO: Can this function cause deadlocks?
 uint32_t getpid(void);
 void*    task_grow_userheap(uint32_t increase);
+bool     task_shrink_userheap(uint32_t decrease);
 void     task_log(task_t* t);
 
 
@@ -0,0 +1,208 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "workqueue.h"
+#include "task.h"
+#include "synchronisation.h"
+#include "timer.h"
+#include "util/todo_list.h"
+#include "util/util.h"
+#include "video/console.h"
+
+/*
+Work that should not be done in an interrupt handler or that has to wait for some time is deferred to worker threads. There is
+one queue per class of work, each with an own worker thread on its own priority level, so that for example network processing
+does not depend on what the kernel console or the storage drivers are doing.
+
+A queue takes two kinds of work:
+- work_t structures provided by the caller (workqueue_schedule). They are linked into a list under a spinlock, so interrupt
+  handlers can schedule them without allocating memory. A work is queued only once until it has been started.
+- Exercises with a copy of their data and an optional execution time (workqueue_add), kept in a todo list.
+
+The worker sleeps (BL_WORK) until a work is scheduled or an exercise becomes due. For each queue the delay between scheduling
+(or due time) and execution is measured.
+*/
+
+
+typedef struct
+{
+    const char* name;
+    uint8_t     priority;
+    spinlock_t  lock;     // Protects the list of works. Taken in interrupt handlers.
+    work_t*     head;
+    work_t*     tail;
+    todoList_t* delayed;  // Exercises added by workqueue_add
+    task_t*     worker;
+
+    // Statistics about works. The todo list keeps statistics about its exercises.
+    uint32_t    executed;
+    uint64_t    latency;    // Sum, in microseconds
+    uint32_t    maxLatency;
+} workqueue_t;
+
+
+static workqueue_t queues[WQ_COUNT] =
+{
+    {.name = "network", .priority = PRIORITY_NORMAL+2},
+    {.name = "storage", .priority = PRIORITY_NORMAL+2},
+    {.name = "timer",   .priority = PRIORITY_NORMAL+1},
+    {.name = "user I/O", .priority = PRIORITY_NORMAL}
+};
+
+
+static void wakeUp(void* data)
+{
+    scheduler_unblockEvent(BL_WORK, data);
+}
+
+static void runWorks(workqueue_t* queue)
+{
+    while (true)
+    {
+        bool ints = spinlock_lockIrq(&queue->lock);
+        work_t* work = queue->head;
+        if (work)
+        {
+            queue->head = work->next;
+            if (queue->head == 0)
+                queue->tail = 0;
+            work->pending = false; // From now on, the work can be scheduled again. Then it will be executed once more.
+        }
+        spinlock_unlockIrq(&queue->lock, ints);
+
+        if (work == 0)
+            return;
+
+        uint32_t latency = min(timer_getMicroseconds() - work->queued, 0xFFFFFFFF);
+        queue->executed++;
+        queue->latency += latency;
+        queue->maxLatency = max(queue->maxLatency, latency);
+
+        work->function(work);
+    }
+}
+
+static void worker(void)
+{
+    workqueue_t* queue = 0;
+    for (uint32_t i = 0; i < WQ_COUNT && queue == 0; i++)
+    {
+        if (queues[i].worker == currentTask)
+            queue = &queues[i];
+    }
+
+    while (true)
+    {
+        scheduler_blockCurrentTask(BL_WORK, queue, 0); // Returns at once if there is something to do (workqueue_unlockTask)
+        runWorks(queue);
+        todoList_execute(queue->delayed);
+    }
+}
+
+void workqueue_install(void)
+{
+    for (uint32_t i = 0; i < WQ_COUNT; i++)
+    {
+        workqueue_t* queue = &queues[i];
+        spinlock_init(&queue->lock, queue->name);
+        queue->delayed = todolist_create();
+        ktimer_init(&queue->delayed->timer, &wakeUp, queue); // The worker does not wait on the todo list itself, so its timer has to wake up the worker
+
+        queue->worker = create_thread(&worker);
+        queue->worker->priority = queue->priority;
+        scheduler_insertTask(queue->worker);
+    }
+}
+
+void workqueue_schedule(WORKQUEUE_t type, work_t* work)
+{
+    workqueue_t* queue = &queues[type];
+
+    bool ints = spinlock_lockIrq(&queue->lock);
+    if (!work->pending)
+    {
+        work->pending = true;
+        work->queued  = timer_getMicroseconds();
+        work->next    = 0;
+        if (queue->tail)
+            queue->tail->next = work;
+        else
+            queue->head = work;
+        queue->tail = work;
+    }
+    spinlock_unlockIrq(&queue->lock, ints);
+
+    scheduler_unblockEvent(BL_WORK, queue);
+}
+
+void workqueue_add(WORKQUEUE_t type, void (*function)(void*, size_t), void* data, size_t length, uint64_t executionTime)
+{
+    workqueue_t* queue = &queues[type];
+    todoList_add(queue->delayed, function, data, length, executionTime);
+    if (executionTime <= timer_getMicroseconds())
+        scheduler_unblockEvent(BL_WORK, queue);
+}
+
+bool workqueue_unlockTask(void* data)
+{
+    workqueue_t* queue = data;
+    return (queue->head != 0 || todoList_unlockTask(queue->delayed));
+}
+
+static uint32_t average(uint64_t sum, uint32_t count) // Avoids 64 bit division
+{
+    if (count == 0)
+        return (0);
+    if (sum >> 32)
+        return (((uint32_t)(sum >> 10) / count) << 10);
+    return ((uint32_t)sum / count);
+}
+
+void workqueue_log(void)
+{
+    textColor(HEADLINE);
+    printf("\nWork queues:");
+    textColor(TEXT);
+    for (uint32_t i = 0; i < WQ_COUNT; i++)
+    {
+        const workqueue_t* queue = &queues[i];
+        const todoList_t* delayed = queue->delayed;
+        if (delayed == 0)
+            continue;
+        printf("\n%s (level %u):\tworks: %u, latency: avg. %u us, max. %u us\n\t\t\texercises: %u, latency: avg. %u us, max. %u us",
+               queue->name, queue->priority, queue->executed, average(queue->latency, queue->executed), queue->maxLatency,
+               delayed->executed, average(delayed->latency, delayed->executed), delayed->maxLatency);
+    }
+    putch('\n');
+}
+
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
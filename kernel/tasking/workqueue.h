@@ -0,0 +1,35 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include "os.h"
+
+
+typedef enum
+{
+    WQ_NETWORK, // Received frames, protocol processing
+    WQ_STORAGE, // Completion of disk requests
+    WQ_TIMER,   // Delayed exercises, e.g. cleanup after a timeout
+    WQ_IO,      // Asynchronous I/O of user programs (io rings)
+    WQ_COUNT
+} WORKQUEUE_t;
+
+// Deferred work that can be scheduled by interrupt handlers. The structure is provided by the caller, so scheduling does not allocate memory.
+typedef struct work
+{
+    void        (*function)(struct work*);
+    volatile bool pending; // Scheduled, but not yet started
+    uint64_t      queued;  // Time of scheduling in microseconds since boot
+    struct work*  next;
+} work_t;
+
+#define WORK_INIT(func) {.function = (func), .pending = false, .next = 0}
+
+
+void workqueue_install(void);
+void workqueue_schedule(WORKQUEUE_t queue, work_t* work); // Can be called in interrupt handlers. Does nothing if the work is already pending.
+void workqueue_add(WORKQUEUE_t queue, void (*function)(void*, size_t), void* data, size_t length, uint64_t executionTime); // Copies data. executionTime: microseconds since boot, 0 for immediately. Not in interrupt handlers.
+bool workqueue_unlockTask(void* queue); // Used for scheduler. Returns true if the worker has something to do.
+void workqueue_log(void);
+
+
+#endif
@@ -7,28 +7,154 @@
 #include "util/util.h"
 #include "pit.h"
 #include "irq.h"
+#include "apic.h"
 #include "tasking/task.h"
 #include "cpu.h"
 
+/*
+The timer interrupt is not periodic. The timer device (PIT channel 0, or the local APIC timer if available) runs in one-shot mode
+and is programmed to the next deadline of all armed kernel timers (ktimer_t). The scheduler tick is an ordinary periodic timer that
+is only armed while more than one task wants the CPU, so an idle system is woken up by interrupts that are really needed.
+
+The time since boot is accumulated from the counter of the timer device each time it is reprogrammed, and read in between by
+adding the cycles elapsed since then. Cycles are converted by multiplying with 32.32 fixed point factors, so no 64 bit division
+is needed.
+
+Armed timers are kept in a hierarchical timer wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots. A slot of level 0 covers
+2^WHEEL_RESOLUTION microseconds, a slot of level n covers WHEEL_SLOTS^n slots of level 0. A timer is linked into the lowest level
+that reaches its deadline. When the wheel reaches the beginning of a slot of a higher level, the timers of that slot are moved
+(cascaded) down. Bitmaps of occupied slots allow to skip empty parts of the wheel and to find the next deadline quickly.
+*/
+
+#define WHEEL_LEVELS     4
+#define WHEEL_SLOT_BITS  6
+#define WHEEL_SLOTS      BIT(WHEEL_SLOT_BITS)
+#define WHEEL_RESOLUTION 7      // A slot of level 0 covers 2^7 = 128 microseconds
+#define TIMER_MIN_DELAY  20     // Microseconds. Shorter delays are extended to avoid interrupt storms.
+#define TIMER_MAX_SLEEP  100000 // Microseconds. The system is woken up at least that often to keep the clock and polling loops running.
+
+
+typedef struct
+{
+    uint32_t   frequency;             // Counter cycles per second. Has to be above 1 MHz.
+    uint32_t   maxCycles;             // Longest delay the device can be programmed to
+    void     (*program)(uint32_t);    // Starts the counter to raise an interrupt after the given number of cycles
+    uint32_t (*elapsed)(void);        // Cycles since the last call of program
+    void     (*acknowledge)(void);    // End of interrupt, if not done by the PIC (optional)
+} timerDevice_t;
+
 
-static uint16_t systemfrequency; // system frequency
+static uint16_t systemfrequency;   // Scheduler ticks per second
+static uint32_t tickPeriod;        // Microseconds between two scheduler ticks
 static volatile uint64_t timer_ticks = 0;
+static ktimer_t tickTimer;
 
-void timer_install(uint16_t sysfreq)
+static const timerDevice_t* device = 0;
+static uint64_t clockBase     = 0; // Microseconds since boot at the last call of device->program
+static uint32_t clockFraction = 0; // Fractional part of clockBase (2^-32 microseconds)
+static uint32_t usFactor;          // Microseconds per cycle (32.32 fixed point)
+static uint32_t cycleFactor;       // Cycles per microsecond (16.16 fixed point)
+static uint64_t programmed;        // Deadline the device is programmed to
+
+static ktimer_t* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t  occupied[WHEEL_LEVELS]; // Bit n set: wheel[level][n] is not empty
+static uint64_t  wheelTime = 0;          // Slot of level 0 (in units of 2^WHEEL_RESOLUTION microseconds) processed last
+
+
+/// Fixed point helpers
+static uint32_t fixedDivide(uint32_t high, uint32_t low, uint32_t divisor) // (high*2^32 + low)/divisor. The quotient has to fit into 32 bits (high < divisor).
 {
-    irq_installHandler(IRQ_TIMER, timer_handler); // Installs 'timer_handler' to IRQ_TIMER
+    uint32_t quotient, remainder;
+    __asm__("divl %4" : "=a"(quotient), "=d"(remainder) : "a"(low), "d"(high), "rm"(divisor));
+    return (quotient);
+}
 
-    timer_setFrequency(sysfreq); // x Hz, meaning a tick every 1000/x milliseconds
+static uint64_t scale(uint64_t value, uint32_t factor) // value*factor/2^32
+{
+    return ((uint64_t)(uint32_t)(value >> 32) * factor + (((uint64_t)(uint32_t)value * factor) >> 32));
 }
 
-uint32_t timer_getSeconds(void)
+
+/// Timer devices
+static uint16_t pitCount; // Value the counter was started with
+
+static void pit_program(uint32_t cycles)
+{
+    pitCount = cycles;
+    outportb(COMMANDREGISTER, COUNTER_0 | RW_HI_LO_MODE | ONESHOT);
+    outportb(COUNTER_0_DATAPORT, BYTE1(cycles));
+    outportb(COUNTER_0_DATAPORT, BYTE2(cycles));
+}
+
+static uint32_t pit_elapsed(void)
+{
+    outportb(COMMANDREGISTER, COUNTER_0 | COUNTER_LATCH);
+    uint16_t count = inportb(COUNTER_0_DATAPORT);
+    count |= inportb(COUNTER_0_DATAPORT) << 8;
+    return ((uint16_t)(pitCount - count)); // In mode 0, the counter wraps around to 0xFFFF after reaching 0 and keeps counting
+}
+
+static const timerDevice_t pit = {TIMECOUNTER_i8254_FREQU, 0x8000, &pit_program, &pit_elapsed, 0}; // Half of the counter range is left as margin for delayed interrupts
+
+static uint32_t apicCount;
+
+static void apic_program(uint32_t cycles)
+{
+    apicCount = cycles;
+    apic_timerStart(cycles);
+}
+
+static uint32_t apic_elapsed(void)
+{
+    return (apicCount - apic_timerCount()); // The counter stops at 0
+}
+
+static timerDevice_t lapic = {0, 0xFFFFFFFF, &apic_program, &apic_elapsed, &apic_eoi};
+
+
+/// Clock
+static void accumulate(void) // Adds the time since the last call of device->program to the clock. Interrupts have to be disabled.
 {
-    return ((uint32_t)timer_ticks/systemfrequency);
+    uint64_t product = (uint64_t)device->elapsed() * usFactor;
+    uint32_t fraction = clockFraction + (uint32_t)product;
+    clockBase += (product >> 32) + (fraction < clockFraction);
+    clockFraction = fraction;
 }
+
+static uint64_t now(void) // Interrupts have to be disabled
+{
+    if (device == 0)
+        return (0);
+    return (clockBase + (((uint64_t)device->elapsed() * usFactor + clockFraction) >> 32));
+}
+
+static void useDevice(const timerDevice_t* newDevice) // Interrupts have to be disabled
+{
+    if (device)
+        accumulate();
+    device      = newDevice;
+    usFactor    = fixedDivide(1000000, 0, device->frequency);
+    cycleFactor = fixedDivide(device->frequency >> 16, device->frequency << 16, 1000000);
+}
+
+uint64_t timer_getMicroseconds(void)
+{
+    bool ints = interrupts_disable();
+    uint64_t time = now();
+    interrupts_restore(ints);
+    return (time);
+}
+
 uint32_t timer_getMilliseconds(void)
 {
-    return (((uint32_t)timer_ticks*1000)/systemfrequency);
+    return (scale(timer_getMicroseconds(), 4294968)); // 2^32/1000, rounded up
+}
+
+uint32_t timer_getSeconds(void)
+{
+    return (scale(timer_getMilliseconds(), 4294968));
 }
+
 uint64_t timer_getTicks(void)
 {
     return (timer_ticks);
@@ -39,36 +165,244 @@ uint32_t timer_millisecondsToTicks(uint32_t milliseconds)
     return ((milliseconds*systemfrequency)/1000);
 }
 
-void timer_handler(registers_t* r)
+
+/// Timer wheel. Interrupts have to be disabled.
+static uint32_t lowestBit(uint64_t bits, uint32_t from) // Index of the lowest bit set at or above from. WHEEL_SLOTS if there is none.
 {
-    ++timer_ticks;
+    if (from >= WHEEL_SLOTS)
+        return (WHEEL_SLOTS);
+    bits &= ~0ULL << from;
+
+    uint32_t index;
+    if ((uint32_t)bits)
+    {
+        __asm__("bsf %1, %0" : "=r"(index) : "rm"((uint32_t)bits));
+        return (index);
+    }
+    if (bits >> 32)
+    {
+        __asm__("bsf %1, %0" : "=r"(index) : "rm"((uint32_t)(bits >> 32)));
+        return (32 + index);
+    }
+    return (WHEEL_SLOTS);
 }
 
-void sleepSeconds(uint32_t seconds)
+static void wheelAdd(ktimer_t* timer)
 {
-    scheduler_blockCurrentTask(0, 0, 1000*seconds); // "abuse" timeout function
+    uint64_t unit = max(timer->expires >> WHEEL_RESOLUTION, wheelTime);
+    uint64_t delta = unit - wheelTime;
+
+    uint32_t level = 0;
+    while (level < WHEEL_LEVELS-1 && delta >= (1ULL << (WHEEL_SLOT_BITS*(level+1))))
+        level++;
+    if (delta >= (1ULL << (WHEEL_SLOT_BITS*WHEEL_LEVELS))) // Beyond the range of the wheel: Put it into the last slot, it is cascaded again later
+        unit = wheelTime + (1ULL << (WHEEL_SLOT_BITS*WHEEL_LEVELS)) - 1;
+
+    uint32_t index = (unit >> (WHEEL_SLOT_BITS*level)) & (WHEEL_SLOTS-1);
+    ktimer_t** slot = &wheel[level][index];
+
+    timer->slot = slot;
+    timer->prev = 0;
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->prev = timer;
+    *slot = timer;
+    occupied[level] |= 1ULL << index;
 }
 
-void sleepMilliSeconds(uint32_t ms)
+static void wheelRemove(ktimer_t* timer)
 {
-    scheduler_blockCurrentTask(0, 0, ms); // "abuse" timeout function
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    if (*timer->slot == 0)
+    {
+        uint32_t position = timer->slot - &wheel[0][0];
+        occupied[position / WHEEL_SLOTS] &= ~(1ULL << (position % WHEEL_SLOTS));
+    }
+    timer->slot = 0;
 }
 
-void timer_setFrequency(uint32_t freq)
+static void cascade(void) // Moves the timers of all higher level slots beginning at wheelTime down
+{
+    uint32_t levels = 1;
+    while (levels < WHEEL_LEVELS && (wheelTime & ((1ULL << (WHEEL_SLOT_BITS*levels)) - 1)) == 0)
+        levels++;
+
+    for (uint32_t level = levels-1; level > 0; level--)
+    {
+        uint32_t index = (wheelTime >> (WHEEL_SLOT_BITS*level)) & (WHEEL_SLOTS-1);
+        ktimer_t* timer = wheel[level][index];
+        wheel[level][index] = 0;
+        occupied[level] &= ~(1ULL << index);
+
+        while (timer)
+        {
+            ktimer_t* next = timer->next;
+            wheelAdd(timer);
+            timer = next;
+        }
+    }
+}
+
+static uint64_t wheelNextEvent(void) // Earliest deadline in microseconds, or the beginning of the next slot to be cascaded. ~0 if no timer is armed.
 {
-    systemfrequency  = freq;
-    uint16_t divisor = TIMECOUNTER_i8254_FREQU / systemfrequency; //divisor must fit into 16 bits; PIT (programable interrupt timer)
+    uint64_t next = ~0ULL;
+
+    for (uint32_t level = 0; level < WHEEL_LEVELS; level++)
+    {
+        uint32_t shift = WHEEL_SLOT_BITS*level;
+        uint64_t block = wheelTime >> shift;
+        uint32_t current = block & (WHEEL_SLOTS-1);
 
-    // Send the command byte
-    outportb(COMMANDREGISTER, COUNTER_0 | RW_HI_LO_MODE | RATEGENERATOR);
+        // Level 0: the current slot can contain timers that have not expired yet. Higher levels: the current slot has already been cascaded.
+        uint32_t index = lowestBit(occupied[level], level == 0 ? current : current+1);
+        if (index == WHEEL_SLOTS)
+        {
+            index = lowestBit(occupied[level], 0);
+            if (index == WHEEL_SLOTS)
+                continue;
+            block += WHEEL_SLOTS; // Slots below the current one belong to the next round
+        }
+        uint64_t deadline = ((block & ~(uint64_t)(WHEEL_SLOTS-1)) + index) << (shift + WHEEL_RESOLUTION);
 
-    // cf. http://wiki.osdev.org/Programmable_Interval_Timer
-    // Typically, OSes and BIOSes use mode 3 for PIT channel 0 to generate IRQ 0 timer ticks,
-    // but some use mode 2 (rate generator with frequency divider) instead, to gain frequency accuracy.
+        if (level == 0) // Exact deadline
+        {
+            deadline = ~0ULL;
+            for (ktimer_t* timer = wheel[0][index]; timer; timer = timer->next)
+                deadline = min(deadline, timer->expires);
+        }
+        next = min(next, deadline);
+    }
 
-    // Send divisor
-    outportb(COUNTER_0_DATAPORT, BYTE1(divisor));
-    outportb(COUNTER_0_DATAPORT, BYTE2(divisor));
+    return (next);
+}
+
+static void runSlot(ktimer_t** slot, uint64_t time)
+{
+    for (ktimer_t* timer = *slot; timer != 0;)
+    {
+        if (timer->expires <= time)
+        {
+            wheelRemove(timer);
+            if (timer->period) // Rearm before calling the callback, so that it can stop the timer
+            {
+                timer->expires += timer->period;
+                if (timer->expires <= time) // Missed periods are dropped
+                    timer->expires = time + timer->period;
+                wheelAdd(timer);
+            }
+            timer->callback(timer->data);
+            timer = *slot; // The callback might have changed the slot
+        }
+        else
+        {
+            timer = timer->next;
+        }
+    }
+}
+
+static void wheelRun(uint64_t time) // Calls the callbacks of all timers expired until time
+{
+    uint64_t unit = time >> WHEEL_RESOLUTION;
+
+    while (true)
+    {
+        if ((wheelTime & (WHEEL_SLOTS-1)) == 0)
+            cascade();
+        runSlot(&wheel[0][wheelTime & (WHEEL_SLOTS-1)], time);
+
+        if (wheelTime >= unit)
+            break;
+
+        // Skip empty slots
+        uint64_t next = wheelNextEvent() >> WHEEL_RESOLUTION;
+        wheelTime = max(wheelTime+1, min(next, unit));
+    }
+}
+
+static void programDevice(uint64_t time) // Programs the device to the next deadline. Interrupts have to be disabled.
+{
+    if (device == 0)
+        return;
+
+    uint64_t deadline = min(wheelNextEvent(), time + TIMER_MAX_SLEEP);
+    uint32_t delay = deadline > time + TIMER_MIN_DELAY ? deadline - time : TIMER_MIN_DELAY;
+    uint32_t cycles = max(1, min(((uint64_t)delay * cycleFactor) >> 16, device->maxCycles));
+
+    accumulate();
+    device->program(cycles);
+    programmed = time + delay;
+}
+
+
+/// Kernel timers
+void ktimer_init(ktimer_t* timer, void (*callback)(void*), void* data)
+{
+    timer->callback = callback;
+    timer->data     = data;
+    timer->period   = 0;
+    timer->slot     = 0;
+}
+
+void ktimer_start(ktimer_t* timer, uint64_t microseconds, uint32_t period)
+{
+    bool ints = interrupts_disable();
+
+    if (timer->slot)
+        wheelRemove(timer);
+
+    uint64_t time = now();
+    timer->expires = time + microseconds;
+    timer->period  = period;
+    wheelAdd(timer);
+
+    if (timer->expires < programmed) // New timer expires before the next interrupt
+        programDevice(time);
+
+    interrupts_restore(ints);
+}
+
+bool ktimer_stop(ktimer_t* timer)
+{
+    bool ints = interrupts_disable();
+    bool armed = timer->slot != 0;
+    if (armed)
+        wheelRemove(timer); // The device is not reprogrammed. The next interrupt might come too early, which does not harm.
+    interrupts_restore(ints);
+    return (armed);
+}
+
+
+/// Scheduler tick
+static void tick(void* data)
+{
+    ++timer_ticks;
+    scheduler_tick();
+}
+
+void timer_enableTick(bool enable)
+{
+    if (enable == (tickTimer.slot != 0))
+        return;
+
+    if (enable)
+        ktimer_start(&tickTimer, tickPeriod, tickPeriod);
+    else
+        ktimer_stop(&tickTimer);
+}
+
+void timer_setFrequency(uint32_t freq)
+{
+    systemfrequency = freq;
+    tickPeriod      = 1000000/freq;
+
+    if (tickTimer.slot)
+        ktimer_start(&tickTimer, tickPeriod, tickPeriod);
 }
 
 uint16_t timer_getFrequency(void)
@@ -76,6 +410,77 @@ uint16_t timer_getFrequency(void)
     return (systemfrequency);
 }
 
+
+/// Installation and interrupt
+void timer_install(uint16_t sysfreq)
+{
+    irq_installHandler(IRQ_TIMER, timer_handler); // Installs 'timer_handler' to IRQ_TIMER
+
+    bool ints = interrupts_disable();
+    useDevice(&pit);
+    programDevice(0);
+    interrupts_restore(ints);
+
+    ktimer_init(&tickTimer, &tick, 0);
+    timer_setFrequency(sysfreq); // x Hz, meaning a tick every 1000/x milliseconds
+    timer_enableTick(true);
+}
+
+bool timer_installLocalAPIC(void)
+{
+    bool ints = interrupts_disable();
+
+    if (!apic_timerInstall(32+IRQ_APIC_TIMER, &lapic.frequency) || lapic.frequency <= 1000000)
+    {
+        interrupts_restore(ints);
+        return (false);
+    }
+
+    irq_installHandler(IRQ_APIC_TIMER, timer_handler);
+    useDevice(&lapic);
+    outportb(PIC_MASTER_DATA, inportb(PIC_MASTER_DATA) | BIT(IRQ_TIMER)); // The PIT is not needed any more
+    programDevice(now());
+
+    interrupts_restore(ints);
+    return (true);
+}
+
+void timer_useGlobalDevice(void) // The local APIC timer can only be used by its own CPU. The PIT is shared by all CPUs.
+{
+    bool ints = interrupts_disable();
+
+    if (device == &lapic)
+    {
+        useDevice(&pit);            // Adds the time measured by the local APIC timer to the clock
+        apic_timerStart(0);
+        pit_program(pit.maxCycles); // Restart the PIT, so that it does not add the time since its last interrupt again
+        outportb(PIC_MASTER_DATA, inportb(PIC_MASTER_DATA) & ~BIT(IRQ_TIMER));
+        programDevice(now());
+    }
+
+    interrupts_restore(ints);
+}
+
+void timer_handler(registers_t* r)
+{
+    uint64_t time = now();
+    wheelRun(time);
+    programDevice(now());
+
+    if (device->acknowledge)
+        device->acknowledge();
+}
+
+void sleepSeconds(uint32_t seconds)
+{
+    scheduler_blockCurrentTask(BL_TIME, 0, 1000*seconds); // "abuse" timeout function
+}
+
+void sleepMilliSeconds(uint32_t ms)
+{
+    scheduler_blockCurrentTask(BL_TIME, 0, ms); // "abuse" timeout function
+}
+
 // delay in microseconds independent of timer interrupt but on rdtsc
 void delay(uint32_t microsec)
 {
@@ -4,18 +4,38 @@
 #include "irq.h"
 
 
-#define SYSTEMFREQUENCY 100
+#define SYSTEMFREQUENCY 100 // Scheduler ticks per second. The tick only runs while there are tasks to share the CPU.
+
+
+typedef struct ktimer
+{
+    uint64_t        expires;          // Deadline in microseconds since boot
+    uint32_t        period;           // Microseconds between two expirations of a periodic timer. 0 for one-shot timers
+    void          (*callback)(void*); // Called in interrupt context when the timer expires
+    void*           data;             // Parameter of callback
+    struct ktimer*  next;             // Links inside of the slot of the timer wheel
+    struct ktimer*  prev;
+    struct ktimer** slot;             // Slot of the timer wheel the timer is linked into. 0 if the timer is not armed
+} ktimer_t;
 
 
 void     timer_install(uint16_t sysfreq);
+bool     timer_installLocalAPIC(void); // Moves the timer interrupt from the PIT to the local APIC timer. Needs paging.
+void     timer_useGlobalDevice(void);  // Moves the timer interrupt back to the PIT, which can be used by all CPUs (smp.c)
 void     timer_handler(registers_t* r);
 void     timer_setFrequency(uint32_t freq);
 uint16_t timer_getFrequency(void);
+void     timer_enableTick(bool enable);
 uint32_t timer_getSeconds(void);
 uint32_t timer_getMilliseconds(void);
+uint64_t timer_getMicroseconds(void);
 uint64_t timer_getTicks(void);
 uint32_t timer_millisecondsToTicks(uint32_t milliseconds);
 
+void     ktimer_init(ktimer_t* timer, void (*callback)(void*), void* data);
+void     ktimer_start(ktimer_t* timer, uint64_t microseconds, uint32_t period); // (Re)arms the timer to expire after the given time, then every period microseconds if period is not 0
+bool     ktimer_stop(ktimer_t* timer);                                          // Returns false if the timer was not armed
+
 void sleepSeconds(uint32_t seconds);
 void sleepMilliSeconds(uint32_t ms);
 void delay(uint32_t microsec);
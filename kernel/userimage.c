@@ -0,0 +1,197 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "userimage.h"
+#include "util/util.h"
+#include "util/list.h"
+#include "kheap.h"
+#include "paging.h"
+
+/* A user image keeps the contents of an executable file in the kernel, as long as a process started from it is running.
+   The pages of its segments are not loaded when a program is started, but when they are touched for the first time
+   (cf. paging_handlePageFault). Pages that are only read are shared by all processes started from the same file.
+   Pages that are written get a private copy. Since shared pages are never written, a private copy can always be built
+   from the file again.
+
+   Images are found by the contents of the file, so a program is shared even if it has been started from different paths.
+   They are looked up by a hash of the file; the whole contents are only compared if hash and size match. A new image is
+   only cached after the executable has been prepared successfully, so an image without all of its segments is never shared. */
+
+
+static list_t* images = 0; // Cached images
+
+
+static uint32_t hashFile(const uint8_t* file, size_t size) // FNV-1a
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ file[i]) * 16777619u;
+    }
+    return (hash);
+}
+
+userImage_t* userImage_get(const void* file, size_t size)
+{
+    if (images == 0)
+    {
+        images = list_create();
+    }
+
+    uint32_t hash = hashFile(file, size);
+    for (dlelement_t* e = images->head; e != 0; e = e->next)
+    {
+        userImage_t* image = e->data;
+        if (image->hash == hash && image->size == size && memcmp(image->file, file, size) == 0)
+        {
+            image->refCount++;
+            return (image);
+        }
+    }
+
+    userImage_t* image = malloc(sizeof(userImage_t), 0, "userImage");
+    image->file         = malloc(size, 0, "userImage-file");
+    image->size         = size;
+    image->hash         = hash;
+    image->cached       = false;
+    image->refCount     = 1;
+    image->segments     = 0;
+    image->segmentCount = 0;
+    image->base         = 0;
+    image->pageCount    = 0;
+    image->frames       = 0;
+    memcpy(image->file, file, size);
+    return (image);
+}
+
+void userImage_cache(userImage_t* image)
+{
+    if (!image->cached)
+    {
+        image->cached = true;
+        list_append(images, image);
+    }
+}
+
+void userImage_addSegment(userImage_t* image, uintptr_t vaddr, size_t offset, size_t fileSize, size_t memSize)
+{
+    imageSegment_t* segments = malloc(sizeof(imageSegment_t)*(image->segmentCount+1), 0, "userImage-segments");
+    memcpy(segments, image->segments, sizeof(imageSegment_t)*image->segmentCount);
+    free(image->segments);
+    image->segments = segments;
+
+    imageSegment_t* segment = &image->segments[image->segmentCount++];
+    segment->vaddr    = vaddr;
+    segment->offset   = offset;
+    segment->fileSize = fileSize;
+    segment->memSize  = memSize;
+
+    // Extend the range of pages covered by the image
+    uintptr_t begin = alignDown(vaddr, PAGESIZE);
+    uintptr_t end   = alignUp(vaddr + memSize, PAGESIZE);
+    if (image->pageCount != 0)
+    {
+        end   = max(end, image->base + image->pageCount*PAGESIZE);
+        begin = min(begin, image->base);
+    }
+    image->base      = begin;
+    image->pageCount = (end - begin)/PAGESIZE;
+}
+
+void userImage_release(userImage_t* image)
+{
+    if (--image->refCount > 0)
+    {
+        return;
+    }
+
+    if (image->frames)
+    {
+        for (uint32_t i = 0; i < image->pageCount; i++)
+        {
+            if (image->frames[i])
+            {
+                paging_freeContiguous(image->frames[i], PAGESIZE);
+            }
+        }
+        free(image->frames);
+    }
+    if (image->cached)
+    {
+        list_delete(images, list_find(images, image));
+    }
+    free(image->segments);
+    free(image->file);
+    free(image);
+}
+
+bool userImage_containsData(const userImage_t* image, uintptr_t page)
+{
+    for (uint32_t i = 0; i < image->segmentCount; i++)
+    {
+        const imageSegment_t* segment = &image->segments[i];
+        if (segment->fileSize && segment->vaddr < page + PAGESIZE && segment->vaddr + segment->fileSize > page)
+        {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+void userImage_fillPage(const userImage_t* image, uintptr_t page, void* dest)
+{
+    memset(dest, 0, PAGESIZE);
+
+    // Copy the parts of all segments overlapping the page
+    for (uint32_t i = 0; i < image->segmentCount; i++)
+    {
+        const imageSegment_t* segment = &image->segments[i];
+        uintptr_t begin = max(segment->vaddr, page);
+        uintptr_t end   = min(segment->vaddr + segment->fileSize, page + PAGESIZE);
+        if (begin < end)
+        {
+            memcpy(dest + (begin - page), image->file + segment->offset + (begin - segment->vaddr), end - begin);
+        }
+    }
+}
+
+uint32_t* userImage_sharedFrame(userImage_t* image, uintptr_t page)
+{
+    if (image->frames == 0)
+    {
+        image->frames = malloc(image->pageCount*sizeof(uint32_t), 0, "userImage-frames");
+        memset(image->frames, 0, image->pageCount*sizeof(uint32_t));
+    }
+    return (&image->frames[(page - image->base)/PAGESIZE]);
+}
+
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
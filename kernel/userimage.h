@@ -0,0 +1,39 @@
+#ifndef USERIMAGE_H
+#define USERIMAGE_H
+
+#include "os.h"
+
+
+typedef struct
+{
+    uintptr_t vaddr;    // Virtual address of the segment
+    size_t    offset;   // Position of the segment's data in the file
+    size_t    fileSize; // Number of bytes taken from the file
+    size_t    memSize;  // Size of the segment in memory. The bytes behind fileSize are zero.
+} imageSegment_t;
+
+typedef struct userImage
+{
+    uint8_t*        file;         // Copy of the executable file. Pages are loaded from it when they are touched.
+    size_t          size;
+    uint32_t        hash;         // Of the file contents, to find the image without comparing whole files
+    bool            cached;       // Complete and found by userImage_get. Set by userImage_cache.
+    uint32_t        refCount;     // Number of page directories using this image
+    imageSegment_t* segments;
+    uint32_t        segmentCount;
+    uintptr_t       base;         // First page covered by the segments
+    uint32_t        pageCount;    // Number of pages from base to the end of the last segment
+    uint32_t*       frames;       // Physical addresses of the pages shared read-only by all users, 0 if not loaded yet
+} userImage_t;
+
+
+userImage_t* userImage_get(const void* file, size_t size);  // Returns the image of an executable file with an additional reference. A new image has no segments yet.
+void         userImage_addSegment(userImage_t* image, uintptr_t vaddr, size_t offset, size_t fileSize, size_t memSize);
+void         userImage_cache(userImage_t* image);           // Makes a new image available to userImage_get, after all of its segments have been added
+void         userImage_release(userImage_t* image);         // Drops a reference. The image and its shared frames are freed with the last one.
+bool         userImage_containsData(const userImage_t* image, uintptr_t page); // Returns whether the page contains data from the file, i.e. is not zero only
+void         userImage_fillPage(const userImage_t* image, uintptr_t page, void* dest); // Writes the contents of a page to dest
+uint32_t*    userImage_sharedFrame(userImage_t* image, uintptr_t page);         // Returns the slot storing the shared frame of a page
+
+
+#endif
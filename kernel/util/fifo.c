@@ -0,0 +1,217 @@
+/*
+*  license and disclaimer for the use of this source code as per statement below
+*  Lizenz und Haftungsausschluss fr die Verwendung dieses Sourcecodes siehe unten
+*/
+
+#include "fifo.h"
+#include "util.h"
+#include "kheap.h"
+#include "tasking/scheduler.h"
+
+/* Each slot carries a sequence number, which tells producers and the consumer whose turn it is (cf. D. Vyukov's bounded queue):
+   - sequence == position:     The slot is free for the producer that gets this position.
+   - sequence == position + 1: The slot has been filled and can be read by the consumer.
+   After reading, the consumer sets the sequence to position + number of slots, so the slot becomes free for the next round.
+
+   Producers claim positions by incrementing head with lock cmpxchg, so several interrupt handlers (on several CPUs) can put
+   elements at the same time. A fifo with only one producer claims positions without the locked instruction. The consumer is
+   always alone, so it reads and advances the tail without atomic operations. Neither side allocates memory or takes a lock,
+   so producers can run in interrupt handlers. Elements are copied into the slots (or filled in place via fifo_reserve). */
+
+
+typedef struct
+{
+    volatile uint32_t sequence;
+    uint32_t          length;
+    uint8_t           data[];
+} fifoSlot_t;
+
+
+static inline fifoSlot_t* slot(const fifo_t* fifo, uint32_t position)
+{
+    return ((fifoSlot_t*)(fifo->slots + (position & fifo->mask)*fifo->stride));
+}
+
+fifo_t* fifo_create(uint32_t slots, size_t slotSize, bool multiProducer)
+{
+    uint32_t count = 2;
+    while (count < slots)
+        count <<= 1;
+
+    fifo_t* fifo = malloc(sizeof(fifo_t), 0, "fifo");
+    fifo->slotSize      = slotSize;
+    fifo->stride        = alignUp(sizeof(fifoSlot_t) + slotSize, 8);
+    fifo->slots         = malloc(count*fifo->stride, 8, "fifo::slots");
+    fifo->mask          = count-1;
+    fifo->multiProducer = multiProducer;
+    fifo->head          = 0;
+    fifo->tail          = 0;
+    fifo->waiting       = false;
+    fifo->dropped       = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+        slot(fifo, i)->sequence = i;
+
+    return (fifo);
+}
+
+void fifo_delete(fifo_t* fifo)
+{
+    free(fifo->slots);
+    free(fifo);
+}
+
+static fifoSlot_t* reserve(fifo_t* fifo, size_t length)
+{
+    if (length > fifo->slotSize)
+    {
+        __sync_fetch_and_add(&fifo->dropped, 1);
+        return (0);
+    }
+
+    uint32_t position = fifo->head;
+    fifoSlot_t* s;
+    while (true)
+    {
+        s = slot(fifo, position);
+        int32_t diff = (int32_t)(s->sequence - position);
+        if (diff < 0) // The consumer has not yet read this slot: Full
+        {
+            __sync_fetch_and_add(&fifo->dropped, 1);
+            return (0);
+        }
+        if (diff == 0)
+        {
+            if (!fifo->multiProducer)
+            {
+                fifo->head = position+1;
+                break;
+            }
+            uint32_t old = __sync_val_compare_and_swap(&fifo->head, position, position+1);
+            if (old == position)
+                break;
+            position = old; // Another producer was faster
+        }
+        else
+            position = fifo->head; // Another producer has already filled this slot
+    }
+
+    s->length = length;
+    return (s);
+}
+
+static void commit(fifo_t* fifo, fifoSlot_t* s)
+{
+    __asm__ volatile("" : : : "memory"); // The content has to be written before the slot is marked. x86 does not reorder stores.
+    s->sequence++; // Equal to position+1 now: Ready for the consumer
+
+    if (fifo->waiting)
+    {
+        fifo->waiting = false;
+        scheduler_unblockEvent(BL_FIFO, fifo);
+    }
+}
+
+void* fifo_reserve(fifo_t* fifo, size_t length)
+{
+    fifoSlot_t* s = reserve(fifo, length);
+    return (s ? s->data : 0);
+}
+
+void fifo_commit(fifo_t* fifo, void* data)
+{
+    commit(fifo, (fifoSlot_t*)((uint8_t*)data - offsetof(fifoSlot_t, data)));
+}
+
+bool fifo_put(fifo_t* fifo, const void* data, size_t length)
+{
+    fifoSlot_t* s = reserve(fifo, length);
+    if (s == 0)
+        return (false);
+    memcpy(s->data, data, length);
+    commit(fifo, s);
+    return (true);
+}
+
+static fifoSlot_t* readable(const fifo_t* fifo) // Slot at the tail, if it is ready to be read
+{
+    fifoSlot_t* s = slot(fifo, fifo->tail);
+    return (s->sequence == fifo->tail+1 ? s : 0);
+}
+
+static void release(fifo_t* fifo, fifoSlot_t* s)
+{
+    __asm__ volatile("" : : : "memory"); // The content has to be read before the slot is given back
+    s->sequence = fifo->tail + fifo->mask + 1;
+    fifo->tail++;
+}
+
+size_t fifo_get(fifo_t* fifo, void* destination, size_t maxLength)
+{
+    fifoSlot_t* s = readable(fifo);
+    if (s == 0)
+        return (0);
+
+    size_t length = min(s->length, maxLength);
+    memcpy(destination, s->data, length);
+    release(fifo, s);
+    return (length);
+}
+
+uint32_t fifo_consume(fifo_t* fifo, uint32_t maxCount, void (*handler)(void*, size_t, void*), void* context)
+{
+    uint32_t count = 0;
+    for (fifoSlot_t* s; count < maxCount && (s = readable(fifo)) != 0; count++)
+    {
+        handler(s->data, s->length, context);
+        release(fifo, s);
+    }
+    return (count);
+}
+
+bool fifo_isEmpty(const fifo_t* fifo)
+{
+    return (readable(fifo) == 0);
+}
+
+void fifo_wait(fifo_t* fifo)
+{
+    // Interrupts are disabled, so a producer on this CPU cannot miss the waiting flag. Producers on other CPUs have to
+    // wait for the kernel lock.
+    bool ints = interrupts_disable();
+    while (fifo_isEmpty(fifo))
+    {
+        fifo->waiting = true;
+        scheduler_blockCurrentTask(BL_FIFO, fifo, 0);
+    }
+    interrupts_restore(ints);
+}
+
+
+/*
+* Copyright (c) 2009-2013 The PrettyOS Project. All rights reserved.
+*
+* http://www.c-plusplus.de/forum/viewforum-var-f-is-62.html
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+* PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
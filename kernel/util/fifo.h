@@ -0,0 +1,33 @@
+#ifndef FIFO_H
+#define FIFO_H
+
+#include "os.h"
+
+
+// Lock-free ring buffer with fixed-size slots. Any number of producers (interrupt handlers) and a single consumer (task).
+typedef struct
+{
+    uint8_t*          slots;
+    size_t            slotSize;      // Maximum length of an element
+    size_t            stride;        // Distance between two slots
+    uint32_t          mask;          // Number of slots - 1
+    bool              multiProducer; // false: Only one producer, it does not need atomic operations
+    volatile uint32_t head;          // Next position given to a producer
+    uint32_t          tail;          // Next position read by the consumer
+    volatile bool     waiting;       // The consumer sleeps in fifo_wait
+    volatile uint32_t dropped;       // Elements rejected because the fifo was full or they were too long
+} fifo_t;
+
+
+fifo_t* fifo_create(uint32_t slots, size_t slotSize, bool multiProducer); // slots is rounded up to a power of two
+void    fifo_delete(fifo_t* fifo);
+void*   fifo_reserve(fifo_t* fifo, size_t length);  // Producer: Claims a slot that can be filled in place. 0 if the fifo is full.
+void    fifo_commit(fifo_t* fifo, void* data);      // Producer: Hands the filled slot to the consumer
+bool    fifo_put(fifo_t* fifo, const void* data, size_t length); // Producer: Copies the data into a slot
+size_t  fifo_get(fifo_t* fifo, void* destination, size_t maxLength); // Consumer: Takes one element. Returns its length, 0 if the fifo is empty.
+uint32_t fifo_consume(fifo_t* fifo, uint32_t maxCount, void (*handler)(void* data, size_t length, void* context), void* context); // Consumer: Passes up to maxCount elements to handler in place, returns their number
+bool    fifo_isEmpty(const fifo_t* fifo);
+void    fifo_wait(fifo_t* fifo);                    // Consumer: Blocks until the fifo is not empty
+
+
+#endif
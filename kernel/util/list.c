@@ -6,22 +6,38 @@
 #include "list.h"
 #include "util.h"
 #include "kheap.h"
+#include "objcache.h"
 
 
+static objCache_t* listCache;    // Empty lists
+static objCache_t* elementCache; // Elements are completely written when they are inserted, so they need no constructor
+
+static void list_construct(void* object)
+{
+    list_t* list = object;
+    list->head = 0;
+    list->tail = 0;
+}
+
+void list_install(void)
+{
+    listCache    = objCache_create("listHead", sizeof(list_t), &list_construct);
+    elementCache = objCache_create("listElement", sizeof(dlelement_t), 0);
+}
+
+static dlelement_t* list_allocElement(void)
+{
+    return (objCache_alloc(elementCache));
+}
+
 list_t* list_create(void)
 {
-    list_t* list = malloc(sizeof(list_t), 0, "listHead");
-    if (list)
-    {
-        list->head = 0;
-        list->tail = 0;
-    }
-    return (list);
+    return (objCache_alloc(listCache));
 }
 
 dlelement_t* list_append(list_t* list, void* data)
 {
-    dlelement_t* newElement = malloc(sizeof(dlelement_t), 0, "listElement");
+    dlelement_t* newElement = list_allocElement();
     if (newElement)
     {
         newElement->data = data;
@@ -49,7 +65,7 @@ dlelement_t* list_insert(list_t* list, dlelement_t* next, void* data)
         return (list_append(list, data));
     }
 
-    dlelement_t* newElement = malloc(sizeof(dlelement_t), 0, "listElement");
+    dlelement_t* newElement = list_allocElement();
     if (newElement)
     {
         newElement->data = data;
@@ -84,7 +100,7 @@ dlelement_t* list_delete(list_t* list, dlelement_t* elem)
 
     if (list->head == list->tail)
     {
-        free(elem);
+        objCache_free(elementCache, elem);
         list->head = list->tail = 0;
         return (0);
     }
@@ -107,7 +123,7 @@ dlelement_t* list_delete(list_t* list, dlelement_t* elem)
         elem->next->prev = elem->prev;
     }
 
-    free(elem);
+    objCache_free(elementCache, elem);
 
     return temp;
 }
@@ -120,11 +136,13 @@ void list_free(list_t* list)
     while (cur)
     {
         nex=cur->next;
-        free(cur);
+        objCache_free(elementCache, cur);
         cur=nex;
     }
 
-    free(list);
+    list->head = 0; // Return it empty, as the constructor left it
+    list->tail = 0;
+    objCache_free(listCache, list);
 }
 
 dlelement_t* list_getElement(list_t* list, uint32_t number)
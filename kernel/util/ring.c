@@ -6,14 +6,28 @@
 #include "ring.h"
 #include "util.h"
 #include "kheap.h"
+#include "objcache.h"
 
 
-ring_t* ring_create(void)
+static objCache_t* ringCache;    // Empty rings
+static objCache_t* elementCache; // Elements are completely written when they are put in, so they need no constructor
+
+static void ring_construct(void* object)
 {
-    ring_t* ring  = malloc(sizeof(ring_t), 0, "ring");
+    ring_t* ring  = object;
     ring->current = 0;
     ring->begin   = 0;
-    return (ring);
+}
+
+void ring_install(void)
+{
+    ringCache    = objCache_create("ring", sizeof(ring_t), &ring_construct);
+    elementCache = objCache_create("ring-element", sizeof(slelement_t), 0);
+}
+
+ring_t* ring_create(void)
+{
+    return (objCache_alloc(ringCache));
 }
 
 static void putIn(ring_t* ring, slelement_t* prev, slelement_t* elem)
@@ -64,7 +78,7 @@ bool ring_insert(ring_t* ring, void* data, bool single)
         }
         while (current != ring->current);
     }
-    slelement_t* item = malloc(sizeof(slelement_t), 0, "ring-element");
+    slelement_t* item = objCache_alloc(elementCache);
     if (item)
     {
         item->data = data;
@@ -92,7 +106,7 @@ bool ring_deleteFirst(ring_t* ring, void* data)
         {
             slelement_t* temp = current->next;
             takeOut(ring, current);
-            free(temp);
+            objCache_free(elementCache, temp);
             return (true);
         }
         current = current->next;
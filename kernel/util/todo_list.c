@@ -5,45 +5,92 @@
 
 #include "todo_list.h"
 #include "kheap.h"
+#include "objcache.h"
 #include "util.h"
 #include "tasking/scheduler.h"
 #include "timer.h"
 
 
+#define TODOLIST_INLINE_DATA 16 // Payloads up to this size are stored in the task itself
+
+
 typedef struct
 {
     void*      data;
     size_t     length;
     void     (*function)(void*, size_t);
-    uint32_t   timeToExecute;
+    uint64_t   timeToExecute;
+    uint8_t    inlineData[TODOLIST_INLINE_DATA];
 } todoList_task_t;
 
 
+static objCache_t* taskCache; // Exercises with data pointing to their inline buffer
+
+
+static void todoList_constructTask(void* object)
+{
+    todoList_task_t* task = object;
+    task->data = task->inlineData;
+}
+
+static void todoList_freeTask(todoList_task_t* task)
+{
+    if (task->data != task->inlineData)
+    {
+        free(task->data);
+        task->data = task->inlineData;
+    }
+    objCache_free(taskCache, task);
+}
+
+
+static void todoList_wakeUp(void* data) // Timer callback: a delayed exercise became due
+{
+    scheduler_unblockEvent(BL_TODOLIST, data);
+}
+
+
+void todoList_install(void)
+{
+    taskCache = objCache_create("todoList_task_t", sizeof(todoList_task_t), &todoList_constructTask);
+}
+
 todoList_t* todolist_create(void)
 {
     todoList_t* list = malloc(sizeof(todoList_t), 0, "todoList");
     list->queue = list_create();
+    ktimer_init(&list->timer, &todoList_wakeUp, list);
+    list->executed   = 0;
+    list->latency    = 0;
+    list->maxLatency = 0;
     return (list);
 }
 
-void todoList_add(todoList_t* list, void (*function)(void*, size_t), void* data, size_t length, uint32_t executionTime)
+void todoList_add(todoList_t* list, void (*function)(void*, size_t), void* data, size_t length, uint64_t executionTime)
 {
-    todoList_task_t* task = malloc(sizeof(todoList_task_t), 0, "todoList_task_t");
+    todoList_task_t* task = objCache_alloc(taskCache);
 
-    if (length != 0)
+    if (length > TODOLIST_INLINE_DATA)
     {
         task->data = malloc(length, 0, "todoList_task_t::data");
     }
-    else
-    {
-        task->data = 0;
-    }
+
+    uint64_t now = timer_getMicroseconds();
 
     memcpy(task->data, data, length);
     task->length = length;
-    task->timeToExecute = executionTime;
+    task->timeToExecute = max(executionTime, now); // Exercises for immediate execution are due from now on, so their latency can be measured
     task->function = function;
     list_append(list->queue, task);
+
+    if (executionTime <= now)
+    {
+        scheduler_unblockEvent(BL_TODOLIST, list); // Wake up tasks waiting in todoList_wait
+    }
+    else if (list->timer.slot == 0 || executionTime < list->timer.expires)
+    {
+        ktimer_start(&list->timer, executionTime - now, 0); // Wake them up when the exercise becomes due
+    }
 }
 
 void todoList_execute(todoList_t* list)
@@ -52,11 +99,16 @@ void todoList_execute(todoList_t* list)
     {
         todoList_task_t* task = e->data;
 
-        if (task->timeToExecute == 0 || task->timeToExecute < timer_getMilliseconds())
+        uint64_t now = timer_getMicroseconds();
+        if (task->timeToExecute <= now)
         {
+            uint32_t latency = min(now - task->timeToExecute, 0xFFFFFFFF);
+            list->executed++;
+            list->latency += latency;
+            list->maxLatency = max(list->maxLatency, latency);
+
             task->function(task->data, task->length);
-            free(task->data);
-            free(task);
+            todoList_freeTask(task);
             e = list_delete(list->queue, e);
         }
         else
@@ -64,6 +116,21 @@ void todoList_execute(todoList_t* list)
             e = e->next;
         }
     }
+
+    // The timer is armed for the earliest exercise only, so it has to be armed again for the earliest one still waiting.
+    // Exercises that became due in between are found by todoList_unlockTask before the caller waits again.
+    uint64_t next = 0;
+    for (dlelement_t* e = list->queue->head; e != 0; e = e->next)
+    {
+        uint64_t time = ((todoList_task_t*)e->data)->timeToExecute;
+        if (next == 0 || time < next)
+            next = time;
+    }
+    uint64_t now = timer_getMicroseconds();
+    if (next > now && (list->timer.slot == 0 || next < list->timer.expires))
+    {
+        ktimer_start(&list->timer, next - now, 0);
+    }
 }
 
 void todoList_wait(todoList_t* list)
@@ -73,11 +140,22 @@ void todoList_wait(todoList_t* list)
 
 bool todoList_unlockTask(void* data)
 {
-    return (((todoList_t*)data)->queue->head != 0);
+    uint64_t now = timer_getMicroseconds();
+    for (dlelement_t* e = ((todoList_t*)data)->queue->head; e != 0; e = e->next)
+    {
+        if (((todoList_task_t*)e->data)->timeToExecute <= now)
+            return (true);
+    }
+    return (false);
 }
 
 void todolist_delete(todoList_t* list)
 {
+    ktimer_stop(&list->timer);
+    for (dlelement_t* e = list->queue->head; e != 0; e = e->next)
+    {
+        todoList_freeTask(e->data);
+    }
     list_free(list->queue);
     free(list);
 }
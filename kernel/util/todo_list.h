@@ -2,19 +2,27 @@
 #define EVENT_LIST_H
 
 #include "list.h"
+#include "timer.h"
 
 
 typedef struct todoList
 {
-    list_t* queue;
+    list_t*  queue;
+    ktimer_t timer; // Wakes up waiting tasks when the earliest delayed exercise becomes due
+
+    // Statistics
+    uint32_t executed;   // Number of exercises executed
+    uint64_t latency;    // Sum of the delays between due time and execution in microseconds
+    uint32_t maxLatency; // Largest delay in microseconds
 } todoList_t;
 
 
+void todoList_install(void);                                 // Creates the cache for exercises
 todoList_t* todolist_create(void);                           // Allocates memory for a todoList_t and initializes it
-void todoList_add(todoList_t* list, void (*function)(void*, size_t), void* data, size_t length, uint32_t executionTime); // Takes a functionpointer
+void todoList_add(todoList_t* list, void (*function)(void*, size_t), void* data, size_t length, uint64_t executionTime); // Takes a functionpointer. executionTime: microseconds since boot (timer_getMicroseconds), 0 for immediately
 void todoList_execute(todoList_t* list);                 // Executes the content of the queue and clears the queue
 void todoList_wait(todoList_t* list);                    // Waits (using scheduler) until there is something to do
-bool todoList_unlockTask(void* task);                    // Used for scheduler. Returns true if there are exercises in the list that blocks the task
+bool todoList_unlockTask(void* task);                    // Used for scheduler. Returns true if there are exercises due in the list that blocks the task
 void todolist_delete(todoList_t* list);                  // Frees memory of a todoList_t
 
 
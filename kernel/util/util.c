@@ -10,6 +10,11 @@
 #include "power_management.h"
 #include "keyboard.h"
 #include "tasking/task.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "memory.h"
+#include "kheap.h"
+#include "storage/devicemanager.h"
 
 
 const int32_t INT_MAX = 2147483647;
@@ -44,27 +49,142 @@ void memshow(const void* start, size_t count, bool alpha)
     }
 }
 
-void* memcpy(void* dest, const void* src, size_t bytes)
+/* The copy and fill functions choose their method by size and CPU features (selected by mem_install):
+   - Up to MEM_SMALL bytes, dwords are moved from both ends without string instructions, whose startup costs dominate small sizes.
+   - With ERMS (Enhanced REP MOVSB/STOSB), rep movsb/stosb is the fastest method for all other sizes.
+   - Otherwise rep movsl/stosl is used for the dwords and rep movsb/stosb for the remaining bytes.
+   - Large copies within kernel memory (e.g. to the framebuffer) are done by SSE2 with non-temporal stores, which bypass the caches.
+     Each chunk is copied in a kernel_fpu_begin/end section (interrupts disabled), which saves the state of the task owning the FPU. */
+#define MEM_SMALL    32      // Sizes handled without string instructions
+#define MEM_NT_MIN   0x10000 // Minimum size of copies using non-temporal stores
+#define MEM_NT_CHUNK 0x10000 // Maximum size copied with interrupts disabled
+
+static bool erms = false;
+static bool sse2 = false;
+
+void mem_install(void)
 {
-    size_t dwords = bytes/4;
-    bytes %= 4;
-    __asm__ volatile("cld\n" "rep movsl" : : "S" (src), "D" (dest), "c" (dwords));
-    __asm__ volatile("rep movsb" : : "c" (bytes));
-    return (dest);
+    erms = cpu_supports(CF_ERMS);
+    sse2 = cpu_supports(CF_SSE2) && cpu_supports(CF_FXSR); // cpu_install enables OSFXSR, if FXSR is supported
 }
 
-void* memcpyr(void* dest, const void* src, size_t bytes)
+typedef uint32_t __attribute__((may_alias)) aliasedDword_t;
+
+// Copies n to 2*n bytes (n: 4, 8 or 16) by moving n bytes from the beginning and n bytes from the end.
+// All data is loaded before it is stored, so the source and destination may overlap.
+static inline void copyEnds(uint8_t* dest, const uint8_t* src, size_t bytes, size_t n)
 {
-    // Calculate starting addresses
-    void* temp = dest+bytes-1;
-    src += bytes-1;
+    const aliasedDword_t* s1 = (const aliasedDword_t*)src;
+    const aliasedDword_t* s2 = (const aliasedDword_t*)(src + bytes - n);
+    uint32_t head[4], tail[4];
+    for (size_t i = 0; i < n/4; i++)
+    {
+        head[i] = s1[i];
+        tail[i] = s2[i];
+    }
 
-    size_t dwords = bytes/4;
-    bytes %= 4;
+    aliasedDword_t* d1 = (aliasedDword_t*)dest;
+    aliasedDword_t* d2 = (aliasedDword_t*)(dest + bytes - n);
+    for (size_t i = 0; i < n/4; i++)
+    {
+        d1[i] = head[i];
+        d2[i] = tail[i];
+    }
+}
 
-    __asm__ volatile("std\n" "rep movsb"         : : "S" (src), "D" (temp), "c" (bytes));
-    __asm__ volatile("sub $3, %edi\n" "sub $3, %esi");
-    __asm__ volatile("rep movsl\n" "cld" : : "c" (dwords));
+static inline void memcpy_small(uint8_t* dest, const uint8_t* src, size_t bytes)
+{
+    if (bytes >= 16)
+        copyEnds(dest, src, bytes, 16);
+    else if (bytes >= 8)
+        copyEnds(dest, src, bytes, 8);
+    else if (bytes >= 4)
+        copyEnds(dest, src, bytes, 4);
+    else if (bytes)
+    {
+        uint8_t first = src[0], middle = src[bytes/2], last = src[bytes-1];
+        dest[0] = first;
+        dest[bytes/2] = middle;
+        dest[bytes-1] = last;
+    }
+}
+
+static inline void memcpy_rep(void* dest, const void* src, size_t bytes)
+{
+    if (erms)
+    {
+        __asm__ volatile("cld\n" "rep movsb" : "+D"(dest), "+S"(src), "+c"(bytes) : : "memory");
+    }
+    else
+    {
+        size_t dwords = bytes/4;
+        __asm__ volatile("cld\n" "rep movsl\n" "mov %3, %%ecx\n" "rep movsb" : "+D"(dest), "+S"(src), "+c"(dwords) : "r"(bytes%4) : "memory");
+    }
+}
+
+// Copies a multiple of 64 bytes to a 16 byte aligned destination
+static void memcpy_nt(uint8_t* dest, const uint8_t* src, size_t bytes)
+{
+    while (bytes)
+    {
+        size_t chunk = min(bytes, MEM_NT_CHUNK);
+        bytes -= chunk;
+
+        bool ints = kernel_fpu_begin();
+        __asm__ volatile("1:\n"
+                         "movdqu   (%1), %%xmm0\n"
+                         "movdqu 16(%1), %%xmm1\n"
+                         "movdqu 32(%1), %%xmm2\n"
+                         "movdqu 48(%1), %%xmm3\n"
+                         "movntdq %%xmm0,   (%0)\n"
+                         "movntdq %%xmm1, 16(%0)\n"
+                         "movntdq %%xmm2, 32(%0)\n"
+                         "movntdq %%xmm3, 48(%0)\n"
+                         "add $64, %1\n"
+                         "add $64, %0\n"
+                         "sub $64, %2\n"
+                         "jnz 1b\n"
+                         "sfence"
+                         : "+r"(dest), "+r"(src), "+r"(chunk) : : "memory", "cc");
+        kernel_fpu_end(ints);
+    }
+}
+
+void* memcpy(void* dest, const void* src, size_t bytes)
+{
+    if (bytes <= MEM_SMALL)
+    {
+        memcpy_small(dest, src, bytes);
+    }
+    else if (sse2 && bytes >= MEM_NT_MIN && (uintptr_t)dest >= PCI_MEM_START && (uintptr_t)src >= PCI_MEM_START) // Kernel memory does not cause page faults
+    {
+        size_t head = (16 - (uintptr_t)dest%16) % 16;
+        size_t body = (bytes - head) & ~63;
+        memcpy_rep(dest, src, head);
+        memcpy_nt(dest + head, src + head, body);
+        memcpy_rep(dest + head + body, src + head + body, bytes - head - body);
+    }
+    else
+    {
+        memcpy_rep(dest, src, bytes);
+    }
+    return (dest);
+}
+
+static void* memcpyr(void* dest, const void* src, size_t bytes)
+{
+    // Copy backwards: First the bytes behind the last complete dword, then the dwords
+    void* d = dest + bytes - 1;
+    src += bytes - 1;
+    size_t rest = bytes%4;
+    __asm__ volatile("std\n"
+                     "rep movsb\n"
+                     "sub $3, %%esi\n"
+                     "sub $3, %%edi\n"
+                     "mov %3, %%ecx\n"
+                     "rep movsl\n"
+                     "cld"
+                     : "+D"(d), "+S"(src), "+c"(rest) : "r"(bytes/4) : "memory");
     return (dest);
 }
 
@@ -112,28 +232,102 @@ void* memmove(void* destination, const void* source, size_t size)
 
 void* memset(void* dest, int8_t val, size_t bytes)
 {
-    size_t dwords = bytes/4; // Number of dwords (4 Byte blocks) to be written
-    bytes %= 4;              // Remaining bytes
-    uint32_t dval = (val<<24)|(val<<16)|(val<<8)|val; // Create dword from byte value
-    __asm__ volatile("cld\n" "rep stosl" : : "D"(dest), "a"(dval), "c" (dwords));
-    __asm__ volatile("rep stosb" : : "a"(val), "c" (bytes));
-    return dest;
+    uint32_t dval = 0x01010101 * (uint8_t)val; // Create dword from byte value
+    if (bytes <= MEM_SMALL)
+    {
+        if (bytes >= 4)
+        {
+            // Dwords from both ends. The ranges may overlap.
+            aliasedDword_t* d1 = dest;
+            aliasedDword_t* d2 = dest + bytes - 4;
+            for (size_t i = 0; i < (bytes+7)/8; i++)
+                d1[i] = d2[-(int32_t)i] = dval;
+        }
+        else if (bytes)
+        {
+            uint8_t* d = dest;
+            d[0] = d[bytes/2] = d[bytes-1] = val;
+        }
+    }
+    else if (erms)
+    {
+        void* d = dest;
+        __asm__ volatile("cld\n" "rep stosb" : "+D"(d), "+c"(bytes) : "a"(dval) : "memory");
+    }
+    else
+    {
+        void* d = dest;
+        size_t dwords = bytes/4;
+        __asm__ volatile("cld\n" "rep stosl\n" "mov %3, %%ecx\n" "rep stosb" : "+D"(d), "+c"(dwords) : "a"(dval), "r"(bytes%4) : "memory");
+    }
+    return (dest);
 }
 
 uint16_t* memsetw(uint16_t* dest, uint16_t val, size_t words)
 {
-    size_t dwords = words/2; // Number of dwords (4 Byte blocks) to be written
-    words %= 2;              // Remaining words
-    uint32_t dval = (val<<16)|val; // Create dword from byte value
-    __asm__ volatile("cld\n" "rep stosl" : : "D"(dest), "ea"(dval), "c" (dwords));
-    __asm__ volatile("rep stosw" : : "a"(val), "c" (words));
-    return dest;
+    uint32_t dval = (val<<16)|val; // Create dword from word value
+    void* d = dest;
+    size_t dwords = words/2;
+    __asm__ volatile("cld\n" "rep stosl\n" "mov %3, %%ecx\n" "rep stosw" : "+D"(d), "+c"(dwords) : "a"(dval), "r"(words%2) : "memory");
+    return (dest);
 }
 
 uint32_t* memsetl(uint32_t* dest, uint32_t val, size_t dwords)
 {
-    __asm__("cld\n" "rep stosl" : : "D"(dest), "a"(val), "c" (dwords));
-    return dest;
+    void* d = dest;
+    __asm__ volatile("cld\n" "rep stosl" : "+D"(d), "+c"(dwords) : "a"(val) : "memory");
+    return (dest);
+}
+
+// Executes memcpy (or memset, if src is 0) repeatedly for 100 ms, returns the throughput in MiB/s
+static uint32_t mem_measure(void* dest, const void* src, size_t size)
+{
+    uint32_t start = timer_getMilliseconds();
+    while (timer_getMilliseconds() == start); // Wait for the beginning of the next tick
+    start = timer_getMilliseconds();
+
+    uint64_t bytes = 0;
+    uint32_t elapsed;
+    do
+    {
+        for (uint32_t i = 0; i < 16; i++)
+        {
+            if (src)
+                memcpy(dest, src, size);
+            else
+                memset(dest, (int8_t)i, size);
+        }
+        bytes += 16*size;
+        elapsed = timer_getMilliseconds() - start;
+    } while (elapsed < 100);
+
+    return ((uint32_t)(bytes >> 10) / elapsed * 1000 / 1024); // KiB/ms -> MiB/s
+}
+
+void mem_benchmark(void)
+{
+    static const uint32_t sizes[] = {8, 32, 64, 256, 1024, 4096, 0x10000, 0x100000};
+    const uint32_t maxSize = sizes[sizeof(sizes)/sizeof(*sizes)-1];
+
+    uint8_t* buffer = malloc(2*maxSize + 16, 16, "mem_benchmark");
+    if (!buffer)
+        return;
+
+    textColor(HEADLINE);
+    printf("\nmemcpy/memset throughput (MiB/s). ERMS: %s, SSE2: %s", erms ? "yes" : "no", sse2 ? "yes" : "no");
+    textColor(TABLE_HEADING);
+    printf("\nsize\t\tmemcpy\tunaligned\tmemset");
+    textColor(TEXT);
+    for (uint32_t i = 0; i < sizeof(sizes)/sizeof(*sizes); i++)
+    {
+        printf("\n%u\t\t", sizes[i]);
+        printf("%u\t", mem_measure(buffer, buffer + maxSize + 16, sizes[i]));
+        printf("%u\t\t", mem_measure(buffer + 1, buffer + maxSize + 3, sizes[i]));
+        printf("%u", mem_measure(buffer, 0, sizes[i]));
+    }
+    putch('\n');
+
+    free(buffer);
 }
 
 int32_t memcmp(const void* s1, const void* s2, size_t n)
@@ -561,10 +755,12 @@ void systemControl(SYSTEM_CONTROL todo) // TODO: Improve it.
                 puts("Standby failed");
             break;
         case REBOOT:
+            devicemanager_flushCaches(0); // Dirty blocks of the block cache would be lost
             if (!powmgmt_action(PM_REBOOT))
                 puts("Rebooting failed");
             break;
         case SHUTDOWN:
+            devicemanager_flushCaches(0);
             if (!powmgmt_action(PM_SOFTOFF))
                 puts("Shutdown failed");
             break;
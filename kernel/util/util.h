@@ -27,6 +27,7 @@
 #define getField(addr, byte, shift, len) ((((uint8_t*)(addr))[byte]>>(shift)) & (BIT(len)-1))
 
 #define ASSERT(b) ((b) ? (void)0 : panic_assert(__FILE__, __LINE__, #b))
+#define STATIC_ASSERT(b) _Static_assert(b, #b) // Checked by the compiler. Can be used outside of functions.
 void panic_assert(const char* file, uint32_t line, const char* desc);
 
 #define CLEAR_BIT(val, bit) __asm__("btr %1, %0" : "+r"(val) : "r"(bit))
@@ -37,6 +38,17 @@ static inline void nop(void) { __asm__ volatile ("nop"); } // Do nothing
 static inline void hlt(void) { __asm__ volatile ("hlt"); } // Wait until next interrupt
 static inline void sti(void) { __asm__ volatile ("sti"); } // Enable interrupts
 static inline void cli(void) { __asm__ volatile ("cli"); } // Disable interrupts
+static inline bool interrupts_disable(void) // Disables interrupts, returns whether they were enabled before
+{
+    uint32_t eflags;
+    __asm__ volatile ("pushfl\n" "pop %0\n" "cli" : "=r"(eflags) : : "memory");
+    return (eflags & BIT(9));
+}
+static inline void interrupts_restore(bool enabled) // Enables interrupts again if they were enabled before interrupts_disable
+{
+    if (enabled)
+        __asm__ volatile ("sti" : : : "memory");
+}
 static inline uint64_t rdtsc(void)
 {
     uint64_t val;
@@ -96,6 +108,8 @@ static inline uint32_t alignDown(uint32_t val, uint32_t alignment)
 }
 
 void      memshow(const void* start, size_t count, bool alpha);
+void      mem_install(void);   // Selects the methods of memcpy and memset depending on the CPU
+void      mem_benchmark(void); // Shows the throughput of memcpy and memset for several sizes
 void*     memset(void* dest, int8_t val, size_t bytes);
 uint16_t* memsetw(uint16_t* dest, uint16_t val, size_t words);
 uint32_t* memsetl(uint32_t* dest, uint32_t val, size_t dwords);
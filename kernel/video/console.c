@@ -43,7 +43,7 @@ inline void textColor(uint8_t color) // bit 0-3: foreground bit 4-7: background
 void kernel_console_init(void)
 {
     kernelConsole.tasks = list_create();
-    kernelConsole.mutex = mutex_create();
+    kernelConsole.mutex = mutex_create("kernel console");
     memset(kernelConsole.vidmem, 0, COLUMNS * LINES * sizeof(uint16_t));
 
     reachableConsoles[KERNELCONSOLE_ID] = &kernelConsole;
@@ -59,7 +59,7 @@ void console_init(console_t* console, const char* name)
     console->scrollEnd   = USER_END-USER_BEGIN;
     console->properties  = CONSOLE_AUTOREFRESH|CONSOLE_AUTOSCROLL;
     console->tasks       = list_create();
-    console->mutex       = mutex_create();
+    console->mutex       = mutex_create("console");
     strcpy(console->name, name);
     memset(console->vidmem, 0, COLUMNS * LINES * 2);
 
@@ -26,7 +26,7 @@ static mutex_t* videoLock = 0;
 
 bool vga_install(void)
 {
-    videoLock = mutex_create();
+    videoLock = mutex_create("video");
     vidmem = paging_acquirePciMemory(VIDEORAM, 2);
     return(vidmem != 0);
 }
@@ -22,6 +22,7 @@ int fclose(FILE* file); // -> Syscall
 int remove(const char* path); /// TODO
 int rename(const char* oldpath, const char* newpath); /// TODO
 int fputc(char c, FILE* file); // -> Syscall
+void fputchars(const char* src, size_t length, FILE* file); // -> Userlib
 int putc(char c, FILE* file)
 {
     return(fputc(c, file));
@@ -35,8 +36,7 @@ int ungetc(char c, FILE* file); /// TODO
 char* fgets(char* dest, size_t num, FILE* file); /// TODO
 int fputs(const char* src, FILE* file)
 {
-    for(; *src; src++)
-        fputc(*src, file);
+    fputchars(src, strlen(src), file);
     fputc('\n', file);
     return(0);
 }
@@ -48,8 +48,7 @@ size_t fread(void* dest, size_t size, size_t count, FILE* file)
 }
 size_t fwrite(const void* src, size_t size, size_t count, FILE* file)
 {
-    for (size_t i = 0; i < count*size; i++)
-        fputc(((uint8_t*)src)[i], file);
+    fputchars(src, count*size, file);
     return (count*size);
 }
 int fflush(FILE* file); // -> Syscall
@@ -111,12 +110,10 @@ char* gets(char* str)
 int vscanf(const char* format, va_list arg); /// TODO
 int scanf(const char* format, ...); /// TODO
 int putchar(char c); // -> Syscall
+void putchars(const char* str, size_t length); // -> Userlib
 int puts(const char* str)
 {
-    for (size_t i = 0; str[i] != 0; i++)
-    {
-        putchar(str[i]);
-    }
+    putchars(str, strlen(str));
     return (0);
 }
 
@@ -12,6 +12,7 @@ extern void (**_at_quick_exit_funcs)(); // -> syscalls.c
 
 
 void* userheapAlloc(size_t increase); // -> Syscall, Userlib
+bool userheapFree(size_t decrease); // -> Syscall, Userlib
 void exitProcess(void); // -> Syscall, Userlib
 
 
@@ -117,49 +118,270 @@ double random(double lower, double upper)
     return (( (double) rand() / ((double)RAND_MAX / (upper - lower))) + lower );
 }
 
-void* malloc(size_t size)
+/* Heap
+   The heap is a contiguous area growing with userheapAlloc. It is divided into blocks, each starting with a header that
+   stores its size and the size of the block in front of it, so free neighbours can be merged in both directions.
+   Headers are placed at addresses 8 bytes before a 16 byte border, so all returned pointers are 16 byte aligned.
+   A header with size 0 marks the end of the heap.
+   Free blocks are kept in lists sorted by size classes: Classes of 16 bytes up to 1 KiB, and powers of two above.
+   If there is much free memory at the end of the heap, it is given back to the kernel with userheapFree. */
+
+#define HEAP_ALIGNMENT  16
+#define HEAP_MINGROWTH  0x10000   // Grow by at least 64 KiB
+#define HEAP_TRIM       0x20000   // Give back memory, if at least 128 KiB are free at the end of the heap
+#define HEAP_SMALLBINS  64        // Classes of 16 bytes for blocks smaller than 1 KiB
+#define HEAP_BINS       (HEAP_SMALLBINS + 22)
+#define HEAP_PAGESIZE   4096
+#define BLOCK_USED      1
+
+typedef struct heapBlock
+{
+    size_t size;                  // Size of the block including its header. Bit 0: Block is used
+    size_t prevSize;              // Size of the previous block, 0 for the first block
+    struct heapBlock* nextFree;   // Only valid for free blocks (located in the user data)
+    struct heapBlock* prevFree;
+} heapBlock_t;
+
+#define HEADER_SIZE    (2*sizeof(size_t))
+#define MIN_BLOCKSIZE  (sizeof(heapBlock_t) + HEAP_ALIGNMENT - sizeof(heapBlock_t)%HEAP_ALIGNMENT)
+
+static heapBlock_t* bins[HEAP_BINS];
+static uint32_t     binMap[(HEAP_BINS+31)/32]; // Bit set: bin is not empty
+static heapBlock_t* heapEnd = 0;               // Header marking the end of the heap
+
+static inline size_t blockSize(const heapBlock_t* block)
+{
+    return (block->size & ~BLOCK_USED);
+}
+
+static inline heapBlock_t* nextBlock(heapBlock_t* block)
+{
+    return ((heapBlock_t*)((char*)block + blockSize(block)));
+}
+
+static inline heapBlock_t* prevBlock(heapBlock_t* block)
+{
+    return (block->prevSize ? (heapBlock_t*)((char*)block - block->prevSize) : 0);
+}
+
+static size_t binOf(size_t size)
+{
+    if (size < HEAP_SMALLBINS*HEAP_ALIGNMENT)
+        return (size/HEAP_ALIGNMENT);
+
+    size_t bin = HEAP_SMALLBINS;
+    for (size /= HEAP_SMALLBINS*HEAP_ALIGNMENT*2; size && bin < HEAP_BINS-1; size /= 2)
+        bin++;
+    return (bin);
+}
+
+static void insertFree(heapBlock_t* block)
 {
-    static char* cur = 0;
-    static char* top = 0;
+    size_t bin = binOf(blockSize(block));
+    block->size &= ~BLOCK_USED;
+    block->prevFree = 0;
+    block->nextFree = bins[bin];
+    if (bins[bin])
+        bins[bin]->prevFree = block;
+    bins[bin] = block;
+    binMap[bin/32] |= 1u << (bin%32);
+}
+
+static void removeFree(heapBlock_t* block)
+{
+    size_t bin = binOf(blockSize(block));
+    if (block->prevFree)
+        block->prevFree->nextFree = block->nextFree;
+    else
+        bins[bin] = block->nextFree;
+    if (block->nextFree)
+        block->nextFree->prevFree = block->prevFree;
+    if (bins[bin] == 0)
+        binMap[bin/32] &= ~(1u << (bin%32));
+}
 
-    // Align
-    size = (size+15) & ~15;
+static void setSize(heapBlock_t* block, size_t size, bool used)
+{
+    block->size = size | (used ? BLOCK_USED : 0);
+    nextBlock(block)->prevSize = size;
+}
 
-    // Heap not set up?
-    if (!cur)
+// Merges a free block (not in a list) with its free neighbours, puts it into a list and returns it
+static heapBlock_t* coalesce(heapBlock_t* block)
+{
+    heapBlock_t* next = nextBlock(block);
+    if (next != heapEnd && !(next->size & BLOCK_USED))
     {
-        uint32_t sizeToGrow = (size+4095) & ~4095;
-        cur = userheapAlloc(sizeToGrow);
-        if (!cur)
-            return (0);
-        top = cur + sizeToGrow;
+        removeFree(next);
+        setSize(block, blockSize(block) + blockSize(next), false);
     }
-    // Not enough space on heap?
-    else if (top - cur < size)
+
+    heapBlock_t* prev = prevBlock(block);
+    if (prev && !(prev->size & BLOCK_USED))
     {
-        uint32_t sizeToGrow = (size+4095) & ~4095;
-        if (!userheapAlloc(sizeToGrow))
-            return (0);
-        top += sizeToGrow;
+        removeFree(prev);
+        setSize(prev, blockSize(prev) + blockSize(block), false);
+        block = prev;
+    }
+
+    insertFree(block);
+    return (block);
+}
+
+// Cuts the block to the given size and returns the rest to the free lists
+static void split(heapBlock_t* block, size_t size)
+{
+    size_t rest = blockSize(block) - size;
+    if (rest >= MIN_BLOCKSIZE)
+    {
+        setSize(block, size, true);
+        heapBlock_t* remainder = nextBlock(block);
+        setSize(remainder, rest, false);
+        coalesce(remainder);
+    }
+}
+
+static bool heapGrow(size_t size)
+{
+    size_t increase = (size + HEADER_SIZE + HEAP_PAGESIZE - 1) & ~(HEAP_PAGESIZE - 1);
+    if (increase < HEAP_MINGROWTH)
+        increase = HEAP_MINGROWTH;
+
+    char* area = userheapAlloc(increase);
+    if (area == 0)
+        return (false);
+
+    heapBlock_t* block;
+    if (heapEnd == 0) // First call: Set up the heap
+    {
+        block = (heapBlock_t*)(area + HEAP_ALIGNMENT - HEADER_SIZE);
+        block->prevSize = 0;
+        increase -= HEAP_ALIGNMENT;
     }
+    else // The heap is contiguous, so the old end marker becomes the header of the new block
+    {
+        block = heapEnd;
+    }
+
+    heapEnd = (heapBlock_t*)((char*)block + increase);
+    heapEnd->size = 0 | BLOCK_USED;
+    setSize(block, increase, false);
+    coalesce(block);
+    return (true);
+}
+
+// Gives memory at the end of the heap back to the kernel
+static void heapTrim(heapBlock_t* last)
+{
+    char* end = (char*)heapEnd + HEADER_SIZE;
+    char* newEnd = (char*)(((uintptr_t)last + MIN_BLOCKSIZE + HEADER_SIZE + HEAP_PAGESIZE - 1) & ~(HEAP_PAGESIZE - 1));
+    if (end - newEnd < HEAP_TRIM || !userheapFree(end - newEnd))
+        return;
+
+    removeFree(last);
+    heapEnd = (heapBlock_t*)(newEnd - HEADER_SIZE);
+    heapEnd->size = 0 | BLOCK_USED;
+    setSize(last, (char*)heapEnd - (char*)last, false);
+    insertFree(last);
+}
+
+void* malloc(size_t size)
+{
+    if (size == 0 || size > UINT_MAX/2)
+        return (0);
+
+    size = (size + HEADER_SIZE + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1);
+    if (size < MIN_BLOCKSIZE)
+        size = MIN_BLOCKSIZE;
+
+    for (;;)
+    {
+        // Search the bin of this size and all larger ones that are not empty
+        for (size_t bin = binOf(size); bin < HEAP_BINS; bin++)
+        {
+            if (!(binMap[bin/32] & (1u << (bin%32))))
+            {
+                if (binMap[bin/32] >> (bin%32) == 0) // Skip the rest of this dword
+                    bin |= 31;
+                continue;
+            }
 
-    void* ret = cur;
-    cur += size;
-   return (ret);
+            for (heapBlock_t* block = bins[bin]; block; block = block->nextFree)
+            {
+                if (blockSize(block) >= size)
+                {
+                    removeFree(block);
+                    block->size |= BLOCK_USED;
+                    split(block, size);
+                    return ((char*)block + HEADER_SIZE);
+                }
+            }
+        }
+
+        if (!heapGrow(size))
+            return (0);
+    }
 }
 
 void* calloc(size_t num, size_t size)
 {
+    if (size && num > UINT_MAX/size)
+        return (0);
+
     void* ptr = malloc(num*size);
-    memset(ptr, 0, num*size);
+    if (ptr)
+        memset(ptr, 0, num*size);
     return (ptr);
 }
 
-void* realloc(void* ptr, size_t size); /// TODO (Impossible with placement)
+void* realloc(void* ptr, size_t size)
+{
+    if (ptr == 0)
+        return (malloc(size));
+    if (size == 0)
+    {
+        free(ptr);
+        return (0);
+    }
+    if (size > UINT_MAX/2)
+        return (0);
+
+    heapBlock_t* block = (heapBlock_t*)((char*)ptr - HEADER_SIZE);
+    size_t newSize = (size + HEADER_SIZE + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1);
+    if (newSize < MIN_BLOCKSIZE)
+        newSize = MIN_BLOCKSIZE;
+
+    // Try to grow in place by taking the following free block
+    heapBlock_t* next = nextBlock(block);
+    if (blockSize(block) < newSize && next != heapEnd && !(next->size & BLOCK_USED) && blockSize(block) + blockSize(next) >= newSize)
+    {
+        removeFree(next);
+        setSize(block, blockSize(block) + blockSize(next), true);
+    }
+
+    if (blockSize(block) >= newSize)
+    {
+        split(block, newSize);
+        return (ptr);
+    }
+
+    void* newPtr = malloc(size);
+    if (newPtr)
+    {
+        memcpy(newPtr, ptr, blockSize(block) - HEADER_SIZE);
+        free(ptr);
+    }
+    return (newPtr);
+}
 
 void free(void* ptr)
 {
-    // We do placement allocation at the moment -> Nothing to do.
+    if (ptr == 0)
+        return;
+
+    heapBlock_t* block = coalesce((heapBlock_t*)((char*)ptr - HEADER_SIZE));
+    if (nextBlock(block) == heapEnd)
+        heapTrim(block);
 }
 
 char* getenv(const char* name)
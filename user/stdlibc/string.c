@@ -31,10 +31,9 @@ int memcmp(const void* ptr1, const void* ptr2, size_t num)
 
 void* memcpy(void* dest, const void* source, size_t bytes)
 {
+    void* d = dest;
     size_t dwords = bytes/4;
-    bytes %= 4;
-    __asm__ volatile("cld\n" "rep movsl" : : "S" (source), "D" (dest), "c" (dwords));
-    __asm__ volatile("rep movsb" : : "c" (bytes));
+    __asm__ volatile("cld\n" "rep movsl\n" "mov %3, %%ecx\n" "rep movsb" : "+D"(d), "+S"(source), "+c"(dwords) : "r"(bytes%4) : "memory");
     return (dest);
 }
 
@@ -44,12 +43,10 @@ static void* memcpyr(void* dest, const void* src, size_t bytes)
     void* temp = dest+bytes-1;
     src += bytes-1;
 
-    size_t dwords = bytes/4;
-    bytes %= 4;
-
-    __asm__ volatile("std\n" "rep movsb" : : "S" (src), "D" (temp), "c" (bytes));
-    __asm__ volatile("sub $3, %edi\n" "sub $3, %esi");
-    __asm__ volatile("rep movsl\n" "cld" : : "c" (dwords));
+    // Copy backwards: First the bytes behind the last complete dword, then the dwords
+    size_t rest = bytes%4;
+    __asm__ volatile("std\n" "rep movsb\n" "sub $3, %%esi\n" "sub $3, %%edi\n" "mov %3, %%ecx\n" "rep movsl\n" "cld"
+                     : "+D"(temp), "+S"(src), "+c"(rest) : "r"(bytes/4) : "memory");
     return (dest);
 }
 
@@ -81,11 +78,10 @@ void* memmove(void* dest, const void* source, size_t num)
 
 void* memset(void* dest, char value, size_t bytes)
 {
+    void* d = dest;
     size_t dwords = bytes/4; // Number of dwords (4 Byte blocks) to be written
-    bytes %= 4;              // Remaining bytes
-    uint32_t dval = (value<<24)|(value<<16)|(value<<8)|value; // Create dword from byte value
-    __asm__ volatile("cld\n" "rep stosl" : : "D"(dest), "a"(dval), "c" (dwords));
-    __asm__ volatile("rep stosb" : : "al"(value), "c" (bytes));
+    uint32_t dval = 0x01010101 * (uint8_t)value; // Create dword from byte value
+    __asm__ volatile("cld\n" "rep stosl\n" "mov %3, %%ecx\n" "rep stosb" : "+D"(d), "+c"(dwords) : "a"(dval), "r"(bytes%4) : "memory");
     return dest;
 }
 
@@ -6,7 +6,6 @@ global _start
 global _syscall
 
 _syscall dd syscall         ; Function pointer. Points to syscall per default
-oldEsp dd 0                 ; Contains esp in case of sysenter
 
 _start:
     push ecx                ; argv
@@ -25,11 +24,15 @@ syscall:
     ret
 
 sysenter:
+    push ecx                ; Parameters. sysexit overwrites ecx and edx
+    push edx
     push ebp
-    mov [oldEsp], esp       ; Save esp
-    mov ebp, .done          ; Write return address to ebp
+    push .done              ; Return address for sysexit
+    mov ebp, esp            ; The kernel returns to [ebp] with esp = ebp
     sysenter                ; Call kernel by executing sysenter instruction
     .done:
-    mov esp, [oldEsp]       ; Restore esp
+    add esp, 4
     pop ebp
+    pop edx
+    pop ecx
     ret
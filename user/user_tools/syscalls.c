@@ -36,6 +36,13 @@ bool wait(BLOCKERTYPE reason, void* data, uint32_t timeout)
 
 // TODO: (4) createConsoleThread
 
+size_t syscall_multicall(syscallDescriptor_t* calls, size_t count)
+{
+    size_t ret;
+    __asm__ volatile("call *_syscall" : "=a"(ret) : "a"(5), "b"(calls), "c"(count) : "memory");
+    return (ret);
+}
+
 uint32_t getMyPID(void)
 {
     uint32_t ret;
@@ -50,7 +57,12 @@ void* userheapAlloc(size_t increase)
     return (void*)ret;
 }
 
-// TODO: (11) userheapFree
+bool userheapFree(size_t decrease)
+{
+    bool ret;
+    __asm__("call *_syscall" : "=a"(ret) : "a"(11), "b"(decrease));
+    return (ret);
+}
 
 file_t* fopen(const char* path, const char* mode)
 {
@@ -101,6 +113,20 @@ FS_ERROR partition_format(const char* path, FS_t type, const char* name)
     return (ret);
 }
 
+ioRing_t* ioring_setup(uint32_t entries, size_t bufferSize)
+{
+    ioRing_t* ret;
+    __asm__("call *_syscall" : "=a"(ret) : "a"(23), "b"(entries), "c"(bufferSize));
+    return (ret);
+}
+
+uint32_t ioring_enter(ioRing_t* ring, uint32_t minComplete)
+{
+    uint32_t ret;
+    __asm__ volatile("call *_syscall" : "=a"(ret) : "a"(24), "b"(ring), "c"(minComplete) : "memory");
+    return (ret);
+}
+
 file_t* ipc_fopen(const char* path, const char* mode)
 {
     file_t* ret;
@@ -10,16 +10,91 @@
 #include "stdlib.h"
 
 
+#define SYSCALL_BATCH 32 // Number of syscalls submitted together by the batching functions
+
+
 bool enabledEvents = false;
 
 
 void event_flush(EVENT_t filter)
 {
-    EVENT_t ev;
-    do
+    syscallDescriptor_t calls[SYSCALL_BATCH];
+    for (size_t i = 0; i < SYSCALL_BATCH; i++)
+    {
+        calls[i].number = 39; // event_poll(0, 0, filter)
+        calls[i].args[0] = 0;
+        calls[i].args[1] = 0;
+        calls[i].args[2] = filter;
+    }
+
+    while (true)
     {
-        ev = event_poll(0, 0, filter);
-    } while(ev != EVENT_NONE);
+        size_t count = syscall_multicall(calls, SYSCALL_BATCH);
+        if (count == 0) // The kernel rejected the batch
+            return;
+        for (size_t i = 0; i < count; i++)
+            if (calls[i].result == EVENT_NONE)
+                return;
+    }
+}
+
+static void batch(uint32_t number, const char* data, size_t length, uint32_t arg)
+{
+    syscallDescriptor_t calls[SYSCALL_BATCH];
+    while (length)
+    {
+        size_t count = min(length, SYSCALL_BATCH);
+        for (size_t i = 0; i < count; i++)
+        {
+            calls[i].number = number;
+            calls[i].args[0] = (uint8_t)data[i];
+            calls[i].args[1] = arg;
+        }
+        syscall_multicall(calls, count);
+        data += count;
+        length -= count;
+    }
+}
+
+void putchars(const char* str, size_t length)
+{
+    batch(55, str, length, 0); // putchar
+}
+
+void fputchars(const char* src, size_t length, struct file* file)
+{
+    batch(17, src, length, (uintptr_t)file); // fputc
+}
+
+ioSubmission_t* ioring_getSubmission(ioRing_t* ring)
+{
+    if (ring->sqTail - ring->sqHead >= ring->entries)
+        return (0);
+    return ((ioSubmission_t*)((uint8_t*)ring + ring->sqOffset) + (ring->sqTail & (ring->entries - 1)));
+}
+
+void ioring_submit(ioRing_t* ring)
+{
+    __asm__ volatile("" : : : "memory"); // The submission is written before it is published
+    ring->sqTail++;
+}
+
+ioCompletion_t* ioring_getCompletion(ioRing_t* ring)
+{
+    if (ring->cqHead == ring->cqTail)
+        return (0);
+    return ((ioCompletion_t*)((uint8_t*)ring + ring->cqOffset) + (ring->cqHead & (ring->entries - 1)));
+}
+
+void ioring_consume(ioRing_t* ring)
+{
+    __asm__ volatile("" : : : "memory"); // The completion is read before its slot is released
+    ring->cqHead++;
+}
+
+void* ioring_buffer(ioRing_t* ring)
+{
+    return ((uint8_t*)ring + ring->bufferOffset);
 }
 
 void sleep(uint32_t milliseconds)
@@ -27,16 +27,71 @@ enum COLORS
 
 struct file;
 
+// Element of the array given to syscall_multicall
+typedef struct
+{
+    uint32_t number;
+    uint32_t args[5]; // ebx, ecx, edx, esi, edi
+    uint32_t result;  // eax
+} syscallDescriptor_t;
+
+// Asynchronous I/O (cf. kernel/ioring.h). The ring is shared with the kernel.
+typedef enum
+{
+    IORING_OP_NOP, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_TCP_SEND, IORING_OP_UDP_SEND
+} IORING_OP;
+
+#define IORING_EINVAL  (-1) // Submission refers to data outside of the buffer area, to a file not opened by the program or has an unknown opcode
+#define IORING_EFAILED (-2) // The operation failed
+#define IORING_CURRENT 0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t opcode;   // IORING_OP
+    uint32_t handle;   // READ/WRITE: file, TCP_SEND: connection ID, UDP_SEND: destination IP
+    uint32_t offset;   // Offset of the data in the buffer area
+    uint32_t length;
+    uint32_t position; // READ/WRITE: File position, IORING_CURRENT for the current one
+    uint16_t srcPort;  // UDP_SEND
+    uint16_t destPort; // UDP_SEND
+    uint32_t userData; // Copied to the completion
+    uint32_t reserved;
+} ioSubmission_t;
+
+typedef struct
+{
+    uint32_t userData;
+    int32_t  result;   // Number of bytes transferred or IORING_E...
+} ioCompletion_t;
+
+typedef struct
+{
+    volatile uint32_t sqHead;
+    volatile uint32_t sqTail;
+    volatile uint32_t cqHead;
+    volatile uint32_t cqTail;
+    uint32_t          entries;
+    uint32_t          sqOffset;
+    uint32_t          cqOffset;
+    uint32_t          bufferOffset;
+    uint32_t          bufferSize;
+} ioRing_t;
+
 // syscalls (only non-standard functions, because we do not want to include stdio.h here.
 FS_ERROR execute(const char* path, size_t argc, char* argv[]);
+size_t syscall_multicall(syscallDescriptor_t* calls, size_t count); // Executes the syscalls with one kernel entry. Returns the number executed.
 void exitProcess(void);
 bool wait(BLOCKERTYPE reason, void* data, uint32_t timeout);
 uint32_t getMyPID(void);
 
 void* userheapAlloc(size_t increase);
+bool userheapFree(size_t decrease);
 
 FS_ERROR partition_format(const char* path, FS_t type, const char* name);
 
+ioRing_t* ioring_setup(uint32_t entries, size_t bufferSize); // entries: Power of two, up to 256
+uint32_t  ioring_enter(ioRing_t* ring, uint32_t minComplete);  // Starts the submitted operations, waits for minComplete completions
+
 bool waitForEvent(uint32_t timeout);
 void event_enable(bool b);
 EVENT_t event_poll(void* destination, size_t maxLength, EVENT_t filter);
@@ -87,6 +142,14 @@ void printLine(const char* message, uint32_t line, uint8_t attribute);
 
 // user functions
 void event_flush(EVENT_t filter);
+void putchars(const char* str, size_t length);                     // Like putchar for each character, batched
+void fputchars(const char* src, size_t length, struct file* file); // Like fputc for each character, batched
+
+ioSubmission_t* ioring_getSubmission(ioRing_t* ring); // Free slot of the submission queue, 0 if it is full
+void            ioring_submit(ioRing_t* ring);        // Posts the slot returned by ioring_getSubmission. The kernel takes it at the next ioring_enter.
+ioCompletion_t* ioring_getCompletion(ioRing_t* ring); // Oldest completion, 0 if there is none
+void            ioring_consume(ioRing_t* ring);       // Releases the completion returned by ioring_getCompletion
+void*           ioring_buffer(ioRing_t* ring);        // Buffer area. Offsets in submissions are relative to it.
 void sleep(uint32_t milliseconds);
 bool waitForTask(uint32_t pid, uint32_t timeout);
 